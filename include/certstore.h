@@ -0,0 +1,78 @@
+/** \file certstore.h
+ \brief certificates and keys in a precompiled format
+ */
+#ifndef CERTSTORE_H
+#define CERTSTORE_H
+
+#include <openssl/ssl.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define CERTSTORE_MAGIC "QSCERT1"		/**< identifies a compiled certificate store, including the trailing 0 byte */
+#define CERTSTORE_NAME "servercerts.store"	/**< name of the server store in the control directory */
+#define CERTSTORE_CLIENT_NAME "clientcerts.store"	/**< name of the client store in the control directory */
+
+/** @enum certstore_type
+ * @brief the certificates a store is compiled from
+ */
+enum certstore_type {
+	CERTSTORE_SERVER,	/**< servercert.pem* of Qsmtpd */
+	CERTSTORE_CLIENT	/**< clientcert.pem of Qremote */
+};
+
+/** @struct certstore_header
+ * @brief the header of a compiled certificate store
+ *
+ * The header is followed by entries certificates and names host names. All
+ * other data is referenced by offsets from the start of the file. All values
+ * are stored in host byte order, the files are not meant to be shared between
+ * different architectures.
+ */
+struct certstore_header {
+	char magic[8];		/**< CERTSTORE_MAGIC */
+	uint32_t entries;	/**< number of certificates */
+	uint32_t names;		/**< number of host names */
+	uint32_t size;		/**< size of the whole file */
+};
+
+/** @struct certstore_entry
+ * @brief a certificate with its chain and private key
+ */
+struct certstore_entry {
+	uint32_t bind;		/**< offset of the "<ip>" or "<ip>:<port>" suffix of the file name, empty for the default */
+	uint32_t file;		/**< offset of the name of the certificate file */
+	uint32_t chain;		/**< offset of the DER encoded certificate, followed by the chain certificates */
+	uint32_t chainlen;	/**< length of chain */
+	uint32_t key;		/**< offset of the DER encoded private key */
+	uint32_t keylen;	/**< length of key */
+};
+
+/** @struct certstore_name
+ * @brief a host name a certificate is valid for, entries are sorted by name
+ *
+ * Names are stored in lower case. A name starting with "*." matches all
+ * direct subdomains of the rest of the name.
+ */
+struct certstore_name {
+	uint32_t name;		/**< offset of the name */
+	uint32_t entry;		/**< index of the certificate */
+};
+
+/** @struct certstore
+ * @brief an opened certificate store
+ */
+struct certstore {
+	const char *map;	/**< the mapped file, NULL if not opened */
+	off_t len;		/**< length of map */
+};
+
+extern int certstore_compile(const int dirfd, const enum certstore_type type, const int outfd, const char **errfile) __attribute__ ((nonnull (4)));
+extern int certstore_open(const int dirfd, const enum certstore_type type, struct certstore *cs) __attribute__ ((nonnull (3)));
+extern void certstore_close(struct certstore *cs) __attribute__ ((nonnull (1)));
+extern int certstore_find(const struct certstore *cs, const char *ip, const char *port) __attribute__ ((nonnull (1, 2)));
+extern int certstore_find_name(const struct certstore *cs, const char *name) __attribute__ ((nonnull (1, 2)));
+extern const char *certstore_file(const struct certstore *cs, const unsigned int idx) __attribute__ ((nonnull (1)));
+extern int certstore_use_ctx(const struct certstore *cs, const unsigned int idx, SSL_CTX *ctx) __attribute__ ((nonnull (1, 3)));
+extern int certstore_use(const struct certstore *cs, const unsigned int idx, SSL *ssl) __attribute__ ((nonnull (1, 3)));
+
+#endif
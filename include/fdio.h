@@ -0,0 +1,12 @@
+/** \file fdio.h
+ \brief headers of functions for reading and writing complete buffers
+ */
+#ifndef FDIO_H
+#define FDIO_H
+
+#include <sys/types.h>
+
+extern int write_all(const int fd, const void *buf, size_t len) __attribute__ ((nonnull (2)));
+extern int read_all(const int fd, void *buf, size_t len) __attribute__ ((nonnull (2)));
+
+#endif
@@ -10,6 +10,7 @@
 #include <openssl/ssl.h>
 #include <string.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <time.h>
 
 extern struct string linein;
@@ -19,6 +20,7 @@ extern int net_writen(const char *const *) __attribute__ ((nonnull (1)));
 extern int net_write_multiline(const char *const *) __attribute__ ((nonnull (1)));
 static inline int netwrite(const char *) __attribute__ ((nonnull (1)));
 extern int netnwrite(const char *, const size_t) __attribute__ ((nonnull (1))) ATTR_ACCESS(read_only, 1, 2);
+extern int netnwritev(const struct iovec *, const unsigned int) __attribute__ ((nonnull (1)));
 extern size_t net_readbin(size_t, char *) __attribute__ ((nonnull (2))) ATTR_ACCESS(read_write, 2, 1);
 extern size_t net_readline(size_t, char *) __attribute__ ((nonnull (2))) ATTR_ACCESS(read_write, 2, 1);
 extern int data_pending(SSL *s);
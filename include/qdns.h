@@ -6,6 +6,7 @@
 
 #include <arpa/inet.h>
 #include <netinet/in.h>
+#include <time.h>
 
 /** @enum mx_special_priorities
  * @brief values used as priority in struct ips to reflect special conditions
@@ -52,6 +53,12 @@ extern int ask_dnsname(const struct in6_addr *, char **) __attribute__ ((nonnull
 
 /* lib/dnshelpers.c */
 
+extern time_t dns_deadline;
+extern unsigned long dnstxt_minttl;
+extern unsigned long dns_minttl;
+extern unsigned long dns_queries;
+extern int dns_time_left(void);
+
 extern void freeips(struct ips *);
 extern int domainvalid(const char * const) __attribute__ ((pure)) __attribute__ ((nonnull (1)));
 extern int domainvalid_or_inherit(const char * const) __attribute__ ((pure)) __attribute__ ((nonnull (1)));
@@ -5,12 +5,15 @@
 #define CONN_H
 
 #include <qdns.h>
+#include <qremote/hosthealth.h>
 
 #include <netinet/in.h>
 
 extern unsigned int targetport;	/**< the port on the destination host to connect to */
+extern unsigned long timeoutconnect;	/**< seconds to wait for a single connection attempt */
 
 extern int tryconn(struct ips *mx, const struct in6_addr *outip4, const struct in6_addr *outip6);
+extern void tryconn_result(const enum host_failure reason);
 
 /**
  * @brief establish a connection to a MX
@@ -26,6 +29,22 @@ extern int tryconn(struct ips *mx, const struct in6_addr *outip4, const struct i
  * connection can be made this function return -ENOENT.
  */
 extern int connect_mx(struct ips *mx, const struct in6_addr *outip4, const struct in6_addr *outip6);
-extern void getmxlist(char *, struct ips **);
+/**
+ * @enum mx_source
+ * @brief where the list returned by getmxlist() comes from
+ */
+enum mx_source {
+	MX_SOURCE_STATIC,	/**< an IP address or a static route */
+	MX_SOURCE_DNS,		/**< the MX records of the target */
+	MX_SOURCE_CACHE		/**< the route cache, the list is already filtered and sorted */
+};
+
+extern enum mx_source getmxlist(char *, struct ips **);
+
+struct daneinfo;
+
+extern void tlsa_prefetch_start(const char *remhost, const struct ips *mx) __attribute__ ((nonnull (1)));
+extern int tlsa_lookup(const char *host, struct daneinfo **out) __attribute__ ((nonnull (1,2)));
+extern void tlsa_prefetch_reset(void);
 
 #endif
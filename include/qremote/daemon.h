@@ -0,0 +1,37 @@
+/** \file daemon.h
+ \brief headers of the persistent delivery mode of Qremote
+ */
+#ifndef QREMOTE_DAEMON_H
+#define QREMOTE_DAEMON_H
+
+#include <sys/types.h>
+
+#define DAEMON_SOCKET_FILE "qremotesocket"	/**< control file containing the path of the daemon socket */
+
+extern unsigned long timeoutidle;	/**< seconds an idle session is kept open by a worker */
+
+extern int daemon_delegate(const char *path, int argc, char **argv) __attribute__ ((nonnull (1, 3)));
+extern void daemon_run(const char *path) __attribute__ ((noreturn)) __attribute__ ((nonnull (1)));
+
+/**
+ * @brief deliver a message
+ * @param msgfd the descriptor of the message
+ * @param size the size of the message
+ * @param argc number of arguments
+ * @param argv the command line arguments of Qremote: host, sender, and recipients
+ *
+ * If a connection to the host is already open it is reused. The function
+ * returns when the message has been delivered or was rejected, the connection
+ * is kept open if possible.
+ *
+ * The replies of the remote server are read from fd 0, so the message must
+ * not be passed on that descriptor while a session may be open.
+ */
+extern void deliver(const int msgfd, const off_t size, int argc, char **argv) __attribute__ ((nonnull (4)));
+
+/**
+ * @brief log the timing record of the running delivery
+ */
+extern void log_timing(void);
+
+#endif
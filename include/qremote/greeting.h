@@ -13,7 +13,8 @@ enum ehlo_extensions {
 	esmtp_auth = 0x10,	/**< AUTH (RfC 2554) */
 	esmtp_utf8 = 0x20,	/**< SMTPUTF8 (RfC 6531) */
 	esmtp_chunking = 0x40,	/**< CHUNKING (RfC 3030) */
-	esmtp_x_final = esmtp_chunking /**< end delimiter */
+	esmtp_binarymime = 0x80,	/**< BINARYMIME (RfC 3030) */
+	esmtp_x_final = esmtp_binarymime /**< end delimiter */
 };
 
 extern unsigned long remotesize;	/**< the maximum size allow by the remote host or 0 if unlimited or unknown */
@@ -0,0 +1,47 @@
+/** \file hosthealth.h
+ \brief connection results of remote servers shared by all Qremote processes
+ */
+#ifndef QREMOTE_HOSTHEALTH_H
+#define QREMOTE_HOSTHEALTH_H
+
+#include <netinet/in.h>
+#include <stdint.h>
+
+#define HOSTHEALTH_SLOTS 4096		/**< number of entries in the health table */
+#define HOSTHEALTH_HOLDDOWN 60		/**< seconds an address is skipped after the first failure */
+#define HOSTHEALTH_HOLDDOWN_MAX 3600	/**< maximum seconds an address is skipped */
+
+/** @enum host_failure
+ * @brief the reason a connection to a remote server failed
+ */
+enum host_failure {
+	HOST_FAIL_NONE,		/**< no failure */
+	HOST_FAIL_CONNECT,	/**< the TCP connection could not be established */
+	HOST_FAIL_GREETING,	/**< the server did not send a valid greeting or EHLO reply */
+	HOST_FAIL_TLS,		/**< the TLS handshake or the verification of the server failed */
+	HOST_FAIL_TIMEOUT	/**< the server accepted the connection, but did not reply in time */
+};
+
+/** @struct host_health_slot
+ * @brief the connection history of one address
+ */
+struct host_health_slot {
+	struct in6_addr addr;	/**< address of the remote server */
+	uint32_t used;		/**< if the slot contains an entry */
+	uint32_t port;		/**< port on the remote server */
+	int64_t last_failure;	/**< time() of the last failure, 0 if none */
+	int64_t last_success;	/**< time() of the last successful connection, 0 if none */
+	uint32_t failures;	/**< number of consecutive failures to connect or to get a reply */
+	uint32_t reason;	/**< enum host_failure of the last failure */
+	uint32_t rtt;		/**< smoothed time to establish the TCP connection in ms, 0 if unknown */
+	uint32_t pad;		/**< unused */
+};
+
+extern int host_health_check(const struct in6_addr *addr, const unsigned int port, unsigned int *rtt) __attribute__ ((nonnull (1, 3)));
+extern int host_health_down(const struct host_health_slot *slot, const int64_t now) __attribute__ ((nonnull (1)));
+extern void host_health_connected(const struct in6_addr *addr, const unsigned int port, const unsigned int rtt) __attribute__ ((nonnull (1)));
+extern void host_health_result(const struct in6_addr *addr, const unsigned int port, const enum host_failure reason) __attribute__ ((nonnull (1)));
+extern int host_health_get(const unsigned int idx, struct host_health_slot *slot) __attribute__ ((nonnull (2)));
+extern int host_health_reset(const struct in6_addr *addr);
+
+#endif
@@ -14,4 +14,42 @@ extern int is_multipart(const cstring *line, cstring *boundary) __attribute__ ((
 extern size_t getfieldlen(const char *, const size_t) __attribute__ ((pure)) __attribute__ ((nonnull(1)));
 extern off_t find_boundary(const char *, const off_t, const cstring *) __attribute__ ((pure)) __attribute__ ((nonnull (1,3)));
 
+/** @brief precomputed data to search for the delimiters of one boundary */
+struct boundary_matcher {
+	const cstring *boundary;	/**< the boundary limit string */
+	char delim[72];			/**< "--" followed by the boundary */
+	size_t len;			/**< length of delim */
+	unsigned char shift[256];	/**< how far the search may skip depending on the last compared character */
+};
+
+extern void boundary_matcher_init(struct boundary_matcher *m, const cstring *boundary) __attribute__ ((nonnull (1,2)));
+extern off_t boundary_matcher_find(const struct boundary_matcher *m, const char *buf, const off_t len) __attribute__ ((pure)) __attribute__ ((nonnull (1,2)));
+
+/** @brief a sorted list of offsets in the indexed message */
+struct mime_offsets {
+	off_t *o;		/**< the offsets */
+	unsigned int count;	/**< number of used entries in o */
+	unsigned int size;	/**< number of allocated entries in o */
+};
+
+/**
+ * @brief structure of a message, collected in a single pass
+ *
+ * Lines are split like need_recode() does it: CRLF is one line ending, a
+ * single CR or LF is one, too.
+ */
+struct mime_index {
+	const char *buf;		/**< the indexed data */
+	off_t len;			/**< length of buf */
+	struct mime_offsets eightbit;	/**< start and end of runs of lines with 8bit characters */
+	struct mime_offsets longlines;	/**< start and end of runs of lines longer than 998 characters */
+	struct mime_offsets empty;	/**< start of empty lines */
+	struct mime_offsets dashes;	/**< position of CR or LF followed by "--" */
+};
+
+extern int mime_index_build(struct mime_index *idx, const char *buf, const off_t len) __attribute__ ((nonnull (1,2)));
+extern void mime_index_free(struct mime_index *idx) __attribute__ ((nonnull (1)));
+extern int mime_index_recode(const struct mime_index *idx, const off_t off, const off_t len) __attribute__ ((pure)) __attribute__ ((nonnull (1)));
+extern off_t mime_index_boundary(const struct mime_index *idx, const off_t off, const off_t len, const cstring *boundary) __attribute__ ((pure)) __attribute__ ((nonnull (1,4)));
+
 #endif
@@ -20,6 +20,8 @@ enum recode_reasons {
 extern unsigned int need_recode(const char *, off_t);
 extern void send_data(unsigned int recodeflag);
 extern void send_bdat(unsigned int recodeflag);
+extern int body_binarymime(const unsigned int recodeflag);
+extern int body_chunked(const unsigned int recodeflag);
 
 extern const char *msgdata;
 extern off_t msgsize;
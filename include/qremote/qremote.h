@@ -92,6 +92,7 @@ extern struct ips *smtproute(const char *, const size_t, unsigned int *);
 extern void free_smtproute_vals();
 
 void quitmsg(void);
+void conn_abort(void);
 
 #define EDONE 1003
 
@@ -0,0 +1,15 @@
+/** \file routecache.h
+ \brief cache of the mail exchangers of target hosts shared by all Qremote processes
+ */
+#ifndef QREMOTE_ROUTECACHE_H
+#define QREMOTE_ROUTECACHE_H
+
+struct ips;
+
+extern unsigned long routecache_ttl;	/**< seconds a cached route is valid */
+
+extern struct ips *route_cache_lookup(const char *host, const unsigned int port) __attribute__ ((nonnull (1)));
+extern void route_cache_store(const char *host, const unsigned int port, const struct ips *mx,
+		const unsigned long ttl) __attribute__ ((nonnull (1, 3)));
+
+#endif
@@ -0,0 +1,42 @@
+/** \file timing.h
+ \brief measure how long the phases of a delivery take
+ */
+#ifndef QREMOTE_TIMING_H
+#define QREMOTE_TIMING_H
+
+#include <stddef.h>
+
+#define TIMING_RECORD_LEN 192	/**< buffer size needed for a timing record */
+
+/** @enum timing_phase
+ * @brief the phases of a delivery
+ */
+enum timing_phase {
+	TIMING_NONE,		/**< time that is not accounted to any phase */
+	TIMING_DNS,		/**< looking up mail exchangers and TLSA records */
+	TIMING_CONNECT,		/**< establishing the TCP connection */
+	TIMING_GREETING,	/**< waiting for the greeting of the server */
+	TIMING_EHLO,		/**< EHLO or HELO, including the one after STARTTLS */
+	TIMING_STARTTLS,	/**< STARTTLS and the TLS handshake */
+	TIMING_ENVELOPE,	/**< RSET of a reused session, MAIL FROM and RCPT TO */
+	TIMING_DATA,		/**< sending the message */
+	TIMING_REPLY,		/**< waiting for the reply to the message */
+	TIMING_PHASES		/**< number of phases */
+};
+
+/** @enum timing_output
+ * @brief where the timing record is written, bits of control/timingremote
+ */
+enum timing_output {
+	TIMING_LOG = 1,		/**< log the record after each delivery */
+	TIMING_STATUS = 2	/**< add the record to the message report of successful deliveries */
+};
+
+extern unsigned long timing_mode;
+
+extern void timing_start(void);
+extern void timing_phase(const enum timing_phase phase);
+extern size_t timing_record(char *buf, const size_t len) __attribute__ ((nonnull (1)));
+extern void timing_reply(void);
+
+#endif
@@ -0,0 +1,29 @@
+/** \file tlscache.h
+ \brief cache of TLS sessions to remote servers shared by all Qremote processes
+ */
+#ifndef QREMOTE_TLSCACHE_H
+#define QREMOTE_TLSCACHE_H
+
+#include <openssl/sha.h>
+#include <openssl/ssl.h>
+#include <sys/stat.h>
+
+struct daneinfo;
+
+/** @struct tlsr_cache_key
+ * @brief identifies the server and the TLS parameters a session was created with
+ */
+struct tlsr_cache_key {
+	unsigned char digest[SHA256_DIGEST_LENGTH];	/**< hash of all parameters */
+};
+
+extern void tlsr_cache_key(struct tlsr_cache_key *key, const char *host, const unsigned int port,
+		const char *servercert, const struct stat *certst,
+		const char *clientcert, const struct stat *clientcertst,
+		const char *clientkey, const struct stat *clientkeyst,
+		const char *ciphers, const struct daneinfo *tlsa, const int tlsa_cnt) __attribute__ ((nonnull (1, 2, 4, 6, 8, 10)));
+extern SSL_SESSION *tlsr_cache_lookup(const struct tlsr_cache_key *key) __attribute__ ((nonnull (1)));
+extern int tlsr_cache_store(const struct tlsr_cache_key *key, SSL_SESSION *sess) __attribute__ ((nonnull (1, 2)));
+extern void tlsr_cache_remove(const struct tlsr_cache_key *key) __attribute__ ((nonnull (1)));
+
+#endif
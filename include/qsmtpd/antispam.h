@@ -9,6 +9,8 @@
 /* qsmtpd/antispam.c */
 
 extern void dotip6(char *);
+extern int rblzone_fallback(const char *rbl, int *r) __attribute__ ((nonnull (1,2)));
+extern int rbl_lookup(const char *rbl, char **txt) __attribute__ ((nonnull (1)));
 extern int check_rbl(char *const *, char **) __attribute__ ((nonnull (1)));
 extern void tarpit(void);
 extern int domainmatch(const char *fqdn, const size_t len, const char **list);
@@ -17,6 +19,7 @@ extern int lookupipbl(int);
 /* qsmtpd/spf.c */
 
 extern int check_host(const char *);
+extern int validate_names(const char *rnames, int cnt, char ***domainlist) __attribute__ ((nonnull (1,3)));
 extern int spfreceived(int, const int);
 
 enum spf_eval_result {
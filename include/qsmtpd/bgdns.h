@@ -0,0 +1,46 @@
+/** \file bgdns.h
+ \brief DNS lookups done by helper processes in the background
+ */
+#ifndef QSMTPD_BGDNS_H
+#define QSMTPD_BGDNS_H
+
+#include <qdns.h>
+
+#include <sys/types.h>
+
+/** @struct bgdns_job
+ * @brief a helper process doing DNS lookups
+ */
+struct bgdns_job {
+	pid_t pid;	/**< process id of the helper, 0 if none is running */
+	int fd;		/**< read end of the pipe the results are sent through */
+};
+
+/**
+ * @brief function run in the helper process
+ * @param fd descriptor to write the results to
+ * @param arg argument given to bgdns_start()
+ *
+ * The function must not return but call _exit() once it is done.
+ */
+typedef void (*bgdns_child)(const int fd, const void *arg);
+
+extern unsigned long dnsbudget;
+extern unsigned long dnsphasebudget;
+
+extern void dns_budget_phase(void);
+extern void dns_budget_begin(void);
+extern void dns_budget_end(void);
+
+extern int bgdns_start(struct bgdns_job *job, bgdns_child child, const void *arg);
+extern int bgdns_wait(const struct bgdns_job *job);
+extern void bgdns_finish(struct bgdns_job *job, const int sig);
+extern int bgdns_read_string(const int fd, const size_t len, char **s);
+extern int bgdns_write_mx(const int fd, const struct ips *mx);
+extern int bgdns_read_mx(const int fd, const unsigned int cnt, struct ips **mx);
+
+extern int sender_lookup_start(const char *spfdomain);
+extern int sender_lookup_wait(void);
+extern void sender_lookup_cancel(void);
+
+#endif
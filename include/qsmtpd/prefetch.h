@@ -0,0 +1,12 @@
+/** \file prefetch.h
+ \brief DNS information about the remote host looked up in advance
+ */
+#ifndef QSMTPD_PREFETCH_H
+#define QSMTPD_PREFETCH_H
+
+extern int connection_lookup_start(void);
+extern int connection_lookup_wait(void);
+extern void connection_rbl_wait(void);
+extern void connection_lookup_cancel(void);
+
+#endif
@@ -26,6 +26,26 @@ struct smtpcomm {
 					     bit 3: a space is required between commands and arguments */
 };
 
+/*! \struct rbl_result
+ The result of a DNSBL lookup for the remote host that was done in advance.
+ */
+struct rbl_result {
+	char *rbl;			/**< domain of the DNSBL */
+	int result;			/**< return value of ask_dnsa() for the lookup */
+	char *txt;			/**< TXT record of the entry if listed, NULL otherwise */
+};
+
+/*! \struct prefetch
+ DNS information about the remote host that is looked up while the connection
+ is set up. The DNSBL results are only filled in once they were collected.
+ */
+struct prefetch {
+	int validcnt;			/**< number of entries in validnames or the DNS error code */
+	char **validnames;		/**< reverse lookup names confirmed by a forward lookup */
+	unsigned int rblcnt;		/**< number of entries in rbls */
+	struct rbl_result *rbls;	/**< results of the global DNSBL lookups */
+};
+
 /*! \struct xmitstat
  This contains some flags describing the transmission and it's status.
  This is used e.g. by the user filters.
@@ -56,6 +76,7 @@ struct xmitstat {
 	struct ips *frommx;		/**< MX IPs of from domain */
 	char *spfexp;			/**< the SPF explanation if provided by the domain or NULL if none */
 	const char *spfmechanism;	/**< the SPF mechanism that matched */
+	struct prefetch *prefetch;	/**< DNS information looked up in advance, NULL if none */
 };
 
 extern struct smtpcomm *current_command;	/**< the SMTP command currently processed */
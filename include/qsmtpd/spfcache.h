@@ -0,0 +1,12 @@
+/** \file spfcache.h
+ \brief cache of SPF results shared between Qsmtpd processes
+ */
+#ifndef QSMTPD_SPFCACHE_H
+#define QSMTPD_SPFCACHE_H
+
+extern unsigned long spfcachetime;
+
+extern int spfcache_lookup(const char *domain) __attribute__ ((nonnull (1)));
+extern void spfcache_store(const char *domain, const int result, const unsigned long ttl) __attribute__ ((nonnull (1)));
+
+#endif
@@ -0,0 +1,40 @@
+/** \file spfprefetch.h
+ \brief DNS lookups of SPF mechanisms started before the record is evaluated
+ */
+#ifndef QSMTPD_SPFPREFETCH_H
+#define QSMTPD_SPFPREFETCH_H
+
+#include <qdns.h>
+
+/** @enum spf_prefetch_type
+ * @brief the kind of DNS lookup done for a prefetched name
+ */
+enum spf_prefetch_type {
+	SPF_PREFETCH_TXT,	/**< dnstxt_records() */
+	SPF_PREFETCH_A,		/**< ask_dnsa() */
+	SPF_PREFETCH_AAAA,	/**< ask_dnsaaaa() */
+	SPF_PREFETCH_MX		/**< ask_dnsmx() */
+};
+
+/** @struct spf_prefetch_answer
+ * @brief the result of a prefetched lookup
+ *
+ * The fields not belonging to the type of the lookup are NULL. The memory
+ * belongs to the caller once it was returned by spfprefetch_take().
+ */
+struct spf_prefetch_answer {
+	int result;		/**< return code of the lookup function */
+	int err;		/**< errno after the lookup */
+	unsigned long ttl;	/**< dnstxt_minttl after the lookup */
+	char *txt;		/**< the TXT records, separated by 0 bytes */
+	struct in6_addr *ip;	/**< the A or AAAA records */
+	struct ips *mx;		/**< the MX entries */
+};
+
+extern unsigned int spfprefetch_mark(void);
+extern void spfprefetch_release(const unsigned int mark);
+extern unsigned int spfprefetch_pending(void);
+extern void spfprefetch_start(const enum spf_prefetch_type type, const char *name) __attribute__ ((nonnull (2)));
+extern int spfprefetch_take(const enum spf_prefetch_type type, const char *name, struct spf_prefetch_answer *ans) __attribute__ ((nonnull (2,3)));
+
+#endif
@@ -0,0 +1,19 @@
+/** \file tlssession.h
+ \brief TLS session resumption across Qsmtpd processes
+ */
+#ifndef QSMTPD_TLSSESSION_H
+#define QSMTPD_TLSSESSION_H
+
+#include <openssl/ssl.h>
+
+#define TLS_TICKET_KEYLEN 80	/**< length of a ticket key: 16 bytes name, 32 bytes HMAC secret, 32 bytes AES key */
+
+extern int tls_ticketkey_invalid(const char *line) __attribute__ ((nonnull (1)));
+extern int tls_ticketkeys_load(void);
+extern void tls_session_setup(SSL_CTX *ctx, const char *certfile) __attribute__ ((nonnull (1, 2)));
+
+extern int tlscache_store(SSL_SESSION *sess) __attribute__ ((nonnull (1)));
+extern SSL_SESSION *tlscache_lookup(const unsigned char *id, const unsigned int idlen) __attribute__ ((nonnull (1)));
+extern void tlscache_remove(const unsigned char *id, const unsigned int idlen) __attribute__ ((nonnull (1)));
+
+#endif
@@ -0,0 +1,73 @@
+/** \file rblzone.h
+ \brief local copies of DNS blacklists in a precompiled format
+ */
+#ifndef RBLZONE_H
+#define RBLZONE_H
+
+#include <netinet/in.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define RBLZONE_MAGIC "QSRBLZ2"	/**< identifies a compiled zone file, including the trailing 0 byte */
+#define RBLZONE_DIR "rblzones/"	/**< directory below control/ where the compiled zones are stored */
+#define RBLZONE_NOCOVER UINT32_MAX	/**< no previous entry reaches further than this one */
+
+/** @enum rblzone_type
+ * @brief the kind of entries stored in a zone
+ */
+enum rblzone_type {
+	RBLZONE_IP = 1,		/**< IPv4 and IPv6 addresses, networks and ranges (dnsbl) */
+	RBLZONE_NAME = 2	/**< domain names (namebl) */
+};
+
+/** @enum rblzone_flags
+ * @brief flags of a single zone entry
+ */
+enum rblzone_flags {
+	RBLZONE_EXCLUDED = 1	/**< the entry is an exception from a wider listing */
+};
+
+/** @struct rblzone_header
+ * @brief the header of a compiled zone file
+ *
+ * The header is followed by count entries and the string table at offset
+ * strings. All values are stored in host byte order, the files are not meant
+ * to be shared between different architectures.
+ */
+struct rblzone_header {
+	char magic[8];		/**< RBLZONE_MAGIC */
+	uint32_t type;		/**< enum rblzone_type */
+	uint32_t count;		/**< number of entries */
+	uint32_t strings;	/**< offset of the string table from the start of the file */
+};
+
+/** @struct rblzone_ip
+ * @brief a listed address range, entries are sorted by first
+ */
+struct rblzone_ip {
+	struct in6_addr first;	/**< first address of the range, IPv4 is stored v4mapped */
+	struct in6_addr last;	/**< last address of the range */
+	struct in6_addr maxlast;	/**< the highest last address of this and all previous entries */
+	uint32_t cover;		/**< index of the nearest previous entry ending behind this one, RBLZONE_NOCOVER if none */
+	uint32_t txt;		/**< offset of the TXT reason in the string table, 0 if there is none */
+	uint32_t flags;		/**< enum rblzone_flags */
+};
+
+/** @struct rblzone_name
+ * @brief a listed domain name, entries are sorted by name
+ *
+ * Names are stored in lower case. A name starting with "*." matches all
+ * subdomains of the rest of the name.
+ */
+struct rblzone_name {
+	uint32_t name;		/**< offset of the name in the string table */
+	uint32_t txt;		/**< offset of the TXT reason in the string table, 0 if there is none */
+	uint32_t flags;		/**< enum rblzone_flags */
+};
+
+extern int rblzone_compile(const char *src, const size_t srclen, const enum rblzone_type type,
+		const int outfd, unsigned int *errline) __attribute__ ((nonnull (1,5)));
+extern int rblzone_lookup_ip(const char *zone, const struct in6_addr *ip, char **txt) __attribute__ ((nonnull (1,2)));
+extern int rblzone_lookup_name(const char *zone, const char *name, char **txt) __attribute__ ((nonnull (1,2)));
+
+#endif
@@ -0,0 +1,54 @@
+/** \file sharedtable.h
+ \brief tables of fixed size slots in a file shared between processes
+ */
+#ifndef SHAREDTABLE_H
+#define SHAREDTABLE_H
+
+#include <stddef.h>
+#include <sys/file.h>
+#include <sys/types.h>
+
+/** @struct shared_table
+ * @brief a table of fixed size slots in a file mapped by many processes
+ *
+ * The file name is taken from an environment variable. If it is not set the
+ * table is disabled. Use SHARED_TABLE_INIT() to initialize the variable.
+ */
+struct shared_table {
+	const char *envname;	/**< environment variable holding the file name */
+	const char *magic;	/**< identifies the file format, 7 characters */
+	const char *desc;	/**< name of the table in log messages */
+	unsigned int slots;	/**< number of slots */
+	size_t slotsize;	/**< size of one slot */
+	int fd;			/**< descriptor of the file */
+	pid_t pid;		/**< the process that opened fd */
+	void *map;		/**< the mapped file */
+	int disabled;		/**< set if the table can't be used */
+};
+
+/**
+ * @brief initializer for struct shared_table
+ * @param env environment variable holding the file name
+ * @param mag identifies the file format, 7 characters
+ * @param dsc name of the table in log messages
+ * @param cnt number of slots
+ * @param size size of one slot
+ */
+#define SHARED_TABLE_INIT(env, mag, dsc, cnt, size) \
+	{ \
+		.envname = (env), \
+		.magic = (mag), \
+		.desc = (dsc), \
+		.slots = (cnt), \
+		.slotsize = (size), \
+		.fd = -1, \
+		.map = NULL, \
+		.disabled = 0 \
+	}
+
+extern int shtable_open(struct shared_table *t) __attribute__ ((nonnull (1)));
+extern void *shtable_slot(const struct shared_table *t, const unsigned int idx) __attribute__ ((nonnull (1)));
+extern int shtable_lock(const struct shared_table *t, const int op) __attribute__ ((nonnull (1)));
+extern void shtable_unlock(const struct shared_table *t) __attribute__ ((nonnull (1)));
+
+#endif
@@ -11,6 +11,9 @@ extern int ssl_timeoutconn(SSL *s, time_t t);
 extern int ssl_timeoutaccept(SSL *s, time_t t);
 extern int ssl_timeoutrehandshake(SSL *s, time_t t);
 
+extern void ssl_ktls_request(SSL *s);
+extern int ssl_ktls_send(SSL *s);
+
 extern int ssl_timeoutread(SSL *s, time_t t, char *buf, const int len);
 extern int ssl_timeoutwrite(SSL *s, time_t t, const char *buf, const int len);
 
@@ -8,6 +8,8 @@
 
 extern SSL *ssl;
 
+int ssl_library_setup(void);
+
 void ssl_free(SSL *myssl);
 
 void ssl_library_destroy();
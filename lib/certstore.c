@@ -0,0 +1,801 @@
+/** \file certstore.c
+ \brief certificates and keys in a precompiled format
+
+ Qsmtpd looks for up to three certificate files for every connection and
+ parses the PEM encoded certificate chain and private key for every STARTTLS.
+ The certificate store combines all of these files in a single file that is
+ only mapped into memory: the certificate matching the local address is found
+ by a simple lookup, the certificate matching the server name sent by the
+ client by a binary search, and the DER encoded data needs no PEM decoding.
+ Qremote uses a store of the same format for its default client certificate.
+ */
+
+#include <certstore.h>
+
+#include <fdio.h>
+#include <mmap.h>
+
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <openssl/err.h>
+#include <openssl/pem.h>
+#include <openssl/x509v3.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+/** @struct store_files
+ * @brief the files a type of store is compiled from
+ */
+static const struct store_files {
+	const char *cert;	/**< name of the default certificate file */
+	const char *key;	/**< name of the default key file */
+	const char *store;	/**< name of the compiled store */
+} store_files[] = {
+	[CERTSTORE_SERVER] = { .cert = "servercert.pem", .key = "serverkey.pem", .store = CERTSTORE_NAME },
+	[CERTSTORE_CLIENT] = { .cert = "clientcert.pem", .key = "clientkey.pem", .store = CERTSTORE_CLIENT_NAME }
+};
+
+/** @struct store_data
+ * @brief the data area of a store while it is compiled
+ */
+struct store_data {
+	char *s;		/**< the data */
+	size_t len;		/**< used length of s */
+	size_t alloc;		/**< allocated length of s */
+};
+
+/** @struct store_name
+ * @brief a host name while the store is compiled
+ */
+struct store_name {
+	char *name;		/**< the name in lower case */
+	uint32_t entry;		/**< index of the certificate */
+	uint32_t off;		/**< offset of the name in the data area */
+};
+
+static int
+data_grow(struct store_data *d, const size_t len)
+{
+	if (d->len + len + 1 > UINT32_MAX) {
+		errno = EFBIG;
+		return -1;
+	}
+
+	if (d->len + len + 1 > d->alloc) {
+		size_t nalloc = (d->alloc == 0) ? 16384 : d->alloc;
+
+		while (d->len + len + 1 > nalloc)
+			nalloc *= 2;
+
+		char *tmp = realloc(d->s, nalloc);
+		if (tmp == NULL)
+			return -1;
+		d->s = tmp;
+		d->alloc = nalloc;
+	}
+
+	return 0;
+}
+
+static int
+data_add(struct store_data *d, const void *s, const size_t len, uint32_t *off)
+{
+	if (data_grow(d, len) != 0)
+		return -1;
+
+	*off = d->len;
+	memcpy(d->s + d->len, s, len);
+	/* every item is 0-terminated, so strings can be used directly */
+	d->s[d->len + len] = '\0';
+	d->len += len + 1;
+
+	return 0;
+}
+
+static int
+data_add_x509(struct store_data *d, X509 *x)
+{
+	const int len = i2d_X509(x, NULL);
+
+	if (len <= 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (data_grow(d, len) != 0)
+		return -1;
+
+	unsigned char *p = (unsigned char *)d->s + d->len;
+	i2d_X509(x, &p);
+	d->len += len;
+
+	return 0;
+}
+
+static void
+data_free(struct store_data *d)
+{
+	if (d->s != NULL)
+		OPENSSL_cleanse(d->s, d->len);
+	free(d->s);
+}
+
+static int
+cmp_filename(const void *a, const void *b)
+{
+	return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+static int
+cmp_name(const void *a, const void *b)
+{
+	const struct store_name *na = a;
+	const struct store_name *nb = b;
+	const int r = strcmp(na->name, nb->name);
+
+	/* keep the first certificate for a name */
+	if (r == 0)
+		return (na->entry < nb->entry) ? -1 : (na->entry > nb->entry);
+	return r;
+}
+
+static BIO *
+open_bio(const int dirfd, const char *fname)
+{
+	int fd = openat(dirfd, fname, O_RDONLY | O_CLOEXEC);
+
+	if (fd < 0)
+		return NULL;
+
+	BIO *b = BIO_new_fd(fd, BIO_CLOSE);
+	if (b == NULL) {
+		close(fd);
+		errno = ENOMEM;
+	}
+
+	return b;
+}
+
+static int
+add_name(struct store_name **names, unsigned int *cnt, const char *name, const size_t len, const uint32_t entry)
+{
+	if ((len == 0) || (memchr(name, '\0', len) != NULL))
+		return 0;
+
+	struct store_name *tmp = realloc(*names, (*cnt + 1) * sizeof(**names));
+	if (tmp == NULL)
+		return -1;
+	*names = tmp;
+
+	char *n = malloc(len + 1);
+	if (n == NULL)
+		return -1;
+	for (size_t i = 0; i < len; i++)
+		n[i] = tolower(name[i]);
+	n[len] = '\0';
+
+	tmp[*cnt].name = n;
+	tmp[*cnt].entry = entry;
+	(*cnt)++;
+
+	return 0;
+}
+
+/**
+ * @brief collect the host names a certificate is valid for
+ *
+ * If the certificate has DNS names in the subject alternative name extension
+ * only those are used, otherwise the common name.
+ */
+static int
+add_cert_names(X509 *cert, struct store_name **names, unsigned int *cnt, const uint32_t entry)
+{
+	GENERAL_NAMES *gens = X509_get_ext_d2i(cert, NID_subject_alt_name, NULL, NULL);
+	int found = 0;
+
+	if (gens != NULL) {
+		for (int i = 0; i < sk_GENERAL_NAME_num(gens); i++) {
+			const GENERAL_NAME *g = sk_GENERAL_NAME_value(gens, i);
+
+			if (g->type != GEN_DNS)
+				continue;
+
+			found = 1;
+			if (add_name(names, cnt, (const char *)ASN1_STRING_get0_data(g->d.dNSName),
+					ASN1_STRING_length(g->d.dNSName), entry) != 0) {
+				GENERAL_NAMES_free(gens);
+				return -1;
+			}
+		}
+		GENERAL_NAMES_free(gens);
+	}
+
+	if (found)
+		return 0;
+
+	X509_NAME *subj = X509_get_subject_name(cert);
+	const int idx = X509_NAME_get_index_by_NID(subj, NID_commonName, -1);
+	if (idx < 0)
+		return 0;
+
+	const ASN1_STRING *cn = X509_NAME_ENTRY_get_data(X509_NAME_get_entry(subj, idx));
+
+	return add_name(names, cnt, (const char *)ASN1_STRING_get0_data(cn), ASN1_STRING_length(cn), entry);
+}
+
+/**
+ * @brief add one certificate file to the store
+ * @param dirfd the control directory
+ * @param files the type of the store
+ * @param certfile name of the certificate file
+ * @param e the entry to fill
+ * @param data the data area
+ * @param names the host names
+ * @param namecnt number of entries in names
+ * @param idx index of e
+ * @return 0 on success, -1 on error (errno is set)
+ */
+static int
+add_cert(const int dirfd, const struct store_files *files, const char *certfile, struct certstore_entry *e, struct store_data *data,
+		struct store_name **names, unsigned int *namecnt, const uint32_t idx)
+{
+	const char *suffix = certfile + strlen(files->cert);
+	char keyfile[strlen(files->key) + strlen(suffix) + 1];
+	struct store_data chain = { .s = NULL, .len = 0, .alloc = 0 };
+	EVP_PKEY *key = NULL;
+	int ret = -1;
+
+	strcpy(keyfile, files->key);
+	strcat(keyfile, suffix);
+
+	BIO *b = open_bio(dirfd, certfile);
+	if (b == NULL)
+		return -1;
+
+	X509 *cert = PEM_read_bio_X509_AUX(b, NULL, NULL, NULL);
+	if (cert == NULL) {
+		errno = EINVAL;
+		goto out;
+	}
+
+	/* the certificate and the chain are stored back to back */
+	if (data_add_x509(&chain, cert) != 0)
+		goto out;
+	for (X509 *ca = PEM_read_bio_X509(b, NULL, NULL, NULL); ca != NULL; ca = PEM_read_bio_X509(b, NULL, NULL, NULL)) {
+		int r = data_add_x509(&chain, ca);
+
+		X509_free(ca);
+		if (r != 0)
+			goto out;
+	}
+	ERR_clear_error();
+
+	if (data_add(data, chain.s, chain.len, &e->chain) != 0)
+		goto out;
+	e->chainlen = chain.len;
+
+	/* like in Qsmtpd the key is in the certificate file if there is no key file */
+	BIO *kb = open_bio(dirfd, keyfile);
+	if (kb != NULL) {
+		BIO_free(b);
+		b = kb;
+	} else if (errno != ENOENT) {
+		goto out;
+	} else if (BIO_reset(b) != 0) {
+		errno = EIO;
+		goto out;
+	}
+
+	key = PEM_read_bio_PrivateKey(b, NULL, NULL, NULL);
+	const int len = (key == NULL) ? -1 : i2d_PrivateKey(key, NULL);
+	if ((len <= 0) || (X509_check_private_key(cert, key) != 1)) {
+		errno = EINVAL;
+		goto out;
+	}
+
+	unsigned char *kder = malloc(len);
+	if (kder == NULL)
+		goto out;
+	unsigned char *p = kder;
+	i2d_PrivateKey(key, &p);
+	int r = data_add(data, kder, len, &e->key);
+	OPENSSL_cleanse(kder, len);
+	free(kder);
+	if (r != 0)
+		goto out;
+	e->keylen = len;
+
+	if (*suffix == '.')
+		suffix++;
+	if ((data_add(data, certfile, strlen(certfile), &e->file) != 0) ||
+			(data_add(data, suffix, strlen(suffix), &e->bind) != 0) ||
+			(add_cert_names(cert, names, namecnt, idx) != 0))
+		goto out;
+
+	ret = 0;
+out:
+	;
+	int err = errno;
+	data_free(&chain);
+	EVP_PKEY_free(key);
+	X509_free(cert);
+	BIO_free(b);
+	errno = err;
+	return ret;
+}
+
+static int
+write_store(const int fd, struct certstore_entry *entries, const unsigned int cnt,
+		const struct store_name *names, const unsigned int namecnt, const struct store_data *data)
+{
+	const size_t datastart = sizeof(struct certstore_header) + cnt * sizeof(*entries) +
+			namecnt * sizeof(struct certstore_name);
+	struct certstore_header hdr = {
+		.magic = CERTSTORE_MAGIC,
+		.entries = cnt,
+		.names = namecnt,
+		.size = datastart + data->len
+	};
+
+	if (datastart + data->len > UINT32_MAX) {
+		errno = EFBIG;
+		return -1;
+	}
+
+	if (write_all(fd, &hdr, sizeof(hdr)) != 0)
+		return -1;
+
+	for (unsigned int i = 0; i < cnt; i++) {
+		const struct certstore_entry e = {
+			.bind = entries[i].bind + datastart,
+			.file = entries[i].file + datastart,
+			.chain = entries[i].chain + datastart,
+			.chainlen = entries[i].chainlen,
+			.key = entries[i].key + datastart,
+			.keylen = entries[i].keylen
+		};
+
+		if (write_all(fd, &e, sizeof(e)) != 0)
+			return -1;
+	}
+
+	for (unsigned int i = 0; i < namecnt; i++) {
+		const struct certstore_name n = {
+			.name = names[i].off + datastart,
+			.entry = names[i].entry
+		};
+
+		if (write_all(fd, &n, sizeof(n)) != 0)
+			return -1;
+	}
+
+	return write_all(fd, data->s, data->len);
+}
+
+/**
+ * @brief compile all certificates of a control directory
+ * @param dirfd the control directory
+ * @param type which certificates to compile
+ * @param outfd the compiled store is written to this descriptor
+ * @param errfile the name of the offending file is stored here on error
+ * @return number of certificates on success, -1 on error (errno is set)
+ *
+ * All files named servercert.pem or servercert.pem.<ip> or
+ * servercert.pem.<ip>:<port> are added to the store, with the private key
+ * from the matching serverkey.pem file if one exists. A client store is
+ * built the same way from clientcert.pem and clientkey.pem. If a file can't be
+ * used its name is stored in errfile, otherwise errfile is set to NULL. The
+ * name is allocated and must be freed by the caller.
+ */
+int
+certstore_compile(const int dirfd, const enum certstore_type type, const int outfd, const char **errfile)
+{
+	const struct store_files *sf = store_files + type;
+	struct store_data data = { .s = NULL, .len = 0, .alloc = 0 };
+	struct store_name *names = NULL;
+	unsigned int namecnt = 0;
+	struct certstore_entry *entries = NULL;
+	char **files = NULL;
+	unsigned int filecnt = 0;
+	int ret = -1;
+
+	*errfile = NULL;
+
+	int dfd = openat(dirfd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (dfd < 0)
+		return -1;
+	DIR *dir = fdopendir(dfd);
+	if (dir == NULL) {
+		close(dfd);
+		return -1;
+	}
+
+	struct dirent *de;
+	while ((de = readdir(dir)) != NULL) {
+		const char *suffix = de->d_name + strlen(sf->cert);
+
+		if ((strncmp(de->d_name, sf->cert, strlen(sf->cert)) != 0) ||
+				((*suffix != '\0') && ((*suffix != '.') || (suffix[1] == '\0'))))
+			continue;
+
+		char **tmp = realloc(files, (filecnt + 1) * sizeof(*files));
+		if (tmp == NULL)
+			goto out;
+		files = tmp;
+		files[filecnt] = strdup(de->d_name);
+		if (files[filecnt] == NULL)
+			goto out;
+		filecnt++;
+	}
+
+	if (filecnt == 0) {
+		errno = ENOENT;
+		goto out;
+	}
+
+	/* the default certificate comes first and wins if several are valid for the same name */
+	qsort(files, filecnt, sizeof(*files), cmp_filename);
+
+	entries = calloc(filecnt, sizeof(*entries));
+	if (entries == NULL)
+		goto out;
+
+	for (unsigned int i = 0; i < filecnt; i++) {
+		if (add_cert(dirfd, sf, files[i], entries + i, &data, &names, &namecnt, i) != 0) {
+			*errfile = files[i];
+			/* keep the name for the caller */
+			files[i] = NULL;
+			goto out;
+		}
+	}
+
+	qsort(names, namecnt, sizeof(*names), cmp_name);
+
+	/* drop duplicate names, the first certificate is kept */
+	unsigned int unique = 0;
+	for (unsigned int i = 0; i < namecnt; i++) {
+		if ((unique > 0) && (strcmp(names[i].name, names[unique - 1].name) == 0)) {
+			free(names[i].name);
+			continue;
+		}
+		names[unique++] = names[i];
+	}
+	namecnt = unique;
+
+	for (unsigned int i = 0; i < namecnt; i++)
+		if (data_add(&data, names[i].name, strlen(names[i].name), &names[i].off) != 0)
+			goto out;
+
+	if (write_store(outfd, entries, filecnt, names, namecnt, &data) != 0)
+		goto out;
+
+	ret = filecnt;
+
+out:
+	;
+	int e = errno;
+	closedir(dir);
+	for (unsigned int i = 0; i < filecnt; i++)
+		free(files[i]);
+	free(files);
+	free(entries);
+	for (unsigned int i = 0; i < namecnt; i++)
+		free(names[i].name);
+	free(names);
+	data_free(&data);
+	errno = e;
+
+	return ret;
+}
+
+/**
+ * @brief open a certificate store of a control directory
+ * @param dirfd the control directory
+ * @param type which store to open
+ * @param cs the store
+ * @return 0 on success, -1 on error (errno is set)
+ *
+ * If the store is already open nothing is done. If there is no store errno is
+ * set to ENOENT, if the file is not a valid store errno is set to EINVAL.
+ */
+int
+certstore_open(const int dirfd, const enum certstore_type type, struct certstore *cs)
+{
+	if (cs->map != NULL)
+		return 0;
+
+	int fd = openat(dirfd, store_files[type].store, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+
+	off_t len;
+	const char *map = mmap_fd(fd, &len);
+	int e = (errno == 0) ? EINVAL : errno;
+	close(fd);
+	if (map == NULL) {
+		errno = e;
+		return -1;
+	}
+
+	const struct certstore_header *hdr = (const struct certstore_header *)map;
+	if (((size_t)len <= sizeof(*hdr)) || (memcmp(hdr->magic, CERTSTORE_MAGIC, sizeof(hdr->magic)) != 0) ||
+			(hdr->size != len) || (hdr->entries == 0) ||
+			(sizeof(*hdr) + (uint64_t)hdr->entries * sizeof(struct certstore_entry) +
+			(uint64_t)hdr->names * sizeof(struct certstore_name) > (uint64_t)len)) {
+		munmap((void *)map, len);
+		errno = EINVAL;
+		return -1;
+	}
+
+	cs->map = map;
+	cs->len = len;
+
+	return 0;
+}
+
+/**
+ * @brief close a certificate store
+ * @param cs the store
+ *
+ * The store can be opened again afterwards, e.g. after the file was replaced.
+ */
+void
+certstore_close(struct certstore *cs)
+{
+	if (cs->map == NULL)
+		return;
+
+	munmap((void *)cs->map, cs->len);
+	cs->map = NULL;
+	cs->len = 0;
+}
+
+static const struct certstore_entry *
+store_entry(const struct certstore *cs, const unsigned int idx)
+{
+	return (const struct certstore_entry *)(cs->map + sizeof(struct certstore_header)) + idx;
+}
+
+/**
+ * @brief get a string from the store
+ * @return the string, NULL if the offset is invalid
+ */
+static const char *
+store_string(const struct certstore *cs, const uint32_t off)
+{
+	if ((off >= cs->len) || (memchr(cs->map + off, '\0', cs->len - off) == NULL))
+		return NULL;
+
+	return cs->map + off;
+}
+
+/**
+ * @brief find the certificate for a local address
+ * @param cs the store
+ * @param ip the local IP address
+ * @param port the local port, NULL if unknown
+ * @return index of the certificate, -1 if none matches
+ *
+ * The same rules as for the certificate files apply: a certificate for the
+ * address and port is preferred over one for the address only, which is
+ * preferred over the default certificate.
+ */
+int
+certstore_find(const struct certstore *cs, const char *ip, const char *port)
+{
+	const struct certstore_header *hdr = (const struct certstore_header *)cs->map;
+	const size_t iplen = strlen(ip);
+	int best = -1;
+	int bestprio = 0;
+
+	for (unsigned int i = 0; i < hdr->entries; i++) {
+		const char *bind = store_string(cs, store_entry(cs, i)->bind);
+		int prio;
+
+		if (bind == NULL)
+			continue;
+
+		if (*bind == '\0') {
+			prio = 1;
+		} else if ((strncmp(bind, ip, iplen) != 0) || ((bind[iplen] != '\0') && (bind[iplen] != ':'))) {
+			continue;
+		} else if (bind[iplen] == '\0') {
+			prio = 2;
+		} else if ((port != NULL) && (strcmp(bind + iplen + 1, port) == 0)) {
+			prio = 3;
+		} else {
+			continue;
+		}
+
+		if (prio > bestprio) {
+			best = i;
+			bestprio = prio;
+		}
+	}
+
+	return best;
+}
+
+static int
+find_exact(const struct certstore *cs, const char *name)
+{
+	const struct certstore_header *hdr = (const struct certstore_header *)cs->map;
+	const struct certstore_name *names = (const struct certstore_name *)
+			(cs->map + sizeof(*hdr) + hdr->entries * sizeof(struct certstore_entry));
+	unsigned int lo = 0;
+	unsigned int hi = hdr->names;
+
+	while (lo < hi) {
+		const unsigned int mid = lo + (hi - lo) / 2;
+		const char *n = store_string(cs, names[mid].name);
+
+		if (n == NULL)
+			return -1;
+
+		const int r = strcmp(name, n);
+		if (r == 0)
+			return (names[mid].entry < hdr->entries) ? (int)names[mid].entry : -1;
+		if (r < 0)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+
+	return -1;
+}
+
+/**
+ * @brief find the certificate for a host name
+ * @param cs the store
+ * @param name the host name sent by the client
+ * @return index of the certificate, -1 if none matches
+ *
+ * A certificate for exactly this name is preferred over a wildcard one.
+ */
+int
+certstore_find_name(const struct certstore *cs, const char *name)
+{
+	const size_t len = strlen(name);
+	char lname[len + 2];
+
+	if ((len == 0) || (len > 255))
+		return -1;
+
+	for (size_t i = 0; i <= len; i++)
+		lname[i] = tolower(name[i]);
+
+	int r = find_exact(cs, lname);
+	if (r >= 0)
+		return r;
+
+	/* replace the first label by a '*' */
+	const char *dot = strchr(lname, '.');
+	if ((dot == NULL) || (dot == lname))
+		return -1;
+
+	lname[0] = '*';
+	memmove(lname + 1, dot, strlen(dot) + 1);
+
+	return find_exact(cs, lname);
+}
+
+/**
+ * @brief get the name of the file a certificate was read from
+ * @param cs the store
+ * @param idx index of the certificate
+ * @return the file name, relative to the control directory
+ */
+const char *
+certstore_file(const struct certstore *cs, const unsigned int idx)
+{
+	const char *f = store_string(cs, store_entry(cs, idx)->file);
+
+	return (f == NULL) ? "" : f;
+}
+
+/**
+ * @brief decode a certificate from the store
+ * @param cs the store
+ * @param idx index of the certificate
+ * @param cert the certificate will be stored here
+ * @param key the private key will be stored here
+ * @param chain the intermediate certificates will be stored here
+ * @return 0 on success, -1 on error
+ */
+static int
+decode_entry(const struct certstore *cs, const unsigned int idx, X509 **cert, EVP_PKEY **key, STACK_OF(X509) **chain)
+{
+	const struct certstore_entry *e = store_entry(cs, idx);
+
+	if ((e->chain >= cs->len) || (e->chainlen > cs->len - e->chain) ||
+			(e->key >= cs->len) || (e->keylen > cs->len - e->key)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	const unsigned char *p = (const unsigned char *)cs->map + e->chain;
+	const unsigned char *end = p + e->chainlen;
+
+	*key = NULL;
+	*chain = sk_X509_new_null();
+	*cert = d2i_X509(NULL, &p, end - p);
+	if ((*cert == NULL) || (*chain == NULL))
+		goto err;
+
+	while (p < end) {
+		X509 *ca = d2i_X509(NULL, &p, end - p);
+
+		if ((ca == NULL) || !sk_X509_push(*chain, ca)) {
+			X509_free(ca);
+			goto err;
+		}
+	}
+
+	p = (const unsigned char *)cs->map + e->key;
+	*key = d2i_AutoPrivateKey(NULL, &p, e->keylen);
+	if (*key == NULL)
+		goto err;
+
+	return 0;
+
+err:
+	X509_free(*cert);
+	sk_X509_pop_free(*chain, X509_free);
+	errno = EINVAL;
+	return -1;
+}
+
+/**
+ * @brief use a certificate of the store for a context
+ * @param cs the store
+ * @param idx index of the certificate
+ * @param ctx the context
+ * @return 0 on success, -1 on error
+ */
+int
+certstore_use_ctx(const struct certstore *cs, const unsigned int idx, SSL_CTX *ctx)
+{
+	X509 *cert;
+	EVP_PKEY *key;
+	STACK_OF(X509) *chain;
+
+	if (decode_entry(cs, idx, &cert, &key, &chain) != 0)
+		return -1;
+
+	const int r = SSL_CTX_use_cert_and_key(ctx, cert, key, chain, 1);
+
+	X509_free(cert);
+	EVP_PKEY_free(key);
+	sk_X509_pop_free(chain, X509_free);
+
+	return (r == 1) ? 0 : -1;
+}
+
+/**
+ * @brief use a certificate of the store for a connection
+ * @param cs the store
+ * @param idx index of the certificate
+ * @param ssl the connection
+ * @return 0 on success, -1 on error
+ */
+int
+certstore_use(const struct certstore *cs, const unsigned int idx, SSL *ssl)
+{
+	X509 *cert;
+	EVP_PKEY *key;
+	STACK_OF(X509) *chain;
+
+	if (decode_entry(cs, idx, &cert, &key, &chain) != 0)
+		return -1;
+
+	const int r = SSL_use_cert_and_key(ssl, cert, key, chain, 1);
+
+	X509_free(cert);
+	EVP_PKEY_free(key);
+	sk_X509_pop_free(chain, X509_free);
+
+	return (r == 1) ? 0 : -1;
+}
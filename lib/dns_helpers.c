@@ -6,9 +6,16 @@
 
 #include <arpa/inet.h>
 #include <assert.h>
+#include <limits.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
+#include <time.h>
+
+time_t dns_deadline;	/**< CLOCK_MONOTONIC second after which no DNS queries are sent, 0 for no limit */
+unsigned long dnstxt_minttl = ULONG_MAX;	/**< lowest TTL of the TXT records received by dnstxt_records() since this was reset */
+unsigned long dns_minttl = ULONG_MAX;	/**< lowest TTL of the MX and address records received by dnsmx(), dnsip4() and dnsip6() since this was reset */
+unsigned long dns_queries;	/**< number of DNS queries sent by this process, for statistics */
 
 /**
  * check if a string is a valid fqdn
@@ -101,6 +108,33 @@ freeips(struct ips *p)
 	}
 }
 
+/**
+ * @brief get the time left until dns_deadline is reached
+ * @return milliseconds left
+ * @retval -1 there is no deadline
+ * @retval 0 the deadline has passed
+ */
+int
+dns_time_left(void)
+{
+	struct timespec now;
+
+	if (dns_deadline == 0)
+		return -1;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (now.tv_sec >= dns_deadline)
+		return 0;
+
+	const time_t left = dns_deadline - now.tv_sec;
+
+	/* the budgets are configured in seconds, so this will not overflow in practice */
+	if (left > INT_MAX / 1000)
+		return INT_MAX;
+
+	return left * 1000 - now.tv_nsec / 1000000;
+}
+
 static int
 ip6_sort(const void *l, const void *r)
 {
@@ -0,0 +1,70 @@
+/** \file fdio.c
+ \brief functions for reading and writing complete buffers
+ */
+
+#include <fdio.h>
+
+#include <errno.h>
+#include <unistd.h>
+
+/**
+ * @brief write a buffer completely to a descriptor
+ * @param fd descriptor to write to
+ * @param buf data to write
+ * @param len length of buf
+ * @return 0 on success, -1 on error (errno is set)
+ *
+ * Interrupted writes are restarted.
+ */
+int
+write_all(const int fd, const void *buf, size_t len)
+{
+	const char *b = buf;
+
+	while (len > 0) {
+		ssize_t w = write(fd, b, len);
+
+		if (w < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		b += w;
+		len -= w;
+	}
+
+	return 0;
+}
+
+/**
+ * @brief read a buffer completely from a descriptor
+ * @param fd descriptor to read from
+ * @param buf data will be stored here
+ * @param len length of buf
+ * @return 0 on success, -1 on error (errno is set)
+ *
+ * Interrupted reads are restarted. If the other side closes the descriptor
+ * before all data was read errno is set to EPIPE.
+ */
+int
+read_all(const int fd, void *buf, size_t len)
+{
+	char *b = buf;
+
+	while (len > 0) {
+		ssize_t r = read(fd, b, len);
+
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		} else if (r == 0) {
+			errno = EPIPE;
+			return -1;
+		}
+		b += r;
+		len -= r;
+	}
+
+	return 0;
+}
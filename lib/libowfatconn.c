@@ -4,6 +4,8 @@
 
 #include <libowfatconn.h>
 
+#include <qdns.h>
+
 #include <byte.h>
 #include <dns.h>
 #include <errno.h>
@@ -41,6 +43,23 @@ mangle_ip_ret(struct stralloc *sa, char **out, size_t *len, int r)
 	return r;
 }
 
+/**
+ * @brief check if the time for DNS lookups is used up
+ * @return if no further queries may be sent
+ *
+ * If the deadline has passed errno is set to ETIMEDOUT, so the callers
+ * handle this like a query that timed out.
+ */
+static int
+deadline_passed(void)
+{
+	if (dns_time_left() != 0)
+		return 0;
+
+	errno = ETIMEDOUT;
+	return 1;
+}
+
 /**
  * @brief create a stralloc for the given string
  *
@@ -54,6 +73,146 @@ mangle_ip_ret(struct stralloc *sa, char **out, size_t *len, int r)
 		.s = (char *)str \
 	}
 
+/**
+ * @brief record the lowest TTL of the answers in a DNS packet
+ * @param buf the packet
+ * @param len length of buf
+ *
+ * All answers of class IN, including CNAMEs, lower dns_minttl.
+ */
+static void
+record_minttl(const char *buf, const unsigned int len)
+{
+	char header[12];
+	uint16 numanswers;
+	uint16 datalen;
+
+	unsigned int pos = dns_packet_copy(buf, len, 0, header, 12);
+	if (pos == 0)
+		return;
+	uint16_unpack_big(header + 6, &numanswers);
+	pos = dns_packet_skipname(buf, len, pos);
+	if (pos == 0)
+		return;
+	pos += 4;
+
+	while (numanswers--) {
+		pos = dns_packet_skipname(buf, len, pos);
+		if (pos == 0)
+			return;
+		pos = dns_packet_copy(buf, len, pos, header, 10);
+		if (pos == 0)
+			return;
+		uint16_unpack_big(header + 8, &datalen);
+
+		if (byte_equal(header + 2, 2, DNS_C_IN)) {
+			const unsigned long ttl = ((unsigned long)(unsigned char)header[4] << 24) |
+					((unsigned char)header[5] << 16) | ((unsigned char)header[6] << 8) |
+					(unsigned char)header[7];
+
+			if (ttl < dns_minttl)
+				dns_minttl = ttl;
+		}
+		pos += datalen;
+	}
+}
+
+/**
+ * @brief extract the A and AAAA records from a DNS packet
+ * @param out the addresses are appended here
+ * @param buf the packet
+ * @param len length of buf
+ * @param mapped if IPv4 addresses are stored as v4mapped IPv6 addresses
+ * @return 0 on success, -1 on error
+ */
+static int
+addr_packet(stralloc *out, const char *buf, const unsigned int len, const int mapped)
+{
+	static const char v4mapped[12] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, (char)0xff, (char)0xff };
+	char header[12];
+	char addr[16];
+	uint16 numanswers;
+	uint16 datalen;
+
+	unsigned int pos = dns_packet_copy(buf, len, 0, header, 12);
+	if (pos == 0)
+		return -1;
+	uint16_unpack_big(header + 6, &numanswers);
+	pos = dns_packet_skipname(buf, len, pos);
+	if (pos == 0)
+		return -1;
+	pos += 4;
+
+	while (numanswers--) {
+		pos = dns_packet_skipname(buf, len, pos);
+		if (pos == 0)
+			return -1;
+		pos = dns_packet_copy(buf, len, pos, header, 10);
+		if (pos == 0)
+			return -1;
+		uint16_unpack_big(header + 8, &datalen);
+
+		if (byte_equal(header + 2, 2, DNS_C_IN)) {
+			if (byte_equal(header, 2, DNS_T_A) && (datalen == 4)) {
+				if (dns_packet_copy(buf, len, pos, addr, 4) == 0)
+					return -1;
+				if (mapped && !stralloc_catb(out, v4mapped, sizeof(v4mapped)))
+					return -1;
+				if (!stralloc_catb(out, addr, 4))
+					return -1;
+			} else if (byte_equal(header, 2, DNS_T_AAAA) && (datalen == 16) && mapped) {
+				if (dns_packet_copy(buf, len, pos, addr, 16) == 0)
+					return -1;
+				if (!stralloc_catb(out, addr, 16))
+					return -1;
+			}
+		}
+		pos += datalen;
+	}
+
+	return 0;
+}
+
+/**
+ * @brief query DNS for the addresses of a host name
+ * @param out the addresses are appended here
+ * @param host the host name
+ * @param type DNS_T_A or DNS_T_AAAA
+ * @param mapped if IPv4 addresses are stored as v4mapped IPv6 addresses
+ * @return 0 on success, -1 on error
+ *
+ * This does the same as the libowfat functions, but records the TTL of the
+ * answers in dns_minttl.
+ */
+static int
+addr_query(stralloc *out, const char *host, const char *type, const int mapped)
+{
+	char *q = NULL;
+
+	if (!dns_domain_fromdot(&q, host, strlen(host)))
+		return -1;
+
+	int r = dns_resolve(q, type);
+	dns_domain_free(&q);
+	if (r != 0)
+		return -1;
+
+	record_minttl(dns_resolve_tx.packet, dns_resolve_tx.packetlen);
+	r = addr_packet(out, dns_resolve_tx.packet, dns_resolve_tx.packetlen, mapped);
+	dns_transmit_free(&dns_resolve_tx);
+
+	return r;
+}
+
+/**
+ * @brief check if a name is an IPv4 address that libowfat parses itself
+ */
+static int
+is_ip4_literal(const char *host)
+{
+	return host[strspn(host, "0123456789.[]")] == '\0';
+}
+
 /**
  * @brief query DNS for IPv6 address of host
  *
@@ -66,17 +225,33 @@ mangle_ip_ret(struct stralloc *sa, char **out, size_t *len, int r)
 int
 dnsip6(char **out, size_t *len, const char *host)
 {
-	/* we can't use const_stralloc_from_string() here as dns_ip6()
-	 * modifies it's second argument. */
-	stralloc fqdn = {.a = 0, .len = 0, .s = NULL};
+	if (deadline_passed()) {
+		*out = NULL;
+		*len = 0;
+		return -1;
+	}
+
 	stralloc sa = {.a = 0, .len = 0, .s = NULL};
 
-	if (!stralloc_copys(&fqdn, host))
-		return -1;
+	if ((strchr(host, ':') != NULL) || is_ip4_literal(host)) {
+		/* we can't use const_stralloc_from_string() here as dns_ip6()
+		 * modifies it's second argument. */
+		stralloc fqdn = {.a = 0, .len = 0, .s = NULL};
 
-	int r = dns_ip6(&sa, &fqdn);
-	free(fqdn.s);
-	return mangle_ip_ret(&sa, out, len, r);
+		if (!stralloc_copys(&fqdn, host))
+			return -1;
+
+		int r = dns_ip6(&sa, &fqdn);
+		free(fqdn.s);
+		return mangle_ip_ret(&sa, out, len, r);
+	}
+
+	dns_queries += 2;
+
+	/* the addresses of one family are used even if the other query fails */
+	const int r6 = addr_query(&sa, host, DNS_T_AAAA, 1);
+	const int r4 = addr_query(&sa, host, DNS_T_A, 1);
+	return mangle_ip_ret(&sa, out, len, ((r6 < 0) && (r4 < 0)) ? -1 : 0);
 }
 
 /**
@@ -91,9 +266,24 @@ dnsip6(char **out, size_t *len, const char *host)
 int
 dnsip4(char **out, size_t *len, const char *host)
 {
-	const stralloc fqdn = const_stralloc_from_string(host);
+	if (deadline_passed()) {
+		*out = NULL;
+		*len = 0;
+		return -1;
+	}
+
 	stralloc sa = {.a = 0, .len = 0, .s = NULL};
-	int r = dns_ip4(&sa, &fqdn);
+	int r;
+
+	if (is_ip4_literal(host)) {
+		const stralloc fqdn = const_stralloc_from_string(host);
+
+		r = dns_ip4(&sa, &fqdn);
+	} else {
+		dns_queries++;
+		r = addr_query(&sa, host, DNS_T_A, 0);
+	}
+
 	return mangle_ip_ret(&sa, out, len, r);
 }
 
@@ -109,17 +299,36 @@ dnsip4(char **out, size_t *len, const char *host)
 int
 dnsmx(char **out, size_t *len, const char *host)
 {
-	const stralloc fqdn = const_stralloc_from_string(host);
+	if (deadline_passed()) {
+		*out = NULL;
+		*len = 0;
+		return -1;
+	}
+
+	dns_queries++;
+
 	stralloc sa = {.a = 0, .len = 0, .s = NULL};
-	int r = dns_mx(&sa, &fqdn);
+	char *q = NULL;
+
+	if (!dns_domain_fromdot(&q, host, strlen(host)))
+		return mangle_ip_ret(&sa, out, len, -1);
+
+	int r = dns_resolve(q, DNS_T_MX);
+	dns_domain_free(&q);
+	if (r == 0) {
+		record_minttl(dns_resolve_tx.packet, dns_resolve_tx.packetlen);
+		r = dns_mx_packet(&sa, dns_resolve_tx.packet, dns_resolve_tx.packetlen);
+		dns_transmit_free(&dns_resolve_tx);
+	}
+
 	return mangle_ip_ret(&sa, out, len, r);
 }
 
 /*
  * The next 2 functions are directly taken from libowfat. That's why they
  * have a different coding style. They are modified only to add 0 separators
- * between every result and pass the number of result records back to the
- * caller.
+ * between every result, pass the number of result records back to the
+ * caller, and to record the lowest TTL in dnstxt_minttl.
  */
 static int
 dns_txt_packet2(stralloc *out,const char *buf,unsigned int len)
@@ -148,6 +357,9 @@ dns_txt_packet2(stralloc *out,const char *buf,unsigned int len)
       int subcount = 0;
       // concat multiple DNS strings
       if (byte_equal(header + 2,2,DNS_C_IN)) {
+	unsigned long ttl = ((unsigned long)(unsigned char)header[4] << 24) | ((unsigned char)header[5] << 16) |
+	    ((unsigned char)header[6] << 8) | (unsigned char)header[7];
+	if (ttl < dnstxt_minttl) dnstxt_minttl = ttl;
 	if (pos + datalen > len) { errno = EINVAL; return -1; }
 	txtlen = 0;
 	for (i = 0;i < datalen;++i) {
@@ -200,6 +412,13 @@ dns_txt2(stralloc *out,const stralloc *fqdn)
 int
 dnstxt_records(char **out, const char *host)
 {
+	if (deadline_passed()) {
+		*out = NULL;
+		return -1;
+	}
+
+	dns_queries++;
+
 	stralloc sa = {.a = 0, .len = 0, .s = NULL};
 	const stralloc fqdn = const_stralloc_from_string(host);
 	int r = dns_txt2(&sa, &fqdn);
@@ -226,6 +445,13 @@ dnstxt_records(char **out, const char *host)
 int
 dnstxt(char **out, const char *host)
 {
+	if (deadline_passed()) {
+		*out = NULL;
+		return -1;
+	}
+
+	dns_queries++;
+
 	stralloc sa = {.a = 0, .len = 0, .s = NULL};
 	const stralloc fqdn = const_stralloc_from_string(host);
 	int r = dns_txt(&sa, &fqdn);
@@ -258,6 +484,13 @@ dnstxt(char **out, const char *host)
 int
 dnsname(char **out, const struct in6_addr *ip)
 {
+	if (deadline_passed()) {
+		*out = NULL;
+		return -1;
+	}
+
+	dns_queries++;
+
 	stralloc sa = {.a = 0, .len = 0, .s = NULL};
 	int r = dns_name6(&sa, (const char *)ip->s6_addr);
 
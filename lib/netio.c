@@ -12,6 +12,7 @@
 #include <errno.h>
 #include <poll.h>
 #include <string.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 #ifdef POLLRDHUP
@@ -392,6 +393,35 @@ net_read(const int fatal)
 	}
 }
 
+/**
+ * handle an error while writing to the network
+ *
+ * @param wfd poll descriptor of the socket
+ * @retval 0 the socket is writable again
+ * @retval -1 on error (errno is set)
+ *
+ * does not return on timeout or if the connection was closed
+ */
+static int
+write_error(struct pollfd *wfd)
+{
+	/* the socket is nonblocking once TLS has been set up */
+	if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+		switch (poll(wfd, 1, timeout * 1000)) {
+		case 0:
+			dieerror(ETIMEDOUT);
+		case -1:
+			return -1;
+		}
+		return 0;
+	}
+	if (errno == EPIPE)
+		dieerror(ECONNRESET);
+	else if ((errno == ECONNRESET) || (errno == ETIMEDOUT))
+		dieerror(errno);
+	return -1;
+}
+
 /**
  * write one line to the network
  *
@@ -407,7 +437,8 @@ netnwrite(const char *s, const size_t l)
 {
 	DEBUG_OUT(s, l);
 
-	if (ssl) {
+	/* with kernel TLS the data goes to the socket directly */
+	if (ssl && !ssl_ktls_send(ssl)) {
 		int r = ssl_timeoutwrite(ssl, timeout, s, l);
 		switch (r) {
 		case -ETIMEDOUT:
@@ -439,11 +470,9 @@ netnwrite(const char *s, const size_t l)
 		while (p < l) {
 			const ssize_t r = write(socketd, s + p, l - p);
 			if (r == -1) {
-				if (errno == EPIPE)
-					dieerror(ECONNRESET);
-				else if ((errno == ECONNRESET) || (errno == ETIMEDOUT))
-					dieerror(errno);
-				return -1;
+				if (write_error(&wfd) != 0)
+					return -1;
+				continue;
 			}
 			p += r;
 		}
@@ -451,6 +480,74 @@ netnwrite(const char *s, const size_t l)
 	}
 }
 
+/**
+ * write several buffers to the network
+ *
+ * @param iov the buffers to send
+ * @param cnt number of entries in iov
+ * @retval 0 on success
+ * @retval -1 on error (errno is set)
+ *
+ * Unless userspace TLS is active all buffers are passed to the kernel at once,
+ * so they need not be copied together before.
+ *
+ * does not return on timeout, program will be cancelled
+ */
+int
+netnwritev(const struct iovec *iov, const unsigned int cnt)
+{
+	if (ssl && !ssl_ktls_send(ssl)) {
+		for (unsigned int i = 0; i < cnt; i++) {
+			if (netnwrite(iov[i].iov_base, iov[i].iov_len) != 0)
+				return -1;
+		}
+		return 0;
+	}
+
+	struct iovec v[cnt];
+	struct iovec *cur = v;
+	unsigned int left = cnt;
+	struct pollfd wfd = {
+		.fd = socketd,
+		.events = POLLOUT
+	};
+
+	for (unsigned int i = 0; i < cnt; i++) {
+		DEBUG_OUT(iov[i].iov_base, iov[i].iov_len);
+		v[i] = iov[i];
+	}
+
+	switch (poll(&wfd, 1, timeout * 1000)) {
+	case 0:
+		dieerror(ETIMEDOUT);
+	case -1:
+		return -1;
+	}
+
+	while (left > 0) {
+		const ssize_t r = writev(socketd, cur, left);
+		if (r == -1) {
+			if (write_error(&wfd) != 0)
+				return -1;
+			continue;
+		}
+
+		/* skip what has been written */
+		size_t done = r;
+		while ((left > 0) && (done >= cur->iov_len)) {
+			done -= cur->iov_len;
+			cur++;
+			left--;
+		}
+		if (left > 0) {
+			cur->iov_base = (char *)cur->iov_base + done;
+			cur->iov_len -= done;
+		}
+	}
+
+	return 0;
+}
+
 /**
  * write one line to the network, fold if needed
  *
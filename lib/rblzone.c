@@ -0,0 +1,797 @@
+/** \file rblzone.c
+ \brief local copies of DNS blacklists in a precompiled format
+
+ Many DNS blacklists can be mirrored locally in the format used by rbldnsd.
+ These files are compiled into a sorted index that is mapped into memory on
+ lookup, so listed addresses and names are found without any DNS traffic.
+
+ The source format is line based. Empty lines and lines starting with '#' or
+ ';' are ignored, as are rbldnsd directives starting with '$'. A line starting
+ with ':' sets the default reason for the following entries in the form
+ ":A:text", where the A value is ignored. Every other line contains one entry,
+ optionally followed by its own reason either as ":A:text" or as plain text.
+ An entry starting with '!' is an exception from a wider listing.
+
+ Entries of IP zones are single IPv4 or IPv6 addresses, networks in CIDR
+ notation, or ranges in the form "first-last". A '$' in the reason is
+ replaced by the address that was looked up.
+
+ Entries of name zones are domain names. A name starting with "*." matches
+ only the subdomains of the given domain, a name starting with '.' matches
+ the domain itself and all of its subdomains.
+ */
+
+#include <rblzone.h>
+
+#include <control.h>
+#include <fdio.h>
+#include <mmap.h>
+#include <qdns.h>
+
+#include <arpa/inet.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+/** @struct zone_entry
+ * @brief an entry of a zone while it is compiled
+ */
+struct zone_entry {
+	struct in6_addr first;	/**< first address of an IP entry */
+	struct in6_addr last;	/**< last address of an IP entry */
+	char *name;		/**< the name of a name entry */
+	uint32_t nameoff;	/**< offset of the name in the string table once it was added */
+	uint32_t txt;		/**< offset of the reason in the string table */
+	uint32_t flags;		/**< enum rblzone_flags */
+};
+
+/** @struct strtab
+ * @brief the string table of a zone while it is compiled
+ */
+struct strtab {
+	char *s;		/**< the strings */
+	size_t len;		/**< used length of s */
+	size_t alloc;		/**< allocated length of s */
+};
+
+static int
+strtab_add(struct strtab *t, const char *s, const size_t len, uint32_t *off)
+{
+	if (t->len + len + 1 > t->alloc) {
+		size_t nalloc = (t->alloc == 0) ? 4096 : t->alloc;
+
+		while (t->len + len + 1 > nalloc)
+			nalloc *= 2;
+
+		char *tmp = realloc(t->s, nalloc);
+		if (tmp == NULL)
+			return -1;
+		t->s = tmp;
+		t->alloc = nalloc;
+	}
+
+	if (t->len + len + 1 > UINT32_MAX) {
+		errno = EFBIG;
+		return -1;
+	}
+
+	*off = t->len;
+	memcpy(t->s + t->len, s, len);
+	t->s[t->len + len] = '\0';
+	t->len += len + 1;
+
+	return 0;
+}
+
+/**
+ * @brief limit an address to the given prefix length
+ * @param first the address, will be set to the first address of the network
+ * @param last will be set to the last address of the network
+ * @param prefix the prefix length
+ */
+static void
+apply_prefix(struct in6_addr *first, struct in6_addr *last, const unsigned int prefix)
+{
+	for (unsigned int i = 0; i < sizeof(first->s6_addr); i++) {
+		unsigned char mask;
+
+		if (prefix >= (i + 1) * 8)
+			mask = 0xff;
+		else if (prefix <= i * 8)
+			mask = 0;
+		else
+			mask = (unsigned char)(0xff << (8 - (prefix - i * 8)));
+
+		first->s6_addr[i] &= mask;
+		last->s6_addr[i] = first->s6_addr[i] | (unsigned char)~mask;
+	}
+}
+
+static int
+parse_addr(const char *s, struct in6_addr *addr, unsigned int *maxprefix)
+{
+	struct in_addr ip4;
+
+	if (inet_pton(AF_INET, s, &ip4) == 1) {
+		*addr = in_addr_to_v4mapped(&ip4);
+		*maxprefix = 32;
+		return 0;
+	} else if (inet_pton(AF_INET6, s, addr) == 1) {
+		*maxprefix = 128;
+		return 0;
+	}
+
+	return -1;
+}
+
+/**
+ * @brief parse an IP entry
+ * @param s the entry
+ * @param e the range will be stored here
+ * @return 0 on success, -1 on syntax error
+ */
+static int
+parse_ip(char *s, struct zone_entry *e)
+{
+	char *sep = strpbrk(s, "/-");
+	unsigned int maxprefix;
+
+	if (sep == NULL) {
+		if (parse_addr(s, &e->first, &maxprefix) != 0)
+			return -1;
+		e->last = e->first;
+		return 0;
+	}
+
+	const char c = *sep;
+	*sep++ = '\0';
+	if (parse_addr(s, &e->first, &maxprefix) != 0)
+		return -1;
+
+	if (c == '-') {
+		unsigned int lastmax;
+
+		if ((parse_addr(sep, &e->last, &lastmax) != 0) || (lastmax != maxprefix))
+			return -1;
+		if (memcmp(&e->first, &e->last, sizeof(e->first)) > 0)
+			return -1;
+		return 0;
+	}
+
+	char *end;
+	unsigned long prefix = strtoul(sep, &end, 10);
+	if ((*sep == '\0') || (*end != '\0') || (prefix > maxprefix))
+		return -1;
+
+	apply_prefix(&e->first, &e->last, prefix + 128 - maxprefix);
+
+	return 0;
+}
+
+/**
+ * @brief parse a name entry
+ * @param s the entry
+ * @param e the first entry will be stored here
+ * @param e2 a second entry needed for names starting with '.' will be stored here
+ * @return number of entries created, -1 on error
+ */
+static int
+parse_name(const char *s, struct zone_entry *e, struct zone_entry *e2)
+{
+	const char *domain = s;
+	int wildcard = 0;
+
+	if (strncmp(s, "*.", 2) == 0) {
+		domain = s + 2;
+		wildcard = 1;
+	} else if (*s == '.') {
+		domain = s + 1;
+		wildcard = 2;
+	}
+
+	if ((*domain == '\0') || (strlen(domain) > DOMAINNAME_MAX) || domainvalid(domain)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	e->name = malloc(strlen(domain) + 3);
+	if (e->name == NULL)
+		return -1;
+	if (wildcard != 0)
+		strcpy(e->name, "*.");
+	else
+		e->name[0] = '\0';
+	strcat(e->name, domain);
+	for (char *c = e->name; *c != '\0'; c++)
+		*c = tolower(*c);
+
+	if (wildcard != 2)
+		return 1;
+
+	*e2 = *e;
+	e2->name = strdup(e->name + 2);
+	if (e2->name == NULL) {
+		free(e->name);
+		return -1;
+	}
+
+	return 2;
+}
+
+static int
+cmp_ip(const void *a, const void *b)
+{
+	const struct zone_entry *x = a;
+	const struct zone_entry *y = b;
+	int r = memcmp(&x->first, &y->first, sizeof(x->first));
+
+	if (r != 0)
+		return r;
+
+	/* wider ranges first, so the more specific entry is found first on lookup */
+	return memcmp(&y->last, &x->last, sizeof(x->last));
+}
+
+static int
+cmp_name(const void *a, const void *b)
+{
+	const struct zone_entry *x = a;
+	const struct zone_entry *y = b;
+
+	return strcmp(x->name, y->name);
+}
+
+static int
+write_zone(const int fd, const enum rblzone_type type, struct zone_entry *entries,
+		const unsigned int cnt, const struct strtab *strings)
+{
+	struct rblzone_header hdr = {
+		.magic = RBLZONE_MAGIC,
+		.type = type,
+		.count = cnt
+	};
+	const size_t esize = (type == RBLZONE_IP) ? sizeof(struct rblzone_ip) : sizeof(struct rblzone_name);
+
+	if (sizeof(hdr) + (size_t)cnt * esize + strings->len > UINT32_MAX) {
+		errno = EFBIG;
+		return -1;
+	}
+	hdr.strings = sizeof(hdr) + cnt * esize;
+
+	/* The entries that may still cover a following one, i.e. those that
+	 * end behind all later entries seen so far. Their last addresses are
+	 * strictly decreasing from the bottom of the stack. */
+	uint32_t *stack = NULL;
+	unsigned int depth = 0;
+	if ((type == RBLZONE_IP) && (cnt > 0)) {
+		stack = malloc(cnt * sizeof(*stack));
+		if (stack == NULL)
+			return -1;
+	}
+
+	int ret = -1;
+	if (write_all(fd, &hdr, sizeof(hdr)) != 0)
+		goto out;
+
+	struct in6_addr maxlast;
+	memset(&maxlast, 0, sizeof(maxlast));
+
+	for (unsigned int i = 0; i < cnt; i++) {
+		if (type == RBLZONE_IP) {
+			struct rblzone_ip e;
+
+			memset(&e, 0, sizeof(e));
+			e.first = entries[i].first;
+			e.last = entries[i].last;
+			if (memcmp(&entries[i].last, &maxlast, sizeof(maxlast)) > 0)
+				maxlast = entries[i].last;
+			e.maxlast = maxlast;
+
+			while ((depth > 0) &&
+					(memcmp(&entries[stack[depth - 1]].last, &entries[i].last, sizeof(entries[i].last)) <= 0))
+				depth--;
+			e.cover = (depth > 0) ? stack[depth - 1] : RBLZONE_NOCOVER;
+			stack[depth++] = i;
+
+			e.txt = entries[i].txt;
+			e.flags = entries[i].flags;
+
+			if (write_all(fd, &e, sizeof(e)) != 0)
+				goto out;
+		} else {
+			const struct rblzone_name e = {
+				.name = entries[i].nameoff,
+				.txt = entries[i].txt,
+				.flags = entries[i].flags
+			};
+
+			if (write_all(fd, &e, sizeof(e)) != 0)
+				goto out;
+		}
+	}
+
+	ret = write_all(fd, strings->s, strings->len);
+
+out:
+	{
+		int e = errno;
+		free(stack);
+		errno = e;
+	}
+	return ret;
+}
+
+/**
+ * @brief compile a zone in rbldnsd format
+ * @param src the contents of the zone file
+ * @param srclen length of src
+ * @param type the type of the zone
+ * @param outfd the compiled zone is written to this descriptor
+ * @param errline the line number of a syntax error is stored here
+ * @return 0 on success, -1 on error (errno is set)
+ *
+ * If the zone contains an invalid entry errno is set to EINVAL and the
+ * number of the offending line is stored in errline.
+ */
+int
+rblzone_compile(const char *src, const size_t srclen, const enum rblzone_type type,
+		const int outfd, unsigned int *errline)
+{
+	struct strtab strings = {
+		.s = NULL,
+		.len = 0,
+		.alloc = 0
+	};
+	struct zone_entry *entries = NULL;
+	unsigned int cnt = 0;
+	unsigned int alloc = 0;
+	uint32_t deftxt = 0;
+	uint32_t off;
+	int ret = -1;
+
+	*errline = 0;
+
+	/* offset 0 is an empty string that marks entries without reason */
+	if (strtab_add(&strings, "", 0, &off) != 0)
+		return -1;
+
+	for (const char *line = src; line < src + srclen; ) {
+		const char *eol = memchr(line, '\n', src + srclen - line);
+		const char *next = (eol == NULL) ? src + srclen : eol + 1;
+
+		if (eol == NULL)
+			eol = src + srclen;
+		(*errline)++;
+
+		while ((eol > line) && isspace((unsigned char)*(eol - 1)))
+			eol--;
+		while ((line < eol) && isspace((unsigned char)*line))
+			line++;
+
+		if ((line == eol) || (*line == '#') || (*line == ';') || (*line == '$')) {
+			line = next;
+			continue;
+		}
+
+		/* split the line into the entry and the reason */
+		const char *value = line;
+		const char *entryend = line;
+		if (*line != ':') {
+			while ((value < eol) && !isspace((unsigned char)*value))
+				value++;
+			entryend = value;
+			while ((value < eol) && isspace((unsigned char)*value))
+				value++;
+
+			/* The reason may directly follow names and IPv4 addresses, while
+			 * IPv6 addresses must be separated by whitespace. */
+			const char *colon = memchr(line, ':', entryend - line);
+			if ((colon != NULL) && ((type == RBLZONE_NAME) || (memchr(line, '.', colon - line) != NULL))) {
+				entryend = colon;
+				value = colon;
+			}
+		}
+
+		const char *txt = value;
+		if ((value < eol) && (*value == ':')) {
+			txt = memchr(value + 1, ':', eol - value - 1);
+			txt = (txt == NULL) ? eol : txt + 1;
+		}
+
+		uint32_t txtoff = deftxt;
+		if (txt < eol) {
+			if (strtab_add(&strings, txt, eol - txt, &txtoff) != 0)
+				goto out;
+		} else if (value < eol) {
+			/* an explicitly empty reason */
+			txtoff = 0;
+		}
+
+		if (*line == ':') {
+			deftxt = txtoff;
+			line = next;
+			continue;
+		}
+
+		struct zone_entry e = {
+			.name = NULL,
+			.txt = txtoff,
+			.flags = 0
+		};
+		if (*line == '!') {
+			e.flags = RBLZONE_EXCLUDED;
+			line++;
+		}
+
+		char buf[DOMAINNAME_MAX + 3];
+		if ((size_t)(entryend - line) >= sizeof(buf)) {
+			errno = EINVAL;
+			goto out;
+		}
+		memcpy(buf, line, entryend - line);
+		buf[entryend - line] = '\0';
+
+		if (cnt + 2 > alloc) {
+			unsigned int nalloc = (alloc == 0) ? 256 : alloc * 2;
+			struct zone_entry *tmp = realloc(entries, nalloc * sizeof(*entries));
+
+			if (tmp == NULL)
+				goto out;
+			entries = tmp;
+			alloc = nalloc;
+		}
+
+		if (type == RBLZONE_IP) {
+			if (parse_ip(buf, &e) != 0) {
+				errno = EINVAL;
+				goto out;
+			}
+			entries[cnt++] = e;
+		} else {
+			int r = parse_name(buf, &e, entries + cnt + 1);
+
+			if (r < 0)
+				goto out;
+			entries[cnt] = e;
+			cnt += r;
+		}
+
+		line = next;
+	}
+
+	if (type == RBLZONE_IP) {
+		qsort(entries, cnt, sizeof(*entries), cmp_ip);
+	} else {
+		qsort(entries, cnt, sizeof(*entries), cmp_name);
+		/* the names are only needed as string table offsets from now on */
+		for (unsigned int i = 0; i < cnt; i++) {
+			if (strtab_add(&strings, entries[i].name, strlen(entries[i].name), &entries[i].nameoff) != 0)
+				goto out;
+			free(entries[i].name);
+			entries[i].name = NULL;
+		}
+	}
+
+	*errline = 0;
+	ret = write_zone(outfd, type, entries, cnt, &strings);
+
+out:
+	if (type == RBLZONE_NAME) {
+		int e = errno;
+
+		for (unsigned int i = 0; i < cnt; i++)
+			free(entries[i].name);
+		errno = e;
+	}
+	free(entries);
+	free(strings.s);
+	return ret;
+}
+
+/** @struct mapped_zone
+ * @brief a compiled zone that is mapped into memory
+ */
+struct mapped_zone {
+	char *name;				/**< the name of the DNS blacklist */
+	const struct rblzone_header *hdr;	/**< the mapped zone */
+	off_t len;				/**< length of the mapping */
+};
+
+static struct mapped_zone *mapped;	/**< the zones mapped by this process */
+static unsigned int mappedcnt;		/**< number of entries in mapped */
+
+/**
+ * @brief map a compiled zone into memory
+ * @param zone the name of the DNS blacklist
+ * @param type the expected type of the zone
+ * @param len the length of the mapping is stored here
+ * @return the mapped zone
+ * @retval NULL the zone can't be used (errno is set)
+ *
+ * If there is no local copy of the zone errno is set to ENOENT. If the file
+ * is not a valid compiled zone of the requested type errno is set to EINVAL.
+ *
+ * A zone is mapped only once and kept for the lifetime of the process. Zones
+ * are replaced by renaming a new file over the old one, so the mapping stays
+ * valid and the process continues to use the version it has seen first.
+ */
+static const struct rblzone_header *
+map_zone(const char *zone, const enum rblzone_type type, off_t *len)
+{
+	char fname[sizeof(RBLZONE_DIR) + DOMAINNAME_MAX];
+	const struct rblzone_header *hdr = NULL;
+
+	for (unsigned int i = 0; i < mappedcnt; i++) {
+		if (strcmp(mapped[i].name, zone) == 0) {
+			hdr = mapped[i].hdr;
+			*len = mapped[i].len;
+			break;
+		}
+	}
+
+	if (hdr == NULL) {
+		if ((strlen(zone) > DOMAINNAME_MAX) || (strchr(zone, '/') != NULL) || (*zone == '.')) {
+			errno = ENOENT;
+			return NULL;
+		}
+		strcpy(fname, RBLZONE_DIR);
+		strcat(fname, zone);
+
+		int fd = openat(controldir_fd, fname, O_RDONLY | O_CLOEXEC);
+		if (fd < 0)
+			return NULL;
+
+		hdr = mmap_fd(fd, len);
+		int e = (errno == 0) ? EINVAL : errno;
+		close(fd);
+		if (hdr == NULL) {
+			errno = e;
+			return NULL;
+		}
+
+		const char *map = (const char *)hdr;
+		const size_t esize = (hdr->type == RBLZONE_IP) ? sizeof(struct rblzone_ip) : sizeof(struct rblzone_name);
+
+		if (((size_t)*len <= sizeof(*hdr)) || (memcmp(hdr->magic, RBLZONE_MAGIC, sizeof(hdr->magic)) != 0) ||
+				((hdr->type != RBLZONE_IP) && (hdr->type != RBLZONE_NAME)) || (hdr->strings >= *len) ||
+				(hdr->strings < sizeof(*hdr) + (uint64_t)hdr->count * esize) ||
+				(map[hdr->strings] != '\0') || (map[*len - 1] != '\0')) {
+			munmap((void *)hdr, *len);
+			errno = EINVAL;
+			return NULL;
+		}
+
+		struct mapped_zone *tmp = realloc(mapped, (mappedcnt + 1) * sizeof(*mapped));
+		char *name = strdup(zone);
+		if (tmp != NULL)
+			mapped = tmp;
+		if ((tmp == NULL) || (name == NULL)) {
+			free(name);
+			munmap((void *)hdr, *len);
+			errno = ENOMEM;
+			return NULL;
+		}
+
+		mapped[mappedcnt].name = name;
+		mapped[mappedcnt].hdr = hdr;
+		mapped[mappedcnt].len = *len;
+		mappedcnt++;
+	}
+
+	if (hdr->type != type) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	return hdr;
+}
+
+/**
+ * @brief get a string from the string table of a zone
+ * @return the string, NULL if the offset is invalid
+ */
+static const char *
+zone_string(const struct rblzone_header *hdr, const off_t len, const uint32_t off)
+{
+	if (off >= len - hdr->strings)
+		return NULL;
+
+	return (const char *)hdr + hdr->strings + off;
+}
+
+/**
+ * @brief copy the reason of a listing
+ * @param reason the reason from the zone
+ * @param ip the address to insert for '$', NULL if no replacement should be done
+ * @param txt the copy will be stored here
+ * @return 0 on success, -1 on error
+ */
+static int
+copy_reason(const char *reason, const struct in6_addr *ip, char **txt)
+{
+	char ipbuf[INET6_ADDRSTRLEN];
+	size_t iplen = 0;
+	size_t len = 0;
+
+	*txt = NULL;
+	if (*reason == '\0')
+		return 0;
+
+	if (ip != NULL) {
+		if (IN6_IS_ADDR_V4MAPPED(ip))
+			inet_ntop(AF_INET, ip->s6_addr + 12, ipbuf, sizeof(ipbuf));
+		else
+			inet_ntop(AF_INET6, ip, ipbuf, sizeof(ipbuf));
+		iplen = strlen(ipbuf);
+	}
+
+	for (const char *c = reason; *c != '\0'; c++)
+		len += ((*c == '$') && (ip != NULL)) ? iplen : 1;
+
+	*txt = malloc(len + 1);
+	if (*txt == NULL)
+		return -1;
+
+	char *o = *txt;
+	for (const char *c = reason; *c != '\0'; c++) {
+		if ((*c == '$') && (ip != NULL)) {
+			memcpy(o, ipbuf, iplen);
+			o += iplen;
+		} else {
+			*o++ = *c;
+		}
+	}
+	*o = '\0';
+
+	return 0;
+}
+
+/**
+ * @brief look up an IP address in the local copy of a DNS blacklist
+ * @param zone the name of the DNS blacklist
+ * @param ip the address to look up
+ * @param txt the reason of the listing will be stored here, may be NULL
+ * @return if the address is listed
+ * @retval 1 the address is listed
+ * @retval 0 the address is not listed
+ * @retval -1 the zone can't be used (errno is set)
+ *
+ * If there is no local copy of the zone errno is set to ENOENT, the DNS
+ * blacklist must be queried then.
+ */
+int
+rblzone_lookup_ip(const char *zone, const struct in6_addr *ip, char **txt)
+{
+	off_t len;
+	const struct rblzone_header *hdr = map_zone(zone, RBLZONE_IP, &len);
+
+	if (hdr == NULL)
+		return -1;
+
+	const struct rblzone_ip *entries = (const struct rblzone_ip *)(hdr + 1);
+	const struct rblzone_ip *match = NULL;
+	unsigned int lo = 0;
+	unsigned int hi = hdr->count;
+
+	/* find the first entry starting behind ip */
+	while (lo < hi) {
+		const unsigned int mid = lo + (hi - lo) / 2;
+
+		if (memcmp(&entries[mid].first, ip, sizeof(*ip)) <= 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	/* Walk back to the most specific entry containing ip. If an entry ends
+	 * before ip all entries between it and the entry covering it end even
+	 * earlier, so they are skipped. Stop once no earlier entry can reach up
+	 * to ip anymore. */
+	while (lo > 0) {
+		const struct rblzone_ip *e = entries + --lo;
+
+		if (memcmp(&e->maxlast, ip, sizeof(*ip)) < 0)
+			break;
+		if (memcmp(&e->last, ip, sizeof(*ip)) >= 0) {
+			match = e;
+			break;
+		}
+		if (e->cover >= lo)
+			break;
+		lo = e->cover + 1;
+	}
+
+	int ret = 0;
+	if ((match != NULL) && !(match->flags & RBLZONE_EXCLUDED)) {
+		const char *reason = zone_string(hdr, len, match->txt);
+
+		ret = 1;
+		if ((txt != NULL) && (reason != NULL) && (copy_reason(reason, ip, txt) != 0))
+			ret = -1;
+	}
+
+	return ret;
+}
+
+static const struct rblzone_name *
+find_name(const struct rblzone_header *hdr, const off_t len, const char *name)
+{
+	const struct rblzone_name *entries = (const struct rblzone_name *)(hdr + 1);
+	unsigned int lo = 0;
+	unsigned int hi = hdr->count;
+
+	while (lo < hi) {
+		const unsigned int mid = lo + (hi - lo) / 2;
+		const char *n = zone_string(hdr, len, entries[mid].name);
+
+		if (n == NULL)
+			return NULL;
+
+		int r = strcmp(n, name);
+		if (r == 0)
+			return entries + mid;
+		else if (r < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return NULL;
+}
+
+/**
+ * @brief look up a domain name in the local copy of a DNS blacklist
+ * @param zone the name of the DNS blacklist
+ * @param name the domain name to look up
+ * @param txt the reason of the listing will be stored here, may be NULL
+ * @return if the name is listed
+ * @retval 1 the name is listed
+ * @retval 0 the name is not listed
+ * @retval -1 the zone can't be used (errno is set)
+ *
+ * If there is no local copy of the zone errno is set to ENOENT, the DNS
+ * blacklist must be queried then.
+ */
+int
+rblzone_lookup_name(const char *zone, const char *name, char **txt)
+{
+	char buf[DOMAINNAME_MAX + 3];
+	const size_t nlen = strlen(name);
+
+	if (nlen > DOMAINNAME_MAX)
+		return 0;
+
+	off_t len;
+	const struct rblzone_header *hdr = map_zone(zone, RBLZONE_NAME, &len);
+
+	if (hdr == NULL)
+		return -1;
+
+	/* the exact name first, then wildcards of the parent domains */
+	for (size_t i = 0; i < nlen; i++)
+		buf[i] = tolower(name[i]);
+	buf[nlen] = '\0';
+
+	const struct rblzone_name *match = find_name(hdr, len, buf);
+	for (const char *p = strchr(buf, '.'); (match == NULL) && (p != NULL); p = strchr(p + 1, '.')) {
+		char wild[DOMAINNAME_MAX + 3] = "*";
+
+		strcat(wild, p);
+		match = find_name(hdr, len, wild);
+	}
+
+	int ret = 0;
+	if ((match != NULL) && !(match->flags & RBLZONE_EXCLUDED)) {
+		const char *reason = zone_string(hdr, len, match->txt);
+
+		ret = 1;
+		if ((txt != NULL) && (reason != NULL) && (copy_reason(reason, NULL, txt) != 0))
+			ret = -1;
+	}
+
+	return ret;
+}
@@ -0,0 +1,174 @@
+/** \file sharedtable.c
+ \brief tables of fixed size slots in a file shared between processes
+
+ Caches that should be used by all instances of a program are stored in a
+ file that every process maps into memory. The file starts with a small
+ header describing the format, followed by the slots. A file that does not
+ match the expected format is cleared. Readers and writers synchronize using
+ flock() on the file.
+ */
+
+#include <sharedtable.h>
+
+#include <log.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <syslog.h>
+#include <unistd.h>
+
+/** @struct shared_table_header
+ * @brief the header of the table file
+ */
+struct shared_table_header {
+	char magic[8];		/**< identifies the file format, including the trailing 0 byte */
+	uint32_t slots;		/**< number of slots */
+	uint32_t slotsize;	/**< size of one slot */
+};
+
+static size_t
+table_size(const struct shared_table *t)
+{
+	return sizeof(struct shared_table_header) + t->slots * t->slotsize;
+}
+
+static void
+table_close(struct shared_table *t)
+{
+	if (t->map != NULL) {
+		munmap(t->map, table_size(t));
+		t->map = NULL;
+	}
+	if (t->fd >= 0) {
+		close(t->fd);
+		t->fd = -1;
+	}
+}
+
+static void
+table_error(struct shared_table *t, const char *msg)
+{
+	const char *logmsg[] = { t->desc, " disabled: ", msg, NULL };
+
+	log_writen(LOG_WARNING, logmsg);
+	t->disabled = 1;
+	table_close(t);
+}
+
+/**
+ * @brief open and map the table file
+ * @param t the table
+ * @return if the table can be used
+ *
+ * The file is reopened after fork(), as flock() locks are shared between all
+ * descriptors referring to the same open file. If the environment variable
+ * is not set or the file can't be used the table is disabled for the rest
+ * of the life of the process.
+ */
+int
+shtable_open(struct shared_table *t)
+{
+	if (t->disabled)
+		return 0;
+
+	if ((t->map != NULL) && (t->pid == getpid()))
+		return 1;
+
+	table_close(t);
+
+	const char *fname = getenv(t->envname);
+	if ((fname == NULL) || (*fname == '\0')) {
+		t->disabled = 1;
+		return 0;
+	}
+
+	t->fd = open(fname, O_RDWR | O_CREAT | O_CLOEXEC, S_IRUSR | S_IWUSR);
+	if (t->fd < 0) {
+		table_error(t, "can't open file");
+		return 0;
+	}
+	t->pid = getpid();
+
+	if (flock(t->fd, LOCK_EX) != 0) {
+		table_error(t, "can't lock file");
+		return 0;
+	}
+
+	struct stat st;
+	if (fstat(t->fd, &st) != 0) {
+		table_error(t, "can't stat file");
+		return 0;
+	}
+
+	const size_t size = table_size(t);
+	const int init = ((size_t)st.st_size != size);
+	/* throw away everything in a file of the wrong size and start from scratch */
+	if (init && ((ftruncate(t->fd, 0) != 0) || (ftruncate(t->fd, size) != 0))) {
+		table_error(t, "can't resize file");
+		return 0;
+	}
+
+	void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, t->fd, 0);
+	if (map == MAP_FAILED) {
+		table_error(t, "can't map file");
+		return 0;
+	}
+	t->map = map;
+
+	struct shared_table_header *hdr = map;
+	if (init || (strncmp(hdr->magic, t->magic, sizeof(hdr->magic)) != 0) ||
+			(hdr->slots != t->slots) || (hdr->slotsize != t->slotsize)) {
+		memset(map, 0, size);
+		strncpy(hdr->magic, t->magic, sizeof(hdr->magic) - 1);
+		hdr->slots = t->slots;
+		hdr->slotsize = t->slotsize;
+	}
+
+	flock(t->fd, LOCK_UN);
+
+	return 1;
+}
+
+/**
+ * @brief get a slot of an opened table
+ * @param t the table
+ * @param idx index of the slot, taken modulo the number of slots
+ * @return the slot
+ */
+void *
+shtable_slot(const struct shared_table *t, const unsigned int idx)
+{
+	return (char *)t->map + sizeof(struct shared_table_header) + (idx % t->slots) * t->slotsize;
+}
+
+/**
+ * @brief lock an opened table
+ * @param t the table
+ * @param op LOCK_SH for reading or LOCK_EX for writing
+ * @return 0 on success, -1 on error
+ */
+int
+shtable_lock(const struct shared_table *t, const int op)
+{
+	int r;
+
+	while (((r = flock(t->fd, op)) != 0) && (errno == EINTR))
+		;
+
+	return r;
+}
+
+/**
+ * @brief release the lock of a table
+ * @param t the table
+ */
+void
+shtable_unlock(const struct shared_table *t)
+{
+	flock(t->fd, LOCK_UN);
+}
@@ -186,6 +186,38 @@ ssl_timeoutrehandshake(SSL *s, time_t t)
 	return ssl_timeoutio(SSL_do_handshake, s, t, NULL, 0);
 }
 
+/**
+ * @brief ask OpenSSL to hand the record encryption to the kernel
+ *
+ * This has to be called before the handshake. If OpenSSL, the kernel, or the
+ * negotiated cipher do not support kernel TLS the connection silently keeps
+ * doing the encryption in user space.
+ */
+void
+ssl_ktls_request(SSL *s)
+{
+#if defined(SSL_OP_ENABLE_KTLS) && !defined(OPENSSL_NO_KTLS)
+	SSL_set_options(s, SSL_OP_ENABLE_KTLS);
+#else
+	(void) s;
+#endif
+}
+
+/**
+ * @brief check if the kernel encrypts outgoing data
+ * @return if plain data written to the socket is sent as TLS records
+ */
+int
+ssl_ktls_send(SSL *s)
+{
+#if defined(SSL_OP_ENABLE_KTLS) && !defined(OPENSSL_NO_KTLS)
+	return BIO_get_ktls_send(SSL_get_wbio(s));
+#else
+	(void) s;
+	return 0;
+#endif
+}
+
 int ssl_timeoutread(SSL *s, time_t t, char *buf, const int len)
 {
 	return ssl_timeoutio(SSL_read, s, t, buf, len);
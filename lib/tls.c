@@ -16,6 +16,20 @@
 
 SSL *ssl;
 
+/**
+ * @brief initialize the SSL library
+ * @return 0 on success, -1 on error
+ *
+ * This is only called once STARTTLS has been negotiated, so sessions that
+ * never use TLS do not pay for the library initialization. Error strings are
+ * not loaded here, ssl_error() does that when they are actually needed.
+ */
+int
+ssl_library_setup(void)
+{
+	return (OPENSSL_init_ssl(0, NULL) == 1) ? 0 : -1;
+}
+
 void ssl_free(SSL *myssl)
 {
 	if (SSL_shutdown(myssl) == 0)
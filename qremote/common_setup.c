@@ -9,6 +9,7 @@
 #include <netio.h>
 #include <qdns.h>
 #include <qmaildir.h>
+#include <qremote/conn.h>
 
 #include <arpa/inet.h>
 #include <sys/socket.h>
@@ -48,6 +49,9 @@ remote_common_setup(void)
 
 	timeout = tmp;
 
+	if (loadintfd(openat(controldir_fd, "timeoutconnect", O_RDONLY | O_CLOEXEC), &timeoutconnect, 60) < 0)
+		err_conf("parse error in control/timeoutconnect");
+
 	if (((ssize_t)loadoneliner(controldir_fd, "outgoingip", &ipbuf, 1)) >= 0) {
 		int r = inet_pton(AF_INET6, ipbuf, &outgoingip);
 
@@ -9,29 +9,54 @@
 #include <netio.h>
 #include <qdns.h>
 #include <qremote/client.h>
+#include <qremote/hosthealth.h>
 #include <qremote/qremote.h>
+#include <qremote/routecache.h>
 
 #include <arpa/inet.h>
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <netinet/in.h>
+#include <poll.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
 #include <syslog.h>
+#include <time.h>
 #include <unistd.h>
 
 unsigned int targetport = 25;
+unsigned long timeoutconnect = 60;
 
 #ifndef SOCK_CLOEXEC
 #define SOCK_CLOEXEC 0
 #endif /* SOCK_CLOEXEC */
 
+#define CONN_ATTEMPT_DELAY 250	/**< milliseconds before the next address is tried in parallel, see RfC 8305 */
+
+/** @struct conn_attempt
+ * @brief a connection attempt in a race between several addresses
+ */
+struct conn_attempt {
+	struct ips *ip;		/**< the MX entry */
+	unsigned short idx;	/**< the index of the address in ip */
+	int sd;			/**< the socket, -1 if not started or finished */
+	unsigned int key;	/**< sort key from the connection times of the address */
+	long long start;	/**< when the attempt was started */
+	long long deadline;	/**< when the attempt is given up */
+};
+
+static struct in6_addr curaddr;	/**< the address of the last connection returned by tryconn() */
+
 /**
- * @brief create a socket and connect to the given ip
+ * @brief create a socket and start connecting to the given ip
  * @param remoteip the target address
  * @param outip the local IP the connection should originate from
- * @return the socket descriptor or a negative error code
+ * @return the nonblocking socket descriptor or a negative error code
+ *
+ * The connection is usually still in progress when this returns.
  */
 static int
 conn(const struct in6_addr remoteip, const struct in6_addr *outip)
@@ -78,9 +103,12 @@ conn(const struct in6_addr remoteip, const struct in6_addr *outip)
 	sock.sin6_addr = remoteip;
 #endif
 
-	int rc = connect(sd, (struct sockaddr *) &sock, sizeof(sock));
+	int rc = fcntl(sd, F_SETFL, fcntl(sd, F_GETFL) | O_NONBLOCK);
+
+	if (rc == 0)
+		rc = connect(sd, (struct sockaddr *) &sock, sizeof(sock));
 
-	if (rc < 0) {
+	if ((rc < 0) && (errno != EINPROGRESS)) {
 		int err = errno;
 		close(sd);
 		return -err;
@@ -89,6 +117,210 @@ conn(const struct in6_addr remoteip, const struct in6_addr *outip)
 	return  sd;
 }
 
+static long long
+now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * @brief reorder addresses so IPv6 and IPv4 ones alternate
+ * @param addr the addresses
+ * @param count number of entries in addr
+ *
+ * The family of the first address stays first, and the order inside each
+ * family is kept (RfC 8305, section 4).
+ */
+static void
+interleave_families(struct in6_addr *addr, const unsigned int count)
+{
+#ifdef IPV4ONLY
+	(void) addr;
+	(void) count;
+#else
+	for (unsigned int i = 1; i < count; i++) {
+		const int prev4 = IN6_IS_ADDR_V4MAPPED(addr + i - 1);
+
+		if (IN6_IS_ADDR_V4MAPPED(addr + i) != prev4)
+			continue;
+
+		unsigned int j = i + 1;
+		while ((j < count) && (IN6_IS_ADDR_V4MAPPED(addr + j) == prev4))
+			j++;
+		if (j == count)
+			return;
+
+		/* move the address of the other family to position i */
+		const struct in6_addr other = addr[j];
+		memmove(addr + i + 1, addr + i, (j - i) * sizeof(*addr));
+		addr[i] = other;
+	}
+#endif
+}
+
+/**
+ * @brief order the addresses of an MX entry by the results of previous connections
+ * @param ip the entry
+ * @param keys the sort keys of the usable addresses are stored here
+ * @return number of usable addresses
+ *
+ * Addresses that are in their hold down time are moved to the end. The
+ * usable ones are sorted by their connection times, addresses without
+ * known times keep their order behind them.
+ */
+static unsigned short
+health_sort(struct ips *ip, unsigned int *keys)
+{
+	struct in6_addr down[ip->count];
+	unsigned short n = 0;
+	unsigned short d = 0;
+
+	for (unsigned short i = 0; i < ip->count; i++) {
+		const struct in6_addr cur = ip->addr[i];
+		unsigned int rtt;
+
+		if (host_health_check(&cur, targetport, &rtt)) {
+			down[d++] = cur;
+			continue;
+		}
+
+		/* insertion sort, stable for equal keys */
+		const unsigned int key = (rtt == 0) ? UINT_MAX : rtt;
+		unsigned short j = n;
+		while ((j > 0) && (keys[j - 1] > key)) {
+			ip->addr[j] = ip->addr[j - 1];
+			keys[j] = keys[j - 1];
+			j--;
+		}
+		ip->addr[j] = cur;
+		keys[j] = key;
+		n++;
+	}
+
+	memcpy(ip->addr + n, down, d * sizeof(*down));
+
+	return n;
+}
+
+/**
+ * @brief race connections to the given addresses
+ * @param att the addresses in the order they should be tried
+ * @param cnt number of entries in att
+ * @param outip4 local IPv4 to bind
+ * @param outip6 local IPv6 to bind
+ * @return index of the connected entry in att
+ * @retval -1 no connection could be established
+ *
+ * A new attempt is started every CONN_ATTEMPT_DELAY milliseconds, or as soon
+ * as all running attempts have failed. Every attempt is given up after
+ * timeoutconnect seconds. The first connection that is established wins,
+ * all others are closed.
+ */
+static int
+race(struct conn_attempt *att, const unsigned int cnt, const struct in6_addr *outip4,
+		const struct in6_addr *outip6)
+{
+	struct pollfd fds[cnt];
+	unsigned int fdidx[cnt];
+	unsigned int next = 0;
+	unsigned int active = 0;
+	long long nextstart = 0;
+	int winner = -1;
+
+	while (winner < 0) {
+		long long now = now_ms();
+
+		if ((next < cnt) && ((active == 0) || (now >= nextstart))) {
+			const struct in6_addr *outip;
+
+#ifdef IPV4ONLY
+			(void) outip6;
+#else
+			if (!IN6_IS_ADDR_V4MAPPED(att[next].ip->addr + att[next].idx))
+				outip = outip6;
+			else
+#endif
+				outip = outip4;
+
+			att[next].sd = conn(att[next].ip->addr[att[next].idx], outip);
+			if (att[next].sd >= 0) {
+				att[next].start = now;
+				att[next].deadline = now + (long long)timeoutconnect * 1000;
+				active++;
+			} else if ((att[next].sd == -ECONNREFUSED) || (att[next].sd == -ENETUNREACH) ||
+					(att[next].sd == -EHOSTUNREACH)) {
+				host_health_result(att[next].ip->addr + att[next].idx, targetport, HOST_FAIL_CONNECT);
+			}
+			next++;
+			nextstart = now + CONN_ATTEMPT_DELAY;
+			continue;
+		}
+
+		if (active == 0)
+			break;
+
+		/* wait until an attempt finishes, the next one is due, or one times out */
+		unsigned int nfds = 0;
+		long long wakeup = (next < cnt) ? nextstart : -1;
+		for (unsigned int i = 0; i < next; i++) {
+			if (att[i].sd < 0)
+				continue;
+			fds[nfds].fd = att[i].sd;
+			fds[nfds].events = POLLOUT;
+			fdidx[nfds++] = i;
+			if ((wakeup < 0) || (att[i].deadline < wakeup))
+				wakeup = att[i].deadline;
+		}
+
+		int n = poll(fds, nfds, (wakeup > now) ? (int)(wakeup - now) : 0);
+		if ((n < 0) && (errno != EINTR))
+			break;
+
+		for (unsigned int i = 0; (n > 0) && (i < nfds); i++) {
+			struct conn_attempt *a = att + fdidx[i];
+			int err;
+			socklen_t errlen = sizeof(err);
+
+			if (fds[i].revents == 0)
+				continue;
+
+			if ((getsockopt(a->sd, SOL_SOCKET, SO_ERROR, &err, &errlen) == 0) && (err == 0)) {
+				winner = fdidx[i];
+				host_health_connected(a->ip->addr + a->idx, targetport, now_ms() - a->start);
+				break;
+			}
+
+			host_health_result(a->ip->addr + a->idx, targetport, HOST_FAIL_CONNECT);
+			close(a->sd);
+			a->sd = -1;
+			active--;
+		}
+
+		if (winner >= 0)
+			break;
+
+		now = now_ms();
+		for (unsigned int i = 0; i < next; i++) {
+			if ((att[i].sd >= 0) && (att[i].deadline <= now)) {
+				host_health_result(att[i].ip->addr + att[i].idx, targetport, HOST_FAIL_CONNECT);
+				close(att[i].sd);
+				att[i].sd = -1;
+				active--;
+			}
+		}
+	}
+
+	for (unsigned int i = 0; i < next; i++)
+		if ((att[i].sd >= 0) && ((int)i != winner))
+			close(att[i].sd);
+
+	return winner;
+}
+
 /**
  * try to estabish an SMTP connection to one of the hosts in the ip list
  *
@@ -100,6 +332,14 @@ conn(const struct in6_addr remoteip, const struct in6_addr *outip)
  *
  * Every entry where a connection attempt was made is marked with a priority of
  * MX_PRIORITY_USED, the last one tried with MX_PRIORITY_CURRENT.
+ *
+ * The remaining addresses of the current entry, or all addresses of the next
+ * MX entries with the same priority, are tried in parallel with staggered
+ * starts as described in RfC 8305. Addresses that recently failed are skipped,
+ * those with the shortest connection times in the past are tried first.
+ * Entries whose addresses have all been tried before the one that was
+ * connected to are considered as used, the others will be tried again on the
+ * next call.
  */
 int
 tryconn(struct ips *mx, const struct in6_addr *outip4, const struct in6_addr *outip6)
@@ -108,51 +348,136 @@ tryconn(struct ips *mx, const struct in6_addr *outip4, const struct in6_addr *ou
 
 	while (1) {
 		struct ips *thisip;
-		const struct in6_addr *outip;
-		int sd;
+		unsigned short first = 0;
 
 		for (thisip = mx; thisip; thisip = thisip->next) {
 			if (thisip->priority == MX_PRIORITY_CURRENT) {
 				if (cur_s < thisip->count - 1) {
-					cur_s++;
+					first = cur_s + 1;
 					break;
 				} else {
 					thisip->priority = MX_PRIORITY_USED;
 				}
 			} else if (thisip->priority <= 65536) {
-				cur_s = 0;
-				/* set priority to MX_PRIORITY_CURRENT so this can be identified */
-				thisip->priority = MX_PRIORITY_CURRENT;
 				break;
 			}
 		}
 		if (!thisip)
 			return -ENOENT;
 
-#ifdef IPV4ONLY
-		(void) outip6;
-#else
-		if (!IN6_IS_ADDR_V4MAPPED(thisip->addr + cur_s))
-			outip = outip6;
-		else
-#endif
-			outip = outip4;
+		/* the rest of the current entry, or all following entries of the same priority */
+		const int fresh = (thisip->priority != MX_PRIORITY_CURRENT);
+		struct ips *last = thisip;
+		unsigned int cnt = thisip->count - first;
+		if (fresh) {
+			while ((last->next != NULL) && (last->next->priority == thisip->priority)) {
+				last = last->next;
+				cnt += last->count;
+			}
+		}
+
+		struct conn_attempt *att = malloc((cnt + 1) * sizeof(*att));
+		if (att == NULL)
+			err_mem(0);
+
+		unsigned int a = 0;
+		for (struct ips *ip = thisip; ip != last->next; ip = ip->next) {
+			const unsigned short s = (ip == thisip) ? first : 0;
+			unsigned int keys[ip->count];
+			unsigned short usable = ip->count;
+
+			interleave_families(ip->addr + s, ip->count - s);
+			/* a partly tried entry keeps its order, cur_s points into it */
+			if (fresh) {
+				usable = health_sort(ip, keys);
+				if (usable == 0) {
+					ip->priority = MX_PRIORITY_USED;
+					continue;
+				}
+				ip->count = usable;
+			}
+
+			for (unsigned short i = s; i < usable; i++) {
+				/* keep the order of the addresses of one entry, sort the entries into each other */
+				const unsigned int key = fresh ? keys[i] : 0;
+				unsigned int j = a++;
+
+				while ((j > 0) && (att[j - 1].ip != ip) && (att[j - 1].key > key)) {
+					att[j] = att[j - 1];
+					j--;
+				}
+				att[j].ip = ip;
+				att[j].idx = i;
+				att[j].key = key;
+				att[j].sd = -1;
+			}
+		}
+
+		if (a == 0) {
+			for (struct ips *ip = thisip; ip != last->next; ip = ip->next)
+				ip->priority = MX_PRIORITY_USED;
+			free(att);
+			continue;
+		}
+
+		int w = race(att, a, outip4, outip6);
+
+		/* entries that had all their addresses tried before the winner count as used */
+		for (struct ips *ip = thisip; ip != last->next; ip = ip->next) {
+			int tried = 1;
+
+			if ((w >= 0) && (ip == att[w].ip))
+				continue;
+			for (unsigned int i = (w < 0) ? a : (unsigned int)w + 1; i < a; i++) {
+				if (att[i].ip == ip)
+					tried = 0;
+			}
+			if (tried)
+				ip->priority = MX_PRIORITY_USED;
+		}
+
+		if (w >= 0) {
+			const int sd = att[w].sd;
+
+			att[w].ip->priority = MX_PRIORITY_CURRENT;
+			cur_s = att[w].idx;
+			curaddr = att[w].ip->addr[cur_s];
+			getrhost(att[w].ip, cur_s);
+			free(att);
+
+			/* the rest of Qremote expects a blocking socket */
+			(void) fcntl(sd, F_SETFL, fcntl(sd, F_GETFL) & ~O_NONBLOCK);
 
-		sd = conn(thisip->addr[cur_s], outip);
-		if (sd >= 0) {
-			getrhost(thisip, cur_s);
 			return sd;
 		}
+
+		free(att);
 	}
 }
 
+/**
+ * @brief record the result of the session on the last connection returned by tryconn()
+ * @param reason why the session can't be used, HOST_FAIL_NONE if it can
+ */
+void
+tryconn_result(const enum host_failure reason)
+{
+	host_health_result(&curaddr, targetport, reason);
+}
+
 /**
  * get all IPs for the MX entries of target address
  *
  * @param remhost target address
  * @param mx list of MX entries will be stored here, memory will be malloced
+ * @return where the entries come from
+ *
+ * Routes taken from the route cache have already been filtered and sorted.
+ * Unless the target is routed statically the lookup of the TLSA records is
+ * started in the background. For routes found in DNS dns_minttl holds the
+ * lowest TTL of the answers afterwards.
  */
-void
+enum mx_source
 getmxlist(char *remhost, struct ips **mx)
 {
 	size_t reml = strlen(remhost);
@@ -177,10 +502,10 @@ getmxlist(char *remhost, struct ips **mx)
 			remhost[reml - 1] = '\0';
 			if (inet_pton(AF_INET6, remhost + 1, (*mx)->addr) > 0) {
 				remhost[reml - 1] = ']';
-				return;
+				return MX_SOURCE_STATIC;
 			} else if (inet_pton_v4mapped(remhost + 1, (*mx)->addr) > 0) {
 				remhost[reml - 1] = ']';
-				return;
+				return MX_SOURCE_STATIC;
 			}
 			remhost[reml - 1] = ']';
 			freeips(*mx);
@@ -197,22 +522,35 @@ getmxlist(char *remhost, struct ips **mx)
 		err_mem(0);
 	}
 
-	if (!*mx) {
-		switch (ask_dnsmx(remhost, mx)) {
-		case 0:
-			break;
-		case 2: {
-			const char *msg[] = { "D5.1.10 only null MX exists for ",
-					remhost };
-			write_status_m(msg, 2);
-			net_conn_shutdown(shutdown_abort);
-			}
-		default: {
-			const char *msg[] = { "Z4.4.3 cannot find a mail exchanger for ",
-					remhost };
-			write_status_m(msg, 2);
-			net_conn_shutdown(shutdown_abort);
-			}
+	if (*mx != NULL)
+		return MX_SOURCE_STATIC;
+
+	*mx = route_cache_lookup(remhost, targetport);
+
+	/* the TLSA records are looked up while the MX addresses are resolved,
+	 * this needs the port that may have been set by smtproute() */
+	tlsa_prefetch_start(remhost, *mx);
+
+	if (*mx != NULL)
+		return MX_SOURCE_CACHE;
+
+	dns_minttl = ULONG_MAX;
+	switch (ask_dnsmx(remhost, mx)) {
+	case 0:
+		break;
+	case 2: {
+		const char *msg[] = { "D5.1.10 only null MX exists for ",
+				remhost };
+		write_status_m(msg, 2);
+		net_conn_shutdown(shutdown_abort);
+		}
+	default: {
+		const char *msg[] = { "Z4.4.3 cannot find a mail exchanger for ",
+				remhost };
+		write_status_m(msg, 2);
+		net_conn_shutdown(shutdown_abort);
 		}
 	}
+
+	return MX_SOURCE_DNS;
 }
@@ -11,6 +11,7 @@
 #include <qremote/greeting.h>
 #include <qremote/qremote.h>
 #include <qremote/starttlsr.h>
+#include <qremote/timing.h>
 #include <qdns_dane.h>
 
 #include <errno.h>
@@ -37,6 +38,17 @@ quitmsg_if_net(const int error)
 	}
 }
 
+/**
+ * @brief classify a failure after the connection was established
+ * @param error the negative error code of the last message
+ * @param reason the failure to record if the server did reply
+ */
+static enum host_failure
+session_failure(const int error, const enum host_failure reason)
+{
+	return (error == -ETIMEDOUT) ? HOST_FAIL_TIMEOUT : reason;
+}
+
 static void
 connection_died(void)
 {
@@ -62,9 +74,11 @@ connect_mx(struct ips *mx, const struct in6_addr *outip4, const struct in6_addr
 		}
 
 		/* query DNS before opening the socket, otherwise a long DNS timeout could lead to SMTP
-		 * socket timeout */
-		tlsa = (mx->name == NULL) ? 0 : dnstlsa(mx->name, targetport, &d);
+		 * socket timeout. Usually the records have already been prefetched. */
+		timing_phase(TIMING_DNS);
+		tlsa = (mx->name == NULL) ? 0 : tlsa_lookup(mx->name, &d);
 
+		timing_phase(TIMING_CONNECT);
 		socketd = tryconn(mx, outip4, outip6);
 		if (socketd < 0) {
 			daneinfo_free(d, tlsa);
@@ -75,11 +89,13 @@ connect_mx(struct ips *mx, const struct in6_addr *outip4, const struct in6_addr
 			net_conn_shutdown(shutdown_abort);
 		}
 
+		timing_phase(TIMING_GREETING);
 		int s = netget(0);
 		if (s < 0) {
 			switch (-s) {
 			case ECONNRESET:
 				/* try next MX */
+				tryconn_result(HOST_FAIL_GREETING);
 				connection_died();
 				continue;
 			case EINVAL:
@@ -87,9 +103,14 @@ connect_mx(struct ips *mx, const struct in6_addr *outip4, const struct in6_addr
 				const char *dropmsg[] = { "invalid greeting from ", rhost, NULL };
 
 				log_writen(LOG_WARNING, dropmsg);
+				tryconn_result(HOST_FAIL_GREETING);
 				quitmsg();
 				continue;
 				}
+			case ETIMEDOUT:
+				/* the server accepted the connection, but does not talk */
+				tryconn_result(HOST_FAIL_TIMEOUT);
+				/* fallthrough */
 			default:
 				/* something unexpected went wrong, assume that this is a local
 				 * problem that will eventually go away. */
@@ -120,6 +141,7 @@ connect_mx(struct ips *mx, const struct in6_addr *outip4, const struct in6_addr
 			break;
 		}
 		if (s == -ECONNRESET) {
+			tryconn_result(HOST_FAIL_GREETING);
 			connection_died();
 			continue;
 		}
@@ -130,13 +152,16 @@ connect_mx(struct ips *mx, const struct in6_addr *outip4, const struct in6_addr
 				log_writen(LOG_WARNING, dropmsg);
 			}
 
+			tryconn_result(session_failure(s, HOST_FAIL_GREETING));
 			quitmsg_if_net(s);
 
 			continue;
 		}
 
+		timing_phase(TIMING_EHLO);
 		flagerr = greeting();
 		if (flagerr < 0) {
+			tryconn_result(session_failure(flagerr, HOST_FAIL_GREETING));
 			quitmsg_if_net(flagerr);
 			continue;
 		}
@@ -144,6 +169,7 @@ connect_mx(struct ips *mx, const struct in6_addr *outip4, const struct in6_addr
 		smtpext = flagerr;
 
 		if (smtpext & esmtp_starttls) {
+			timing_phase(TIMING_STARTTLS);
 			flagerr = tls_init(d, tlsa);
 			/* Local error, this would likely happen on the next host again.
 			 * Since it's a local fault stop trying and hope it gets fixed. */
@@ -153,13 +179,16 @@ connect_mx(struct ips *mx, const struct in6_addr *outip4, const struct in6_addr
 			}
 
 			if (flagerr != 0) {
+				tryconn_result(session_failure(-flagerr, HOST_FAIL_TLS));
 				quitmsg_if_net(-flagerr);
 				continue;
 			}
 
+			timing_phase(TIMING_EHLO);
 			flagerr = greeting();
 
 			if (flagerr < 0) {
+				tryconn_result(session_failure(flagerr, HOST_FAIL_TLS));
 				quitmsg_if_net(flagerr);
 				continue;
 			} else {
@@ -170,6 +199,7 @@ connect_mx(struct ips *mx, const struct in6_addr *outip4, const struct in6_addr
 
 			log_writen(LOG_WARNING, dropmsg);
 
+			tryconn_result(HOST_FAIL_TLS);
 			quitmsg();
 			continue;
 		} else if (tlsa > 0) {
@@ -177,11 +207,13 @@ connect_mx(struct ips *mx, const struct in6_addr *outip4, const struct in6_addr
 
 			log_writen(LOG_WARNING, dropmsg);
 
+			tryconn_result(HOST_FAIL_TLS);
 			quitmsg();
 			continue;
 		}
 	} while (socketd < 0);
 
+	tryconn_result(HOST_FAIL_NONE);
 	daneinfo_free(d, tlsa);
 
 	return 0;
@@ -0,0 +1,555 @@
+/** \file daemon.c
+ \brief keep SMTP sessions open across the deliveries of several messages
+
+ qmail-rspawn runs Qremote once for every message. If a daemon socket is
+ configured, Qremote passes its standard input and output together with its
+ arguments to the daemon (started as "Qremote -d") and waits until the
+ delivery is finished. The daemon hands the message to a worker process that
+ has an idle session to the same host or starts a new worker. Workers keep
+ their session open for timeoutidle seconds after a delivery.
+ */
+
+#include <qremote/daemon.h>
+
+#include <fdio.h>
+#include <netio.h>
+#include <qremote/qremote.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define REQUEST_FDS 3		/**< message, status output, and connection of the client */
+#define CLIENT_FDS 2		/**< the descriptors sent by the client */
+#define REQUEST_MAX (1 << 22)	/**< maximum size of the arguments of a request */
+#define REQUEST_TIMEOUT 10	/**< seconds to wait for a client to send its request */
+
+unsigned long timeoutidle = 30;
+
+/** @struct request_wire
+ * @brief fixed size part of a request, followed by the 0-terminated arguments
+ *
+ * The file descriptors of the request are passed together with this part.
+ */
+struct request_wire {
+	size_t len;		/**< size of the arguments */
+	unsigned int argc;	/**< number of arguments */
+};
+
+/** @struct request
+ * @brief a received delivery request
+ */
+struct request {
+	int fds[REQUEST_FDS];	/**< file descriptors of the request, -1 if not set */
+	int argc;		/**< number of entries in argv, including argv[0] */
+	char **argv;		/**< the arguments in the form Qremote gets them */
+	char *buf;		/**< storage of the argument strings */
+};
+
+/** @struct worker
+ * @brief a worker process as seen by the daemon
+ */
+struct worker {
+	pid_t pid;		/**< process id */
+	int fd;			/**< control connection to the worker */
+	char *host;		/**< the host the worker delivers to */
+	int idle;		/**< if the worker waits for a new request */
+};
+
+static struct worker *workers;
+static unsigned int workercnt;
+static int nullfd = -1;	/**< /dev/null, replaces the status output between deliveries */
+
+/**
+ * @brief send a delivery request
+ * @param sock the socket to send to
+ * @param fds the file descriptors to pass
+ * @param nfds number of entries in fds
+ * @param argc number of arguments
+ * @param argv the arguments: host, sender, and recipients
+ * @return 0 on success, -1 on error
+ */
+static int
+send_request(const int sock, const int *fds, const unsigned int nfds, const int argc, char **argv)
+{
+	struct request_wire w = {
+		.len = 0,
+		.argc = argc
+	};
+	union {
+		char buf[CMSG_SPACE(REQUEST_FDS * sizeof(int))];
+		struct cmsghdr align;
+	} cbuf;
+	struct iovec iov = {
+		.iov_base = &w,
+		.iov_len = sizeof(w)
+	};
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = cbuf.buf,
+		.msg_controllen = CMSG_SPACE(nfds * sizeof(int))
+	};
+
+	for (int i = 0; i < argc; i++)
+		w.len += strlen(argv[i]) + 1;
+	if (w.len > REQUEST_MAX) {
+		errno = E2BIG;
+		return -1;
+	}
+
+	char *args = malloc(w.len);
+	if (args == NULL)
+		return -1;
+	char *a = args;
+	for (int i = 0; i < argc; i++) {
+		const size_t l = strlen(argv[i]) + 1;
+
+		memcpy(a, argv[i], l);
+		a += l;
+	}
+
+	memset(cbuf.buf, 0, sizeof(cbuf.buf));
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+	memcpy(CMSG_DATA(cmsg), fds, nfds * sizeof(int));
+
+	ssize_t r;
+	do {
+		r = sendmsg(sock, &msg, MSG_NOSIGNAL);
+	} while ((r < 0) && (errno == EINTR));
+
+	int ret = 0;
+	if ((r < 0) ||
+			(write_all(sock, (const char *)&w + r, sizeof(w) - r) != 0) ||
+			(write_all(sock, args, w.len) != 0))
+		ret = -1;
+
+	free(args);
+	return ret;
+}
+
+static void
+request_free(struct request *req)
+{
+	for (unsigned int i = 0; i < REQUEST_FDS; i++) {
+		if (req->fds[i] >= 0)
+			close(req->fds[i]);
+		req->fds[i] = -1;
+	}
+	free(req->argv);
+	req->argv = NULL;
+	free(req->buf);
+	req->buf = NULL;
+}
+
+/**
+ * @brief receive a delivery request
+ * @param sock the socket to read from
+ * @param req the request will be stored here
+ * @param nfds the number of file descriptors expected with the request
+ * @return 0 on success, -1 on error
+ *
+ * On error all resources of req are released.
+ */
+static int
+recv_request(const int sock, struct request *req, const unsigned int nfds)
+{
+	struct request_wire w;
+	union {
+		char buf[CMSG_SPACE(REQUEST_FDS * sizeof(int))];
+		struct cmsghdr align;
+	} cbuf;
+	struct iovec iov = {
+		.iov_base = &w,
+		.iov_len = sizeof(w)
+	};
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = cbuf.buf,
+		.msg_controllen = sizeof(cbuf.buf)
+	};
+	unsigned int got = 0;
+
+	for (unsigned int i = 0; i < REQUEST_FDS; i++)
+		req->fds[i] = -1;
+	req->argv = NULL;
+	req->buf = NULL;
+
+	ssize_t r;
+	do {
+		r = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+	} while ((r < 0) && (errno == EINTR));
+
+	if (r <= 0) {
+		if (r == 0)
+			errno = EPIPE;
+		return -1;
+	}
+
+	for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if ((cmsg->cmsg_level != SOL_SOCKET) || (cmsg->cmsg_type != SCM_RIGHTS))
+			continue;
+
+		const unsigned int n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		for (unsigned int i = 0; i < n; i++) {
+			int fd;
+
+			memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(fd));
+			if (got < nfds)
+				req->fds[got++] = fd;
+			else
+				close(fd);
+		}
+	}
+
+	if ((got != nfds) || (msg.msg_flags & MSG_CTRUNC) ||
+			(read_all(sock, (char *)&w + r, sizeof(w) - r) != 0) ||
+			(w.argc < 3) || (w.len == 0) || (w.len > REQUEST_MAX)) {
+		request_free(req);
+		errno = EINVAL;
+		return -1;
+	}
+
+	req->buf = malloc(w.len);
+	req->argv = calloc(w.argc + 2, sizeof(*req->argv));
+	if ((req->buf == NULL) || (req->argv == NULL) || (read_all(sock, req->buf, w.len) != 0)) {
+		request_free(req);
+		return -1;
+	}
+
+	/* argv[0] is not transmitted, the strings must exactly fill the buffer */
+	req->argv[0] = "Qremote";
+	req->argc = 1;
+	for (size_t off = 0; off < w.len; off += strlen(req->buf + off) + 1) {
+		const char *end = memchr(req->buf + off, '\0', w.len - off);
+
+		if ((end == NULL) || ((unsigned int)req->argc > w.argc)) {
+			request_free(req);
+			errno = EINVAL;
+			return -1;
+		}
+		req->argv[req->argc++] = req->buf + off;
+	}
+
+	if ((unsigned int)req->argc != w.argc + 1) {
+		request_free(req);
+		errno = EINVAL;
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * @brief pass the delivery to a running daemon
+ * @param path the path of the daemon socket
+ * @param argc number of arguments
+ * @param argv the command line arguments of Qremote
+ * @return if the message was handled by the daemon
+ * @retval 0 the daemon has delivered the message and written the results
+ * @retval -1 no daemon took over the message, it must be delivered by this process
+ *
+ * Standard input and output are passed to the daemon, which writes the
+ * delivery results directly to qmail-rspawn.
+ */
+int
+daemon_delegate(const char *path, int argc, char **argv)
+{
+	struct sockaddr_un sa = {
+		.sun_family = AF_UNIX
+	};
+	const int fds[CLIENT_FDS] = { 0, 1 };
+	char c;
+
+	if (strlen(path) >= sizeof(sa.sun_path))
+		return -1;
+	strcpy(sa.sun_path, path);
+
+	int s = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (s < 0)
+		return -1;
+
+	/* The worker confirms that it has taken over the message. If it does
+	 * not the message has not been touched and can be delivered here. */
+	if ((connect(s, (struct sockaddr *)&sa, sizeof(sa)) != 0) ||
+			(send_request(s, fds, CLIENT_FDS, argc - 1, argv + 1) != 0) ||
+			(read_all(s, &c, 1) != 0)) {
+		close(s);
+		return -1;
+	}
+
+	/* the worker closes the connection once it is done */
+	ssize_t r;
+	do {
+		r = read(s, &c, 1);
+	} while ((r > 0) || ((r < 0) && (errno == EINTR)));
+
+	close(s);
+	return 0;
+}
+
+/**
+ * @brief deliver the message of a request
+ * @param req the request
+ */
+static void
+worker_deliver(struct request *req)
+{
+	const char c = 'S';
+	struct stat st;
+
+	/* if the client is gone nobody would get the results */
+	if (write_all(req->fds[2], &c, 1) != 0)
+		return;
+
+	/* fd 0 is the connection to the remote server, only the status
+	 * output is redirected */
+	if (dup2(req->fds[1], 1) < 0)
+		return;
+
+	if (fstat(req->fds[0], &st) != 0)
+		write_status("Z4.3.0 internal error: can't fstat() input");
+	else
+		deliver(req->fds[0], st.st_size, req->argc, req->argv);
+
+	/* the client and qmail-rspawn wait until all copies of the status output are closed */
+	dup2(nullfd, 1);
+}
+
+/**
+ * @brief wait for the next request while keeping the session open
+ * @param ctl the control connection to the daemon
+ * @param req the request will be stored here
+ *
+ * The worker terminates if no request arrives within timeoutidle seconds,
+ * the daemon has exited, or the remote server closes the session.
+ */
+static void
+worker_wait(const int ctl, struct request *req)
+{
+	for (;;) {
+		struct pollfd pfd[2] = {
+			{
+				.fd = ctl,
+				.events = POLLIN
+			},
+			{
+				.fd = socketd,
+				.events = POLLIN
+			}
+		};
+
+		int r = poll(pfd, 2, timeoutidle * 1000);
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			net_conn_shutdown(shutdown_clean);
+		} else if (r == 0) {
+			net_conn_shutdown(shutdown_clean);
+		}
+
+		if (pfd[0].revents != 0) {
+			if (recv_request(ctl, req, REQUEST_FDS) == 0)
+				return;
+			net_conn_shutdown(shutdown_clean);
+		}
+
+		/* the server has closed the session or announced to do so */
+		net_conn_shutdown(shutdown_abort);
+	}
+}
+
+static void __attribute__ ((noreturn))
+worker_run(const int ctl, struct request *req)
+{
+	for (;;) {
+		const char c = 'I';
+
+		worker_deliver(req);
+
+		if (socketd < 0)
+			net_conn_shutdown(shutdown_abort);
+
+		/* announce the session before the client is released, so the
+		 * daemon already knows about it when the next message comes */
+		if (write_all(ctl, &c, 1) != 0)
+			net_conn_shutdown(shutdown_clean);
+
+		request_free(req);
+		worker_wait(ctl, req);
+	}
+}
+
+static void
+worker_remove(const unsigned int idx)
+{
+	close(workers[idx].fd);
+	free(workers[idx].host);
+	while ((waitpid(workers[idx].pid, NULL, 0) < 0) && (errno == EINTR))
+		;
+	workers[idx] = workers[--workercnt];
+}
+
+/**
+ * @brief pass a request to a worker
+ * @param listenfd the listening socket of the daemon
+ * @param req the request
+ *
+ * An idle worker connected to the same host is preferred, otherwise a new
+ * worker is started. If no worker can be started the request is dropped and
+ * the client delivers the message itself.
+ */
+static void
+dispatch(const int listenfd, struct request *req)
+{
+	for (unsigned int i = 0; i < workercnt; i++) {
+		struct worker *w = workers + i;
+
+		if (!w->idle || (strcasecmp(w->host, req->argv[1]) != 0))
+			continue;
+
+		/* if this fails the worker has exited, it is removed in the main loop */
+		w->idle = 0;
+		if (send_request(w->fd, req->fds, REQUEST_FDS, req->argc - 1, req->argv + 1) == 0)
+			return;
+	}
+
+	struct worker *tmp = realloc(workers, (workercnt + 1) * sizeof(*workers));
+	if (tmp == NULL)
+		return;
+	workers = tmp;
+
+	char *host = strdup(req->argv[1]);
+	if (host == NULL)
+		return;
+
+	int sp[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sp) != 0) {
+		free(host);
+		return;
+	}
+
+	const pid_t pid = fork();
+	switch (pid) {
+	case -1:
+		close(sp[0]);
+		close(sp[1]);
+		free(host);
+		return;
+	case 0:
+		close(listenfd);
+		close(sp[0]);
+		for (unsigned int i = 0; i < workercnt; i++)
+			close(workers[i].fd);
+		free(host);
+		worker_run(sp[1], req);
+	default:
+		break;
+	}
+
+	close(sp[1]);
+	workers[workercnt].pid = pid;
+	workers[workercnt].fd = sp[0];
+	workers[workercnt].host = host;
+	workers[workercnt].idle = 0;
+	workercnt++;
+}
+
+static void
+accept_request(const int listenfd)
+{
+	const struct timeval tv = {
+		.tv_sec = REQUEST_TIMEOUT
+	};
+	struct request req;
+
+	int c = accept4(listenfd, NULL, NULL, SOCK_CLOEXEC);
+	if (c < 0)
+		return;
+
+	/* a stuck client must not block the other deliveries */
+	if ((setsockopt(c, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) != 0) ||
+			(recv_request(c, &req, CLIENT_FDS) != 0)) {
+		close(c);
+		return;
+	}
+
+	req.fds[2] = c;
+	dispatch(listenfd, &req);
+	request_free(&req);
+}
+
+/**
+ * @brief run the delivery daemon
+ * @param path the path of the socket to listen on
+ */
+void
+daemon_run(const char *path)
+{
+	struct sockaddr_un sa = {
+		.sun_family = AF_UNIX
+	};
+
+	if (strlen(path) >= sizeof(sa.sun_path))
+		err_conf("path in control/" DAEMON_SOCKET_FILE " too long");
+	strcpy(sa.sun_path, path);
+
+	nullfd = open("/dev/null", O_RDWR | O_CLOEXEC);
+	if (nullfd < 0)
+		err_conf("cannot open /dev/null");
+
+	int s = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (s < 0)
+		err_conf("cannot create the daemon socket");
+
+	/* remove the socket of a previous instance */
+	unlink(path);
+	if ((bind(s, (struct sockaddr *)&sa, sizeof(sa)) != 0) ||
+			(chmod(path, S_IRUSR | S_IWUSR) != 0) ||
+			(listen(s, SOMAXCONN) != 0))
+		err_conf("cannot listen on the socket in control/" DAEMON_SOCKET_FILE);
+
+	for (;;) {
+		struct pollfd pfd[workercnt + 1];
+
+		pfd[0].fd = s;
+		pfd[0].events = POLLIN;
+		for (unsigned int i = 0; i < workercnt; i++) {
+			pfd[i + 1].fd = workers[i].fd;
+			pfd[i + 1].events = POLLIN;
+		}
+
+		if (poll(pfd, workercnt + 1, -1) < 0)
+			continue;
+
+		/* go backwards, worker_remove() moves the last entry */
+		for (unsigned int i = workercnt; i > 0; i--) {
+			char c;
+
+			if (pfd[i].revents == 0)
+				continue;
+
+			ssize_t r = read(workers[i - 1].fd, &c, 1);
+			if (r == 1)
+				workers[i - 1].idle = 1;
+			else if ((r == 0) || (errno != EINTR))
+				worker_remove(i - 1);
+		}
+
+		if (pfd[0].revents & POLLIN)
+			accept_request(s);
+	}
+}
@@ -0,0 +1,467 @@
+/** \file dane_prefetch.c
+ \brief look up TLSA records of all MX hosts in the background
+
+ The TLSA records are only needed after the connection to an MX has been
+ established, but looking them up at that point adds a DNS round trip to
+ every delivery. A helper process queries the MX names of the target domain
+ and the TLSA records of all of them while the addresses of the MX hosts are
+ resolved in parallel. If the MX hosts are already known from the route cache
+ only their TLSA records are queried.
+
+ The helper starts one process per MX host, so a slow zone does not delay the
+ records of the other hosts. The results are forwarded to Qremote in the order
+ they arrive, and tlsa_lookup() only waits until the records of the host it
+ was asked for are available.
+ */
+
+#include <qremote/conn.h>
+
+#include <fdio.h>
+#include <libowfatconn.h>
+#include <qdns.h>
+#include <qdns_dane.h>
+#include <qremote/qremote.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/** @struct tlsa_host
+ * @brief the TLSA records of one MX host
+ */
+struct tlsa_host {
+	char *name;		/**< name of the MX */
+	int cnt;		/**< return code of dnstlsa() */
+	struct daneinfo *info;	/**< the TLSA records */
+};
+
+/** @struct tlsa_wire
+ * @brief fixed size part of the results for one MX host as sent by the helper
+ */
+struct tlsa_wire {
+	size_t namelen;		/**< strlen() of the MX name, 0 marks the end of the results */
+	int cnt;		/**< return code of dnstlsa() */
+};
+
+/** @struct tlsa_job
+ * @brief the lookup of one MX host inside the helper
+ */
+struct tlsa_job {
+	const char *name;	/**< name of the MX */
+	pid_t pid;		/**< process id doing the lookup */
+	int fd;			/**< read end of the pipe the result is sent through, -1 once it is complete */
+	char *buf;		/**< the result as received so far */
+	size_t len;		/**< used length of buf */
+};
+
+static pid_t prefetch_pid;	/**< process id of the helper, 0 if none is running */
+static int prefetch_fd = -1;	/**< read end of the pipe the results are sent through */
+static struct tlsa_host *hosts;	/**< the results collected from the helper */
+static unsigned int hostcnt;	/**< number of entries in hosts */
+
+static int
+send_host(const int fd, const char *name)
+{
+	struct daneinfo *info = NULL;
+	const struct tlsa_wire w = {
+		.namelen = strlen(name),
+		.cnt = dnstlsa(name, targetport, &info)
+	};
+	int r = 0;
+
+	if ((write_all(fd, &w, sizeof(w)) != 0) || (write_all(fd, name, w.namelen) != 0))
+		r = -1;
+
+	for (int i = 0; (r == 0) && (i < w.cnt); i++) {
+		if ((write_all(fd, info + i, sizeof(*info)) != 0) ||
+				(write_all(fd, info[i].data, info[i].datalen) != 0))
+			r = -1;
+	}
+
+	if (w.cnt > 0)
+		daneinfo_free(info, w.cnt);
+
+	return r;
+}
+
+/**
+ * @brief start the lookup of one MX host in a separate process
+ * @param fd descriptor the helper sends its results to
+ * @param job the job to start
+ *
+ * If no process can be started the lookup is done immediately and the result
+ * is sent directly.
+ */
+static void
+start_job(const int fd, struct tlsa_job *job)
+{
+	int p[2];
+
+	job->fd = -1;
+	job->buf = NULL;
+	job->len = 0;
+
+	if (pipe(p) == 0) {
+		switch (job->pid = fork()) {
+		case -1:
+			close(p[0]);
+			close(p[1]);
+			break;
+		case 0:
+			close(p[0]);
+			_exit((send_host(p[1], job->name) == 0) ? 0 : 1);
+		default:
+			close(p[1]);
+			job->fd = p[0];
+			return;
+		}
+	}
+
+	job->pid = 0;
+	if (send_host(fd, job->name) != 0)
+		_exit(1);
+}
+
+/**
+ * @brief read the data a lookup process has available
+ * @param fd descriptor the helper sends its results to
+ * @param job the job to read from
+ *
+ * Once the process has finished its complete result is forwarded. A process
+ * that fails sends nothing, the host is then looked up by Qremote itself.
+ */
+static void
+read_job(const int fd, struct tlsa_job *job)
+{
+	char buf[4096];
+	ssize_t r;
+
+	while ((r = read(job->fd, buf, sizeof(buf))) < 0) {
+		if (errno != EINTR)
+			break;
+	}
+
+	if (r > 0) {
+		char *tmp = realloc(job->buf, job->len + r);
+
+		if (tmp == NULL)
+			_exit(1);
+		job->buf = tmp;
+		memcpy(job->buf + job->len, buf, r);
+		job->len += r;
+		return;
+	}
+
+	int status;
+	close(job->fd);
+	job->fd = -1;
+	while ((waitpid(job->pid, &status, 0) < 0) && (errno == EINTR))
+		;
+
+	if ((r == 0) && WIFEXITED(status) && (WEXITSTATUS(status) == 0) &&
+			(write_all(fd, job->buf, job->len) != 0))
+		_exit(1);
+	free(job->buf);
+	job->buf = NULL;
+}
+
+static void __attribute__ ((noreturn))
+prefetch_child(const int fd, const char *remhost, const struct ips *mxlist)
+{
+	const struct tlsa_wire end = {
+		.namelen = 0
+	};
+	char *mx = NULL;
+	size_t len = 0;
+	struct tlsa_job *jobs;
+	unsigned int cnt = 0;
+
+	if (mxlist != NULL) {
+		for (const struct ips *m = mxlist; m != NULL; m = m->next)
+			cnt++;
+	} else {
+		if (dnsmx(&mx, &len, remhost) != 0)
+			_exit(1);
+
+		/* the MX names are stored with 2 bytes priority in front and a terminating 0 */
+		for (const char *s = mx; s < mx + len; s += 3 + strlen(s + 2))
+			cnt++;
+	}
+
+	jobs = calloc((cnt == 0) ? 1 : cnt, sizeof(*jobs));
+	struct pollfd *pfd = calloc((cnt == 0) ? 1 : cnt, sizeof(*pfd));
+	if ((jobs == NULL) || (pfd == NULL))
+		_exit(1);
+
+	if (mxlist != NULL) {
+		/* entries without name come from static routes or IP addresses */
+		cnt = 0;
+		for (const struct ips *m = mxlist; m != NULL; m = m->next)
+			if (m->name != NULL)
+				jobs[cnt++].name = m->name;
+	} else if (cnt == 0) {
+		/* no MX, the host itself is used */
+		jobs[0].name = remhost;
+		cnt = 1;
+	} else {
+		unsigned int i = 0;
+
+		for (const char *s = mx; s < mx + len; s += 3 + strlen(s + 2))
+			jobs[i++].name = s + 2;
+	}
+
+	for (unsigned int i = 0; i < cnt; i++)
+		start_job(fd, jobs + i);
+
+	for (;;) {
+		unsigned int active = 0;
+
+		for (unsigned int i = 0; i < cnt; i++) {
+			if (jobs[i].fd < 0)
+				continue;
+			pfd[active].fd = jobs[i].fd;
+			pfd[active].events = POLLIN;
+			active++;
+		}
+
+		if (active == 0)
+			break;
+
+		if (poll(pfd, active, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			_exit(1);
+		}
+
+		active = 0;
+		for (unsigned int i = 0; i < cnt; i++) {
+			if (jobs[i].fd < 0)
+				continue;
+			if (pfd[active++].revents != 0)
+				read_job(fd, jobs + i);
+		}
+	}
+
+	if (write_all(fd, &end, sizeof(end)) != 0)
+		_exit(1);
+
+	_exit(0);
+}
+
+/**
+ * @brief start looking up the TLSA records for the MX hosts of the target
+ * @param remhost the target host as given on the command line
+ * @param mx the MX list of the target if already known, NULL to look it up
+ *
+ * This must be called once targetport is set, the records are looked up
+ * for that port. Nothing is done if the target is an IP address. If the
+ * helper process can't be started the TLSA records will be queried when
+ * they are needed.
+ */
+void
+tlsa_prefetch_start(const char *remhost, const struct ips *mx)
+{
+	int p[2];
+
+	if (remhost[0] == '[')
+		return;
+
+	if (pipe(p) != 0)
+		return;
+
+	switch (prefetch_pid = fork()) {
+	case -1:
+		prefetch_pid = 0;
+		close(p[0]);
+		close(p[1]);
+		return;
+	case 0:
+		close(p[0]);
+		prefetch_child(p[1], remhost, mx);
+	default:
+		break;
+	}
+
+	close(p[1]);
+	prefetch_fd = p[0];
+	(void) fcntl(prefetch_fd, F_SETFD, FD_CLOEXEC);
+}
+
+static int
+read_host(struct tlsa_host *h)
+{
+	struct tlsa_wire w;
+
+	if (read_all(prefetch_fd, &w, sizeof(w)) != 0)
+		return -1;
+	if (w.namelen == 0)
+		return 1;
+
+	h->name = malloc(w.namelen + 1);
+	if (h->name == NULL)
+		return -1;
+	if (read_all(prefetch_fd, h->name, w.namelen) != 0) {
+		free(h->name);
+		return -1;
+	}
+	h->name[w.namelen] = '\0';
+	h->cnt = w.cnt;
+	h->info = NULL;
+
+	if (w.cnt <= 0)
+		return 0;
+
+	h->info = calloc(w.cnt, sizeof(*h->info));
+	if (h->info == NULL) {
+		free(h->name);
+		return -1;
+	}
+
+	for (int i = 0; i < w.cnt; i++) {
+		struct daneinfo *d = h->info + i;
+
+		if (read_all(prefetch_fd, d, sizeof(*d)) == 0) {
+			d->data = malloc(d->datalen);
+			if ((d->data != NULL) && (read_all(prefetch_fd, d->data, d->datalen) == 0))
+				continue;
+			free(d->data);
+		}
+
+		daneinfo_free(h->info, i);
+		free(h->name);
+		return -1;
+	}
+
+	return 0;
+}
+
+static void
+free_hosts(void)
+{
+	for (unsigned int i = 0; i < hostcnt; i++) {
+		free(hosts[i].name);
+		if (hosts[i].cnt > 0)
+			daneinfo_free(hosts[i].info, hosts[i].cnt);
+	}
+	free(hosts);
+	hosts = NULL;
+	hostcnt = 0;
+}
+
+/**
+ * @brief stop the helper process
+ * @param sig if not 0 this signal is sent to the helper first
+ */
+static void
+tlsa_prefetch_finish(const int sig)
+{
+	if (sig != 0)
+		kill(prefetch_pid, sig);
+	close(prefetch_fd);
+	prefetch_fd = -1;
+	while ((waitpid(prefetch_pid, NULL, 0) < 0) && (errno == EINTR))
+		;
+	prefetch_pid = 0;
+}
+
+/**
+ * @brief collect the results of the helper process up to the given host
+ * @param host the name of the host
+ * @return the entry of host, NULL if the helper did not send one
+ *
+ * The results of other hosts that arrive first are kept. If a result can't
+ * be read the helper is stopped, the hosts received before remain valid.
+ */
+static const struct tlsa_host *
+tlsa_prefetch_wait(const char *host)
+{
+	while (prefetch_pid != 0) {
+		struct tlsa_host *tmp = realloc(hosts, (hostcnt + 1) * sizeof(*hosts));
+		int r;
+
+		if (tmp == NULL) {
+			r = -1;
+		} else {
+			hosts = tmp;
+			r = read_host(hosts + hostcnt);
+		}
+
+		if (r != 0) {
+			tlsa_prefetch_finish((r < 0) ? SIGKILL : 0);
+			break;
+		}
+
+		if (strcmp(hosts[hostcnt++].name, host) == 0)
+			return hosts + hostcnt - 1;
+	}
+
+	return NULL;
+}
+
+/**
+ * @brief get the prefetched TLSA records of a host
+ * @param host the name of the host
+ * @param out a copy of the TLSA records will be stored here
+ * @return the number of TLSA records or error code as returned by dnstlsa()
+ *
+ * If no prefetched records for host are available dnstlsa() is called.
+ */
+int
+tlsa_lookup(const char *host, struct daneinfo **out)
+{
+	const struct tlsa_host *h = NULL;
+
+	for (unsigned int i = 0; (h == NULL) && (i < hostcnt); i++) {
+		if (strcmp(hosts[i].name, host) == 0)
+			h = hosts + i;
+	}
+
+	if (h == NULL)
+		h = tlsa_prefetch_wait(host);
+
+	if (h == NULL)
+		return dnstlsa(host, targetport, out);
+
+	*out = NULL;
+	if (h->cnt <= 0)
+		return h->cnt;
+
+	*out = calloc(h->cnt, sizeof(**out));
+	if (*out == NULL)
+		return DNS_ERROR_LOCAL;
+
+	for (int j = 0; j < h->cnt; j++) {
+		(*out)[j] = h->info[j];
+		(*out)[j].data = malloc(h->info[j].datalen);
+		if ((*out)[j].data == NULL) {
+			daneinfo_free(*out, j);
+			*out = NULL;
+			return DNS_ERROR_LOCAL;
+		}
+		memcpy((*out)[j].data, h->info[j].data, h->info[j].datalen);
+	}
+
+	return h->cnt;
+}
+
+/**
+ * @brief discard the prefetched TLSA records
+ *
+ * A helper process that is still running is terminated. This must be called
+ * once the connection is established if the process will deliver further
+ * messages.
+ */
+void
+tlsa_prefetch_reset(void)
+{
+	if (prefetch_pid != 0)
+		tlsa_prefetch_finish(SIGKILL);
+
+	free_hosts();
+}
@@ -0,0 +1,153 @@
+/** \file deliver.c
+ \brief deliver one message of Qremote
+
+ This file contains the delivery of a single message, either over a new
+ connection or over the session kept open from a previous delivery.
+ */
+
+#include <qremote/daemon.h>
+
+#include <ipme.h>
+#include <log.h>
+#include <netio.h>
+#include <qdns.h>
+#include <qremote/conn.h>
+#include <qremote/qrdata.h>
+#include <qremote/qremote.h>
+#include <qremote/routecache.h>
+#include <qremote/starttlsr.h>
+#include <qremote/timing.h>
+#include <tls.h>
+
+#include <sys/mman.h>
+#include <syslog.h>
+
+static const char *timing_host;	/**< the target host of the running delivery, NULL if there is none */
+
+void
+log_timing(void)
+{
+	char record[TIMING_RECORD_LEN];
+
+	if ((timing_host != NULL) && (timing_mode & TIMING_LOG)) {
+		timing_record(record, sizeof(record));
+
+		const char *logmsg[] = { "delivery to ", timing_host, " via ", (rhost != NULL) ? rhost : "-",
+				": ", record, NULL };
+		log_writen(LOG_INFO, logmsg);
+	}
+
+	timing_host = NULL;
+}
+
+/**
+ * @brief reset the session of a previous delivery for the next message
+ * @return if the session can be used
+ * @retval 0 the server accepted the RSET
+ * @retval -1 the connection has been closed
+ */
+static int
+session_reset(void)
+{
+	if (netwrite("RSET\r\n") == 0) {
+		int r;
+
+		do {
+			r = netget(0);
+		} while ((r > 0) && (linein.s[3] == '-'));
+
+		if (r == 250)
+			return 0;
+	}
+
+	conn_abort();
+	return -1;
+}
+
+void
+deliver(const int msgfd, const off_t size, int argc, char **argv)
+{
+	timing_start();
+	timing_host = argv[1];
+
+	msgsize = size;
+	msgdata = mmap(NULL, msgsize, PROT_READ, MAP_SHARED, msgfd, 0);
+
+	if (msgdata == MAP_FAILED) {
+		log_write(LOG_CRIT, "can't mmap() input");
+		write_status("Z4.3.0 internal error: can't mmap() input");
+		net_conn_shutdown(shutdown_abort);
+	}
+
+	/* the RSET of a reused session belongs to the transaction */
+	if (socketd >= 0)
+		timing_phase(TIMING_ENVELOPE);
+
+	if ((socketd < 0) || (session_reset() != 0)) {
+		struct ips *mx = NULL;
+
+		timing_phase(TIMING_DNS);
+		const enum mx_source src = getmxlist(argv[1], &mx);
+		if (src != MX_SOURCE_CACHE) {
+			if (targetport == 25) {
+				mx = filter_my_ips(mx);
+				if (mx == NULL) {
+					const char *msg[] = { "Z4.4.3 all mail exchangers for ",
+							argv[1], " point back to me" };
+					write_status_m(msg, 3);
+					net_conn_shutdown(shutdown_abort);
+				}
+			}
+			sortmx(&mx);
+
+			if (src == MX_SOURCE_DNS)
+				route_cache_store(argv[1], targetport, mx, dns_minttl);
+		}
+
+		int i = connect_mx(mx, &outgoingip, &outgoingip6);
+		freeips(mx);
+		tlsa_prefetch_reset();
+
+		if (i < 0) {
+			write_status("Z4.4.2 can't connect to any server");
+			net_conn_shutdown(shutdown_abort);
+		}
+	}
+
+	timing_phase(TIMING_ENVELOPE);
+
+	if (ssl) {
+		successmsg[3] = "message ";
+		successmsg[4] = SSL_get_cipher(ssl);
+		if (SSL_get0_dane_tlsa(ssl, NULL, NULL, NULL, NULL, NULL) > 0)
+			successmsg[5] = " encrypted and DANE secured";
+		else
+			successmsg[5] = " encrypted";
+	} else {
+		successmsg[3] = "message";
+		successmsg[4] = "";
+		successmsg[5] = "";
+	}
+
+/* check if message is plain ASCII or not */
+	const unsigned int recodeflag = need_recode(msgdata, msgsize);
+
+	if (send_envelope(recodeflag, argv[2], argc - 3, argv + 3) == 0) {
+		successmsg[0] = rhost;
+		timing_phase(TIMING_DATA);
+#ifdef CHUNKING
+		if (body_chunked(recodeflag)) {
+			send_bdat(recodeflag);
+		} else {
+#else
+		{
+#endif
+			send_data(recodeflag);
+		}
+	}
+
+	log_timing();
+
+	munmap((void*)msgdata, msgsize);
+	msgdata = MAP_FAILED;
+}
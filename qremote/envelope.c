@@ -7,6 +7,48 @@
 #include <qremote/greeting.h>
 #include <qremote/qrdata.h>
 
+/**
+ * @brief check if the message can not be sent unmodified with DATA
+ * @param recodeflag the result of need_recode() for the message
+ */
+static int
+body_needs_recode(const unsigned int recodeflag)
+{
+	return (recodeflag & recode_long) || ((recodeflag & recode_8bit) && !(smtpext & esmtp_8bitmime));
+}
+
+/**
+ * @brief check if the message is sent as BODY=BINARYMIME
+ * @param recodeflag the result of need_recode() for the message
+ * @return if the message would need recoding for DATA and is sent unmodified with BDAT instead
+ */
+int
+body_binarymime(const unsigned int recodeflag)
+{
+	if ((smtpext & (esmtp_chunking | esmtp_binarymime)) != (esmtp_chunking | esmtp_binarymime))
+		return 0;
+
+	return body_needs_recode(recodeflag);
+}
+
+/**
+ * @brief check if the message is sent with BDAT
+ * @param recodeflag the result of need_recode() for the message
+ * @return if the server supports CHUNKING and the message can be sent unmodified
+ *
+ * BDAT transfers the message as is, so a message that needs recoding may only
+ * be sent that way if the server also supports BINARYMIME (RFC 3030). Otherwise
+ * it is recoded and sent with DATA.
+ */
+int
+body_chunked(const unsigned int recodeflag)
+{
+	if (!(smtpext & esmtp_chunking))
+		return 0;
+
+	return !body_needs_recode(recodeflag) || body_binarymime(recodeflag);
+}
+
 int
 send_envelope(const unsigned int recodeflag, const char *sender, int rcptcount, char **rcpts)
 {
@@ -24,8 +66,10 @@ send_envelope(const unsigned int recodeflag, const char *sender, int rcptcount,
 	} else {
 		netmsg[lastmsg++] = ">";
 	}
-/* ESMTP 8BITMIME extension */
-	if (smtpext & esmtp_8bitmime) {
+/* ESMTP BINARYMIME and 8BITMIME extensions */
+	if (body_binarymime(recodeflag)) {
+		netmsg[lastmsg++] = " BODY=BINARYMIME";
+	} else if (smtpext & esmtp_8bitmime) {
 		netmsg[lastmsg++] = (recodeflag & 1) ? " BODY=8BITMIME" : " BODY=7BIT";
 	}
 	if (smtpext & esmtp_pipelining) {
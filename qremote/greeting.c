@@ -84,6 +84,7 @@ esmtp_check_extension(const char *input)
 		{ .name = "SMTPUTF8",	.len = 8,	.func = cb_utf8	}, /* 0x20 */
 #ifdef CHUNKING
 		{ .name = "CHUNKING",	.len = 8,	.func = NULL	}, /* 0x40 */
+		{ .name = "BINARYMIME",	.len = 10,	.func = NULL	}, /* 0x80 */
 #endif
 		{ .name = NULL }
 	};
@@ -0,0 +1,237 @@
+/** \file hosthealth.c
+ \brief connection results of remote servers shared by all Qremote processes
+
+ Every Qremote process would find out on its own that a mail exchanger is
+ unreachable, each one waiting for the connection to time out. The results of
+ all connection attempts are stored in the file named in the environment
+ variable HOSTHEALTH. Addresses that could not be connected to or did not reply
+ in time are skipped for a hold down time that doubles with every consecutive
+ failure, and addresses of the same priority are tried in the order of their
+ connection times.
+ */
+
+#include <qremote/hosthealth.h>
+
+#include <sharedtable.h>
+
+#include <string.h>
+#include <time.h>
+
+#define HOSTHEALTH_MAGIC "QRHLTH1"	/**< identifies a host health file */
+
+static struct shared_table table = SHARED_TABLE_INIT("HOSTHEALTH", HOSTHEALTH_MAGIC, "host health table",
+		HOSTHEALTH_SLOTS, sizeof(struct host_health_slot));
+
+static struct host_health_slot *
+addr_slot(const struct in6_addr *addr, const unsigned int port)
+{
+	/* FNV-1a */
+	uint32_t h = 2166136261u;
+
+	for (unsigned int i = 0; i < sizeof(addr->s6_addr); i++)
+		h = (h ^ addr->s6_addr[i]) * 16777619u;
+	h = (h ^ port) * 16777619u;
+
+	return shtable_slot(&table, h);
+}
+
+static int
+slot_matches(const struct host_health_slot *slot, const struct in6_addr *addr, const unsigned int port)
+{
+	return slot->used && (slot->port == port) && IN6_ARE_ADDR_EQUAL(&slot->addr, addr);
+}
+
+/**
+ * @brief check if an address is in its hold down time
+ * @param slot the entry of the address
+ * @param now the current time()
+ * @return if connections to the address should not be attempted
+ *
+ * Only failures to connect and timeouts put an address on hold. A server that
+ * rejects the session, e.g. with a 421 greeting, or has broken TLS is still
+ * reachable and may accept the next connection.
+ */
+int
+host_health_down(const struct host_health_slot *slot, const int64_t now)
+{
+	if ((slot->failures == 0) ||
+			((slot->reason != HOST_FAIL_CONNECT) && (slot->reason != HOST_FAIL_TIMEOUT)))
+		return 0;
+
+	int64_t holddown = HOSTHEALTH_HOLDDOWN;
+	for (uint32_t i = 1; (i < slot->failures) && (holddown < HOSTHEALTH_HOLDDOWN_MAX); i++)
+		holddown *= 2;
+	if (holddown > HOSTHEALTH_HOLDDOWN_MAX)
+		holddown = HOSTHEALTH_HOLDDOWN_MAX;
+
+	return now < slot->last_failure + holddown;
+}
+
+/**
+ * @brief get the state of an address
+ * @param addr the address of the remote server
+ * @param port the port on the remote server
+ * @param rtt the smoothed connection time in ms is stored here, 0 if unknown
+ * @return if the address is in its hold down time
+ */
+int
+host_health_check(const struct in6_addr *addr, const unsigned int port, unsigned int *rtt)
+{
+	int down = 0;
+
+	*rtt = 0;
+
+	if (!shtable_open(&table))
+		return 0;
+
+	const struct host_health_slot *slot = addr_slot(addr, port);
+
+	if (shtable_lock(&table, LOCK_SH) != 0)
+		return 0;
+
+	if (slot_matches(slot, addr, port)) {
+		*rtt = slot->rtt;
+		down = host_health_down(slot, time(NULL));
+	}
+
+	shtable_unlock(&table);
+
+	return down;
+}
+
+/**
+ * @brief get the entry of an address for updating, replacing the previous contents
+ * @param addr the address of the remote server
+ * @param port the port on the remote server
+ * @return the locked slot, NULL on error
+ */
+static struct host_health_slot *
+update_slot(const struct in6_addr *addr, const unsigned int port)
+{
+	if (!shtable_open(&table))
+		return NULL;
+
+	struct host_health_slot *slot = addr_slot(addr, port);
+
+	if (shtable_lock(&table, LOCK_EX) != 0)
+		return NULL;
+
+	if (!slot_matches(slot, addr, port)) {
+		memset(slot, 0, sizeof(*slot));
+		slot->addr = *addr;
+		slot->port = port;
+		slot->used = 1;
+	}
+
+	return slot;
+}
+
+/**
+ * @brief record an established TCP connection
+ * @param addr the address of the remote server
+ * @param port the port on the remote server
+ * @param rtt the time it took to establish the connection in ms
+ */
+void
+host_health_connected(const struct in6_addr *addr, const unsigned int port, const unsigned int rtt)
+{
+	struct host_health_slot *slot = update_slot(addr, port);
+
+	if (slot == NULL)
+		return;
+
+	/* 0 means unknown */
+	const uint32_t sample = (rtt == 0) ? 1 : rtt;
+	slot->rtt = (slot->rtt == 0) ? sample : (7 * slot->rtt + sample) / 8;
+
+	shtable_unlock(&table);
+}
+
+/**
+ * @brief record the result of a connection attempt
+ * @param addr the address of the remote server
+ * @param port the port on the remote server
+ * @param reason why the connection failed, HOST_FAIL_NONE if a session was established
+ *
+ * Failures after the server replied, i.e. a rejected greeting, EHLO or TLS
+ * problems, end a series of failures to connect, as the address is reachable.
+ */
+void
+host_health_result(const struct in6_addr *addr, const unsigned int port, const enum host_failure reason)
+{
+	struct host_health_slot *slot = update_slot(addr, port);
+
+	if (slot == NULL)
+		return;
+
+	if (reason == HOST_FAIL_NONE) {
+		slot->last_success = time(NULL);
+		slot->failures = 0;
+	} else {
+		slot->last_failure = time(NULL);
+		slot->reason = reason;
+		if ((reason == HOST_FAIL_CONNECT) || (reason == HOST_FAIL_TIMEOUT))
+			slot->failures++;
+		else
+			slot->failures = 0;
+	}
+
+	shtable_unlock(&table);
+}
+
+/**
+ * @brief read an entry of the table
+ * @param idx index of the slot
+ * @param slot the contents of the slot are stored here
+ * @return if the slot is used
+ * @retval -1 the table can't be opened
+ */
+int
+host_health_get(const unsigned int idx, struct host_health_slot *slot)
+{
+	if (!shtable_open(&table))
+		return -1;
+
+	if (shtable_lock(&table, LOCK_SH) != 0)
+		return -1;
+
+	*slot = *(const struct host_health_slot *)shtable_slot(&table, idx);
+
+	shtable_unlock(&table);
+
+	return slot->used ? 1 : 0;
+}
+
+/**
+ * @brief remove entries from the table
+ * @param addr the address to remove, NULL to remove all
+ * @return number of removed entries
+ * @retval -1 the table can't be opened
+ *
+ * Entries for all ports of the address are removed.
+ */
+int
+host_health_reset(const struct in6_addr *addr)
+{
+	int cnt = 0;
+
+	if (!shtable_open(&table))
+		return -1;
+
+	if (shtable_lock(&table, LOCK_EX) != 0)
+		return -1;
+
+	for (unsigned int i = 0; i < HOSTHEALTH_SLOTS; i++) {
+		struct host_health_slot *slot = shtable_slot(&table, i);
+
+		if (!slot->used || ((addr != NULL) && !IN6_ARE_ADDR_EQUAL(&slot->addr, addr)))
+			continue;
+
+		memset(slot, 0, sizeof(*slot));
+		cnt++;
+	}
+
+	shtable_unlock(&table);
+
+	return cnt;
+}
@@ -11,6 +11,8 @@
 #include <sstring.h>
 
 #include <assert.h>
+#include <errno.h>
+#include <stdlib.h>
 #include <string.h>
 #include <strings.h>
 #include <unistd.h>
@@ -312,6 +314,99 @@ getfieldlen(const char *msg, const size_t len)
 	return ((*(cr - 1) == '\n') || (*(cr - 1) == '\r')) ? len - r : 0;
 }
 
+/**
+ * check if a boundary delimiter starts at the given position
+ *
+ * @param buf buffer to scan
+ * @param len length of buffer
+ * @param pos position of the CR or LF in front of "--", is moved behind the
+ *        boundary string if that matches
+ * @param boundary boundary limit string
+ * @return offset of first character behind the boundary
+ * @retval 0 this is no boundary
+ */
+static off_t
+match_boundary(const char *buf, const off_t len, off_t *pos, const cstring *boundary)
+{
+	if (strncmp(buf + *pos + 3, boundary->s, boundary->len) != 0)
+		return 0;
+
+	*pos += 3 + boundary->len;
+	if ((*pos == len) || WSPACE(buf[*pos]))
+		return *pos;
+	if (*pos + 1 < len) {
+		if ((buf[*pos] == '-') && (buf[*pos + 1] == '-') &&
+				((*pos + 2 == len) || (WSPACE(buf[*pos + 2])))) {
+			return *pos;
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * prepare the search for a boundary
+ *
+ * @param m the matcher to fill
+ * @param boundary boundary limit string, must not be longer than 70 characters
+ *
+ * The matcher can be used for all searches for this boundary, the table
+ * needed to skip over the data is only built once.
+ */
+void
+boundary_matcher_init(struct boundary_matcher *m, const cstring *boundary)
+{
+	assert(boundary->len <= sizeof(m->delim) - 2);
+
+	m->boundary = boundary;
+	m->delim[0] = '-';
+	m->delim[1] = '-';
+	memcpy(m->delim + 2, boundary->s, boundary->len);
+	m->len = boundary->len + 2;
+
+	memset(m->shift, m->len, sizeof(m->shift));
+	for (size_t i = 0; i < m->len - 1; i++)
+		m->shift[(unsigned char)m->delim[i]] = m->len - 1 - i;
+}
+
+/**
+ * find next mime boundary
+ *
+ * @param m the matcher of the boundary
+ * @param buf buffer to scan
+ * @param len length of buffer
+ * @return offset of first character behind next boundary
+ * @retval 0 no boundary found
+ *
+ * The buffer is searched for "--boundary" with the Boyer-Moore-Horspool
+ * algorithm, only the matches following a CR or LF are checked further.
+ */
+off_t
+boundary_matcher_find(const struct boundary_matcher *m, const char *buf, const off_t len)
+{
+	const unsigned char last = m->delim[m->len - 1];
+	off_t q = 1;	/* start of the delimiter, behind the CR or LF */
+
+	while (q + (off_t)m->len <= len) {
+		const unsigned char c = buf[q + m->len - 1];
+
+		if ((c == last) && ((buf[q - 1] == '\r') || (buf[q - 1] == '\n')) &&
+				(memcmp(buf + q, m->delim, m->len - 1) == 0)) {
+			off_t pos = q - 1;
+			const off_t r = match_boundary(buf, len, &pos, m->boundary);
+
+			if (r)
+				return r;
+			/* like find_boundary(): continue behind the boundary string */
+			q = pos + 2;
+		} else {
+			q += m->shift[c];
+		}
+	}
+
+	return 0;
+}
+
 /**
  * find next mime boundary
  *
@@ -324,25 +419,262 @@ getfieldlen(const char *msg, const size_t len)
 off_t
 find_boundary(const char *buf, const off_t len, const cstring *boundary)
 {
-	off_t pos = 0;
+	struct boundary_matcher m;
 
 	if (len < (off_t) (boundary->len + 3))
 		return 0;
-	while (pos <= len - 3 - (off_t) boundary->len) {
-		if (((buf[pos] == '\r') || (buf[pos] == '\n')) && (buf[pos + 1] == '-') && (buf[pos + 2] == '-')) {
-			if (!strncmp(buf + pos + 3, boundary->s, boundary->len)) {
-				pos += 3 + boundary->len;
-				if ((pos == len) || WSPACE(buf[pos]))
-					return pos;
-				if (pos + 1 < len) {
-					if ((buf[pos] == '-') && (buf[pos + 1] == '-') &&
-							((pos + 2 == len) || (WSPACE(buf[pos + 2])))) {
-						return pos;
-					}
-				}
+
+	boundary_matcher_init(&m, boundary);
+
+	return boundary_matcher_find(&m, buf, len);
+}
+
+static int
+offsets_add(struct mime_offsets *list, const off_t o)
+{
+	if (list->count == list->size) {
+		const unsigned int nsize = list->size ? list->size * 2 : 64;
+		off_t *n = realloc(list->o, nsize * sizeof(*n));
+
+		if (n == NULL)
+			return -ENOMEM;
+		list->o = n;
+		list->size = nsize;
+	}
+
+	list->o[list->count++] = o;
+	return 0;
+}
+
+/**
+ * add a line to a list of line runs
+ *
+ * @param list the list, containing pairs of start and end offsets
+ * @param start start of the line
+ * @param end offset of the next line
+ * @return 0 on success or negative error code
+ */
+static int
+runs_add(struct mime_offsets *list, const off_t start, const off_t end)
+{
+	if ((list->count > 0) && (list->o[list->count - 1] == start)) {
+		list->o[list->count - 1] = end;
+		return 0;
+	}
+
+	if (offsets_add(list, start) != 0)
+		return -ENOMEM;
+	return offsets_add(list, end);
+}
+
+/**
+ * @brief find the first entry not below a given offset
+ * @param list the list to search
+ * @param o the offset to look for
+ * @return index of the first entry >= o, list->count if there is none
+ */
+static unsigned int __attribute__ ((pure))
+offsets_lower(const struct mime_offsets *list, const off_t o)
+{
+	unsigned int lo = 0;
+	unsigned int hi = list->count;
+
+	while (lo < hi) {
+		const unsigned int mid = lo + (hi - lo) / 2;
+
+		if (list->o[mid] < o)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+/**
+ * @brief check if any line run intersects the given range
+ * @param list the list of line runs
+ * @param start start of the range
+ * @param end end of the range
+ */
+static int __attribute__ ((pure))
+runs_hit(const struct mime_offsets *list, const off_t start, const off_t end)
+{
+	if (start >= end)
+		return 0;
+
+	/* find the first run ending behind start */
+	unsigned int i = offsets_lower(list, start + 1);
+	if (i == list->count)
+		return 0;
+	/* i points to an end: that run contains start, otherwise it is the start of the next run */
+	return (i % 2) ? 1 : (list->o[i] < end);
+}
+
+static inline int
+dashes_at(const char *buf, const off_t len, const off_t pos)
+{
+	return (pos + 2 < len) && (buf[pos + 1] == '-') && (buf[pos + 2] == '-');
+}
+
+/**
+ * @brief index a message
+ * @param idx the index to fill
+ * @param buf the message data
+ * @param len length of buf
+ * @return 0 on success or negative error code
+ *
+ * The message is scanned once, the positions needed to decide which parts
+ * need recoding and where the MIME boundaries are are recorded so they can
+ * later be looked up for any part of the message without scanning it again.
+ */
+int
+mime_index_build(struct mime_index *idx, const char *buf, const off_t len)
+{
+	off_t ls = 0;	/* start of the current line */
+
+	memset(idx, 0, sizeof(*idx));
+	idx->buf = buf;
+	idx->len = len;
+
+	while (ls < len) {
+		off_t pos = ls;
+		int eightbit = 0;
+		int longline;
+
+		while ((pos < len) && (buf[pos] != '\r') && (buf[pos] != '\n')) {
+			if (((signed char)buf[pos]) <= 0)
+				eightbit = 1;
+			pos++;
+		}
+
+		off_t next = pos;
+		int r = 0;
+
+		if (pos == len) {
+			/* need_recode() only counts characters before the last one here */
+			longline = (pos - ls > 999);
+		} else {
+			longline = (pos - ls > 998);
+			if (pos == ls)
+				r = offsets_add(&idx->empty, ls);
+			if ((r == 0) && dashes_at(buf, len, next))
+				r = offsets_add(&idx->dashes, next);
+			next++;
+			/* both CR and LF of a CRLF pair may start a boundary delimiter */
+			if ((buf[pos] == '\r') && (next < len) && (buf[next] == '\n')) {
+				if ((r == 0) && dashes_at(buf, len, next))
+					r = offsets_add(&idx->dashes, next);
+				next++;
 			}
 		}
-		pos++;
+
+		if ((r == 0) && eightbit)
+			r = runs_add(&idx->eightbit, ls, next);
+		if ((r == 0) && longline)
+			r = runs_add(&idx->longlines, ls, next);
+		if (r != 0) {
+			mime_index_free(idx);
+			return r;
+		}
+
+		ls = next;
 	}
+
+	return 0;
+}
+
+/**
+ * @brief free the memory used by an index
+ * @param idx the index
+ */
+void
+mime_index_free(struct mime_index *idx)
+{
+	free(idx->eightbit.o);
+	free(idx->longlines.o);
+	free(idx->empty.o);
+	free(idx->dashes.o);
+	memset(idx, 0, sizeof(*idx));
+}
+
+/**
+ * @brief check if a line starts at the given offset
+ */
+static int __attribute__ ((pure))
+line_start(const struct mime_index *idx, const off_t o)
+{
+	if ((o == 0) || (o == idx->len))
+		return 1;
+	if (idx->buf[o - 1] == '\n')
+		return 1;
+	return (idx->buf[o - 1] == '\r') && (idx->buf[o] != '\n');
+}
+
+/**
+ * @brief check if a part of the indexed message has to be recoded
+ * @param idx the index
+ * @param off offset of the part in the message
+ * @param len length of the part
+ * @return logical or of recode_reason flags, the same as need_recode() for that part
+ * @retval -EINVAL the part does not start and end at line boundaries
+ */
+int
+mime_index_recode(const struct mime_index *idx, const off_t off, const off_t len)
+{
+	const off_t end = off + len;
+	int res = 0;
+
+	if (!line_start(idx, off) || !line_start(idx, end))
+		return -EINVAL;
+
+	if (runs_hit(&idx->eightbit, off, end))
+		res |= recode_8bit;
+
+	/* the header ends at the first empty line */
+	const unsigned int e = offsets_lower(&idx->empty, off);
+	const off_t hend = ((e < idx->empty.count) && (idx->empty.o[e] < end)) ? idx->empty.o[e] : end;
+
+	if (runs_hit(&idx->longlines, off, hend))
+		res |= recode_long_header;
+	if (runs_hit(&idx->longlines, hend, end))
+		res |= recode_long_line;
+
+	return res;
+}
+
+/**
+ * @brief find next mime boundary in a part of the indexed message
+ * @param idx the index
+ * @param off offset of the part in the message
+ * @param len length of the part
+ * @param boundary boundary limit string
+ * @return offset of first character behind next boundary relative to off
+ * @retval 0 no boundary found
+ *
+ * This returns the same as find_boundary() for the given part.
+ */
+off_t
+mime_index_boundary(const struct mime_index *idx, const off_t off, const off_t len, const cstring *boundary)
+{
+	if (len < (off_t) (boundary->len + 3))
+		return 0;
+
+	const off_t last = len - 3 - (off_t) boundary->len;
+	off_t next = 0;		/* find_boundary() does not look at candidates inside a matching string */
+
+	for (unsigned int i = offsets_lower(&idx->dashes, off);
+			(i < idx->dashes.count) && (idx->dashes.o[i] - off <= last); i++) {
+		off_t pos = idx->dashes.o[i] - off;
+
+		if (pos < next)
+			continue;
+
+		off_t r = match_boundary(idx->buf + off, len, &pos, boundary);
+		if (r)
+			return r;
+		next = pos + 1;
+	}
+
 	return 0;
 }
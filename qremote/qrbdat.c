@@ -4,33 +4,296 @@
 #include <log.h>
 #include <netio.h>
 #include <qremote/client.h>
+#include <qremote/greeting.h>
 #include <qremote/qremote.h>
+#include <qremote/timing.h>
+#include <tls.h>
 
 #include <stdlib.h>
 #include <string.h>
 #include <syslog.h>
+#include <sys/uio.h>
+#include <time.h>
+
+#define BDAT_WINDOW 4		/**< chunks sent without waiting for replies if the server supports PIPELINING */
+#define BDAT_CHUNK_START 8192	/**< size of the first chunk if the server supports PIPELINING */
+#define BDAT_CHUNK_MIN 1024	/**< chunks never shrink below this size */
 
 size_t chunksize;	/**< the maximum allowed size for an outgoing send buffer in BDAT mode */
 
+static unsigned int pending;	/**< chunks that have been sent but not yet been replied to */
+static size_t cursize;		/**< size of the next chunk, including the BDAT command */
+
+/** @struct bdat_flight
+ * @brief a chunk that has been sent but not yet been replied to
+ */
+static struct bdat_flight {
+	long long sent;		/**< time the chunk was written, in microseconds */
+	size_t len;		/**< bytes sent for the chunk */
+} flight[BDAT_WINDOW];
+static unsigned int flight_first;	/**< index of the oldest chunk in flight */
+static long long minrtt;		/**< lowest round trip time seen in this transfer, in microseconds */
+
+/**
+ * @brief check if the message can be sent as it is
+ * @param buf the message data
+ * @param len length of buf
+ * @return if all line endings in the message are CRLF
+ */
+static int
+crlf_only(const char *buf, const off_t len)
+{
+	const char *end = buf + len;
+	const char *p = buf;
+
+	while ((p = memchr(p, '\n', end - p)) != NULL) {
+		if ((p == buf) || (*(p - 1) != '\r'))
+			return 0;
+		p++;
+	}
+
+	for (p = buf; (p = memchr(p, '\r', end - p)) != NULL; p++) {
+		if ((p == end - 1) || (*(p + 1) != '\n'))
+			return 0;
+	}
+
+	return 1;
+}
+
+static long long
+now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/**
+ * @brief adapt the chunk size to the measured bandwidth-delay product
+ * @param rtt time between writing the oldest chunk and receiving its reply
+ * @param wait time spent waiting for the reply
+ *
+ * The chunks in flight were written in rtt - wait, which gives the rate the
+ * link accepts data. Multiplied with the lowest round trip time seen this is
+ * the amount of data that must be in flight to keep the link busy. The chunk
+ * size is set so that the window of chunks covers it, so it grows on slow or
+ * distant links and shrinks again where the replies come in early.
+ */
+static void
+bdat_adapt(long long rtt, const long long wait)
+{
+	unsigned long long inflight = 0;
+
+	for (unsigned int i = 0; i < pending; i++)
+		inflight += flight[(flight_first + i) % BDAT_WINDOW].len;
+
+	if (rtt < 1)
+		rtt = 1;
+	if ((minrtt == 0) || (rtt < minrtt))
+		minrtt = rtt;
+
+	const long long busy = (rtt - wait < 1) ? 1 : rtt - wait;
+	const unsigned long long bdp = inflight * minrtt / busy;
+	const size_t lower = (chunksize < BDAT_CHUNK_MIN) ? chunksize : BDAT_CHUNK_MIN;
+
+	if (bdp / BDAT_WINDOW >= chunksize)
+		cursize = chunksize;
+	else if (bdp / BDAT_WINDOW <= lower)
+		cursize = lower;
+	else
+		cursize = bdp / BDAT_WINDOW;
+}
+
+/**
+ * @brief collect the reply to the oldest chunk still in flight
+ * @param chunkbuf the chunk buffer, freed on error
+ *
+ * If the server supports PIPELINING the round trip time of the chunk is used
+ * to adapt the size of the following chunks.
+ */
+static void
+bdat_reply(char *chunkbuf)
+{
+	const long long start = now_us();
+
+#ifdef DEBUG_IO
+	in_data = 0;
+#endif
+	if (checkreply(" ZD", NULL, 0) != 250) {
+		free(chunkbuf);
+		net_conn_shutdown(shutdown_clean);
+	}
+#ifdef DEBUG_IO
+	in_data = 1;
+#endif
+
+	if (smtpext & esmtp_pipelining) {
+		const long long end = now_us();
+
+		bdat_adapt(end - flight[flight_first].sent, end - start);
+	}
+
+	flight_first = (flight_first + 1) % BDAT_WINDOW;
+	pending--;
+}
+
+/**
+ * @brief remember a chunk that was sent and collect replies that already arrived
+ * @param chunkbuf the chunk buffer, freed on error
+ * @param len bytes sent for the chunk
+ * @param window maximum number of chunks in flight
+ *
+ * Reading the replies as soon as they are there gives round trip times that
+ * are not distorted by the time needed to send the rest of the window.
+ */
+static void
+bdat_sent(char *chunkbuf, const size_t len, const unsigned int window)
+{
+	struct bdat_flight *f = flight + (flight_first + pending) % BDAT_WINDOW;
+
+	f->sent = now_us();
+	f->len = len;
+
+	if (++pending == window) {
+		bdat_reply(chunkbuf);
+		return;
+	}
+
+	while ((pending > 0) && (data_pending(ssl) > 0))
+		bdat_reply(chunkbuf);
+}
+
+/**
+ * @brief write the BDAT command for a chunk
+ * @param buf the command is written to the end of this buffer
+ * @param lenlen length of buf
+ * @param len length of the chunk data
+ * @param last if this is the last chunk
+ * @return offset of the command in buf
+ */
+static size_t
+bdat_header(char *buf, const size_t lenlen, const size_t len, const int last)
+{
+	size_t i = 7;	/* "BDAT " + CRLF */
+	size_t hl = len;
+
+	/* just to be sure: len == 0 */
+	if (!hl) {
+		i++;
+	} else {
+		while (hl) {
+			i++;
+			hl /= 10;
+		}
+	}
+
+	if (last) {
+		/* " LAST" */
+		i += 5;
+	}
+	hl = lenlen - i;
+	memcpy(buf + hl, "BDAT ", 5);
+	ultostr(len, buf + hl + 5);
+	if (last) {
+		memcpy(buf + lenlen - 7, " LAST\r\n", 7);
+	} else {
+		buf[lenlen - 2] = '\r';
+		buf[lenlen - 1] = '\n';
+	}
+
+	return hl;
+}
+
+/**
+ * @brief fill the chunk buffer from the message, fixing line endings
+ * @param chunkbuf the buffer
+ * @param lenlen space reserved for the BDAT command at the start of chunkbuf
+ * @param off offset in the message, is updated to the first byte not sent
+ * @param bare_cr_warning if the warning about a bare CR has already been logged
+ * @return length of the used space in chunkbuf, including lenlen
+ */
+static size_t
+fill_chunk(char *chunkbuf, const size_t lenlen, off_t *off, int *bare_cr_warning)
+{
+	size_t len = lenlen;	/* currently used space in chunkbuf */
+	size_t cpoff = *off;	/* offset the current line starts at */
+	size_t linel = 0;	/* length of the currently parsed line */
+
+	while ((*off < msgsize) && (len + linel < cursize - 1)) {
+		if (msgdata[*off] == '\n') {
+			if (!linel) {
+				/* two linebreaks after each other. We
+				 * need to insert CR here. We assume
+				 * that normally there are not much
+				 * empty lines after each other so the
+				 * LF will be copied when the
+				 * complete line is sent. */
+				chunkbuf[len++] = '\r';
+				linel++;
+			} else if (linel && msgdata[*off - 1] != '\r') {
+				memcpy(chunkbuf + len, msgdata + cpoff, linel);
+				len += linel++;
+				chunkbuf[len++] = '\r';
+				chunkbuf[len++] = '\n';
+				cpoff += linel;
+				linel = 0;
+			} else {
+				linel++;
+			}
+		} else {
+			linel++;
+		}
+		(*off)++;
+	}
+	/* this buffer is full. Put header in front, flush it out and start again */
+	if (linel) {
+		/* first copy remaining part of input buffer to output buffer */
+		memcpy(chunkbuf + len, msgdata + cpoff, linel);
+		len += linel;
+		/* optimize: never send a CR at end of chunk. This is inefficient as
+		 * hell for both RX and TX. We always send LF behind it so we don't
+		 * have to remember the state of the CRLF encoding between chunks. */
+		if (msgdata[*off - 1] == '\r') {
+			/* CR means LF will follow. If the LF is not in input
+			 * stream we will insert one. Garbage in, Garbage out.
+			 * This is 8BITMIME and not BINARYMIME. */
+			chunkbuf[len++] = '\n';
+			if ((*off < msgsize - 1) && (msgdata[*off] == '\n')) {
+				(*off)++;
+			} else if (*bare_cr_warning == 0) {
+				log_write(LOG_WARNING, "found bare CR in message\n");
+				*bare_cr_warning = 1;
+			}
+		}
+	}
+
+	return len;
+}
+
 /**
  * send the message data as binary chunk
  *
  * @param recodeflag the result of need_recode() for the input data
+ *
+ * If the message already has CRLF line endings the chunks are sent directly
+ * from the mapped message, otherwise they are copied to a buffer while the
+ * line endings are fixed. If the server supports PIPELINING up to BDAT_WINDOW
+ * chunks are sent before the replies are read, and the chunks are sized to
+ * the measured bandwidth-delay product of the connection. Otherwise every
+ * chunk has the configured maximum size, as each one waits for its reply.
+ *
+ * The message is never recoded here, so this must only be used if
+ * body_chunked() is true for it.
  */
 void
 send_bdat(unsigned int recodeflag)
 {
+	const int direct = crlf_only(msgdata, msgsize);
 	int bare_cr_warning = 0;
+	char *chunkbuf;
 
-	char *chunkbuf = malloc(chunksize);
-
-	if (chunkbuf == NULL) {
-		log_write(LOG_WARNING, "cannot allocate buffer for chunked transfer, fallback to normal transfer\n");
-		send_data(recodeflag);
-		return;
-	}
-
-	successmsg[2] = "chunked ";
 	/* calculate length needed to send out the "BDAT <len>" stuff */
 	size_t lenlen = 0;			/* "reserved" length for "BDAT <len> (LAST)?" */
 	size_t i = chunksize;
@@ -40,106 +303,66 @@ send_bdat(unsigned int recodeflag)
 	}
 	lenlen += 12; /* "BDAT " + " LAST" + CRLF */
 
+	chunkbuf = malloc(direct ? lenlen : chunksize);
+	if (chunkbuf == NULL) {
+		/* a BINARYMIME body must not be sent with DATA, every other message
+		 * passed here needs no recoding and is sent unmodified by DATA, too */
+		if (body_binarymime(recodeflag))
+			err_mem(1);
+		log_write(LOG_WARNING, "cannot allocate buffer for chunked transfer, fallback to normal transfer\n");
+		send_data(recodeflag);
+		return;
+	}
+
+	successmsg[2] = "chunked ";
+	const unsigned int window = (smtpext & esmtp_pipelining) ? BDAT_WINDOW : 1;
+	cursize = ((window > 1) && (chunksize > BDAT_CHUNK_START)) ? BDAT_CHUNK_START : chunksize;
+	pending = 0;
+	flight_first = 0;
+	minrtt = 0;
+
 #ifdef DEBUG_IO
 	in_data = 1;
 #endif
 	for (off_t off = 0; off < msgsize; ) {
-		size_t len = lenlen;	/* currently used space in chunkbuf */
-		size_t cpoff = off;	/* offset the current line starts at */
-		size_t linel = 0;	/* length of the currently parsed line */
-		unsigned long hl;	/* length of header */
-
-		while ((off < msgsize) && (len + linel < chunksize - 1)) {
-			if (msgdata[off] == '\n') {
-				if (!linel) {
-					/* two linebreaks after each other. We
-					 * need to insert CR here. We assume
-					 * that normally there are not much
-					 * empty lines after each other so the
-					 * LF will be copied when the
-					 * complete line is sent. */
-					chunkbuf[len++] = '\r';
-					linel++;
-				} else if (linel && msgdata[off - 1] != '\r') {
-					memcpy(chunkbuf + len, msgdata + cpoff, linel);
-					len += linel++;
-					chunkbuf[len++] = '\r';
-					chunkbuf[len++] = '\n';
-					cpoff += linel;
-					linel = 0;
-				} else {
-					linel++;
-				}
-			} else {
-				linel++;
-			}
-			off++;
-		}
-		/* this buffer is full. Put header in front, flush it out and start again */
-		if (linel) {
-			/* first copy remaining part of input buffer to output buffer */
-			memcpy(chunkbuf + len, msgdata + cpoff, linel);
-			len += linel;
-			/* optimize: never send a CR at end of chunk. This is inefficient as
-			 * hell for both RX and TX. We always send LF behind it so we don't
-			 * have to remember the state of the CRLF encoding between chunks. */
-			if (msgdata[off - 1] == '\r') {
-				/* CR means LF will follow. If the LF is not in input
-				 * stream we will insert one. Garbage in, Garbage out.
-				 * This is 8BITMIME and not BINARYMIME. */
-				chunkbuf[len++] = '\n';
-				if ((off < msgsize - 1) && (msgdata[off] == '\n')) {
-					off++;
-				} else if (bare_cr_warning == 0) {
-					log_write(LOG_WARNING, "found bare CR in message\n");
-					bare_cr_warning = 1;
-				}
-			}
-		}
+		size_t sent;
 
-		/* write header */
-		i = 7;	/* "BDAT " + CRLF */
-		hl = len - lenlen;
-		/* just to be sure: len == 0 */
-		if (!hl) {
-			i++;
-		} else {
-			while (hl) {
-				i++;
-				hl /= 10;
-			}
-		}
+		if (direct) {
+			size_t len = (cursize > lenlen + 2) ? cursize - lenlen - 1 : 1;
 
-		if (off == msgsize) {
-			/* " LAST" */
-			i += 5;
-		}
-		hl = lenlen - i;
-		memcpy(chunkbuf + hl, "BDAT ", 5);
-		ultostr(len - lenlen, chunkbuf + hl + 5);
-		if (off == msgsize) {
-			memcpy(chunkbuf + lenlen - 7, " LAST\r\n", 7);
+			if ((off_t)len > msgsize - off)
+				len = msgsize - off;
+			/* keep CRLF together, like the copied chunks do */
+			else if ((msgdata[off + len - 1] == '\r') && (off + (off_t)len < msgsize))
+				len++;
+
+			const size_t hl = bdat_header(chunkbuf, lenlen, len, off + (off_t)len == msgsize);
+			const struct iovec iov[] = {
+				{ .iov_base = chunkbuf + hl, .iov_len = lenlen - hl },
+				{ .iov_base = (char *)msgdata + off, .iov_len = len }
+			};
+
+			off += len;
+			netnwritev(iov, 2);
+			sent = lenlen - hl + len;
 		} else {
-			chunkbuf[lenlen - 2] = '\r';
-			chunkbuf[lenlen - 1] = '\n';
-		}
-		netnwrite(chunkbuf + hl, len - hl);
-		if (off != msgsize) {
-#ifdef DEBUG_IO
-			in_data = 0;
-#endif
-			if (checkreply(" ZD", NULL, 0) != 250) {
-				free(chunkbuf);
-				net_conn_shutdown(shutdown_clean);
-			}
-#ifdef DEBUG_IO
-			in_data = 1;
-#endif
+			const size_t len = fill_chunk(chunkbuf, lenlen, &off, &bare_cr_warning);
+			const size_t hl = bdat_header(chunkbuf, lenlen, len - lenlen, off == msgsize);
+
+			netnwrite(chunkbuf + hl, len - hl);
+			sent = len - hl;
 		}
+
+		if (off != msgsize)
+			bdat_sent(chunkbuf, sent, window);
 	}
+
+	while (pending > 0)
+		bdat_reply(chunkbuf);
 #ifdef DEBUG_IO
 	in_data = 0;
 #endif
 	free(chunkbuf);
+	timing_reply();
 	checkreply("KZD", successmsg, 1);
 }
@@ -15,6 +15,7 @@
 #include <qremote/greeting.h>
 #include <qremote/mime.h>
 #include <qremote/qremote.h>
+#include <qremote/timing.h>
 #include <version.h>
 
 #include <assert.h>
@@ -27,10 +28,11 @@
 #include <syslog.h>
 #include <unistd.h>
 
-const char *successmsg[] = {NULL, " accepted ", NULL, "message", "", "", "./Remote host said: ", NULL};
+const char *successmsg[] = {NULL, " accepted ", NULL, "message", "", "", "", "./Remote host said: ", NULL};
 const char *msgdata = MAP_FAILED;		/* message will be mmaped here */
 off_t msgsize;		/* size of the mmaped area */
 static int lastlf = 1;		/* set if last byte sent was a LF */
+static const struct mime_index *mindex;	/* index of msgdata while it is recoded */
 
 /**
  * check if buffer has to be recoded for SMTP transfer
@@ -74,6 +76,49 @@ need_recode(const char *buf, off_t len)
 	return res;
 }
 
+/**
+ * check if a part of the message has to be recoded
+ *
+ * @param buf start of the part
+ * @param len length of the part
+ * @return logical or of recode_reason flags
+ *
+ * This uses the index of the message if present, otherwise the part is scanned.
+ */
+static unsigned int
+part_recode(const char *buf, const off_t len)
+{
+	if (mindex != NULL) {
+		const int r = mime_index_recode(mindex, buf - mindex->buf, len);
+
+		if (r >= 0)
+			return r;
+	}
+
+	return need_recode(buf, len);
+}
+
+/**
+ * find next mime boundary in a part of the message
+ *
+ * @param buf start of the part
+ * @param len length of the part
+ * @param m the matcher of the boundary
+ * @return offset of first character behind next boundary
+ * @retval 0 no boundary found
+ */
+static off_t
+part_boundary(const char *buf, const off_t len, const struct boundary_matcher *m)
+{
+	if (mindex != NULL)
+		return mime_index_boundary(mindex, buf - mindex->buf, len, m->boundary);
+
+	if (len < (off_t) (m->boundary->len + 3))
+		return 0;
+
+	return boundary_matcher_find(m, buf, len);
+}
+
 /**
  * send message body, only fix broken line endings if present
  *
@@ -272,7 +317,7 @@ wrap_header(const char *buf, const off_t len)
 	off_t off = 0;	/* start of current line relative to pos */
 	off_t ll = 0;	/* length of current line */
 
-	if (!(need_recode(buf, len) & recode_long_header)) {
+	if (!(part_recode(buf, len) & recode_long_header)) {
 		send_plain(buf, len);
 		return;
 	}
@@ -386,7 +431,7 @@ qp_header(const char *buf, const off_t len, cstring *boundary, int *multipart, c
 		header = len;
 	}
 
-	if (need_recode(buf, header) & recode_8bit) {
+	if (part_recode(buf, header) & recode_8bit) {
 		/* no empty line found: treat whole message as header. But this means we have
 		 * 8bit characters in header which is a bug in the client that we can't handle */
 		write_status("D5.6.3 message contains unencoded 8bit data in message header");
@@ -420,152 +465,163 @@ qp_header(const char *buf, const off_t len, cstring *boundary, int *multipart, c
 	return header;
 }
 
+/** @brief classes of input characters for quoted-printable recoding */
+enum qp_class {
+	qp_plain = 0,	/**< printable character that is copied */
+	qp_space,	/**< space or tab, recoded at end of line */
+	qp_cr,		/**< carriage return */
+	qp_lf,		/**< line feed */
+	qp_encode	/**< character that is always recoded */
+};
+
+static const unsigned char qp_classes[256] = {
+	[0 ... 8] = qp_encode,
+	['\t'] = qp_space,
+	['\n'] = qp_lf,
+	[11 ... 12] = qp_encode,
+	['\r'] = qp_cr,
+	[14 ... 31] = qp_encode,
+	[' '] = qp_space,
+	[33 ... 60] = qp_plain,
+	['='] = qp_encode,
+	[62 ... 126] = qp_plain,
+	[127 ... 255] = qp_encode
+};
+
+#define QP_BUFSIZE 16384	/**< recoded data is sent in blocks of this size, the payload of a TLS record */
+#define QP_MAXSTEP 96		/**< maximum output of one step of recode_qp() */
+
 /**
  * recode buffer to quoted-printable and send it to remote host
  *
  * @param buf data to send
  * @param len length of buffer
+ *
+ * The characters are classified by table lookup, runs of characters that
+ * are copied unchanged are copied as a whole, up to the point where a soft
+ * line break is needed.
  */
 static void
 recode_qp(const char *buf, const off_t len)
 {
-	unsigned int idx = 0;
-	char sendbuf[1280];
+	static const char hexchars[] = "0123456789ABCDEF";
+	char sendbuf[QP_BUFSIZE];
+	size_t idx = 0;
 	int llen = 0;		/* length of this line, needed for qp line break */
+	off_t off = 0;
 
 	assert(len >= 0);
 
 	if (len <= 0)
 		return;
 
-	for (off_t off = 0; off < len; ) {
-		size_t chunk = 0;	/* size of the chunk to copy into sendbuf */
-		if (idx > 0) {
-			/* flush out everything already in the buffer */
-			netnwrite(sendbuf, idx);
-			lastlf = (sendbuf[idx - 1] == '\n');
-			idx = 0;
+	while (off < len) {
+		if (idx > sizeof(sendbuf) - QP_MAXSTEP) {
+			/* keep the last character, it is recoded if a soft line break follows */
+			netnwrite(sendbuf, idx - 1);
+			sendbuf[0] = sendbuf[idx - 1];
+			idx = 1;
+		}
+
+		switch (qp_classes[(unsigned char)buf[off]]) {
+		case qp_cr:
+			/* CR with or without following LF */
+			if (buf[++off] == '\n')
+				off++;
+			sendbuf[idx++] = '\r';
+			sendbuf[idx++] = '\n';
+			llen = 0;
+			continue;
+		case qp_lf:
+			/* LF without preceding CR */
+			off++;
+			sendbuf[idx++] = '\r';
+			sendbuf[idx++] = '\n';
+			llen = 0;
+			continue;
+		default:
+			break;
 		}
 
-		while ((idx + chunk < sizeof(sendbuf) - 11) && (off + (off_t) chunk < len)) {
-			if (buf[off + chunk] == '\r') {
-				chunk++;
-				llen = 0;
-				if (buf[off + chunk] == '\n') {
-					/* valid CRLF pair, chunk can accumulate further */
-					chunk++;
+		/* add soft line break to make sure encoded line length < 80 */
+		if (llen > 72) {
+			/* recode last character if it was whitespace */
+			if ((idx > 0) && ((sendbuf[idx - 1] == '\t') || (sendbuf[idx - 1] == ' '))) {
+				/* if the next character does not need recoding add
+				 * it to this line if this line would end in a whitespace
+				 * otherwise. " x" is shorter than "=20". */
+				if ((off < len) &&
+						((buf[off] > 32) && (buf[off] < 127) &&
+						(buf[off] != '='))) {
+					sendbuf[idx++] = buf[off++];
+				} else if (sendbuf[idx - 1] == '\t') {
+					sendbuf[idx - 1] = '=';
+					sendbuf[idx++] = '0';
+					sendbuf[idx++] = '9';
 				} else {
-					/* CR without following LF, copy chunk, insert LF,
-					 * start next chunk */
-					memcpy(sendbuf + idx, buf + off, chunk);
-					off += chunk;
-					idx += chunk;
-					sendbuf[idx++] = '\n';
-					chunk = 0;
+					sendbuf[idx - 1] = '=';
+					sendbuf[idx++] = '2';
+					sendbuf[idx++] = '0';
 				}
-				continue;
-			} else if (buf[off + chunk] == '\n') {
-				/* LF without preceding CR, copy chunk without LF, insert
-				 * CRLF, skip LF in input, start next chunk */
-				memcpy(sendbuf + idx, buf + off, chunk);
-				off += chunk + 1;
-				idx += chunk;
-				chunk = 0;
-				sendbuf[idx++] = '\r';
-				sendbuf[idx++] = '\n';
-				llen = 0;
-				continue;
 			}
+			sendbuf[idx++] = '=';
+			sendbuf[idx++] = '\r';
+			sendbuf[idx++] = '\n';
+			llen = 0;
+		}
 
-			/* add soft line break to make sure encoded line length < 80 */
-			if (llen > 72) {
-				memcpy(sendbuf + idx, buf + off, chunk);
-				off += chunk;
-				idx += chunk;
-				chunk = 0;
-				/* recode last character if it was whitespace */
-				if ((idx > 0) && ((sendbuf[idx - 1] == '\t') || (sendbuf[idx - 1] == ' '))) {
-					/* if the next character does not need recoding add
-					 * it to this line if this line would end in a whitespace
-					 * otherwise. " x" is shorter than "=20". */
-					if ((off < len) &&
-							((buf[off] > 32) && (buf[off] < 127) &&
-							(buf[off] != '='))) {
-						sendbuf[idx++] = buf[off++];
-					} else if (sendbuf[idx - 1] == '\t') {
-						sendbuf[idx - 1] = '=';
-						sendbuf[idx++] = '0';
-						sendbuf[idx++] = '9';
-					} else {
-						assert(sendbuf[idx - 1] == ' ');
-						sendbuf[idx - 1] = '=';
-						sendbuf[idx++] = '2';
-						sendbuf[idx++] = '0';
-					}
-				}
+		if (!llen && (buf[off] == '.')) {
+			sendbuf[idx++] = '.';
+			sendbuf[idx++] = '.';
+			off++;
+			continue;
+		}
+
+		switch (qp_classes[(unsigned char)buf[off]]) {
+		case qp_plain:
+			{
+				/* copy all following characters that fit into this line */
+				const off_t run = (len - off < 73 - llen) ? len - off : 73 - llen;
+				off_t n = 1;
+
+				while ((n < run) && (qp_classes[(unsigned char)buf[off + n]] == qp_plain))
+					n++;
+				memcpy(sendbuf + idx, buf + off, n);
+				idx += n;
+				off += n;
+				llen += n;
+			}
+			break;
+		case qp_space:
+			/* recode whitespace if a linebreak follows */
+			if ((off < len) && ((buf[off + 1] == '\r') || (buf[off + 1] == '\n'))) {
 				sendbuf[idx++] = '=';
+				if (buf[off] == '\t') {
+					sendbuf[idx++] = '0';
+					sendbuf[idx++] = '9';
+				} else {
+					sendbuf[idx++] = '2';
+					sendbuf[idx++] = '0';
+				}
 				sendbuf[idx++] = '\r';
 				sendbuf[idx++] = '\n';
+				if (buf[++off] == '\r')
+					off++;
+				if ((off < len) && (buf[off] == '\n'))
+					off++;
 				llen = 0;
-			}
-
-			if (!llen && (buf[off + chunk] == '.')) {
-				chunk++;
-				memcpy(sendbuf + idx, buf + off, chunk);
-				off += chunk;
-				idx += chunk;
-				sendbuf[idx++] = '.';
-				chunk = 0;
-			} else if ((buf[off + chunk] == '\t') || (buf[off + chunk] == ' ')) {
-				/* recode whitespace if a linebreak follows */
-				if ((off + (off_t) chunk < len) &&
-						((buf[off + chunk + 1] == '\r') || (buf[off + chunk + 1] == '\n'))) {
-					memcpy(sendbuf + idx, buf + off, chunk);
-					off += chunk;
-					idx += chunk;
-					sendbuf[idx++] = '=';
-					if (buf[off] == '\t') {
-						sendbuf[idx++] = '0';
-						sendbuf[idx++] = '9';
-					} else {
-						sendbuf[idx++] = '2';
-						sendbuf[idx++] = '0';
-					}
-					sendbuf[idx++] = '\r';
-					sendbuf[idx++] = '\n';
-					if (buf[++off] == '\r')
-						off++;
-					if ((off < len) && (buf[off] == '\n'))
-						off++;
-					llen = 0;
-					chunk = 0;
-				} else {
-					chunk++;
-					llen++;
-				}
-			} else if ((buf[off + chunk] < 32) || (buf[off + chunk] == '=') ||
-							 (buf[off + chunk] > 126)) {
-				const char hexchars[] = "0123456789ABCDEF";
-
-				/* recode non-printable and non-ascii characters */
-				memcpy(sendbuf + idx, buf + off, chunk);
-				off += chunk;
-				idx += chunk;
-				chunk = 0;
-				sendbuf[idx++] = '=';
-				sendbuf[idx++] = hexchars[(buf[off] >> 4) & 0x0f];
-				sendbuf[idx++] = hexchars[buf[off] & 0xf];
-				llen +=3;
-				off++;
 			} else {
+				sendbuf[idx++] = buf[off++];
 				llen++;
-				chunk++;
 			}
-		}
-		if (chunk) {
-			memcpy(sendbuf + idx, buf + off, chunk);
-			off += chunk;
-			idx += chunk;
+			break;
+		default:
+			/* recode non-printable and non-ascii characters */
+			sendbuf[idx++] = '=';
+			sendbuf[idx++] = hexchars[(buf[off] >> 4) & 0x0f];
+			sendbuf[idx++] = hexchars[buf[off] & 0xf];
+			llen += 3;
+			off++;
 		}
 	}
 	lastlf = (sendbuf[idx - 1] == '\n');
@@ -605,7 +661,7 @@ send_qp(const char *buf, const off_t len)
 	cstring boundary;
 	int multipart;		/* set to one if this is a multipart message */
 
-	unsigned int recodeflag = need_recode(buf, len);
+	unsigned int recodeflag = part_recode(buf, len);
 
 	off_t off = qp_header(buf, len, &boundary, &multipart, (recodeflag & recode_qp_body));
 
@@ -615,7 +671,11 @@ send_qp(const char *buf, const off_t len)
 		else
 			send_plain(buf + off, len - off);
 	} else {
-		off_t nextoff = find_boundary(buf + off, len - off, &boundary);
+		struct boundary_matcher bm;
+
+		boundary_matcher_init(&bm, &boundary);
+
+		off_t nextoff = part_boundary(buf + off, len - off, &bm);
 		int islast = 0;	/* set to one if MIME end boundary was found */
 		const int nr_match = (smtpext & esmtp_8bitmime) ? 0x6 : 0x7; /* when recode is needed */
 
@@ -639,7 +699,7 @@ send_qp(const char *buf, const off_t len)
 		}
 
 		/* check and send or discard MIME preamble */
-		if (need_recode(buf + off, nextoff)) {
+		if (part_recode(buf + off, nextoff)) {
 			log_write(LOG_ERR, "discarding invalid MIME preamble");
 			netwrite("\r\ninvalid MIME preamble was dicarded.\r\n\r\n--");
 			netnwrite(boundary.s, boundary.len);
@@ -663,9 +723,9 @@ send_qp(const char *buf, const off_t len)
 		off += skip_tpad(buf + off, len - off);
 		netwrite("\r\n");
 
-		while ((off < len) && !islast && (nextoff = find_boundary(buf + off, len - off, &boundary))) {
+		while ((off < len) && !islast && (nextoff = part_boundary(buf + off, len - off, &bm))) {
 			off_t partlen = nextoff - boundary.len - 2;
-			int nr = need_recode(buf + off, partlen);
+			int nr = part_recode(buf + off, partlen);
 
 			if (nr & nr_match)
 				send_qp(buf + off, partlen);
@@ -699,7 +759,7 @@ send_qp(const char *buf, const off_t len)
 			netwrite("\r\n--");
 			netnwrite(boundary.s, boundary.len);
 			netwrite("--\r\n");
-		} else if (need_recode(buf + off, len - off)) {
+		} else if (part_recode(buf + off, len - off)) {
 			/* All normal MIME parts are processed now, what follow is the epilogue.
 			 * Check if it needs recode. If it does, it is broken and can simply be
 			 * discarded */
@@ -735,8 +795,17 @@ send_data(unsigned int recodeflag)
 
 	if ((!(smtpext & esmtp_8bitmime) && (recodeflag & recode_8bit)) ||
 			(recodeflag & recode_long)) {
+		struct mime_index idx;
+
 		successmsg[2] = "(qp recoded) ";
+		/* without the index every MIME level scans its parts again */
+		if (mime_index_build(&idx, msgdata, msgsize) == 0)
+			mindex = &idx;
 		send_qp(msgdata, msgsize);
+		if (mindex != NULL) {
+			mime_index_free(&idx);
+			mindex = NULL;
+		}
 	} else {
 		send_plain(msgdata, msgsize);
 	}
@@ -749,5 +818,6 @@ send_data(unsigned int recodeflag)
 #ifdef DEBUG_IO
 	in_data = 0;
 #endif
+	timing_reply();
 	checkreply("KZD", successmsg, 1);
 }
@@ -8,20 +8,20 @@
 #include <qremote/qremote.h>
 
 #include <control.h>
-#include <ipme.h>
 #include <log.h>
 #include <netio.h>
-#include <qdns.h>
 #include <qmaildir.h>
-#include <qremote/conn.h>
+#include <qremote/daemon.h>
 #include <qremote/greeting.h>
 #include <qremote/qrdata.h>
-#include <qremote/starttlsr.h>
+#include <qremote/routecache.h>
+#include <qremote/timing.h>
 #include <sstring.h>
 #include <tls.h>
 
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <netinet/in.h>
 #include <signal.h>
 #include <stdio.h>
@@ -69,25 +69,40 @@ quitmsg(void)
 	free_smtproute_vals();
 }
 
+/**
+ * @brief close the connection to the remote server without sending QUIT
+ */
 void
-net_conn_shutdown(const enum conn_shutdown_type sd_type)
+conn_abort(void)
 {
-	if ((sd_type == shutdown_clean) && (socketd >= 0)) {
-		quitmsg();
-	} else if (socketd >= 0) {
-		close(socketd);
-		socketd = -1;
+	if (socketd < 0)
+		return;
 
-		if (ssl != NULL) {
-			ssl_free(ssl);
-			ssl = NULL;
-		}
+	close(socketd);
+	socketd = -1;
 
-		free(partner_fqdn);
-		free(rhost);
-		free_smtproute_vals();
+	if (ssl != NULL) {
+		ssl_free(ssl);
+		ssl = NULL;
 	}
 
+	free(partner_fqdn);
+	partner_fqdn = NULL;
+	free(rhost);
+	rhost = NULL;
+	free_smtproute_vals();
+}
+
+void
+net_conn_shutdown(const enum conn_shutdown_type sd_type)
+{
+	log_timing();
+
+	if ((sd_type == shutdown_clean) && (socketd >= 0))
+		quitmsg();
+	else
+		conn_abort();
+
 #ifdef USESYSLOG
 	closelog();
 #endif
@@ -165,23 +180,53 @@ setup(void)
 	}
 #endif
 
+	if (loadintfd(openat(controldir_fd, "routecachetime", O_RDONLY | O_CLOEXEC), &routecache_ttl, 300) < 0)
+		err_conf("parse error in control/routecachetime");
+
+	if (loadintfd(openat(controldir_fd, "timingremote", O_RDONLY | O_CLOEXEC), &timing_mode, 0) < 0)
+		err_conf("parse error in control/timingremote");
+
 #ifdef DEBUG_IO
 	do_debug_io = (faccessat(controldir_fd, "Qremote_debug", R_OK, 0) == 0);
 #endif
 }
 
+/**
+ * @brief run the delivery daemon
+ *
+ * The daemon is only started if control/qremotesocket exists.
+ */
+static void __attribute__ ((noreturn))
+start_daemon(void)
+{
+	char *sockpath;
+
+	if (((ssize_t)loadoneliner(controldir_fd, DAEMON_SOCKET_FILE, &sockpath, 0)) < 0)
+		err_conf("can't read control/" DAEMON_SOCKET_FILE);
+
+	if (loadintfd(openat(controldir_fd, "timeoutremoteidle", O_RDONLY | O_CLOEXEC), &timeoutidle, 30) < 0)
+		err_conf("parse error in control/timeoutremoteidle");
+	if (timeoutidle > INT_MAX / 1000)
+		err_conf("timeout in control/timeoutremoteidle too big");
+
+	daemon_run(sockpath);
+}
+
 int
 main(int argc, char *argv[])
 {
-	struct ips *mx = NULL;
 	int rcptcount = argc - 3;
 	struct stat st;
+	char *sockpath;
 
 	/* do this check before opening any files to catch the case that fd 0 is closed at this point */
 	int i = fstat(0, &st);
 
 	setup();
 
+	if ((argc == 2) && (strcmp(argv[1], "-d") == 0))
+		start_daemon();
+
 	if (rcptcount <= 0) {
 		log_write(LOG_CRIT, "too few arguments");
 		write_status("Z4.3.0 internal error: Qremote called with invalid arguments");
@@ -196,59 +241,15 @@ main(int argc, char *argv[])
 		write_status("Z4.3.0 internal error: can't fstat() input");
 		net_conn_shutdown(shutdown_abort);
 	}
-	msgsize = st.st_size;
-	msgdata = mmap(NULL, msgsize, PROT_READ, MAP_SHARED, 0, 0);
-
-	if (msgdata == MAP_FAILED) {
-		log_write(LOG_CRIT, "can't mmap() input");
-		write_status("Z4.3.0 internal error: can't mmap() input");
-		net_conn_shutdown(shutdown_abort);
-	}
 
-	getmxlist(argv[1], &mx);
-	if (targetport == 25) {
-		mx = filter_my_ips(mx);
-		if (mx == NULL) {
-			const char *msg[] = { "Z4.4.3 all mail exchangers for ",
-					argv[1], " point back to me" };
-			write_status_m(msg, 3);
+	/* if a daemon is running it may already have a session to the host */
+	if (((ssize_t)loadoneliner(controldir_fd, DAEMON_SOCKET_FILE, &sockpath, 1)) >= 0) {
+		i = daemon_delegate(sockpath, argc, argv);
+		free(sockpath);
+		if (i == 0)
 			net_conn_shutdown(shutdown_abort);
-		}
 	}
-	sortmx(&mx);
-
-	i = connect_mx(mx, &outgoingip, &outgoingip6);
-	freeips(mx);
 
-	if (i < 0) {
-		write_status("Z4.4.2 can't connect to any server");
-		net_conn_shutdown(shutdown_abort);
-	}
-
-	if (ssl) {
-		successmsg[3] = "message ";
-		successmsg[4] = SSL_get_cipher(ssl);
-		if (SSL_get0_dane_tlsa(ssl, NULL, NULL, NULL, NULL, NULL) > 0)
-			successmsg[5] = " encrypted and DANE secured";
-		else
-			successmsg[5] = " encrypted";
-	}
-
-/* check if message is plain ASCII or not */
-	const unsigned int recodeflag = need_recode(msgdata, msgsize);
-
-	if (send_envelope(recodeflag, argv[2], argc - 3, argv + 3) != 0)
-		net_conn_shutdown(shutdown_clean);
-
-	successmsg[0] = rhost;
-#ifdef CHUNKING
-	if (smtpext & esmtp_chunking) {
-		send_bdat(recodeflag);
-	} else {
-#else
-	{
-#endif
-		send_data(recodeflag);
-	}
+	deliver(0, st.st_size, argc, argv);
 	net_conn_shutdown(shutdown_clean);
 }
@@ -0,0 +1,234 @@
+/** \file routecache.c
+ \brief cache of the mail exchangers of target hosts shared by all Qremote processes
+
+ Every delivery is done by a new Qremote process, which has to look up the MX
+ records and addresses of the target, remove the local addresses and sort
+ the result again. The final list is stored in the file named in the
+ environment variable ROUTECACHE for routecache_ttl seconds, so a burst of
+ messages to the same domain only resolves it once. A route is never kept
+ longer than the lowest TTL of the DNS records it was built from.
+
+ Only routes found in DNS are cached, static routes are always read from the
+ control files.
+ */
+
+#include <qremote/routecache.h>
+
+#include <qdns.h>
+#include <sharedtable.h>
+
+#include <ctype.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define ROUTECACHE_MAGIC "QRROUTE"	/**< identifies a route cache file */
+#define ROUTECACHE_SLOTS 1024		/**< number of entries in the route cache file */
+#define ROUTECACHE_MX 8			/**< maximum number of MX entries of a cached route */
+#define ROUTECACHE_ADDRS 32		/**< maximum number of addresses of a cached route */
+#define ROUTECACHE_NAMELEN 1024		/**< space for the target host and the MX names */
+
+unsigned long routecache_ttl = 300;
+
+/** @struct route_cache_mx
+ * @brief one MX entry of a cached route
+ */
+struct route_cache_mx {
+	uint32_t priority;	/**< MX priority, including the special values */
+	uint16_t count;		/**< number of addresses */
+	uint16_t name;		/**< offset of the name in names, 0 if the MX has no name */
+};
+
+/** @struct route_cache_slot
+ * @brief the route to one target host
+ */
+struct route_cache_slot {
+	uint32_t used;			/**< if the slot contains a route */
+	uint32_t port;			/**< the port on the remote servers */
+	int64_t expires;		/**< time() when the route becomes invalid */
+	uint32_t mxcnt;			/**< number of entries in mx */
+	uint32_t namelen;		/**< used bytes in names */
+	struct route_cache_mx mx[ROUTECACHE_MX];	/**< the MX entries in the order they are tried */
+	struct in6_addr addr[ROUTECACHE_ADDRS];	/**< the addresses of all MX entries */
+	char names[ROUTECACHE_NAMELEN];	/**< the lower case target host at offset 0, followed by the MX names */
+};
+
+static struct shared_table cache = SHARED_TABLE_INIT("ROUTECACHE", ROUTECACHE_MAGIC, "route cache",
+		ROUTECACHE_SLOTS, sizeof(struct route_cache_slot));
+
+/**
+ * @brief convert the target to lower case
+ * @param host the target host
+ * @param buf the result, ROUTECACHE_NAMELEN bytes
+ * @return length of the host name, -1 if it does not fit into buf
+ */
+static int
+lower_host(const char *host, char *buf)
+{
+	const size_t len = strlen(host);
+
+	if (len >= ROUTECACHE_NAMELEN)
+		return -1;
+
+	for (size_t i = 0; i <= len; i++)
+		buf[i] = tolower(host[i]);
+
+	return len;
+}
+
+static struct route_cache_slot *
+route_slot(const char *lhost, const unsigned int port)
+{
+	/* FNV-1a */
+	uint32_t h = 2166136261u;
+
+	for (const char *c = lhost; *c != '\0'; c++)
+		h = (h ^ (unsigned char)*c) * 16777619u;
+	h = (h ^ port) * 16777619u;
+
+	return shtable_slot(&cache, h);
+}
+
+/**
+ * @brief create a MX list from a cache slot
+ * @param slot the slot
+ * @return the MX list, NULL if the slot is invalid or on out of memory
+ */
+static struct ips *
+slot_ips(const struct route_cache_slot *slot)
+{
+	struct ips *res = NULL;
+	struct ips **next = &res;
+	unsigned int a = 0;
+
+	if ((slot->mxcnt == 0) || (slot->mxcnt > ROUTECACHE_MX) || (slot->namelen > ROUTECACHE_NAMELEN))
+		return NULL;
+
+	for (unsigned int i = 0; i < slot->mxcnt; i++) {
+		const struct route_cache_mx *m = slot->mx + i;
+
+		if ((m->count == 0) || (m->count > ROUTECACHE_ADDRS - a) || (m->name >= slot->namelen) ||
+				((m->name != 0) && (memchr(slot->names + m->name, '\0', slot->namelen - m->name) == NULL)))
+			goto err;
+
+		struct in6_addr *addr = malloc(m->count * sizeof(*addr));
+		if (addr == NULL)
+			goto err;
+		memcpy(addr, slot->addr + a, m->count * sizeof(*addr));
+		a += m->count;
+
+		*next = in6_to_ips(addr, m->count, m->priority);
+		if (*next == NULL)
+			goto err;
+
+		if (m->name != 0) {
+			(*next)->name = strdup(slot->names + m->name);
+			if ((*next)->name == NULL)
+				goto err;
+		}
+
+		next = &(*next)->next;
+	}
+
+	return res;
+err:
+	freeips(res);
+	return NULL;
+}
+
+/**
+ * @brief get the cached route to a host
+ * @param host the target host as given on the command line
+ * @param port the port on the remote servers
+ * @return the MX list, already filtered and sorted, NULL if none is cached
+ */
+struct ips *
+route_cache_lookup(const char *host, const unsigned int port)
+{
+	char lhost[ROUTECACHE_NAMELEN];
+
+	if ((lower_host(host, lhost) < 0) || !shtable_open(&cache))
+		return NULL;
+
+	struct route_cache_slot *slot = route_slot(lhost, port);
+	struct ips *res = NULL;
+
+	if (shtable_lock(&cache, LOCK_SH) != 0)
+		return NULL;
+
+	if (slot->used && (slot->port == port) && (slot->expires > time(NULL)) &&
+			(slot->namelen <= ROUTECACHE_NAMELEN) &&
+			(strncmp(slot->names, lhost, slot->namelen) == 0))
+		res = slot_ips(slot);
+
+	shtable_unlock(&cache);
+
+	return res;
+}
+
+/**
+ * @brief store the route to a host in the cache
+ * @param host the target host as given on the command line
+ * @param port the port on the remote servers
+ * @param mx the MX list after filtering and sorting
+ * @param ttl the lowest TTL of the DNS records the route was built from
+ *
+ * Routes that do not fit into a slot are not cached.
+ */
+void
+route_cache_store(const char *host, const unsigned int port, const struct ips *mx, const unsigned long ttl)
+{
+	struct route_cache_slot tmp;
+	const unsigned long lifetime = (ttl < routecache_ttl) ? ttl : routecache_ttl;
+
+	if (lifetime == 0)
+		return;
+
+	memset(&tmp, 0, sizeof(tmp));
+	const int hlen = lower_host(host, tmp.names);
+	if (hlen < 0)
+		return;
+	tmp.namelen = hlen + 1;
+
+	unsigned int a = 0;
+	for (const struct ips *m = mx; m != NULL; m = m->next) {
+		struct route_cache_mx *c = tmp.mx + tmp.mxcnt;
+
+		if ((tmp.mxcnt == ROUTECACHE_MX) || (m->count > ROUTECACHE_ADDRS - a))
+			return;
+
+		c->priority = m->priority;
+		c->count = m->count;
+		memcpy(tmp.addr + a, m->addr, m->count * sizeof(*m->addr));
+		a += m->count;
+
+		if (m->name != NULL) {
+			const size_t nlen = strlen(m->name) + 1;
+
+			if (nlen > ROUTECACHE_NAMELEN - tmp.namelen)
+				return;
+			c->name = tmp.namelen;
+			memcpy(tmp.names + tmp.namelen, m->name, nlen);
+			tmp.namelen += nlen;
+		}
+
+		tmp.mxcnt++;
+	}
+
+	if ((tmp.mxcnt == 0) || !shtable_open(&cache))
+		return;
+
+	tmp.used = 1;
+	tmp.port = port;
+	tmp.expires = time(NULL) + lifetime;
+
+	struct route_cache_slot *slot = route_slot(tmp.names, port);
+
+	if (shtable_lock(&cache, LOCK_EX) != 0)
+		return;
+
+	*slot = tmp;
+
+	shtable_unlock(&cache);
+}
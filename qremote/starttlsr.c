@@ -4,18 +4,23 @@
 
 #include <qremote/starttlsr.h>
 
+#include <certstore.h>
 #include <control.h>
 #include <log.h>
 #include <netio.h>
 #include <qdns.h>
 #include <qdns_dane.h>
+#include <qremote/conn.h>
 #include <qremote/qremote.h>
+#include <qremote/tlscache.h>
 #include <ssl_timeoutio.h>
 #include <sstring.h>
 #include <tls.h>
 
 #include <assert.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <openssl/err.h>
 #include <openssl/x509v3.h>
 #include <string.h>
 #include <strings.h>
@@ -26,6 +31,195 @@
 const char *clientcertname = "control/clientcert.pem";
 const char *clientkeyname = "control/clientcert.pem";
 
+static struct tlsr_cache_key cachekey;	/**< identifies the current connection in the session cache */
+static int cache_verified;		/**< only cache sessions if the server certificate was verified */
+
+/** @enum client_file
+ * @brief the files the client context is created from
+ */
+enum client_file {
+	CLIENT_CERT,		/**< the client certificate */
+	CLIENT_KEY,		/**< the client key */
+	CLIENT_STORE,		/**< the precompiled default client certificate */
+	CLIENT_FILES		/**< number of files */
+};
+
+static SSL_CTX *client_ctx;		/**< the context shared by all connections of this process */
+static char *client_ctx_cert;		/**< the client certificate loaded into client_ctx */
+static char *client_ctx_key;		/**< the client key loaded into client_ctx */
+static struct stat client_ctx_st[CLIENT_FILES];	/**< the file information of the files client_ctx was created from */
+static int client_ctx_dane;		/**< if DANE has been enabled for client_ctx */
+static struct certstore client_store;	/**< the precompiled default client certificate */
+static struct stat client_store_st;	/**< the file information of the store when client_store was mapped */
+
+static X509_STORE *host_store;		/**< the certificates of the last tlshosts file loaded */
+static char *host_store_file;		/**< the name of the file host_store was loaded from */
+static struct stat host_store_st;	/**< the file information of host_store_file when it was loaded */
+
+static int
+new_session_cb(SSL *s, SSL_SESSION *sess)
+{
+	/* a session that failed verification must not be resumed later */
+	if (!cache_verified || (SSL_get_verify_result(s) == X509_V_OK))
+		(void) tlsr_cache_store(&cachekey, sess);
+
+	/* no reference to the session is kept */
+	return 0;
+}
+
+static int
+same_file(const struct stat *a, const struct stat *b)
+{
+	return (a->st_ino == b->st_ino) && (a->st_dev == b->st_dev) &&
+			(a->st_mtime == b->st_mtime) && (a->st_size == b->st_size);
+}
+
+/**
+ * @brief get the file information of the files the client context is created from
+ * @param st the information is stored here, zeroed for files that do not exist
+ */
+static void
+client_files(struct stat st[CLIENT_FILES])
+{
+	if (stat(clientcertname, &st[CLIENT_CERT]) != 0)
+		memset(&st[CLIENT_CERT], 0, sizeof(st[CLIENT_CERT]));
+	if (stat(clientkeyname, &st[CLIENT_KEY]) != 0)
+		memset(&st[CLIENT_KEY], 0, sizeof(st[CLIENT_KEY]));
+	if (fstatat(controldir_fd, CERTSTORE_CLIENT_NAME, &st[CLIENT_STORE], 0) != 0)
+		memset(&st[CLIENT_STORE], 0, sizeof(st[CLIENT_STORE]));
+}
+
+/**
+ * @brief load the default client certificate from the precompiled store
+ * @param ctx the context to use the certificate for
+ * @param storest the current file information of the store
+ * @return if the certificate was loaded
+ *
+ * A store that was replaced since it was mapped is mapped again.
+ */
+static int
+use_client_store(SSL_CTX *ctx, const struct stat *storest)
+{
+	/* the store is built from the default files, and the key is found the same way */
+	if ((strcmp(clientcertname, "control/clientcert.pem") != 0) ||
+			((strcmp(clientkeyname, clientcertname) != 0) && (strcmp(clientkeyname, "control/clientkey.pem") != 0)))
+		return 0;
+
+	if ((client_store.map != NULL) && !same_file(&client_store_st, storest))
+		certstore_close(&client_store);
+	if (client_store.map == NULL)
+		client_store_st = *storest;
+
+	if (certstore_open(controldir_fd, CERTSTORE_CLIENT, &client_store) != 0) {
+		if (errno == EINVAL)
+			log_write(LOG_WARNING, "control/" CERTSTORE_CLIENT_NAME " is invalid, reading the certificate files");
+		return 0;
+	}
+
+	const int idx = certstore_find(&client_store, "", NULL);
+
+	return (idx >= 0) && (certstore_use_ctx(&client_store, idx, ctx) == 0);
+}
+
+/**
+ * @brief get the client context for the current connection
+ * @param st the current file information of the client certificate, key and store
+ * @return the context, NULL on error
+ *
+ * The context is only created for the first connection and then reused as
+ * long as the same client certificate is used and none of the files it was
+ * created from has changed.
+ */
+static SSL_CTX *
+client_context(const struct stat st[CLIENT_FILES])
+{
+	if ((client_ctx != NULL) && (strcmp(client_ctx_cert, clientcertname) == 0) &&
+			(strcmp(client_ctx_key, clientkeyname) == 0) &&
+			same_file(&client_ctx_st[CLIENT_CERT], &st[CLIENT_CERT]) &&
+			same_file(&client_ctx_st[CLIENT_KEY], &st[CLIENT_KEY]) &&
+			same_file(&client_ctx_st[CLIENT_STORE], &st[CLIENT_STORE]))
+		return client_ctx;
+
+	/* OpenSSL is first touched here, connections without STARTTLS never initialize it */
+	SSL_CTX *ctx = (ssl_library_setup() == 0) ? SSL_CTX_new(TLS_client_method()) : NULL;
+	if (ctx == NULL)
+		return NULL;
+
+	char *cert = strdup(clientcertname);
+	char *key = strdup(clientkeyname);
+	if ((cert == NULL) || (key == NULL)) {
+		free(cert);
+		free(key);
+		SSL_CTX_free(ctx);
+		err_mem(0);
+	}
+
+	/* disable obsolete and insecure protocol versions */
+	SSL_CTX_set_options(ctx, SSL_OP_NO_SSLv2 | SSL_OP_NO_SSLv3);
+
+	/* sessions are only kept in the cache shared with the other Qremote processes */
+	SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+	SSL_CTX_sess_set_new_cb(ctx, new_session_cb);
+
+	/* let the other side complain if it needs a cert and we don't have one */
+	if (!use_client_store(ctx, &st[CLIENT_STORE]) && (SSL_CTX_use_certificate_chain_file(ctx, clientcertname) == 1))
+		SSL_CTX_use_RSAPrivateKey_file(ctx, clientkeyname, SSL_FILETYPE_PEM);
+	ERR_clear_error();
+
+	SSL_CTX_set_post_handshake_auth(ctx, 1);
+
+	SSL_CTX_free(client_ctx);
+	free(client_ctx_cert);
+	free(client_ctx_key);
+	client_ctx = ctx;
+	client_ctx_cert = cert;
+	client_ctx_key = key;
+	memcpy(client_ctx_st, st, sizeof(client_ctx_st));
+	client_ctx_dane = 0;
+
+	return ctx;
+}
+
+/**
+ * @brief get the certificates a server is verified against
+ * @param fname the file in control/tlshosts
+ * @param st the current file information of fname
+ * @return the certificate store, NULL on error
+ *
+ * The last loaded store is kept, so trying the next MX of the same host does
+ * not need to parse the file again.
+ */
+static X509_STORE *
+tlshost_store(const char *fname, const struct stat *st)
+{
+	if ((host_store != NULL) && (strcmp(host_store_file, fname) == 0) && same_file(&host_store_st, st))
+		return host_store;
+
+	X509_STORE *store = X509_STORE_new();
+	if (store == NULL)
+		return NULL;
+
+	char *f = strdup(fname);
+	if (f == NULL) {
+		X509_STORE_free(store);
+		err_mem(0);
+	}
+
+	if (X509_STORE_load_locations(store, fname, NULL) != 1) {
+		free(f);
+		X509_STORE_free(store);
+		return NULL;
+	}
+
+	X509_STORE_free(host_store);
+	free(host_store_file);
+	host_store = store;
+	host_store_file = f;
+	host_store_st = *st;
+
+	return store;
+}
+
 /**
  * @brief send STARTTLS and handle the connection setup
  * @param d the dane information received for that domain
@@ -47,12 +241,12 @@ tls_init(const struct daneinfo *tlsa_info, int tlsa_cnt)
 	const char *fnprefix = "control/tlshosts/";
 	const char *fnsuffix = ".pem";
 	char servercert[strlen(fnprefix) + DOMAINNAME_MAX + strlen(fnsuffix) + 1];
+	struct stat st;
+	struct stat clientst[CLIENT_FILES];
 
 	if (partner_fqdn == NULL) {
 		*servercert = '\0';
 	} else {
-		struct stat st;
-
 		fqlen = strlen(partner_fqdn);
 		assert(fqlen <= DOMAINNAME_MAX);
 		memcpy(servercert, fnprefix, strlen(fnprefix));
@@ -63,8 +257,8 @@ tls_init(const struct daneinfo *tlsa_info, int tlsa_cnt)
 			*servercert = '\0';
 	}
 
-	SSL_library_init();
-	SSL_CTX *ctx = SSL_CTX_new(TLS_client_method());
+	client_files(clientst);
+	SSL_CTX *ctx = client_context(clientst);
 	if (!ctx) {
 		const char *msg[] = { "Z4.5.0 TLS error initializing ctx: ", ssl_error(), "; connecting to ",
 				rhost };
@@ -73,25 +267,17 @@ tls_init(const struct daneinfo *tlsa_info, int tlsa_cnt)
 		return -1;
 	}
 
-	/* disable obsolete and insecure protocol versions */
-	SSL_CTX_set_options(ctx, SSL_OP_NO_SSLv2 | SSL_OP_NO_SSLv3);
-
-	if (*servercert && !SSL_CTX_load_verify_locations(ctx, servercert, NULL)) {
+	X509_STORE *vstore = NULL;
+	if (*servercert && ((vstore = tlshost_store(servercert, &st)) == NULL)) {
 		const char *msg[] = { "Z4.5.0 TLS unable to load ", servercert, ": ",
 				ssl_error(),  "; connecting to ", rhost };
 
 		write_status_m(msg, 6);
-		SSL_CTX_free(ctx);
 		ssl_library_destroy();
 		return -1;
 	}
 
-	/* let the other side complain if it needs a cert and we don't have one */
-	if (SSL_CTX_use_certificate_chain_file(ctx, clientcertname) == 1)
-		SSL_CTX_use_RSAPrivateKey_file(ctx, clientkeyname, SSL_FILETYPE_PEM);
-
 	int tlsa_usable = 0;
-	SSL_CTX_set_post_handshake_auth(ctx, 1);
 	if (tlsa_cnt > 0) {
 		/* find out if there is a usable record at all */
 		for (int i = 0; i < tlsa_cnt; i++) {
@@ -110,21 +296,20 @@ tls_init(const struct daneinfo *tlsa_info, int tlsa_cnt)
 
 		if (tlsa_usable == 0) {
 			tlsa_cnt = 0;
-		} else {
+		} else if (!client_ctx_dane) {
 			if (SSL_CTX_dane_enable(ctx) <= 0) {
 				const char *msg[] = { "Z4.5.0 TLS unable to activate DANE: ", ssl_error(), "; connecting to ",
 						rhost };
 
 				write_status_m(msg, 4);
-				SSL_CTX_free(ctx);
 				ssl_library_destroy();
 				return -1;
 			}
+			client_ctx_dane = 1;
 		}
 	}
 
 	SSL *myssl = SSL_new(ctx);
-	SSL_CTX_free(ctx);
 	if (!myssl) {
 		const char *msg[] = { "Z4.5.0 TLS error initializing ssl: ", ssl_error(), "; connecting to ",
 				rhost };
@@ -185,6 +370,16 @@ tls_init(const struct daneinfo *tlsa_info, int tlsa_cnt)
 	if (*servercert) {
 		X509_VERIFY_PARAM *vparam = SSL_get0_param(myssl);
 
+		/* the context is shared by all hosts, the certificates of this one are only used here */
+		if (SSL_set1_verify_cert_store(myssl, vstore) != 1) {
+			const char *msg[] = { "Z4.5.0 TLS unable to use ", servercert, ": ",
+					ssl_error(),  "; connecting to ", rhost };
+
+			write_status_m(msg, 6);
+			ssl_free(myssl);
+			return -1;
+		}
+
 		/* Enable automatic hostname checks */
 		X509_VERIFY_PARAM_set_hostflags(vparam, X509_CHECK_FLAG_NO_PARTIAL_WILDCARDS);
 		if (X509_VERIFY_PARAM_set1_host(vparam, partner_fqdn, fqlen) != 1) {
@@ -214,12 +409,27 @@ tls_init(const struct daneinfo *tlsa_info, int tlsa_cnt)
 		ciphers = "DEFAULT";
 	}
 	int i = SSL_set_cipher_list(myssl, ciphers);
-	free(saciphers);
 	if (i != 1) {
+		free(saciphers);
 		ssl_free(myssl);
 		err_conf("can't set ciphers\n");
 	}
 
+	/* offer a session from an earlier connection using the same verification
+	 * settings and client certificate */
+	cache_verified = (*servercert || tlsa_usable > 0);
+	tlsr_cache_key(&cachekey, (partner_fqdn != NULL) ? partner_fqdn : rhost, targetport,
+			servercert, &st, clientcertname, (clientst[CLIENT_CERT].st_ino != 0) ? &clientst[CLIENT_CERT] : NULL,
+			clientkeyname, (clientst[CLIENT_KEY].st_ino != 0) ? &clientst[CLIENT_KEY] : NULL,
+			ciphers, tlsa_info, tlsa_cnt);
+	free(saciphers);
+
+	SSL_SESSION *cached = tlsr_cache_lookup(&cachekey);
+	if (cached != NULL) {
+		SSL_set_session(myssl, cached);
+		SSL_SESSION_free(cached);
+	}
+
 	i = SSL_set_fd(myssl, socketd);
 	if (i != 1) {
 		const char *msg[] = { "Z4.5.0 TLS error setting fd: ", ssl_error(), "; connecting to ",
@@ -252,6 +462,9 @@ tls_init(const struct daneinfo *tlsa_info, int tlsa_cnt)
 		return i < 0 ? -i : EDONE;
 	}
 
+	/* the client never renegotiates, so kernel TLS can always be used */
+	ssl_ktls_request(myssl);
+
 	i = ssl_timeoutconn(myssl, timeout);
 	if (i < 0) {
 		const char *msg[] = { "TLS connection failed at ", rhost, ": ", ssl_strerror(), NULL };
@@ -274,6 +487,7 @@ tls_init(const struct daneinfo *tlsa_info, int tlsa_cnt)
 				msg[2] = "";
 
 			log_writen(LOG_ERR, msg);
+			tlsr_cache_remove(&cachekey);
 			return EDONE;
 		}
 	}
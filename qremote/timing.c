@@ -0,0 +1,133 @@
+/** \file timing.c
+ \brief measure how long the phases of a delivery take
+
+ The time spent in every phase of a delivery is measured with the monotonic
+ clock. The resulting record lists all phases that were entered with their
+ durations in milliseconds, e.g. "dns=12 connect=31 greeting=40 ehlo=20
+ envelope=48 data=310 reply=22 total=483". Phases that were entered more than
+ once, e.g. because the first mail exchanger failed, are summed up.
+ */
+
+#include <qremote/timing.h>
+
+#include <qremote/qrdata.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+unsigned long timing_mode;	/**< enum timing_output bits, read from control/timingremote */
+
+static const char *phase_names[TIMING_PHASES] = {
+	NULL,
+	"dns",
+	"connect",
+	"greeting",
+	"ehlo",
+	"starttls",
+	"envelope",
+	"data",
+	"reply"
+};
+
+static unsigned long long spent[TIMING_PHASES];	/**< microseconds spent in each phase */
+static unsigned int entered;			/**< bitmask of the phases that were entered */
+static enum timing_phase current;		/**< the currently running phase */
+static struct timespec start;			/**< start of the delivery */
+static struct timespec mark;			/**< start of the current phase */
+
+static unsigned long long
+usec_since(const struct timespec *since, const struct timespec *now)
+{
+	return (now->tv_sec - since->tv_sec) * 1000000LL + (now->tv_nsec - since->tv_nsec) / 1000;
+}
+
+/**
+ * @brief start the measurement of a new delivery
+ */
+void
+timing_start(void)
+{
+	memset(spent, 0, sizeof(spent));
+	entered = 0;
+	current = TIMING_NONE;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	mark = start;
+}
+
+/**
+ * @brief enter the next phase of the delivery
+ * @param phase the new phase
+ *
+ * The time since the last call is accounted to the previous phase.
+ */
+void
+timing_phase(const enum timing_phase phase)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	spent[current] += usec_since(&mark, &now);
+	mark = now;
+	current = phase;
+	entered |= (1 << phase);
+}
+
+/**
+ * @brief format the timing record
+ * @param buf buffer to write the record to, should be TIMING_RECORD_LEN bytes
+ * @param len size of buf
+ * @return length of the record
+ *
+ * The currently running phase is included up to now.
+ */
+size_t
+timing_record(char *buf, const size_t len)
+{
+	struct timespec now;
+	size_t pos = 0;
+
+	/* account the running phase without leaving it */
+	timing_phase(current);
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	for (unsigned int i = TIMING_NONE + 1; i < TIMING_PHASES; i++) {
+		if (!(entered & (1 << i)))
+			continue;
+
+		const int r = snprintf(buf + pos, len - pos, "%s=%llu ", phase_names[i], spent[i] / 1000);
+		if ((r < 0) || ((size_t)r >= len - pos))
+			return strlen(buf);
+		pos += r;
+	}
+
+	const int r = snprintf(buf + pos, len - pos, "total=%llu", usec_since(&start, &now) / 1000);
+	if ((r < 0) || ((size_t)r >= len - pos))
+		return strlen(buf);
+
+	return pos + r;
+}
+
+/**
+ * @brief enter the phase waiting for the reply to the message
+ *
+ * If configured the record of all previous phases is added to the message
+ * report, the reply itself can not be included there as the report is
+ * written as soon as the reply arrives.
+ */
+void
+timing_reply(void)
+{
+	static char record[TIMING_RECORD_LEN + 3];
+
+	if (timing_mode & TIMING_STATUS) {
+		record[0] = ' ';
+		record[1] = '[';
+		const size_t l = 2 + timing_record(record + 2, TIMING_RECORD_LEN);
+		record[l] = ']';
+		record[l + 1] = '\0';
+		successmsg[6] = record;
+	}
+
+	timing_phase(TIMING_REPLY);
+}
@@ -0,0 +1,229 @@
+/** \file tlscache.c
+ \brief cache of TLS sessions to remote servers shared by all Qremote processes
+
+ Every delivery is done by a new Qremote process, so a TLS session can only be
+ resumed if it is stored outside of the process. Sessions are kept in the file
+ named in the environment variable TLSCLIENTCACHE.
+
+ A session is only offered again if the server name, port and everything that
+ influences the verification of the server certificate are the same as when
+ it was created. The verification result stored in the session is then still
+ valid, and checked by the caller exactly like after a full handshake.
+ */
+
+#include <qremote/tlscache.h>
+
+#include <qdns_dane.h>
+#include <sharedtable.h>
+
+#include <ctype.h>
+#include <openssl/evp.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#define TLSRCACHE_MAGIC "QRTLSC1"	/**< identifies a session cache file */
+#define TLSRCACHE_SLOTS 1024		/**< number of entries in the session cache file */
+#define TLSRCACHE_DATALEN 4096		/**< maximum size of a serialized session */
+
+/** @struct tlsr_cache_slot
+ * @brief one cached TLS session
+ */
+struct tlsr_cache_slot {
+	uint32_t used;			/**< if the slot contains a session */
+	uint32_t len;			/**< length of data */
+	int64_t expires;		/**< time() when the session becomes invalid */
+	struct tlsr_cache_key key;	/**< the parameters the session was created with */
+	unsigned char data[TLSRCACHE_DATALEN];	/**< the session as serialized by i2d_SSL_SESSION() */
+};
+
+static struct shared_table cache = SHARED_TABLE_INIT("TLSCLIENTCACHE", TLSRCACHE_MAGIC, "TLS client session cache",
+		TLSRCACHE_SLOTS, sizeof(struct tlsr_cache_slot));
+
+static void
+digest_uint(EVP_MD_CTX *mdctx, const uint64_t v)
+{
+	unsigned char buf[8];
+
+	for (unsigned int i = 0; i < sizeof(buf); i++)
+		buf[i] = (v >> (8 * i)) & 0xff;
+
+	EVP_DigestUpdate(mdctx, buf, sizeof(buf));
+}
+
+static void
+digest_data(EVP_MD_CTX *mdctx, const void *data, const size_t len)
+{
+	/* prefix with the length so the concatenation is unambiguous */
+	digest_uint(mdctx, len);
+	EVP_DigestUpdate(mdctx, data, len);
+}
+
+static void
+digest_file(EVP_MD_CTX *mdctx, const char *name, const struct stat *st)
+{
+	digest_data(mdctx, name, strlen(name));
+	digest_uint(mdctx, st != NULL);
+	if (st != NULL) {
+		digest_uint(mdctx, st->st_dev);
+		digest_uint(mdctx, st->st_ino);
+		digest_uint(mdctx, st->st_size);
+		digest_uint(mdctx, st->st_mtime);
+	}
+}
+
+/**
+ * @brief compute the cache key for a connection
+ * @param key the key will be stored here
+ * @param host the name of the remote server
+ * @param port the port on the remote server
+ * @param servercert name of the certificate file the server is verified with, empty if none is used
+ * @param certst file information of servercert
+ * @param clientcert name of the client certificate file
+ * @param clientcertst file information of clientcert, NULL if it does not exist
+ * @param clientkey name of the client key file
+ * @param clientkeyst file information of clientkey, NULL if it does not exist
+ * @param ciphers the cipher list used for the connection
+ * @param tlsa the TLSA records of the server
+ * @param tlsa_cnt number of entries in tlsa
+ *
+ * A changed certificate file or changed TLSA records result in a new key, so
+ * sessions verified with the old settings are never used again. The same
+ * applies to the client certificate, a session authenticated with one client
+ * certificate is never offered for a route that uses another one.
+ */
+void
+tlsr_cache_key(struct tlsr_cache_key *key, const char *host, const unsigned int port,
+		const char *servercert, const struct stat *certst,
+		const char *clientcert, const struct stat *clientcertst,
+		const char *clientkey, const struct stat *clientkeyst,
+		const char *ciphers, const struct daneinfo *tlsa, const int tlsa_cnt)
+{
+	EVP_MD_CTX *mdctx = EVP_MD_CTX_new();
+	const size_t hostlen = strlen(host);
+	char lhost[hostlen + 1];
+
+	for (size_t i = 0; i < hostlen; i++)
+		lhost[i] = tolower(host[i]);
+
+	if ((mdctx == NULL) || (EVP_DigestInit_ex(mdctx, EVP_sha256(), NULL) != 1)) {
+		/* a key that will not match any other */
+		memset(key, 0, sizeof(*key));
+		EVP_MD_CTX_free(mdctx);
+		return;
+	}
+
+	digest_data(mdctx, lhost, hostlen);
+	digest_uint(mdctx, port);
+	digest_file(mdctx, servercert, (*servercert != '\0') ? certst : NULL);
+	digest_file(mdctx, clientcert, clientcertst);
+	digest_file(mdctx, clientkey, clientkeyst);
+	digest_data(mdctx, ciphers, strlen(ciphers));
+	digest_uint(mdctx, tlsa_cnt);
+	for (int i = 0; i < tlsa_cnt; i++) {
+		const unsigned char params[3] = { tlsa[i].cert_usage, tlsa[i].selector, tlsa[i].matching_type };
+
+		EVP_DigestUpdate(mdctx, params, sizeof(params));
+		digest_data(mdctx, tlsa[i].data, tlsa[i].datalen);
+	}
+
+	EVP_DigestFinal_ex(mdctx, key->digest, NULL);
+	EVP_MD_CTX_free(mdctx);
+}
+
+static struct tlsr_cache_slot *
+key_slot(const struct tlsr_cache_key *key)
+{
+	const unsigned int idx = key->digest[0] | (key->digest[1] << 8) | (key->digest[2] << 16);
+
+	return shtable_slot(&cache, idx);
+}
+
+/**
+ * @brief get the cached session for a connection
+ * @param key the key of the connection
+ * @return the session, NULL if none is cached
+ *
+ * TLS 1.3 tickets are removed from the cache as they should only be used
+ * once. The server usually sends a new one on the resumed connection.
+ */
+SSL_SESSION *
+tlsr_cache_lookup(const struct tlsr_cache_key *key)
+{
+	if (!shtable_open(&cache))
+		return NULL;
+
+	struct tlsr_cache_slot *slot = key_slot(key);
+	SSL_SESSION *sess = NULL;
+
+	if (shtable_lock(&cache, LOCK_EX) != 0)
+		return NULL;
+
+	if (slot->used && (memcmp(&slot->key, key, sizeof(*key)) == 0)) {
+		if ((slot->expires > time(NULL)) && (slot->len <= TLSRCACHE_DATALEN)) {
+			const unsigned char *p = slot->data;
+
+			sess = d2i_SSL_SESSION(NULL, &p, slot->len);
+		}
+
+		if ((sess == NULL) || (SSL_SESSION_get_protocol_version(sess) >= TLS1_3_VERSION))
+			slot->used = 0;
+	}
+
+	shtable_unlock(&cache);
+
+	return sess;
+}
+
+/**
+ * @brief store a session in the cache
+ * @param key the key of the connection
+ * @param sess the session
+ * @return 0 if the session was stored, -1 otherwise
+ */
+int
+tlsr_cache_store(const struct tlsr_cache_key *key, SSL_SESSION *sess)
+{
+	const int len = i2d_SSL_SESSION(sess, NULL);
+
+	if (!SSL_SESSION_is_resumable(sess) || (len <= 0) || (len > TLSRCACHE_DATALEN))
+		return -1;
+	if (!shtable_open(&cache))
+		return -1;
+
+	struct tlsr_cache_slot *slot = key_slot(key);
+
+	if (shtable_lock(&cache, LOCK_EX) != 0)
+		return -1;
+
+	unsigned char *p = slot->data;
+	slot->len = i2d_SSL_SESSION(sess, &p);
+	slot->expires = SSL_SESSION_get_time(sess) + SSL_SESSION_get_timeout(sess);
+	slot->key = *key;
+	slot->used = 1;
+
+	shtable_unlock(&cache);
+
+	return 0;
+}
+
+/**
+ * @brief remove the cached session for a connection
+ * @param key the key of the connection
+ */
+void
+tlsr_cache_remove(const struct tlsr_cache_key *key)
+{
+	if (!shtable_open(&cache))
+		return;
+
+	struct tlsr_cache_slot *slot = key_slot(key);
+
+	if (shtable_lock(&cache, LOCK_EX) != 0)
+		return;
+
+	if (memcmp(&slot->key, key, sizeof(*key)) == 0)
+		slot->used = 0;
+
+	shtable_unlock(&cache);
+}
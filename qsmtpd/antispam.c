@@ -13,6 +13,7 @@
 #include <netio.h>
 #include <qdns.h>
 #include <qsmtpd/qsmtpd.h>
+#include <rblzone.h>
 
 #include <arpa/inet.h>
 #include <errno.h>
@@ -21,6 +22,7 @@
 #include <poll.h>
 #include <stdint.h>
 #include <string.h>
+#include <strings.h>
 #include <sys/file.h>
 #include <sys/mman.h>
 #include <sys/socket.h>
@@ -76,6 +78,98 @@ reverseip4(char *buf)
 	return strlen(buf);
 }
 
+/**
+ * check if a lookup in a local zone must be repeated using DNS
+ *
+ * @param rbl domain of the rbl
+ * @param r return value of rblzone_lookup_ip() or rblzone_lookup_name(), will be
+ *          set to DNS_ERROR_LOCAL on local errors
+ * @return if the rbl must be queried using DNS
+ */
+int
+rblzone_fallback(const char *rbl, int *r)
+{
+	if (*r >= 0)
+		return 0;
+
+	if (errno == ENOMEM) {
+		*r = DNS_ERROR_LOCAL;
+		return 0;
+	}
+
+	if (errno != ENOENT) {
+		const char *logmsg[] = {"local copy of rbl \"", rbl, "\" can't be used, querying DNS", NULL};
+
+		log_writen(LOG_WARNING, logmsg);
+	}
+
+	return 1;
+}
+
+/**
+ * look up remoteip in a single rbl
+ *
+ * @param rbl domain of the rbl
+ * @param txt pointer to "char *" where the TXT record of the listing will be stored if existent
+ * @return the result of the ask_dnsa() call, DNS_ERROR_PERM if the name of the rbl is too long
+ *
+ * If txt is NULL no TXT record lookup will be performed. If a local copy of
+ * the rbl exists it is used instead of DNS.
+ */
+int
+rbl_lookup(const char *rbl, char **txt)
+{
+	char lookup[DOMAINNAME_MAX + 1];
+	unsigned int l;
+
+	int j = rblzone_lookup_ip(rbl, &xmitstat.sremoteip, txt);
+	if (!rblzone_fallback(rbl, &j))
+		return j;
+
+	if (connection_is_ipv4()) {
+		l = reverseip4(lookup);
+		lookup[l++] = '.';
+	} else {
+		dotip6(lookup);
+		l = 64;
+	}
+
+	if (strlen(rbl) >= sizeof(lookup) - l) {
+		const char *logmsg[] = {"name of rbl too long: \"", rbl, "\"", NULL};
+
+		log_writen(LOG_ERR, logmsg);
+		return DNS_ERROR_PERM;
+	}
+
+	strcpy(lookup + l, rbl);
+	j = ask_dnsa(lookup, NULL);
+	/* if there is any error here we just write the generic message to the client
+	 * so that's no real problem for us */
+	if ((j > 0) && (txt != NULL))
+		(void) dnstxt(txt, lookup);
+
+	return j;
+}
+
+/**
+ * find the result of a rbl lookup done in advance
+ *
+ * @param rbl domain of the rbl
+ * @return the entry or NULL if this rbl was not looked up in advance
+ */
+static const struct rbl_result *
+rbl_prefetched(const char *rbl)
+{
+	if (xmitstat.prefetch == NULL)
+		return NULL;
+
+	for (unsigned int i = 0; i < xmitstat.prefetch->rblcnt; i++)
+		if (strcasecmp(xmitstat.prefetch->rbls[i].rbl, rbl) == 0)
+			return xmitstat.prefetch->rbls + i;
+
+	return NULL;
+}
+
 /**
  * do a rbl lookup for remoteip
  *
@@ -87,50 +181,38 @@ reverseip4(char *buf)
  * If no match was found but temporary DNS errors were encountered errno
  * is set to EAGAIN.
  *
- * If txt is NULL no TXT record lookup will be performed.
+ * If txt is NULL no TXT record lookup will be performed. Results of lookups
+ * done when the connection was set up are reused.
  */
 int
 check_rbl(char *const *rbls, char **txt)
 {
-	char lookup[DOMAINNAME_MAX + 1];
-	unsigned int l;
 	int i = 0;
 	int again = 0;	/* if this is set at least one rbl lookup failed with temp error */
 
-	if (connection_is_ipv4()) {
-		l = reverseip4(lookup);
-		lookup[l++] = '.';
-	} else {
-		dotip6(lookup);
-		l = 64;
-	}
 	while (rbls[i]) {
-		if (strlen(rbls[i]) >= sizeof(lookup) - l) {
-			const char *logmsg[] = {"name of rbl too long: \"", rbls[i], "\"", NULL};
+		const struct rbl_result *pre = rbl_prefetched(rbls[i]);
+		int j;
 
-			log_writen(LOG_ERR, logmsg);
+		if (pre == NULL) {
+			j = rbl_lookup(rbls[i], txt);
 		} else {
-			int j;
-
-			strcpy(lookup + l, rbls[i]);
-			j = ask_dnsa(lookup, NULL);
-			switch (j) {
-			case DNS_ERROR_LOCAL:
-				return j;
-			case DNS_ERROR_TEMP:
-				/* This lookup failed with temporary error. We continue and check the other RBLs first, if
-				 * one matches we can block permanently, only if no other matches we block mail with 4xx */
-				again = 1;
-				break;
-			default:
-				/* if there is any error here we just write the generic message to the client
-				 * so that's no real problem for us */
-				if (j > 0) {
-					if (txt != NULL)
-						(void) dnstxt(txt, lookup);
-					return i;
-				}
-			}
+			j = pre->result;
+			if ((j > 0) && (txt != NULL) && (pre->txt != NULL))
+				*txt = strdup(pre->txt);
+		}
+
+		switch (j) {
+		case DNS_ERROR_LOCAL:
+			return j;
+		case DNS_ERROR_TEMP:
+			/* This lookup failed with temporary error. We continue and check the other RBLs first, if
+			 * one matches we can block permanently, only if no other matches we block mail with 4xx */
+			again = 1;
+			break;
+		default:
+			if (j > 0)
+				return i;
 		}
 		i++;
 	}
@@ -0,0 +1,479 @@
+/** \file bgdns.c
+ \brief DNS lookups done by helper processes in the background
+
+ The MX and SPF lookups for the sender domain may take a long time. They are
+ started when MAIL FROM is accepted, but run in a helper process so the reply
+ to the client is not delayed by them. The results are only collected when a
+ filter or the Received-SPF header actually needs them.
+
+ The time all DNS lookups may take is limited by a budget for the whole
+ transaction and one for every SMTP command. Once the budget is used up no new
+ queries are sent, and helpers that have not finished are killed. Their
+ lookups are then reported as temporary DNS errors.
+ */
+
+#include <qsmtpd/bgdns.h>
+
+#include <fdio.h>
+#include <log.h>
+#include <qdns.h>
+#include <qsmtpd/antispam.h>
+#include <qsmtpd/qsmtpd.h>
+
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+unsigned long dnsbudget;		/**< seconds the DNS lookups of one transaction may take, 0 for no limit */
+unsigned long dnsphasebudget;		/**< seconds the DNS lookups of one SMTP command may take, 0 for no limit */
+static time_t transaction_deadline;	/**< end of the transaction budget, 0 if there is none */
+
+static struct bgdns_job sender_job = {
+	.pid = 0,
+	.fd = -1
+};
+
+/** @struct sender_result
+ * @brief fixed size part of the results of the sender lookup
+ */
+struct sender_result {
+	int fromdomain;			/**< return code of ask_dnsmx() */
+	int spf;			/**< SPF status */
+	int err;			/**< errno if a local error happened */
+	const char *spfmechanism;	/**< the SPF mechanism that matched */
+	size_t spfexplen;		/**< strlen(spfexp), 0 if there is none */
+	unsigned int mxcount;		/**< number of MX entries that follow */
+};
+
+/** @struct bgdns_mx
+ * @brief fixed size part of one MX entry sent by a helper
+ */
+struct bgdns_mx {
+	unsigned int priority;	/**< MX priority */
+	unsigned short count;	/**< entries in addr */
+	size_t namelen;		/**< strlen(name) */
+};
+
+/**
+ * @brief calculate the end of a DNS budget starting now
+ * @param budget length of the budget in seconds, 0 for no limit
+ * @return the deadline, 0 for no limit
+ */
+static time_t
+deadline_from(const unsigned long budget)
+{
+	struct timespec now;
+
+	if (budget == 0)
+		return 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec + budget;
+}
+
+/**
+ * @brief limit dns_deadline to the given point in time
+ * @param limit the new limit, 0 for no limit
+ */
+static void
+limit_deadline(const time_t limit)
+{
+	if ((limit != 0) && ((dns_deadline == 0) || (limit < dns_deadline)))
+		dns_deadline = limit;
+}
+
+/**
+ * @brief start the DNS budget for a new SMTP command
+ *
+ * The DNS lookups done from now on may take up to dnsphasebudget seconds,
+ * but may not exceed the budget of the current transaction.
+ */
+void
+dns_budget_phase(void)
+{
+	dns_deadline = deadline_from(dnsphasebudget);
+	limit_deadline(transaction_deadline);
+}
+
+/**
+ * @brief start the DNS budget for a new mail transaction
+ */
+void
+dns_budget_begin(void)
+{
+	transaction_deadline = deadline_from(dnsbudget);
+	limit_deadline(transaction_deadline);
+}
+
+/**
+ * @brief end the DNS budget of the current mail transaction
+ */
+void
+dns_budget_end(void)
+{
+	transaction_deadline = 0;
+}
+
+/**
+ * @brief read a string of the given length from a helper process
+ * @param fd descriptor to read from
+ * @param len length of the string
+ * @param s pointer to the string will be stored here, NULL if len is 0
+ * @return 0 on success, -1 on error
+ */
+int
+bgdns_read_string(const int fd, const size_t len, char **s)
+{
+	*s = NULL;
+	if (len == 0)
+		return 0;
+
+	*s = malloc(len + 1);
+	if (*s == NULL)
+		return -1;
+
+	if (read_all(fd, *s, len) != 0) {
+		free(*s);
+		*s = NULL;
+		return -1;
+	}
+	(*s)[len] = '\0';
+
+	return 0;
+}
+
+/**
+ * @brief send a list of MX entries to the parent process
+ * @param fd descriptor to write to
+ * @param mx the list to send
+ * @return 0 on success, -1 on error
+ *
+ * The receiver has to know the number of entries, e.g. from a header sent
+ * before.
+ */
+int
+bgdns_write_mx(const int fd, const struct ips *mx)
+{
+	for (; mx != NULL; mx = mx->next) {
+		const struct bgdns_mx smx = {
+			.priority = mx->priority,
+			.count = mx->count,
+			.namelen = (mx->name == NULL) ? 0 : strlen(mx->name)
+		};
+
+		if (write_all(fd, &smx, sizeof(smx)) != 0)
+			return -1;
+		if (write_all(fd, mx->addr, mx->count * sizeof(*mx->addr)) != 0)
+			return -1;
+		if ((smx.namelen != 0) && (write_all(fd, mx->name, smx.namelen) != 0))
+			return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * @brief read a list of MX entries sent by bgdns_write_mx()
+ * @param fd descriptor to read from
+ * @param cnt number of entries to read
+ * @param mx the list is stored here
+ * @return 0 on success, -1 on error
+ *
+ * The entries read so far are stored in mx even if an error occurs, the
+ * caller has to free them in any case.
+ */
+int
+bgdns_read_mx(const int fd, const unsigned int cnt, struct ips **mx)
+{
+	struct ips **next = mx;
+
+	for (unsigned int i = 0; i < cnt; i++) {
+		struct bgdns_mx smx;
+		struct ips *cur;
+
+		if (read_all(fd, &smx, sizeof(smx)) != 0)
+			return -1;
+		if (smx.count == 0) {
+			errno = EINVAL;
+			return -1;
+		}
+
+		cur = calloc(1, sizeof(*cur));
+		if (cur == NULL)
+			return -1;
+		*next = cur;
+		next = &cur->next;
+
+		cur->priority = smx.priority;
+		cur->addr = malloc(smx.count * sizeof(*cur->addr));
+		if (cur->addr == NULL)
+			return -1;
+		cur->count = smx.count;
+		if (read_all(fd, cur->addr, smx.count * sizeof(*cur->addr)) != 0)
+			return -1;
+		if (bgdns_read_string(fd, smx.namelen, &cur->name) != 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * @brief wait until a helper process has results available
+ * @param job the job description
+ * @return 0 if the results can be read, -1 on error
+ *
+ * If the DNS budget is used up before the helper has sent its results errno
+ * is set to ETIMEDOUT. The helper should be killed then.
+ */
+int
+bgdns_wait(const struct bgdns_job *job)
+{
+	struct pollfd pfd = {
+		.fd = job->fd,
+		.events = POLLIN
+	};
+	int r;
+
+	while ((r = poll(&pfd, 1, dns_time_left())) < 0) {
+		if (errno != EINTR)
+			return -1;
+	}
+
+	if (r == 0) {
+		errno = ETIMEDOUT;
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * @brief start a helper process
+ * @param job the job description to fill
+ * @param child the function to run in the helper process
+ * @param arg argument passed to child
+ * @return 0 on success, -1 if no helper could be started
+ *
+ * The helper writes its results to the descriptor passed to child and must
+ * exit afterwards. The parent reads them from job->fd.
+ */
+int
+bgdns_start(struct bgdns_job *job, bgdns_child child, const void *arg)
+{
+	int p[2];
+
+	if (wpipe(p) != 0)
+		return -1;
+
+	switch (job->pid = fork_clean()) {
+	case -1:
+		job->pid = 0;
+		close(p[0]);
+		close(p[1]);
+		return -1;
+	case 0:
+		close(p[0]);
+		child(p[1], arg);
+		_exit(1);
+	default:
+		break;
+	}
+
+	close(p[1]);
+	job->fd = p[0];
+
+	return 0;
+}
+
+/**
+ * @brief clean up a helper process
+ * @param job the job description
+ * @param sig if not 0 this signal is sent to the helper first
+ */
+void
+bgdns_finish(struct bgdns_job *job, const int sig)
+{
+	if (sig != 0)
+		kill(job->pid, sig);
+	close(job->fd);
+	while ((waitpid(job->pid, NULL, 0) < 0) && (errno == EINTR))
+		;
+	job->pid = 0;
+	job->fd = -1;
+}
+
+/**
+ * @brief do the sender lookups in this process
+ * @param spfdomain the domain to check the SPF policy for, NULL if SPF is ignored
+ * @return 0 on success, else error code
+ */
+static int
+sender_lookup_inline(const char *spfdomain)
+{
+	if (xmitstat.mailfrom.len) {
+		/* strchr can't return NULL here, we have checked xmitstat.mailfrom.s before */
+		xmitstat.fromdomain = ask_dnsmx(strchr(xmitstat.mailfrom.s, '@') + 1, &xmitstat.frommx);
+		if (xmitstat.fromdomain == DNS_ERROR_LOCAL)
+			return errno;
+	}
+
+	if (spfdomain != NULL) {
+		int i = check_host(spfdomain);
+		if (i < 0)
+			return errno;
+		xmitstat.spf = (i & 0x0f);
+	}
+
+	return 0;
+}
+
+static void __attribute__ ((noreturn))
+sender_lookup_child(const int fd, const void *arg)
+{
+	const char *spfdomain = arg;
+	struct sender_result res;
+	struct ips *mx;
+
+	res.err = sender_lookup_inline(spfdomain);
+	res.fromdomain = xmitstat.fromdomain;
+	res.spf = xmitstat.spf;
+	/* this always points to a string literal, which is at the
+	 * same address in the parent process */
+	res.spfmechanism = xmitstat.spfmechanism;
+	res.spfexplen = (xmitstat.spfexp == NULL) ? 0 : strlen(xmitstat.spfexp);
+	res.mxcount = 0;
+
+	for (mx = xmitstat.frommx; mx != NULL; mx = mx->next)
+		res.mxcount++;
+
+	if (write_all(fd, &res, sizeof(res)) != 0)
+		_exit(1);
+	if ((res.spfexplen != 0) && (write_all(fd, xmitstat.spfexp, res.spfexplen) != 0))
+		_exit(1);
+	if (bgdns_write_mx(fd, xmitstat.frommx) != 0)
+		_exit(1);
+
+	_exit(0);
+}
+
+/**
+ * @brief read the results of the sender lookup from the helper process
+ * @param fd descriptor to read from
+ * @return 0 on success, -1 on error
+ *
+ * If the lookup itself had a local error the results are still applied.
+ * The error is returned as positive errno value in that case.
+ */
+static int
+read_sender_result(const int fd)
+{
+	struct sender_result res;
+
+	if (read_all(fd, &res, sizeof(res)) != 0)
+		return -1;
+
+	free(xmitstat.spfexp);
+	if (bgdns_read_string(fd, res.spfexplen, &xmitstat.spfexp) != 0)
+		return -1;
+
+	if (bgdns_read_mx(fd, res.mxcount, &xmitstat.frommx) != 0)
+		return -1;
+
+	xmitstat.fromdomain = res.fromdomain;
+	xmitstat.spf = res.spf;
+	xmitstat.spfmechanism = res.spfmechanism;
+
+	return res.err;
+}
+
+/**
+ * @brief start looking up the MX and SPF information of the sender
+ * @param spfdomain the domain to check the SPF policy for, NULL if SPF is ignored
+ * @return 0 on success, else error code
+ *
+ * The lookup is done by a helper process if possible. If that can't be
+ * started the lookups are done immediately. As this is the start of a
+ * new transaction the transaction DNS budget is started, too.
+ */
+int
+sender_lookup_start(const char *spfdomain)
+{
+	sender_lookup_cancel();
+	dns_budget_begin();
+
+	/* these may still be set from a previous transaction */
+	free(xmitstat.spfexp);
+	xmitstat.spfexp = NULL;
+	xmitstat.spfmechanism = NULL;
+
+	if (!xmitstat.mailfrom.len && (spfdomain == NULL))
+		return 0;
+
+	if (bgdns_start(&sender_job, sender_lookup_child, spfdomain) != 0)
+		return sender_lookup_inline(spfdomain);
+
+	return 0;
+}
+
+/**
+ * @brief wait until the results of the sender lookup are available
+ * @return 0 on success, -1 on error
+ *
+ * After this returned the MX and SPF information in xmitstat are set. If
+ * no lookup is pending this returns immediately.
+ */
+int
+sender_lookup_wait(void)
+{
+	if (sender_job.pid == 0)
+		return 0;
+
+	int r = bgdns_wait(&sender_job);
+	if (r == 0)
+		r = read_sender_result(sender_job.fd);
+	int e = errno;
+
+	bgdns_finish(&sender_job, (r < 0) ? SIGKILL : 0);
+
+	if (r == 0)
+		return 0;
+
+	if (r > 0)
+		e = r;
+	else if (e == ETIMEDOUT)
+		log_write(LOG_WARNING, "DNS time budget exceeded, sender DNS lookup cancelled");
+	else
+		log_write(LOG_ERR, "error reading results of sender DNS lookup");
+
+	/* handle it like a DNS failure, repeated calls will not return an error again */
+	freeips(xmitstat.frommx);
+	xmitstat.frommx = NULL;
+	xmitstat.fromdomain = DNS_ERROR_TEMP;
+	if (xmitstat.spf != SPF_IGNORE)
+		xmitstat.spf = SPF_TEMPERROR;
+
+	if (r < 0)
+		return 0;
+
+	errno = e;
+	return -1;
+}
+
+/**
+ * @brief stop a pending sender lookup
+ *
+ * The results of the lookup are discarded.
+ */
+void
+sender_lookup_cancel(void)
+{
+	if (sender_job.pid != 0)
+		bgdns_finish(&sender_job, SIGKILL);
+}
@@ -6,6 +6,8 @@
 #include <netio.h>
 #include <qsmtpd/addrparse.h>
 #include <qsmtpd/antispam.h>
+#include <qsmtpd/bgdns.h>
+#include <qsmtpd/prefetch.h>
 #include <qsmtpd/qsauth.h>
 #include <qsmtpd/queue.h>
 #include <qsmtpd/qsmtpd.h>
@@ -67,6 +69,9 @@ helovalid(const char *helo, size_t len)
 	if (memchr(helo, ' ', len) != NULL)
 		return 1;
 
+	if (connection_lookup_wait() != 0)
+		return -1;
+
 	xmitstat.helostatus = 0;
 	free(xmitstat.helostr.s);
 
@@ -703,29 +708,27 @@ smtp_from_inner(void)
 		return netwrite("452 4.3.1 Requested action not taken: insufficient system storage\r\n") ? errno : EDONE;
 
 	/* no need to check existence of sender domain on bounce message */
-	if (xmitstat.mailfrom.len) {
+	if (xmitstat.mailfrom.len)
 		/* strchr can't return NULL here, we have checked xmitstat.mailfrom.s before */
-		xmitstat.fromdomain = ask_dnsmx(strchr(xmitstat.mailfrom.s, '@') + 1, &xmitstat.frommx);
-		if (xmitstat.fromdomain == DNS_ERROR_LOCAL)
-			return errno;
 		s = strchr(xmitstat.mailfrom.s, '@') + 1;
-	} else {
+	else
 		s = HELOSTR;
-	}
 
-	/* check if SPF should be ignored, or get the SPF status otherwise */
+	/* check if SPF should be ignored */
 	i = lookupipbl_name(connection_is_ipv4() ? "spffriends" : "spffriends6");
 	if (i < 0) {
 		return -i;
 	} else if (i > 0) {
 		xmitstat.spf = SPF_IGNORE;
-	} else {
-		i = check_host(s);
-		if (i < 0)
-			return errno;
-		xmitstat.spf = (i & 0x0f);
+		s = NULL;
 	}
 
+	/* the MX entries and the SPF status are only needed by some filters,
+	 * they are collected from the background lookup when needed */
+	i = sender_lookup_start(s);
+	if (i != 0)
+		return i;
+
 	goodrcpt = 0;
 	okmsg[1] = MAILFROM;
 	return -net_writen(okmsg);
@@ -744,6 +747,7 @@ smtp_from(void)
 
 	if (r != 0) {
 		/* make sure nothing is left behind */
+		sender_lookup_cancel();
 		freeips(xmitstat.frommx);
 		xmitstat.frommx = NULL;
 		xmitstat.fromdomain = 0;
@@ -9,6 +9,7 @@
 #include <log.h>
 #include <netio.h>
 #include <qsmtpd/antispam.h>
+#include <qsmtpd/bgdns.h>
 #include <qsmtpd/qsmtpd.h>
 #include <qsmtpd/queue.h>
 #include <qsmtpd/syntax.h>
@@ -117,6 +118,9 @@ write_received(const int chunked)
 
 	/* write "Received-SPF: " line */
 	if (!is_authenticated_client() && (relayclient != 1)) {
+		if (sender_lookup_wait() != 0)
+			return -1;
+
 		int rc = spfreceived(queuefd_data, xmitstat.spf);
 		if (rc)
 			return rc;
@@ -5,6 +5,7 @@
 #include <stdlib.h>
 #include <syslog.h>
 #include <qsmtpd/antispam.h>
+#include <qsmtpd/prefetch.h>
 #include "control.h"
 #include "log.h"
 #include "netio.h"
@@ -37,6 +38,9 @@ cb_dnsbl(const struct userconf *ds, const char **logmsg, enum config_domain *t)
 		return FILTER_PASSED;
 	}
 
+	/* the global DNSBLs are already queried in the background */
+	connection_rbl_wait();
+
 	i = check_rbl(a, &txt);
 	if (i >= 0) {
 		int j, u;
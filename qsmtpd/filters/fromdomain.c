@@ -3,6 +3,7 @@
 #include <qsmtpd/userfilters.h>
 
 #include <qsmtpd/antispam.h>
+#include <qsmtpd/bgdns.h>
 #include "control.h"
 #include "log.h"
 #include "netio.h"
@@ -117,6 +118,9 @@ cb_fromdomain(const struct userconf *ds, const char **logmsg, enum config_domain
 	if ( (u = getsettingglobal(ds, "fromdomain", t)) <= 0)
 		return FILTER_PASSED;
 
+	if (sender_lookup_wait() != 0)
+		return FILTER_ERROR;
+
 	if (u & FROMDOMAIN_DOMAIN_IN_DNS) {
 /* check if domain exists in DNS */
 		if (!xmitstat.frommx) {
@@ -10,6 +10,7 @@
 #include "libowfatconn.h"
 #include "log.h"
 #include "netio.h"
+#include "rblzone.h"
 #include <qsmtpd/qsmtpd.h>
 #include <qsmtpd/userconf.h>
 
@@ -59,7 +60,13 @@ cb_namebl(const struct userconf *ds, const char **logmsg, enum config_domain *t)
 				 * buffer length before. */
 				memcpy(blname + dlen, a[i], alen);
 
-				k = ask_dnsa(blname, NULL);
+				int local = 1;	/* if the list was checked using a local copy */
+
+				k = rblzone_lookup_name(a[i], d, &txt);
+				if (rblzone_fallback(a[i], &k)) {
+					local = 0;
+					k = ask_dnsa(blname, NULL);
+				}
 				switch (k) {
 				case DNS_ERROR_LOCAL:
 					rc = FILTER_ERROR;
@@ -79,7 +86,8 @@ cb_namebl(const struct userconf *ds, const char **logmsg, enum config_domain *t)
 
 					/* if there is any error here we just write the generic
 					 * message to the client so that's no real problem for us */
-					(void) dnstxt(&txt, blname);
+					if (!local)
+						(void) dnstxt(&txt, blname);
 					rc = FILTER_DENIED_UNSPECIFIC;
 					break;
 				}
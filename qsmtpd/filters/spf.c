@@ -9,6 +9,7 @@
 #include <syslog.h>
 #include "control.h"
 #include <qsmtpd/antispam.h>
+#include <qsmtpd/bgdns.h>
 #include "log.h"
 #include <qsmtpd/qsmtpd.h>
 #include <qsmtpd/userconf.h>
@@ -38,12 +39,13 @@ cb_spf(const struct userconf *ds, const char **logmsg, enum config_domain *t)
 	enum filter_result r = FILTER_DENIED_WITH_MESSAGE;	/* return code */
 	long p;				/* spf policy */
 	const char *fromdomain = NULL;	/* pointer to the beginning of the domain in xmitstat.mailfrom.s */
-	int spfs = xmitstat.spf;	/* the spf status to check, either global or local one */
+	int spfs;			/* the spf status to check, either global or local one */
 	enum config_domain tmpt;
-	char *exps = xmitstat.spfexp;	/* SPF explanation string */
+	char *exps;			/* SPF explanation string */
 	int do_strict = 0;
 
-	if ((spfs == SPF_PASS) || (spfs == SPF_IGNORE))
+	/* this is already known when the sender lookup is still running */
+	if (xmitstat.spf == SPF_IGNORE)
 		return FILTER_PASSED;
 
 	p = getsettingglobal(ds, "spfpolicy", t);
@@ -51,6 +53,14 @@ cb_spf(const struct userconf *ds, const char **logmsg, enum config_domain *t)
 	if (p <= 0)
 		return FILTER_PASSED;
 
+	if (sender_lookup_wait() != 0)
+		return FILTER_ERROR;
+
+	spfs = xmitstat.spf;
+	exps = xmitstat.spfexp;
+	if (spfs == SPF_PASS)
+		return FILTER_PASSED;
+
 	*logmsg = NULL;
 
 	if (xmitstat.remotehost.len) {
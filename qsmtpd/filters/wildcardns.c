@@ -10,6 +10,7 @@
 #include <strings.h>
 
 #include "control.h"
+#include <qsmtpd/bgdns.h>
 #include <qsmtpd/qsmtpd.h>
 
 /** \struct dns_wc
@@ -95,13 +96,16 @@ cb_wildcardns(const struct userconf *ds, const char **logmsg, enum config_domain
 	int cnt;
 	int match;
 
-	if (xmitstat.frommx == NULL)
-		return FILTER_PASSED;
-
 	/* if there is a syntax error in the file it's the users fault and this mail will be accepted */
 	if (getsettingglobal(ds, "block_wildcardns", t) <= 0)
 		return FILTER_PASSED;
 
+	if (sender_lookup_wait() != 0)
+		return FILTER_ERROR;
+
+	if (xmitstat.frommx == NULL)
+		return FILTER_PASSED;
+
 	/* the only case this returns an error is ENOMEM */
 	cnt = loadjokers(&dns_wildcards);
 	if (cnt < 0)
@@ -0,0 +1,353 @@
+/** \file prefetch.c
+ \brief DNS information about the remote host looked up in advance
+
+ The reverse lookup of the remote host, the forward confirmation of the names
+ found, and the lookups in the global DNSBLs only depend on the IP address of
+ the client. They are started by helper processes when the connection is
+ accepted and run while the banner is sent and the client answers with
+ HELO or EHLO.
+ */
+
+#include <qsmtpd/prefetch.h>
+
+#include <control.h>
+#include <fdio.h>
+#include <log.h>
+#include <qdns.h>
+#include <qsmtpd/antispam.h>
+#include <qsmtpd/bgdns.h>
+#include <qsmtpd/qsmtpd.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+
+static struct bgdns_job names_job = {
+	.pid = 0,
+	.fd = -1
+};
+
+static struct bgdns_job rbl_job = {
+	.pid = 0,
+	.fd = -1
+};
+
+static struct prefetch prefetch = {
+	.validcnt = DNS_ERROR_LOCAL
+};
+
+/** @struct names_result
+ * @brief fixed size part of the results of the reverse lookup
+ */
+struct names_result {
+	int ptr;		/**< return code of ask_dnsname() */
+	int err;		/**< errno if ask_dnsname() had a local error */
+	size_t hostlen;		/**< strlen() of the first name */
+	int validcnt;		/**< return code of validate_names() */
+};
+
+/** @struct rbl_entry
+ * @brief fixed size part of one DNSBL result
+ */
+struct rbl_entry {
+	int result;		/**< return code of rbl_lookup() */
+	size_t rbllen;		/**< strlen() of the DNSBL domain */
+	size_t txtlen;		/**< strlen() of the TXT record, 0 if there is none */
+};
+
+static const char *
+rbl_filename(void)
+{
+	return connection_is_ipv4() ? "dnsbl" : "dnsblv6";
+}
+
+static int
+apply_ptr(const int ptr, char *rnames)
+{
+	if (ptr == DNS_ERROR_LOCAL) {
+		log_write(LOG_ERR, "can't look up remote host name");
+		return -1;
+	} else if (ptr <= 0) {
+		free(rnames);
+		STREMPTY(xmitstat.remotehost);
+	} else {
+		xmitstat.remotehost.s = rnames;
+		xmitstat.remotehost.len = strlen(xmitstat.remotehost.s);
+	}
+
+	return 0;
+}
+
+static void __attribute__ ((noreturn))
+names_child(const int fd, const void *arg __attribute__ ((unused)))
+{
+	struct names_result res = {
+		.err = 0,
+		.hostlen = 0
+	};
+	char *rnames = NULL;
+	char **valid = NULL;
+
+	res.ptr = ask_dnsname(&xmitstat.sremoteip, &rnames);
+	if (res.ptr == DNS_ERROR_LOCAL) {
+		res.err = errno;
+		res.validcnt = DNS_ERROR_LOCAL;
+	} else if (res.ptr <= 0) {
+		res.validcnt = res.ptr;
+	} else {
+		res.hostlen = strlen(rnames);
+		res.validcnt = validate_names(rnames, res.ptr, &valid);
+	}
+
+	if (write_all(fd, &res, sizeof(res)) != 0)
+		_exit(1);
+	if ((res.hostlen != 0) && (write_all(fd, rnames, res.hostlen) != 0))
+		_exit(1);
+
+	for (int i = 0; i < res.validcnt; i++) {
+		const size_t len = strlen(valid[i]);
+
+		if (write_all(fd, &len, sizeof(len)) != 0)
+			_exit(1);
+		if (write_all(fd, valid[i], len) != 0)
+			_exit(1);
+	}
+
+	_exit(0);
+}
+
+static void __attribute__ ((noreturn))
+rbl_child(const int fd, const void *arg __attribute__ ((unused)))
+{
+	char **rbls;
+	unsigned int cnt = 0;
+
+	if (loadlistfd(openat(controldir_fd, rbl_filename(), O_RDONLY | O_CLOEXEC), &rbls, domainvalid) != 0)
+		_exit(1);
+
+	if (rbls != NULL)
+		while (rbls[cnt] != NULL)
+			cnt++;
+
+	if (write_all(fd, &cnt, sizeof(cnt)) != 0)
+		_exit(1);
+
+	for (unsigned int i = 0; i < cnt; i++) {
+		char *txt = NULL;
+		struct rbl_entry e = {
+			.rbllen = strlen(rbls[i])
+		};
+
+		e.result = rbl_lookup(rbls[i], &txt);
+		if (txt != NULL)
+			e.txtlen = strlen(txt);
+
+		if (write_all(fd, &e, sizeof(e)) != 0)
+			_exit(1);
+		if (write_all(fd, rbls[i], e.rbllen) != 0)
+			_exit(1);
+		if ((e.txtlen != 0) && (write_all(fd, txt, e.txtlen) != 0))
+			_exit(1);
+		free(txt);
+	}
+
+	_exit(0);
+}
+
+static int
+read_names(const int fd)
+{
+	struct names_result res;
+	char *host;
+
+	if (read_all(fd, &res, sizeof(res)) != 0)
+		return -1;
+	if (bgdns_read_string(fd, res.hostlen, &host) != 0)
+		return -1;
+
+	if (res.validcnt > 0) {
+		prefetch.validnames = calloc(res.validcnt, sizeof(*prefetch.validnames));
+		if (prefetch.validnames == NULL) {
+			free(host);
+			return -1;
+		}
+
+		for (int i = 0; i < res.validcnt; i++) {
+			size_t len;
+
+			if ((read_all(fd, &len, sizeof(len)) != 0) ||
+					(bgdns_read_string(fd, len, prefetch.validnames + i) != 0)) {
+				while (i > 0)
+					free(prefetch.validnames[--i]);
+				free(prefetch.validnames);
+				prefetch.validnames = NULL;
+				free(host);
+				return -1;
+			}
+		}
+	}
+	prefetch.validcnt = res.validcnt;
+
+	errno = res.err;
+	return apply_ptr(res.ptr, host);
+}
+
+static void
+free_rbls(void)
+{
+	for (unsigned int i = 0; i < prefetch.rblcnt; i++) {
+		free(prefetch.rbls[i].rbl);
+		free(prefetch.rbls[i].txt);
+	}
+	free(prefetch.rbls);
+	prefetch.rbls = NULL;
+	prefetch.rblcnt = 0;
+}
+
+static int
+read_rbls(const int fd)
+{
+	unsigned int cnt;
+
+	if (read_all(fd, &cnt, sizeof(cnt)) != 0)
+		return -1;
+	if (cnt == 0)
+		return 0;
+
+	prefetch.rbls = calloc(cnt, sizeof(*prefetch.rbls));
+	if (prefetch.rbls == NULL)
+		return -1;
+
+	for (prefetch.rblcnt = 0; prefetch.rblcnt < cnt; prefetch.rblcnt++) {
+		struct rbl_result *r = prefetch.rbls + prefetch.rblcnt;
+		struct rbl_entry e;
+
+		if (read_all(fd, &e, sizeof(e)) != 0)
+			return -1;
+		if (bgdns_read_string(fd, e.rbllen, &r->rbl) != 0)
+			return -1;
+		if (r->rbl == NULL) {
+			errno = EINVAL;
+			return -1;
+		}
+		if (bgdns_read_string(fd, e.txtlen, &r->txt) != 0) {
+			free(r->rbl);
+			return -1;
+		}
+		r->result = e.result;
+	}
+
+	return 0;
+}
+
+/**
+ * @brief start the lookups for the remote host
+ * @return 0 on success, -1 on error
+ *
+ * If no helper process can be started the reverse lookup is done
+ * immediately. The DNSBL lookups are only started if a global DNSBL
+ * list exists, otherwise the filters will query them when needed.
+ */
+int
+connection_lookup_start(void)
+{
+	xmitstat.prefetch = &prefetch;
+
+	if (bgdns_start(&names_job, names_child, NULL) != 0) {
+		char *rnames = NULL;
+
+		return apply_ptr(ask_dnsname(&xmitstat.sremoteip, &rnames), rnames);
+	}
+
+	if (faccessat(controldir_fd, rbl_filename(), R_OK, 0) == 0)
+		(void) bgdns_start(&rbl_job, rbl_child, NULL);
+
+	return 0;
+}
+
+/**
+ * @brief wait until the reverse lookup of the remote host is available
+ * @return 0 on success, -1 on error
+ *
+ * After this returned xmitstat.remotehost is set.
+ */
+int
+connection_lookup_wait(void)
+{
+	if (names_job.pid == 0)
+		return 0;
+
+	int r = bgdns_wait(&names_job);
+	if (r == 0)
+		r = read_names(names_job.fd);
+	int e = errno;
+
+	bgdns_finish(&names_job, (r != 0) ? SIGKILL : 0);
+
+	if ((r != 0) && ((e == EPIPE) || (e == ETIMEDOUT))) {
+		/* the helper died or was too slow, go on as if there was no reverse lookup */
+		if (e == ETIMEDOUT)
+			log_write(LOG_WARNING, "DNS time budget exceeded, remote host lookup cancelled");
+		else
+			log_write(LOG_ERR, "error reading results of remote host lookup");
+		STREMPTY(xmitstat.remotehost);
+		return 0;
+	}
+
+	errno = e;
+	return r;
+}
+
+/**
+ * @brief wait until the global DNSBL results are available
+ *
+ * If the results can't be collected the DNSBLs will be queried
+ * directly when they are needed. If the DNS budget is used up
+ * this will result in temporary errors.
+ */
+void
+connection_rbl_wait(void)
+{
+	if (rbl_job.pid == 0)
+		return;
+
+	int r = bgdns_wait(&rbl_job);
+	if (r == 0)
+		r = read_rbls(rbl_job.fd);
+
+	if (r != 0) {
+		if (errno == ETIMEDOUT)
+			log_write(LOG_WARNING, "DNS time budget exceeded, DNSBL lookups cancelled");
+		else
+			log_write(LOG_ERR, "error reading results of DNSBL lookups");
+		free_rbls();
+	}
+
+	bgdns_finish(&rbl_job, (r != 0) ? SIGKILL : 0);
+}
+
+/**
+ * @brief stop all pending lookups and free their results
+ */
+void
+connection_lookup_cancel(void)
+{
+	if (names_job.pid != 0)
+		bgdns_finish(&names_job, SIGKILL);
+	if (rbl_job.pid != 0)
+		bgdns_finish(&rbl_job, SIGKILL);
+
+	free_rbls();
+	if (prefetch.validcnt > 0) {
+		for (int i = 0; i < prefetch.validcnt; i++)
+			free(prefetch.validnames[i]);
+		free(prefetch.validnames);
+	}
+	prefetch.validnames = NULL;
+	prefetch.validcnt = DNS_ERROR_LOCAL;
+	xmitstat.prefetch = NULL;
+}
@@ -15,9 +15,12 @@
 #include <qdns.h>
 #include <qmaildir.h>
 #include <qsmtpd/antispam.h>
+#include <qsmtpd/bgdns.h>
 #include <qsmtpd/commands.h>
+#include <qsmtpd/prefetch.h>
 #include <qsmtpd/qsauth.h>
 #include <qsmtpd/qsdata.h>
+#include <qsmtpd/spfcache.h>
 #include <qsmtpd/starttls.h>
 #include <qsmtpd/syntax.h>
 #include <qsmtpd/userconf.h>
@@ -317,6 +320,22 @@ setup(void)
 		return e;
 	}
 
+	if ( (j = loadintfd(openat(controldir_fd, "dnsbudget", O_RDONLY | O_CLOEXEC), &dnsbudget, 0)) ) {
+		int e = errno;
+		log_write(LOG_ERR, "parse error in control/dnsbudget");
+		return e;
+	}
+	if ( (j = loadintfd(openat(controldir_fd, "dnsphasebudget", O_RDONLY | O_CLOEXEC), &dnsphasebudget, 0)) ) {
+		int e = errno;
+		log_write(LOG_ERR, "parse error in control/dnsphasebudget");
+		return e;
+	}
+	if ( (j = loadintfd(openat(controldir_fd, "spfcachetime", O_RDONLY | O_CLOEXEC), &spfcachetime, 3600)) ) {
+		int e = errno;
+		log_write(LOG_ERR, "parse error in control/spfcachetime");
+		return e;
+	}
+
 	if ( (j = loadlistfd(openat(controldir_fd, "filterconf", O_RDONLY | O_CLOEXEC), &tmpconf, NULL)) ) {
 		if ((errno == ENOENT) || (tmpconf == NULL)) {
 			tmpconf = NULL;
@@ -353,15 +372,10 @@ connsetup(void)
 	xmitstat.ipv4conn = IN6_IS_ADDR_V4MAPPED(&xmitstat.sremoteip) ? 1 : 0;
 #endif /* IPV4ONLY */
 
-	int j = ask_dnsname(&xmitstat.sremoteip, &xmitstat.remotehost.s);
-	if (j == DNS_ERROR_LOCAL) {
-		log_write(LOG_ERR, "can't look up remote host name");
+	/* the reverse lookup is collected when HELO or EHLO is received */
+	dns_budget_phase();
+	if (connection_lookup_start() != 0)
 		return -1;
-	} else if (j <= 0) {
-		STREMPTY(xmitstat.remotehost);
-	} else {
-		xmitstat.remotehost.len = strlen(xmitstat.remotehost.s);
-	}
 	xmitstat.remoteinfo = getenv("TCPREMOTEINFO");
 	xmitstat.remoteport = getenv("TCPREMOTEPORT");
 	if (!xmitstat.remoteport || !*xmitstat.remoteport) {
@@ -378,6 +392,8 @@ connsetup(void)
 void
 freedata(void)
 {
+	sender_lookup_cancel();
+	dns_budget_end();
 	free(xmitstat.mailfrom.s);
 	STREMPTY(xmitstat.mailfrom);
 	freeips(xmitstat.frommx);
@@ -444,6 +460,7 @@ void
 conn_cleanup(const int rc)
 {
 	freedata();
+	connection_lookup_cancel();
 	userbackend_free();
 	free(xmitstat.authname.s);
 
@@ -621,6 +638,7 @@ smtploop(void)
 						flagbogus = EINVAL;
 					} else {
 						current_command = commands + i;
+						dns_budget_phase();
 						flagbogus = commands[i].func();
 						current_command = NULL;
 					}
@@ -10,12 +10,15 @@
 #include <mime_chars.h>
 #include <netio.h>
 #include <qsmtpd/qsmtpd.h>
+#include <qsmtpd/spfcache.h>
+#include <qsmtpd/spfprefetch.h>
 #include <sstring.h>
 
 #include <arpa/inet.h>
 #include <assert.h>
 #include <ctype.h>
 #include <errno.h>
+#include <limits.h>
 #include <netinet/in.h>
 #include <string.h>
 #include <strings.h>
@@ -24,6 +27,7 @@
 #include <unistd.h>
 
 static const char spf_delimiters[] = ".-+,/_=";
+static int spf_volatile;	/**< set if a makro was expanded that depends on other inputs than the cache key */
 
 #define WRITEl(fd, s, l) \
 	do { \
@@ -417,35 +421,30 @@ spf_appendmakro(char **res, unsigned int *l, const char *const s, const unsigned
 }
 
 /**
- * build a list of validated domain names for the connected host
+ * build a list of the names that resolve back to the connected host
+ * @param rnames the names returned by ask_dnsname()
+ * @param r the number of names in rnames
  * @param domainlist where to store the array
  * @return how many entries are in domainlist, negative on error
  *
  * If this functions returns 0 all lookups were successfully, but no
  * validated domain names were found.
  */
-static int
-validate_domain(char ***domainlist)
+int
+validate_names(const char *rnames, int r, char ***domainlist)
 {
-	char *rnames = NULL;
 	int cnt = 0;
 
-	int r = ask_dnsname(&xmitstat.sremoteip, &rnames);
-	if (r <= 0)
-		return r;
-
 	if (r > 10)
 		r = 10;
 
-	assert(rnames != NULL);
 	*domainlist = malloc(sizeof(**domainlist) * r);
 	if (*domainlist == NULL) {
-		free(rnames);
 		errno = ENOMEM;
 		return -1;
 	}
 
-	char *d = rnames;
+	const char *d = rnames;
 	for (int i = 0; i < r; i++) {
 		struct in6_addr *ptrs;
 		int j, k;
@@ -469,7 +468,6 @@ validate_domain(char ***domainlist)
 						free((*domainlist)[--cnt]);
 					}
 					free(*domainlist);
-					free(rnames);
 					free(ptrs);
 					errno = ENOMEM;
 					return -1;
@@ -484,7 +482,6 @@ validate_domain(char ***domainlist)
 		d += strlen(d) + 1;
 	}
 
-	free(rnames);
 	if (cnt == 0) {
 		free(*domainlist);
 		*domainlist = NULL;
@@ -493,6 +490,56 @@ validate_domain(char ***domainlist)
 	return cnt;
 }
 
+/**
+ * build a list of validated domain names for the connected host
+ * @param domainlist where to store the array
+ * @return how many entries are in domainlist, negative on error
+ *
+ * If this functions returns 0 all lookups were successfully, but no
+ * validated domain names were found. If the names were already looked
+ * up when the connection was set up those results are used.
+ */
+static int
+validate_domain(char ***domainlist)
+{
+	if ((xmitstat.prefetch != NULL) && (xmitstat.prefetch->validcnt != DNS_ERROR_LOCAL)) {
+		const int cnt = xmitstat.prefetch->validcnt;
+
+		if (cnt <= 0)
+			return cnt;
+
+		*domainlist = malloc(sizeof(**domainlist) * cnt);
+		if (*domainlist == NULL) {
+			errno = ENOMEM;
+			return -1;
+		}
+		for (int i = 0; i < cnt; i++) {
+			(*domainlist)[i] = strdup(xmitstat.prefetch->validnames[i]);
+			if ((*domainlist)[i] == NULL) {
+				while (i > 0)
+					free((*domainlist)[--i]);
+				free(*domainlist);
+				errno = ENOMEM;
+				return -1;
+			}
+		}
+
+		return cnt;
+	}
+
+	char *rnames = NULL;
+
+	int r = ask_dnsname(&xmitstat.sremoteip, &rnames);
+	if (r <= 0)
+		return r;
+
+	assert(rnames != NULL);
+	r = validate_names(rnames, r, domainlist);
+	free(rnames);
+
+	return r;
+}
+
 #define APPEND(addlen, addstr) \
 	do {\
 		unsigned int oldl = *l;\
@@ -531,6 +578,16 @@ spf_makroletter(const char *p, const char *domain, int ex, char **res, unsigned
 	if (isupper(ch))
 		r |= 0x2;
 
+	switch (tolower(ch)) {
+	case 's':
+	case 'l':
+	case 'h':
+	case 't':
+		/* the local part, the HELO and the time are not part of the cache key */
+		spf_volatile = 1;
+		break;
+	}
+
 	switch (tolower(ch)) {
 	case 's':
 		if (xmitstat.mailfrom.len) {
@@ -803,47 +860,95 @@ enum spf_makro_expansion {
 	SPF_MAKRO_DELIMITER
 };
 
+/** @struct spf_domainspec
+ * @brief a parsed domain-spec with the optional CIDR lengths
+ */
+struct spf_domainspec {
+	const char *name;	/**< the domain-spec, NULL if none is given */
+	unsigned char macro;	/**< if name contains macros that must be expanded */
+	unsigned char error;	/**< SPF_PERMERROR if the domain-spec is invalid */
+	unsigned char cidrerror;	/**< SPF_PERMERROR if the CIDR lengths are invalid */
+	int ip4cidr;		/**< the length of the IPv4 net, -1 if none given */
+	int ip6cidr;		/**< the length of the IPv6 net, -1 if none given */
+};
+
+/** @enum spf_term_kind
+ * @brief the type of a term in a compiled SPF record
+ */
+enum spf_term_kind {
+	SPF_TERM_END,		/**< trailing whitespace at the end of the record */
+	SPF_TERM_BADQUALIFIER,	/**< the term does not start with a qualifier or a letter */
+	SPF_TERM_MX,		/**< "mx" mechanism */
+	SPF_TERM_PTR,		/**< "ptr" mechanism */
+	SPF_TERM_EXISTS,	/**< "exists" mechanism */
+	SPF_TERM_ALL,		/**< "all" mechanism */
+	SPF_TERM_A,		/**< "a" mechanism */
+	SPF_TERM_IP4,		/**< "ip4" mechanism */
+	SPF_TERM_IP6,		/**< "ip6" mechanism */
+	SPF_TERM_INCLUDE,	/**< "include" mechanism */
+	SPF_TERM_INVALID,	/**< a mechanism without its mandatory argument */
+	SPF_TERM_MODIFIER,	/**< a modifier, only checked for syntax */
+	SPF_TERM_BADTOKEN	/**< neither a known mechanism nor a valid modifier */
+};
+
+/** @struct spf_term
+ * @brief a term of a compiled SPF record
+ */
+struct spf_term {
+	enum spf_term_kind kind;	/**< type of the term */
+	int qualifier;			/**< SPF result if the mechanism matches */
+	const char *token;		/**< the term in the record text, behind the qualifier */
+	struct spf_domainspec spec;	/**< the target of a, mx, ptr, exists, and include */
+	struct in6_addr net;		/**< the network of ip4 and ip6 */
+	unsigned char prefix;		/**< the network length of ip4 and ip6 */
+	unsigned char error;		/**< SPF_PERMERROR if the term is syntactically invalid */
+	const char *value;		/**< the value of a modifier if it must be expanded to check it, NULL otherwise */
+};
+
 /**
  * @brief parse the domainspec
  *
- * @param domain the current domain string
  * @param token pointer to the string after the token
- * @param domainspec here the expanded domain string is stored (memory will be malloced)
- * @param ip4cidr the length of the IPv4 net (parsed if present in token, -1 if none given)
- * @param ip6cidr same for IPv6 net length
- * @returns if domainspec is valid or not
- * @retval -1 error (ENOMEM)
- * @retval SPF_PERMERROR domainspec is syntactically invalid
- * @retval 0 everything is fine, domainspec is set
+ * @param spec the parsed domainspec is stored here
+ * @param store buffer to store the domain-spec string in, is moved behind it
+ *
+ * The domain-spec itself is only checked for syntax, makros are expanded
+ * later by spec_expand(). Any error is recorded in spec.
  */
-static int
-spf_domainspec(const char *domain, const char *token, char **domainspec, int *ip4cidr, int *ip6cidr)
+static void
+spf_parse_domainspec(const char *token, struct spf_domainspec *spec, char **store)
 {
-	*ip4cidr = -1;
-	*ip6cidr = -1;
+	spec->ip4cidr = -1;
+	spec->ip6cidr = -1;
+	spec->name = NULL;
+	spec->macro = 0;
+	spec->error = 0;
+	spec->cidrerror = 0;
 	/* if there is nothing we don't need to do anything */
-	*domainspec = NULL;
 	if (!*token || WSPACE(*token)) {
-		return 0;
+		return;
 	/* search for a domain in token */
 	} else if (*token != '/') {
 		enum spf_makro_expansion i = SPF_MAKRO_NONE;
 		const char *t = token;
 		const char *tokenend = NULL;
 
+		spec->error = SPF_PERMERROR;
+
 		while (*t && !WSPACE(*t) && (*t != '/')) {
 			if (((signed char)*t) < 0)
-				return SPF_PERMERROR;
+				return;
 
 			switch (i) {
 			case SPF_MAKRO_NONE:
 				if (*t != '%') {
 					if ((*t < 0x21) || (*t > 0x7e))
-						return SPF_PERMERROR;
+						return;
 					t++;
 					continue;
 				} else {
 					// never used: i = SPF_MAKRO_PERCENT;
+					spec->macro = 1;
 					t++;
 				}
 				/* fallthrough */
@@ -860,7 +965,7 @@ spf_domainspec(const char *domain, const char *token, char **domainspec, int *ip
 					t++;
 					break;
 				default:
-					return SPF_PERMERROR;
+					return;
 				}
 				/* fallthrough */
 			case SPF_MAKRO_BRACE:
@@ -881,7 +986,7 @@ spf_domainspec(const char *domain, const char *token, char **domainspec, int *ip
 					t++;
 					break;
 				default:
-					return SPF_PERMERROR;
+					return;
 				}
 				/* fallthrough */
 			case SPF_MAKRO_LETTER:
@@ -923,13 +1028,13 @@ spf_domainspec(const char *domain, const char *token, char **domainspec, int *ip
 					t++;
 					continue;
 				default:
-					return SPF_PERMERROR;
+					return;
 				}
 			}
 		}
 
 		if (i != SPF_MAKRO_NONE)
-			return SPF_PERMERROR;
+			return;
 
 		/* domainspec must end in toplabel or macro-expand */
 		if ((tokenend == NULL) || (t != tokenend + 1)) {
@@ -949,34 +1054,36 @@ spf_domainspec(const char *domain, const char *token, char **domainspec, int *ip
 
 			/* domainspec may not be only toplabel */
 			if (*dot != '.')
-				return SPF_PERMERROR;
+				return;
 
 			/* toplabel may not be empty */
 			if (dot + 1 >= last)
-				return SPF_PERMERROR;
+				return;
 
 			/* toplabel must begin and end with alphanum,
 			 * enforce C locale here */
 			if (!isalnum(*(dot + 1)))
-				return SPF_PERMERROR;
+				return;
 			if (!isalnum(*last))
-				return SPF_PERMERROR;
+				return;
 
 			/* toplabel mal only be alphanum or '-' and
 			 * must have at least one ALPHA */
 			for (tmp = dot + 1; tmp <= last; tmp++) {
 				hasalpha |= isalpha(*tmp);
 				if (!isalnum(*tmp) && (*tmp != '-'))
-					return SPF_PERMERROR;
+					return;
 			}
 
 			if (!hasalpha)
-				return SPF_PERMERROR;
+				return;
 		}
 
-		if ((i = spf_makro(token, domain, 0, domainspec))) {
-			return i;
-		}
+		spec->error = 0;
+		memcpy(*store, token, t - token);
+		(*store)[t - token] = '\0';
+		spec->name = *store;
+		*store += t - token + 1;
 		token = t;
 	}
 
@@ -987,37 +1094,77 @@ spf_domainspec(const char *domain, const char *token, char **domainspec, int *ip
 		if (*c != '/') {
 			char *cend;
 			if ((*c == '\0') || WSPACE(*c)) {
-				free(*domainspec);
-				return SPF_PERMERROR;
+				spec->cidrerror = SPF_PERMERROR;
+				return;
 			}
-			*ip4cidr = strtol(c, &cend, 10);
-			if ((*ip4cidr > 32) || (!WSPACE(*cend) && (*cend != '/') && (*cend != '\0'))) {
-				free(*domainspec);
-				return SPF_PERMERROR;
+			long l = strtol(c, &cend, 10);
+			if ((l > 32) || (!WSPACE(*cend) && (*cend != '/') && (*cend != '\0'))) {
+				spec->cidrerror = SPF_PERMERROR;
+				return;
 			}
+			spec->ip4cidr = l;
 			c = cend;
 		} else {
 			c--;
 		}
 		if (*c++ != '/') {
-			*ip6cidr = -1;
+			spec->ip6cidr = -1;
 		} else {
 			char *cend;
 			if (*c++ != '/') {
-				free(*domainspec);
-				return SPF_PERMERROR;
+				spec->cidrerror = SPF_PERMERROR;
+				return;
 			}
 			if ((*c == '\0') || WSPACE(*c)) {
-				free(*domainspec);
-				return SPF_PERMERROR;
+				spec->cidrerror = SPF_PERMERROR;
+				return;
 			}
-			*ip6cidr = strtol(c, &cend, 10);
-			if ((*ip6cidr > 128) || !(WSPACE(*cend) || (*cend == '\0'))) {
-				free(*domainspec);
-				return SPF_PERMERROR;
+			long l = strtol(c, &cend, 10);
+			if ((l > 128) || !(WSPACE(*cend) || (*cend == '\0'))) {
+				spec->cidrerror = SPF_PERMERROR;
+				return;
 			}
+			spec->ip6cidr = l;
 		}
 	}
+}
+
+/**
+ * @brief get the target name of a parsed domainspec
+ *
+ * @param domain the current domain string
+ * @param spec the parsed domainspec
+ * @param expanded if makros had to be expanded the result is stored here (memory will be malloced)
+ * @param name the target name is stored here, NULL if the domainspec is empty
+ * @returns if domainspec is valid or not
+ * @retval -1 error (ENOMEM)
+ * @retval SPF_PERMERROR domainspec is syntactically invalid
+ * @retval 0 everything is fine, name is set
+ *
+ * Only domain-specs that contain makros need any memory allocation here.
+ */
+static int
+spec_expand(const char *domain, const struct spf_domainspec *spec, char **expanded, const char **name)
+{
+	*expanded = NULL;
+	*name = spec->name;
+
+	if (spec->error != 0)
+		return spec->error;
+
+	if (spec->macro) {
+		int i = spf_makro(spec->name, domain, 0, expanded);
+		if (i != 0)
+			return i;
+		*name = *expanded;
+	}
+
+	if (spec->cidrerror != 0) {
+		free(*expanded);
+		*expanded = NULL;
+		return spec->cidrerror;
+	}
+
 	return 0;
 }
 
@@ -1047,7 +1194,7 @@ may_have_domainspec(const char *token)
 		return 1;
 	}
 
-	/* Strictly speaking this is no domainspec, but the spf_domainspec()
+	/* Strictly speaking this is no domainspec, but the spf_parse_domainspec()
 	 * function will care for this, too. */
 	if (*token == '/')
 		return 1;
@@ -1055,48 +1202,109 @@ may_have_domainspec(const char *token)
 	return SPF_PERMERROR;
 }
 
-/* the SPF routines
+/**
+ * @brief look up the MX entries of a mechanism target
+ * @param name the name to look up
+ * @param mx the MX entries are stored here
+ * @return the same values as ask_dnsmx()
  *
- * return values:
- *  SPF_NONE: no match
- *  SPF_PASS: match
- *  SPF_PERMERROR: parse error
- * -1: error (ENOMEM)
+ * If the lookup was started in the background its answer is used.
  */
 static int
-spfmx(const char *domain, const char *token)
+spf_dnsmx(const char *name, struct ips **mx)
 {
-	int ip6l = -1;
-	int ip4l = -1;
-	int i;
-	struct ips *mx;
-	char *domainspec = NULL;
+	struct spf_prefetch_answer ans;
+
+	if (!spfprefetch_take(SPF_PREFETCH_MX, name, &ans))
+		return ask_dnsmx(name, mx);
+
+	*mx = ans.mx;
+	errno = ans.err;
+	return ans.result;
+}
+
+/**
+ * @brief look up the addresses of a mechanism target
+ * @param name the name to look up
+ * @param v4 if the A records should be looked up instead of the AAAA records
+ * @param ip the addresses are stored here, may be NULL if v4 is set
+ * @return the same values as ask_dnsa()
+ *
+ * If the lookup was started in the background its answer is used.
+ */
+static int
+spf_dnsa(const char *name, const int v4, struct in6_addr **ip)
+{
+	struct spf_prefetch_answer ans;
+
+	if (!spfprefetch_take(v4 ? SPF_PREFETCH_A : SPF_PREFETCH_AAAA, name, &ans)) {
+		if (v4)
+			return ask_dnsa(name, ip);
+		else
+			return ask_dnsaaaa(name, ip);
+	}
 
+	if (ip != NULL)
+		*ip = ans.ip;
+	else
+		free(ans.ip);
+	errno = ans.err;
+	return ans.result;
+}
+
+/**
+ * @brief parse the optional domainspec of the a, mx, and ptr mechanisms
+ * @param token the string after the mechanism name
+ * @param spec the parsed domainspec is stored here
+ * @param store buffer to store the domain-spec string in
+ */
+static void
+parse_optional_domainspec(const char *token, struct spf_domainspec *spec, char **store)
+{
 	switch (may_have_domainspec(token)) {
 	case 0:
+		spf_parse_domainspec("", spec, store);
 		break;
 	case 1:
 		if (*token == ':')
 			token++;
-		i = spf_domainspec(domain, token, &domainspec, &ip4l, &ip6l);
-		if (i != 0)
-			return i;
+		spf_parse_domainspec(token, spec, store);
 		break;
 	default:
-		return SPF_PERMERROR;
+		spf_parse_domainspec("", spec, store);
+		spec->error = SPF_PERMERROR;
 	}
+}
+
+/* the SPF routines
+ *
+ * return values:
+ *  SPF_NONE: no match
+ *  SPF_PASS: match
+ *  SPF_PERMERROR: parse error
+ * -1: error (ENOMEM)
+ */
+static int
+spfmx(const char *domain, const struct spf_domainspec *spec)
+{
+	int i;
+	struct ips *mx;
+	char *domainspec;
+	const char *lookup;
 
-	if (ip4l < 0)
-		ip4l = 32;
-	if (ip6l < 0)
-		ip6l = 128;
+	i = spec_expand(domain, spec, &domainspec, &lookup);
+	if (i != 0)
+		return i;
+
+	const int ip4l = (spec->ip4cidr < 0) ? 32 : spec->ip4cidr;
+	const int ip6l = (spec->ip6cidr < 0) ? 128 : spec->ip6cidr;
+
+	if (lookup == NULL)
+		lookup = domain;
+
+	i = spf_dnsmx(lookup, &mx);
+	free(domainspec);
 
-	if (domainspec) {
-		i = ask_dnsmx(domainspec, &mx);
-		free(domainspec);
-	} else {
-		i = ask_dnsmx(domain, &mx);
-	}
 	switch (i) {
 	case 1:
 	case 2:
@@ -1163,45 +1371,25 @@ spfmx(const char *domain, const char *token)
 }
 
 static int
-spfa(const char *domain, const char *token)
+spfa(const char *domain, const struct spf_domainspec *spec)
 {
-	int ip6l = -1;
-	int ip4l = -1;
 	int i;
 	struct in6_addr *ip;
-	char *domainspec = NULL;
+	char *domainspec;
 	const int v4 = IN6_IS_ADDR_V4MAPPED(&xmitstat.sremoteip);
 	const char *lookup;
 
-	switch (may_have_domainspec(token)) {
-	case 0:
-		break;
-	case 1:
-		if (*token == ':')
-			token++;
-		i = spf_domainspec(domain, token, &domainspec, &ip4l, &ip6l);
-		if (i != 0)
-			return i;
-		break;
-	default:
-		return SPF_PERMERROR;
-	}
+	i = spec_expand(domain, spec, &domainspec, &lookup);
+	if (i != 0)
+		return i;
 
-	if (ip4l < 0) {
-		ip4l = 32;
-	}
-	if (ip6l < 0) {
-		ip6l = 128;
-	}
-	if (domainspec)
-		lookup = domainspec;
-	else
+	const int ip4l = (spec->ip4cidr < 0) ? 32 : spec->ip4cidr;
+	const int ip6l = (spec->ip6cidr < 0) ? 128 : spec->ip6cidr;
+
+	if (lookup == NULL)
 		lookup = domain;
 
-	if (v4)
-		i = ask_dnsa(lookup, &ip);
-	else
-		i = ask_dnsaaaa(lookup, &ip);
+	i = spf_dnsa(lookup, v4, &ip);
 
 	free(domainspec);
 
@@ -1239,20 +1427,21 @@ spfa(const char *domain, const char *token)
 }
 
 static int
-spfexists(const char *domain, const char *token)
+spfexists(const char *domain, const struct spf_domainspec *spec)
 {
-	int ip6l, ip4l, r = 0;
+	int r = 0;
 	char *domainspec;
+	const char *lookup;
 
-	int i = spf_domainspec(domain, token, &domainspec, &ip4l, &ip6l);
+	int i = spec_expand(domain, spec, &domainspec, &lookup);
 	if (i)
 		return i;
 
-	if ((ip4l > 0) || (ip6l > 0) || !domainspec) {
+	if ((spec->ip4cidr > 0) || (spec->ip6cidr > 0) || !lookup) {
 		free(domainspec);
 		return SPF_PERMERROR;
 	}
-	i = ask_dnsa(domainspec, NULL);
+	i = spf_dnsa(lookup, 1, NULL);
 	free(domainspec);
 
 	switch (i) {
@@ -1275,32 +1464,18 @@ spfexists(const char *domain, const char *token)
 }
 
 static int
-spfptr(const char *domain, const char *token)
+spfptr(const char *domain, const struct spf_domainspec *spec)
 {
 	int r = 0;
-	char *domainspec = NULL;
+	char *domainspec;
 	char **validdomains = NULL;
 	const char *checkdom;
 
-	switch (may_have_domainspec(token)) {
-	case 0:
-		break;
-	case 1: {
-		int ip4l, ip6l;
-
-		if (*token == ':')
-			token++;
-
-		int i = spf_domainspec(domain, token, &domainspec, &ip4l, &ip6l);
-		if (i != 0)
-			return i;
-		if ((ip4l >= 0) || (ip6l >= 0)) {
-			free(domainspec);
-			return SPF_PERMERROR;
-		}
-		break;
-		}
-	default:
+	int i = spec_expand(domain, spec, &domainspec, &checkdom);
+	if (i != 0)
+		return i;
+	if ((spec->ip4cidr >= 0) || (spec->ip6cidr >= 0)) {
+		free(domainspec);
 		return SPF_PERMERROR;
 	}
 
@@ -1309,7 +1484,7 @@ spfptr(const char *domain, const char *token)
 		return SPF_NONE;
 	}
 
-	int i = validate_domain(&validdomains);
+	i = validate_domain(&validdomains);
 	switch (i) {
 	case 0:
 		free(domainspec);
@@ -1327,11 +1502,8 @@ spfptr(const char *domain, const char *token)
 
 	assert(i > 0);
 
-	if (domainspec) {
-		checkdom = domainspec;
-	} else {
+	if (checkdom == NULL)
 		checkdom = domain;
-	}
 
 	const size_t dslen = strlen(checkdom);
 	int j;
@@ -1367,16 +1539,20 @@ spfptr(const char *domain, const char *token)
 	return r;
 }
 
-static int
-spfip4(const char *domain)
+/**
+ * @brief parse the argument of an ip4 mechanism
+ * @param domain the string after "ip4:"
+ * @param t the network is stored here, t->error is set on syntax errors
+ */
+static void
+parse_ip4(const char *domain, struct spf_term *t)
 {
 	const char *sl = domain;
 	struct in_addr net;
 	unsigned long u;
 	char ip4buf[INET_ADDRSTRLEN];
 
-	if (!IN6_IS_ADDR_V4MAPPED(&xmitstat.sremoteip))
-		return SPF_NONE;
+	t->error = SPF_PERMERROR;
 
 	while (((*sl >= '0') && (*sl <= '9')) || (*sl == '.')) {
 		sl++;
@@ -1384,39 +1560,58 @@ spfip4(const char *domain)
 
 	size_t ip4len = sl - domain;
 	if ((ip4len >= sizeof(ip4buf)) || (ip4len < 7))
-		return SPF_PERMERROR;
+		return;
 
 	if (*sl == '/') {
 		char *q;
 
 		u = strtoul(sl + 1, &q, 10);
 		if ((u < 8) || (u > 32) || (!WSPACE(*q) && (*q != '\0')))
-			return SPF_PERMERROR;
+			return;
 	} else if (WSPACE(*sl) || !*sl) {
 		u = 32;
 	} else {
-		return SPF_PERMERROR;
+		return;
 	}
 
 	memset(ip4buf, 0, sizeof(ip4buf));
 	memcpy(ip4buf, domain, ip4len);
 
 	if (!inet_pton(AF_INET, ip4buf, &net))
-		return SPF_PERMERROR;
+		return;
 
-	return ip4_matchnet(&xmitstat.sremoteip, &net, u) ? SPF_PASS : SPF_NONE;
+	t->net = in_addr_to_v4mapped(&net);
+	t->prefix = u;
+	t->error = 0;
 }
 
 static int
-spfip6(const char *domain)
+spfip4(const struct spf_term *t)
+{
+	if (!IN6_IS_ADDR_V4MAPPED(&xmitstat.sremoteip))
+		return SPF_NONE;
+
+	if (t->error != 0)
+		return t->error;
+
+	return ip4_matchnet(&xmitstat.sremoteip, (const struct in_addr *)&t->net.s6_addr32[3], t->prefix) ?
+			SPF_PASS : SPF_NONE;
+}
+
+/**
+ * @brief parse the argument of an ip6 mechanism
+ * @param domain the string after "ip6:"
+ * @param t the network is stored here, t->error is set on syntax errors
+ */
+static void
+parse_ip6(const char *domain, struct spf_term *t)
 {
 	const char *sl = domain;
-	struct in6_addr net;
 	unsigned long u;
 	char ip6buf[INET6_ADDRSTRLEN];
 
-	if (IN6_IS_ADDR_V4MAPPED(&xmitstat.sremoteip))
-		return SPF_NONE;
+	t->error = SPF_PERMERROR;
+
 	while (((*sl >= '0') && (*sl <= '9')) || ((*sl >= 'a') && (*sl <= 'f')) ||
 					((*sl >= 'A') && (*sl <= 'F')) || (*sl == ':') || (*sl == '.')) {
 		sl++;
@@ -1424,42 +1619,54 @@ spfip6(const char *domain)
 
 	size_t ip6len = sl - domain;
 	if ((ip6len >= sizeof(ip6buf)) || (ip6len < 3))
-		return SPF_PERMERROR;
+		return;
 
 	if (*sl == '/') {
 		char *endp;
 		u = strtoul(sl + 1, &endp, 10);
 		if ((u < 8) || (u > 128) || (!WSPACE(*endp) && (*endp != '\0')))
-			return SPF_PERMERROR;
+			return;
 	} else if (WSPACE(*sl) || !*sl) {
 		u = 128;
 	} else {
-		return SPF_PERMERROR;
+		return;
 	}
 
 	memset(ip6buf, 0, sizeof(ip6buf));
 	memcpy(ip6buf, domain, ip6len);
 
-	if (!inet_pton(AF_INET6, ip6buf, &net))
-		return SPF_PERMERROR;
+	if (!inet_pton(AF_INET6, ip6buf, &t->net))
+		return;
+
+	t->prefix = u;
+	t->error = 0;
+}
 
-	return ip6_matchnet(&xmitstat.sremoteip, &net, (unsigned char) (u & 0xff)) ? SPF_PASS : SPF_NONE;
+static int
+spfip6(const struct spf_term *t)
+{
+	if (IN6_IS_ADDR_V4MAPPED(&xmitstat.sremoteip))
+		return SPF_NONE;
+
+	if (t->error != 0)
+		return t->error;
+
+	return ip6_matchnet(&xmitstat.sremoteip, &t->net, t->prefix) ? SPF_PASS : SPF_NONE;
 }
 
 /**
- * @brief lookup TXT record taking SPF specialities into account
- * @param txt result pointer
+ * @brief get the name to look up the TXT record of a domain
  * @param domain domain token to look up
- * @returns the same error codes as dnstxt()
+ * @param lookup the name to query is stored here, must have space for DOMAINNAME_MAX + 1 characters
+ * @return 0 on success, -1 on error (EINVAL)
  *
  * This will take two SPF specific contraints into account:
  * - trailing dots are ignored
  * - if domain is longer than 253 characters parts are removed until it is shorter
  */
 static int
-txtlookup(char **txt, const char *domain)
+txt_lookupname(const char *domain, char *lookup)
 {
-	char lookup[DOMAINNAME_MAX + 1];
 	unsigned int offs = 0;
 	size_t len = strlen(domain);
 
@@ -1484,18 +1691,46 @@ txtlookup(char **txt, const char *domain)
 	memcpy(lookup, domain + offs, len - offs);
 	lookup[len - offs] = '\0';
 
-	return dnstxt_records(txt, lookup);
+	return 0;
 }
 
 /**
- * @brief check if the token matches the given mechanism
- * @param token current token to match
- * @param mechanism the mechanism string to match
- * @param delimiters the delimiters that may be present after the token
- * @returns length of the matched mechanism on success
- * @retval 0 mechanism did not match
+ * @brief lookup TXT record taking SPF specialities into account
+ * @param txt result pointer
+ * @param domain domain token to look up
+ * @returns the same error codes as dnstxt()
+ *
+ * The name is modified as described for txt_lookupname(). If the lookup was
+ * started in the background its answer is used.
  */
-static size_t
+static int
+txtlookup(char **txt, const char *domain)
+{
+	char lookup[DOMAINNAME_MAX + 1];
+	struct spf_prefetch_answer ans;
+
+	if (txt_lookupname(domain, lookup) != 0)
+		return -1;
+
+	if (!spfprefetch_take(SPF_PREFETCH_TXT, lookup, &ans))
+		return dnstxt_records(txt, lookup);
+
+	if (ans.ttl < dnstxt_minttl)
+		dnstxt_minttl = ans.ttl;
+	*txt = ans.txt;
+	errno = ans.err;
+	return ans.result;
+}
+
+/**
+ * @brief check if the token matches the given mechanism
+ * @param token current token to match
+ * @param mechanism the mechanism string to match
+ * @param delimiters the delimiters that may be present after the token
+ * @returns length of the matched mechanism on success
+ * @retval 0 mechanism did not match
+ */
+static size_t
 match_mechanism(const char *token, const char *mechanism, const char *delimiters)
 {
 	const size_t mechlen = strlen(mechanism);
@@ -1622,50 +1857,46 @@ find_modifier(const char *s, const char *mod)
 	return r;
 }
 
-/**
- * look up SPF records for domain
+/** @struct spf_record
+ * @brief a compiled SPF record
  *
- * @param domain no idea what this might be for
- * @param queries number of DNS queries done
- * @return one of the SPF_* constants defined in include/antispam.h or -1 on ENOMEM
+ * The record is parsed once into a list of terms, so it can be evaluated
+ * repeatedly without parsing the text again. Domain-specs without makros
+ * are stored as plain strings that are used directly as lookup targets.
  */
-static int
-spflookup(const char *domain, unsigned int *queries)
-{
-	char *txt, *valid = NULL;
-	int i, result = SPF_NONE, prefix;
-	const char *mechanism = NULL;
+struct spf_record {
+	int invalid;			/**< set if the DNS answer itself determines the result */
+	int result;			/**< the result if invalid is set */
+	char *txt;			/**< the TXT records as received from DNS */
+	const char *expl;		/**< the value of the exp= modifier, NULL if there is none */
+	const char *redirect;		/**< the value of the redirect= modifier, NULL if there is none */
+	struct spf_domainspec redirspec;	/**< the parsed redirect target */
+	unsigned int count;		/**< number of terms */
+	struct spf_term *terms;		/**< the terms of the record */
+};
 
-	/* don't enforce valid domains on redirects */
-	if (*queries == 0) {
-		if (domainvalid(domain))
-			return SPF_PERMERROR;
-		i = dnstxt_records(&txt, domain);
-	} else {
-		i = txtlookup(&txt, domain);
-	}
+static void
+spf_record_free(struct spf_record *rec)
+{
+	free(rec->txt);
+	free(rec);
+}
 
-	if (i < 0) {
-		switch (errno) {
-		case ENOENT:
-			return SPF_NONE;
-		case ETIMEDOUT:
-		case EIO:
-		case ECONNREFUSED:
-		case EAGAIN:
-			return SPF_TEMPERROR;
-		case EINVAL:
-			return SPF_DNS_HARD_ERROR;
-		case ENOMEM:
-		default:
-			return -1;
-		}
-	}
-	if (i == 0)
-		return SPF_NONE;
+/**
+ * @brief compile the TXT records of a domain
+ * @param txt the TXT records, separated by 0 bytes, ownership is transferred to the record
+ * @param cnt the number of records in txt
+ * @return the compiled record, NULL on error (ENOMEM)
+ */
+static struct spf_record *
+spf_compile(char *txt, const int cnt)
+{
+	char *valid = NULL;
 	char *token = txt;
+	int invalid = 0;
+
 	/* scan all DNS records if they are valid SPF records */
-	for (int j = 0; j < i; j++) {
+	for (int j = 0; j < cnt; j++) {
 		if (strncmp(token, "v=spf1", strlen("v=spf1")) == 0) {
 			if (valid) {
 				/* there already was another valid token */
@@ -1673,8 +1904,8 @@ spflookup(const char *domain, unsigned int *queries)
 				 * 'If the resultant record set includes more than one record,
 				 * check_host() produces the "permerror" result."'.
 				 */
-				free(txt);
-				return SPF_PERMERROR;
+				invalid = SPF_PERMERROR;
+				break;
 			} else {
 				token += strlen("v=spf1");
 				/* RfC 7208 section 4.5:
@@ -1687,13 +1918,39 @@ spflookup(const char *domain, unsigned int *queries)
 		}
 		token += strlen(token) + 1;
 	}
+
+	/* count the terms of the record to find out how much memory is needed */
+	unsigned int count = 0;
+	size_t speclen = 0;
+	if ((invalid == 0) && (valid != NULL)) {
+		speclen = 2 * (strlen(valid) + 1);
+		for (token = valid; *token; ) {
+			while (WSPACE(*token))
+				token++;
+			count++;
+			while (*token && !WSPACE(*token))
+				token++;
+		}
+	}
+
+	struct spf_record *rec = malloc(sizeof(*rec) + count * sizeof(rec->terms[0]) + speclen);
+	if (rec == NULL) {
+		free(txt);
+		return NULL;
+	}
+	memset(rec, 0, sizeof(*rec));
+	rec->txt = txt;
+	rec->terms = (struct spf_term *)(rec + 1);
+	char *store = (char *)(rec->terms + count);
+
 	/* RfC 7208 section 4.5:
 	 * 'If the resultant record set includes no records, check_host() produces the
 	 * "none" result.'.
 	 */
-	if (valid == NULL) {
-		free(txt);
-		return SPF_NONE;
+	if ((invalid != 0) || (valid == NULL)) {
+		rec->invalid = 1;
+		rec->result = invalid ? invalid : SPF_NONE;
+		return rec;
 	}
 	token = valid;
 
@@ -1706,137 +1963,271 @@ spflookup(const char *domain, unsigned int *queries)
 		const char *next = redirect + strlen("redirect=");
 		if (WSPACE(*next) || (*next == '\0') ||
 				(find_modifier(next, "redirect=") != NULL)) {
-			free(txt);
-			return SPF_PERMERROR;
+			rec->invalid = 1;
+			rec->result = SPF_PERMERROR;
+			return rec;
 		}
-		redirect = next;
+		rec->redirect = next;
+		spf_parse_domainspec(next, &rec->redirspec, &store);
 	}
 	const char *expl = find_modifier(token, "exp=");
 	if (expl != NULL) {
 		const char *next = expl + strlen("exp=");
 		if (find_modifier(next, "exp=") != NULL) {
-			free(txt);
-			return SPF_PERMERROR;
+			rec->invalid = 1;
+			rec->result = SPF_PERMERROR;
+			return rec;
 		}
 		/* RfC 7208, section 6.2
 		 * [I]f there are syntax errors in the explanation string,
 		 * then proceed as if no "exp" modifier was given.
 		 */
-		if (WSPACE(*next) || (*next == '\0'))
-			expl = NULL;
-		else
-			expl = next;
+		if (!WSPACE(*next) && (*next != '\0'))
+			rec->expl = next;
 	}
 
-	while (*token && (result == SPF_NONE)) {
+	while (*token) {
+		struct spf_term *t = rec->terms + rec->count++;
 		size_t mechlen;
 
-		if (*queries > 10) {
-			result = SPF_FAIL;
-			break;
-		}
+		memset(t, 0, sizeof(*t));
 
 		while (WSPACE(*token)) {
 			token++;
 		}
 		if (!*token) {
-			mechanism = "default";
+			t->kind = SPF_TERM_END;
 			break;
 		}
 		switch (*token) {
 		case '-':
 			token++;
-			prefix = SPF_FAIL;
+			t->qualifier = SPF_FAIL;
 			break;
 		case '~':
 			token++;
-			prefix = SPF_SOFTFAIL;
+			t->qualifier = SPF_SOFTFAIL;
 			break;
 		case '+':
 			token++;
-			prefix = SPF_PASS;
+			t->qualifier = SPF_PASS;
 			break;
 		case '?':
 			token++;
-			prefix = SPF_NEUTRAL;
+			t->qualifier = SPF_NEUTRAL;
 			break;
 		default:
 			if (((*token >= 'a') && (*token <= 'z')) ||
 					((*token >= 'A') && (*token <= 'Z'))) {
-				prefix = SPF_PASS;
+				t->qualifier = SPF_PASS;
 			} else {
-				free(txt);
-				return SPF_PERMERROR;
+				/* evaluation stops here, so the rest is not needed */
+				t->kind = SPF_TERM_BADQUALIFIER;
+				return rec;
 			}
 		}
+		t->token = token;
+
 		if ( (mechlen = match_mechanism(token, "mx", ":/")) != 0) {
-			token += mechlen;
+			t->kind = SPF_TERM_MX;
+			parse_optional_domainspec(token + mechlen, &t->spec, &store);
+		} else if ( (mechlen = match_mechanism(token, "ptr", ":/")) != 0) {
+			t->kind = SPF_TERM_PTR;
+			parse_optional_domainspec(token + mechlen, &t->spec, &store);
+		} else if ( (mechlen = match_mechanism(token, "exists", ":")) != 0) {
+			t->kind = SPF_TERM_EXISTS;
+			if (token[mechlen] == ':')
+				spf_parse_domainspec(token + mechlen + 1, &t->spec, &store);
+			else
+				t->error = SPF_PERMERROR;
+		} else if ( (mechlen = match_mechanism(token, "all", "")) != 0) {
+			t->kind = SPF_TERM_ALL;
+		} else if ( (mechlen = match_mechanism(token, "a", ":/")) != 0) {
+			t->kind = SPF_TERM_A;
+			parse_optional_domainspec(token + mechlen, &t->spec, &store);
+		} else if ( (mechlen = match_mechanism(token, "ip4", ":/")) != 0) {
+			if (token[mechlen] == ':') {
+				t->kind = SPF_TERM_IP4;
+				parse_ip4(token + mechlen + 1, t);
+			} else {
+				t->kind = SPF_TERM_INVALID;
+			}
+		} else if ( (mechlen = match_mechanism(token, "ip6", ":/")) != 0) {
+			if (token[mechlen] == ':') {
+				t->kind = SPF_TERM_IP6;
+				parse_ip6(token + mechlen + 1, t);
+			} else {
+				t->kind = SPF_TERM_INVALID;
+			}
+		} else if ( (mechlen = match_mechanism(token, "include", ":")) != 0) {
+			t->kind = SPF_TERM_INCLUDE;
+			if (may_have_domainspec(token + mechlen) == 1)
+				spf_parse_domainspec(token + mechlen + 1, &t->spec, &store);
+			else
+				t->error = SPF_PERMERROR;
+		} else {
+			/* assume this is a modifier (defined in RfC 4408, section 4.6.1) */
+			size_t eq = spf_modifier_name(token);
+
+			if (eq == 0) {
+				t->kind = SPF_TERM_BADTOKEN;
+			} else {
+				t->kind = SPF_TERM_MODIFIER;
+				/* modifier must not have qualification */
+				if (!WSPACE(*(token - 1)))
+					t->error = SPF_PERMERROR;
+				/* the value can only be invalid if it contains makros */
+				const char *v = token + eq + 1;
+				while (*v && !WSPACE(*v) && (*v != '/') && (*v != '%'))
+					v++;
+				if (*v == '%')
+					t->value = token + eq + 1;
+			}
+		}
 
-			result = spfmx(domain, token);
+		/* skip to the end of this token */
+		while (*token && !WSPACE(*token)) {
+			token++;
+		}
+	}
+
+	return rec;
+}
+
+/**
+ * @brief look up and compile the SPF record of a domain
+ * @param domain the domain to look up
+ * @param redirected if this is not the initial lookup
+ * @param rec the compiled record is stored here, NULL if there is none
+ * @return 0 on success, one of the SPF_* constants or -1 on ENOMEM otherwise
+ */
+static int
+spf_record_get(const char *domain, const int redirected, struct spf_record **rec)
+{
+	char *txt;
+	int i;
+
+	*rec = NULL;
+
+	if (!redirected)
+		i = dnstxt_records(&txt, domain);
+	else
+		i = txtlookup(&txt, domain);
+
+	if (i < 0) {
+		switch (errno) {
+		case ENOENT:
+			return SPF_NONE;
+		case ETIMEDOUT:
+		case EIO:
+		case ECONNREFUSED:
+		case EAGAIN:
+			return SPF_TEMPERROR;
+		case EINVAL:
+			return SPF_DNS_HARD_ERROR;
+		case ENOMEM:
+		default:
+			return -1;
+		}
+	}
+	if (i == 0)
+		return SPF_NONE;
+
+	*rec = spf_compile(txt, i);
+
+	return (*rec == NULL) ? -1 : 0;
+}
+
+static int spflookup(const char *domain, unsigned int *queries);
+
+/**
+ * @brief evaluate a compiled SPF record
+ * @param rec the compiled record
+ * @param domain the domain the record belongs to
+ * @param queries number of DNS queries done
+ * @return one of the SPF_* constants defined in include/antispam.h or -1 on ENOMEM
+ */
+static int
+spf_evaluate(const struct spf_record *rec, const char *domain, unsigned int *queries)
+{
+	int i, result = SPF_NONE, prefix = SPF_NONE;
+	const char *mechanism = NULL;
+
+	if (rec->invalid)
+		return rec->result;
+
+	for (unsigned int n = 0; (n < rec->count) && (result == SPF_NONE); n++) {
+		const struct spf_term *t = rec->terms + n;
+
+		if (*queries > 10) {
+			result = SPF_FAIL;
+			break;
+		}
+
+		if (t->kind == SPF_TERM_END) {
+			mechanism = "default";
+			break;
+		} else if (t->kind == SPF_TERM_BADQUALIFIER) {
+			return SPF_PERMERROR;
+		}
+		prefix = t->qualifier;
+
+		switch (t->kind) {
+		case SPF_TERM_MX:
+			result = spfmx(domain, &t->spec);
 			mechanism = "MX";
 			*queries += 1;
-		} else if ( (mechlen = match_mechanism(token, "ptr", ":/")) != 0) {
-			token += mechlen;
-
-			result = spfptr(domain, token);
+			break;
+		case SPF_TERM_PTR:
+			result = spfptr(domain, &t->spec);
 			mechanism = "PTR";
 			*queries += 1;
-		} else if ( (mechlen = match_mechanism(token, "exists", ":")) != 0) {
-			token += mechlen;
-
-			if (*token == ':') {
-				result = spfexists(domain, ++token);
+			break;
+		case SPF_TERM_EXISTS:
+			if (t->error == 0) {
+				result = spfexists(domain, &t->spec);
 				mechanism = "exists";
 			} else {
-				result = SPF_PERMERROR;
+				result = t->error;
 			}
 			*queries += 1;
-		} else if ( (mechlen = match_mechanism(token, "all", "")) != 0) {
-			token += mechlen;
+			break;
+		case SPF_TERM_ALL:
 			result = SPF_PASS;
 			mechanism = "all";
-		} else if ( (mechlen = match_mechanism(token, "a", ":/")) != 0) {
-			token += mechlen;
-
-			result = spfa(domain, token);
+			break;
+		case SPF_TERM_A:
+			result = spfa(domain, &t->spec);
 			mechanism = "A";
 			*queries += 1;
-		} else if ( (mechlen = match_mechanism(token, "ip4", ":/")) != 0) {
-			token += mechlen;
-
-			if (*token == ':') {
-				result = spfip4(++token);
-				mechanism = "IP4";
-			} else {
-				result = SPF_PERMERROR;
-			}
-		} else if ( (mechlen = match_mechanism(token, "ip6", ":/")) != 0) {
-			token += mechlen;
-
-			if (*token == ':') {
-				result = spfip6(++token);
-				mechanism = "IP6";
-			} else {
-				result = SPF_PERMERROR;
-			}
-		} else if ( (mechlen = match_mechanism(token, "include", ":")) != 0) {
-			token += mechlen;
-
-			if (may_have_domainspec(token) == 1) {
-				char *n = NULL;
-				int ip4l, ip6l;
+			break;
+		case SPF_TERM_IP4:
+			result = spfip4(t);
+			mechanism = "IP4";
+			break;
+		case SPF_TERM_IP6:
+			result = spfip6(t);
+			mechanism = "IP6";
+			break;
+		case SPF_TERM_INVALID:
+			result = SPF_PERMERROR;
+			break;
+		case SPF_TERM_INCLUDE:
+			if (t->error == 0) {
+				char *expanded;
+				const char *target;
 
-				i = spf_domainspec(domain, token + 1, &n, &ip4l, &ip6l);
+				i = spec_expand(domain, &t->spec, &expanded, &target);
 				if (i != 0) {
 					result = i;
 				} else {
-					if ((ip4l >= 0) || (ip6l >= 0)) {
+					if ((t->spec.ip4cidr >= 0) || (t->spec.ip6cidr >= 0)) {
 						result = SPF_PERMERROR;
 					} else {
 						*queries += 1;
-						result = spflookup(n, queries);
+						result = spflookup(target, queries);
 					}
-					free(n);
+					free(expanded);
 				}
 			} else {
 				result = SPF_PERMERROR;
@@ -1863,54 +2254,42 @@ spflookup(const char *domain, unsigned int *queries)
 			}
 
 			mechanism = "include";
-		} else {
-			/* assume this is a modifier (defined in RfC 4408, section 4.6.1) */
-			size_t eq = spf_modifier_name(token);
-
-			if (eq == 0) {
-				record_bad_token(token);
-				result = SPF_PERMERROR;
-				break;
-			} else {
+			break;
+		case SPF_TERM_BADTOKEN:
+			record_bad_token(t->token);
+			result = SPF_PERMERROR;
+			break;
+		case SPF_TERM_MODIFIER:
+			if (t->error != 0) {
+				result = t->error;
+			} else if (t->value != NULL) {
 				char *mres = NULL;
 
-				/* modifier must not have qualification */
-				if (!WSPACE(*(token - 1))) {
-					result = SPF_PERMERROR;
-				} else {
-					i = spf_makro(token + eq + 1, domain, 0, &mres);
-					if (i == 0) {
-						/* token is valid, but not evaluated here */
-						free(mres);
-						token += eq + 1;
-					} else {
-						/* some error condition */
-						result = i;
-					}
-				}
-
-				if (result == SPF_PERMERROR) {
-					record_bad_token(token);
-					break;
-				}
+				i = spf_makro(t->value, domain, 0, &mres);
+				if (i == 0)
+					/* token is valid, but not evaluated here */
+					free(mres);
+				else
+					/* some error condition */
+					result = i;
 			}
-		}
-		/* skip to the end of this token */
-		while (*token && !WSPACE(*token)) {
-			token++;
+
+			if (result == SPF_PERMERROR)
+				record_bad_token(t->token);
+			break;
+		default:
+			assert(0);
 		}
 	}
-	if (result < 0) {
-		free(txt);
+	if (result < 0)
 		return result;
-	}
 	if (result != SPF_NONE) {
 		if (result == SPF_PASS)
 			result = prefix;
-		if ((result == SPF_FAIL) && (expl != NULL)) {
+		if ((result == SPF_FAIL) && (rec->expl != NULL)) {
 			char *target;
 
-			switch (spf_makro(expl, domain, 0, &target)) {
+			switch (spf_makro(rec->expl, domain, 0, &target)) {
 			case 0:
 				{
 				size_t dlen = strlen(target);
@@ -1951,7 +2330,6 @@ spflookup(const char *domain, unsigned int *queries)
 				}
 			}
 		}
-		free(txt);
 		xmitstat.spfmechanism = mechanism;
 		return result;
 	}
@@ -1959,14 +2337,14 @@ spflookup(const char *domain, unsigned int *queries)
 	/* redirect is handled last as it has to be ignored if any "all"
 	 * record is present _anywhere_ in the record.
 	 * See: RfC 7208, section 6.1 */
-	if (redirect) {
+	if (rec->redirect) {
 		char *domspec;
-		int i4, i6;
+		const char *target;
 
-		result = spf_domainspec(domain, redirect, &domspec, &i4, &i6);
+		result = spec_expand(domain, &rec->redirspec, &domspec, &target);
 
 		if (result == 0) {
-			if ((i4 != -1) || (i6 != -1)) {
+			if ((rec->redirspec.ip4cidr != -1) || (rec->redirspec.ip6cidr != -1)) {
 				result = SPF_PERMERROR;
 			} else {
 				*queries += 1;
@@ -1976,12 +2354,12 @@ spflookup(const char *domain, unsigned int *queries)
 				 */
 				free(xmitstat.spfexp);
 				xmitstat.spfexp = NULL;
-				result = spflookup(domspec, queries);
+				result = spflookup(target, queries);
 				/* RfC 7208, section 6.1:
 				 *   The result of this new evaluation of check_host() is then considered
 				 *   the result of the current evaluation with the exception that if no
 				 *   SPF record is found, or if the <target-name> is malformed, the result
-				 *   is a "permerror" rather than "none". 
+				 *   is a "permerror" rather than "none".
 				 */
 				if (result == SPF_NONE)
 					result = SPF_FAIL;
@@ -1991,7 +2369,108 @@ spflookup(const char *domain, unsigned int *queries)
 	} else {
 		result = SPF_NEUTRAL;
 	}
-	free(txt);
+	return result;
+}
+
+/**
+ * @brief start the lookup of an SPF record in the background
+ * @param target the domain-spec of an include or redirect
+ */
+static void
+spf_prefetch_txt(const char *target)
+{
+	char lookup[DOMAINNAME_MAX + 1];
+
+	if (txt_lookupname(target, lookup) == 0)
+		spfprefetch_start(SPF_PREFETCH_TXT, lookup);
+}
+
+/**
+ * @brief start the DNS lookups needed by a record in the background
+ * @param rec the compiled record
+ * @param domain the current domain
+ * @param queries number of DNS queries done
+ *
+ * Only mechanisms without makros are looked up, the targets of the others
+ * depend on earlier results. Not more lookups are started than the remaining
+ * query limit allows, including those already pending for the records this
+ * one is included from.
+ */
+static void
+spf_prefetch(const struct spf_record *rec, const char *domain, const unsigned int queries)
+{
+	const int v4 = IN6_IS_ADDR_V4MAPPED(&xmitstat.sremoteip);
+	int hasall = 0;
+
+	if (rec->invalid)
+		return;
+
+	for (unsigned int n = 0; (n < rec->count) && (queries + spfprefetch_pending() < 10); n++) {
+		const struct spf_term *t = rec->terms + n;
+		const struct spf_domainspec *spec = &t->spec;
+
+		if (t->kind == SPF_TERM_BADQUALIFIER)
+			return;
+		if (t->kind == SPF_TERM_ALL)
+			hasall = 1;
+		if ((t->error != 0) || (spec->error != 0) || spec->macro || (spec->cidrerror != 0))
+			continue;
+
+		switch (t->kind) {
+		case SPF_TERM_A:
+			spfprefetch_start(v4 ? SPF_PREFETCH_A : SPF_PREFETCH_AAAA,
+					(spec->name != NULL) ? spec->name : domain);
+			break;
+		case SPF_TERM_MX:
+			spfprefetch_start(SPF_PREFETCH_MX, (spec->name != NULL) ? spec->name : domain);
+			break;
+		case SPF_TERM_EXISTS:
+			if ((spec->name != NULL) && (spec->ip4cidr <= 0) && (spec->ip6cidr <= 0))
+				spfprefetch_start(SPF_PREFETCH_A, spec->name);
+			break;
+		case SPF_TERM_INCLUDE:
+			if ((spec->name != NULL) && (spec->ip4cidr < 0) && (spec->ip6cidr < 0))
+				spf_prefetch_txt(spec->name);
+			break;
+		default:
+			break;
+		}
+	}
+
+	/* the redirect is ignored if the record contains an "all" mechanism */
+	const struct spf_domainspec *redir = &rec->redirspec;
+	if ((rec->redirect != NULL) && !hasall && (queries + spfprefetch_pending() < 10) &&
+			(redir->name != NULL) && !redir->macro && (redir->error == 0) &&
+			(redir->cidrerror == 0) && (redir->ip4cidr == -1) && (redir->ip6cidr == -1))
+		spf_prefetch_txt(redir->name);
+}
+
+/**
+ * look up SPF records for domain
+ *
+ * @param domain no idea what this might be for
+ * @param queries number of DNS queries done
+ * @return one of the SPF_* constants defined in include/antispam.h or -1 on ENOMEM
+ */
+static int
+spflookup(const char *domain, unsigned int *queries)
+{
+	struct spf_record *rec;
+
+	/* don't enforce valid domains on redirects */
+	if ((*queries == 0) && domainvalid(domain))
+		return SPF_PERMERROR;
+
+	int result = spf_record_get(domain, *queries != 0, &rec);
+	if (rec == NULL)
+		return result;
+
+	const unsigned int mark = spfprefetch_mark();
+	spf_prefetch(rec, domain, *queries);
+	result = spf_evaluate(rec, domain, queries);
+	spfprefetch_release(mark);
+	spf_record_free(rec);
+
 	return result;
 }
 
@@ -2001,6 +2480,10 @@ spflookup(const char *domain, unsigned int *queries)
  * This works a like the check_host in the SPF draft but takes two arguments less. The remote ip and the full
  * sender address can be taken directly from xmitstat.
  *
+ * Results are taken from and stored in the shared SPF cache if it is enabled.
+ * The lifetime of a stored result is limited by the lowest TTL of the SPF
+ * records that were evaluated.
+ *
  * @param domain no idea what this might be for ;)
  * @return one of the SPF_* constants defined in include/antispam.h
  */
@@ -2011,6 +2494,18 @@ check_host(const char *domain)
 	 * SPF implementations MUST limit the total number of those terms to 10
 	 * during SPF evaluation */
 	unsigned int queries = 0;
+	int r = spfcache_lookup(domain);
+
+	if (r >= 0)
+		return r;
+
+	spf_volatile = 0;
+	dnstxt_minttl = ULONG_MAX;
+	r = spflookup(domain, &queries);
 
-	return spflookup(domain, &queries);
+	/* temporary errors should be retried soon, so they are not cached */
+	if ((r >= 0) && (r != SPF_TEMPERROR) && !spf_volatile)
+		spfcache_store(domain, r, dnstxt_minttl);
+
+	return r;
 }
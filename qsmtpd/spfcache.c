@@ -0,0 +1,218 @@
+/** \file spfcache.c
+ \brief cache of SPF results shared between Qsmtpd processes
+
+ Bulk senders often deliver many mails from the same host within a short
+ time. Evaluating their SPF policy again for every mail costs a lot of DNS
+ queries, so the final results are stored in a file that is mapped into
+ every Qsmtpd process. The file is given in the SPFCACHE environment variable,
+ if it is not set no results are cached.
+
+ A result is identified by the checked domain, the IP address of the client,
+ and the domain of the sender (or the HELO if the sender is empty). Results
+ that depend on other inputs, like the local part of the sender, are never
+ stored. The cache is a simple hash table where a new entry replaces the old
+ one in the same slot.
+ */
+
+#include <qsmtpd/spfcache.h>
+
+#include <qdns.h>
+#include <qsmtpd/antispam.h>
+#include <qsmtpd/qsmtpd.h>
+#include <sharedtable.h>
+
+#include <ctype.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+#define SPFCACHE_MAGIC "QSSPFC1"	/**< identifies a cache file */
+#define SPFCACHE_SLOTS 4096		/**< number of entries in the cache file */
+#define SPFCACHE_MECHLEN 16		/**< maximum length of a cached mechanism including the trailing 0 byte */
+#define SPFCACHE_EXPLEN 512		/**< maximum length of a cached explanation including the trailing 0 byte */
+
+unsigned long spfcachetime = 3600;	/**< maximum lifetime of a cached result in seconds, 0 disables the cache */
+
+/** @struct spfcache_slot
+ * @brief one cached SPF result
+ */
+struct spfcache_slot {
+	uint32_t hash;				/**< hash of the key, 0 if the slot is unused */
+	uint32_t result;			/**< the SPF result */
+	int64_t expires;			/**< time() when the entry becomes invalid */
+	struct in6_addr ip;			/**< IP address of the client */
+	char domain[DOMAINNAME_MAX + 1];	/**< the checked domain */
+	char sender[DOMAINNAME_MAX + 1];	/**< domain of the sender */
+	char mechanism[SPFCACHE_MECHLEN];	/**< the SPF mechanism that matched */
+	char exp[SPFCACHE_EXPLEN];		/**< the SPF explanation, empty if there is none */
+};
+
+static struct shared_table cache = SHARED_TABLE_INIT("SPFCACHE", SPFCACHE_MAGIC, "SPF cache",
+		SPFCACHE_SLOTS, sizeof(struct spfcache_slot));
+
+/* the mechanism names used by spflookup(), cached entries point to them again */
+static const char *mechanisms[] = { "MX", "PTR", "exists", "all", "A", "IP4", "IP6", "include", "default", NULL };
+
+static int
+cache_open(void)
+{
+	return (spfcachetime != 0) && shtable_open(&cache);
+}
+
+/**
+ * @brief get the sender part of the cache key
+ * @param len the length of the result is stored here
+ * @return the domain of the sender, the HELO if the sender is empty
+ */
+static const char *
+key_sender(size_t *len)
+{
+	if (xmitstat.mailfrom.len != 0) {
+		const char *at = strchr(xmitstat.mailfrom.s, '@');
+
+		if (at != NULL) {
+			*len = xmitstat.mailfrom.len - (at + 1 - xmitstat.mailfrom.s);
+			return at + 1;
+		}
+	}
+
+	*len = HELOLEN;
+	return (HELOSTR == NULL) ? "" : HELOSTR;
+}
+
+static uint32_t
+hash_add(uint32_t h, const char *s, const size_t len, const int fold)
+{
+	/* FNV-1a */
+	for (size_t i = 0; i < len; i++) {
+		h ^= fold ? (unsigned char)tolower((unsigned char)s[i]) : (unsigned char)s[i];
+		h *= 16777619;
+	}
+
+	return h;
+}
+
+static uint32_t
+key_hash(const char *domain, const char *sender, const size_t senderlen)
+{
+	uint32_t h = 2166136261u;
+
+	h = hash_add(h, domain, strlen(domain), 1);
+	h = hash_add(h, "", 1, 0);
+	h = hash_add(h, sender, senderlen, 1);
+	h = hash_add(h, (const char *)&xmitstat.sremoteip, sizeof(xmitstat.sremoteip), 0);
+
+	/* 0 marks unused slots */
+	return (h == 0) ? 1 : h;
+}
+
+static int
+key_matches(const struct spfcache_slot *slot, const uint32_t hash, const char *domain,
+		const char *sender, const size_t senderlen)
+{
+	return (slot->hash == hash) &&
+			(memcmp(&slot->ip, &xmitstat.sremoteip, sizeof(slot->ip)) == 0) &&
+			(strcasecmp(slot->domain, domain) == 0) &&
+			(strncasecmp(slot->sender, sender, senderlen) == 0) &&
+			(slot->sender[senderlen] == '\0');
+}
+
+/**
+ * @brief look up a cached SPF result
+ * @param domain the domain to check
+ * @return the cached SPF result
+ * @retval -1 no result is cached
+ *
+ * On success xmitstat.spfmechanism is set. If an explanation was cached
+ * xmitstat.spfexp is replaced by it.
+ */
+int
+spfcache_lookup(const char *domain)
+{
+	size_t senderlen;
+	const char *sender = key_sender(&senderlen);
+
+	if ((strlen(domain) > DOMAINNAME_MAX) || (senderlen > DOMAINNAME_MAX) || !cache_open())
+		return -1;
+
+	const uint32_t hash = key_hash(domain, sender, senderlen);
+	const struct spfcache_slot *slot = shtable_slot(&cache, hash);
+	int ret = -1;
+
+	if (shtable_lock(&cache, LOCK_SH) != 0)
+		return -1;
+
+	if (key_matches(slot, hash, domain, sender, senderlen) && (slot->expires > time(NULL))) {
+		char *exp = NULL;
+
+		if ((slot->exp[0] != '\0') && ((exp = strdup(slot->exp)) == NULL)) {
+			shtable_unlock(&cache);
+			return -1;
+		}
+
+		ret = slot->result;
+		xmitstat.spfmechanism = NULL;
+		for (unsigned int i = 0; mechanisms[i] != NULL; i++) {
+			if (strcmp(mechanisms[i], slot->mechanism) == 0) {
+				xmitstat.spfmechanism = mechanisms[i];
+				break;
+			}
+		}
+		if (exp != NULL) {
+			free(xmitstat.spfexp);
+			xmitstat.spfexp = exp;
+		}
+	}
+
+	shtable_unlock(&cache);
+
+	return ret;
+}
+
+/**
+ * @brief store an SPF result in the cache
+ * @param domain the checked domain
+ * @param result the SPF result
+ * @param ttl the lowest TTL of the DNS records the result is based on
+ *
+ * The entry lives for the given TTL, but at most spfcachetime seconds. The
+ * values of xmitstat.spfmechanism and xmitstat.spfexp are stored with it.
+ */
+void
+spfcache_store(const char *domain, const int result, const unsigned long ttl)
+{
+	size_t senderlen;
+	const char *sender = key_sender(&senderlen);
+	const unsigned long lifetime = (ttl < spfcachetime) ? ttl : spfcachetime;
+
+	if ((lifetime == 0) || (strlen(domain) > DOMAINNAME_MAX) || (senderlen > DOMAINNAME_MAX))
+		return;
+	if ((result == SPF_FAIL) && (xmitstat.spfexp != NULL) && (strlen(xmitstat.spfexp) >= SPFCACHE_EXPLEN))
+		return;
+	if ((xmitstat.spfmechanism != NULL) && (strlen(xmitstat.spfmechanism) >= SPFCACHE_MECHLEN))
+		return;
+	if (!cache_open())
+		return;
+
+	const uint32_t hash = key_hash(domain, sender, senderlen);
+	struct spfcache_slot *slot = shtable_slot(&cache, hash);
+
+	if (shtable_lock(&cache, LOCK_EX) != 0)
+		return;
+
+	memset(slot, 0, sizeof(*slot));
+	slot->result = result;
+	slot->expires = time(NULL) + lifetime;
+	slot->ip = xmitstat.sremoteip;
+	strcpy(slot->domain, domain);
+	memcpy(slot->sender, sender, senderlen);
+	if (xmitstat.spfmechanism != NULL)
+		strcpy(slot->mechanism, xmitstat.spfmechanism);
+	if ((result == SPF_FAIL) && (xmitstat.spfexp != NULL))
+		strcpy(slot->exp, xmitstat.spfexp);
+	slot->hash = hash;
+
+	shtable_unlock(&cache);
+}
@@ -0,0 +1,282 @@
+/** \file spfprefetch.c
+ \brief DNS lookups of SPF mechanisms started before the record is evaluated
+
+ SPF records are evaluated term by term, and every include, a, mx, and exists
+ mechanism needs a DNS lookup before the next term can be checked. Records of
+ big providers contain many of those, so waiting for each answer in turn adds
+ up to a long time.
+
+ When a record has been compiled the targets of all its mechanisms that do not
+ contain makros are known. A helper process is started for each of them that
+ does the lookup and sends the answer back through a pipe. The evaluation then
+ runs in order as before, but takes the answers from the helpers, which have
+ been running concurrently since the record was compiled. The resolver used
+ by libowfat is blocking, so this can't be done with concurrent queries from
+ the same process.
+ */
+
+#include <qsmtpd/spfprefetch.h>
+
+#include <fdio.h>
+#include <libowfatconn.h>
+#include <qsmtpd/bgdns.h>
+
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#define SPF_PREFETCH_MAX 32	/**< maximum number of lookups that are remembered at the same time */
+
+/** @struct prefetch_entry
+ * @brief one lookup done by a helper process
+ */
+struct prefetch_entry {
+	enum spf_prefetch_type type;	/**< the lookup to do */
+	char *name;			/**< the name to look up */
+	struct bgdns_job job;		/**< the helper, job.pid is 0 once it has finished */
+	int taken;			/**< set once spfprefetch_take() has returned this entry */
+};
+
+/** @struct prefetch_wire
+ * @brief fixed size part of the answer as sent by the helper
+ */
+struct prefetch_wire {
+	int result;		/**< return code of the lookup function */
+	int err;		/**< errno after the lookup */
+	unsigned long ttl;	/**< dnstxt_minttl after the lookup */
+	unsigned long queries;	/**< number of DNS queries sent by the helper */
+	size_t len;		/**< length of the TXT or address data that follows */
+	unsigned int mxcount;	/**< number of MX entries that follow */
+};
+
+static struct prefetch_entry entries[SPF_PREFETCH_MAX];
+static unsigned int entrycnt;	/**< number of used entries */
+
+static void __attribute__ ((noreturn))
+prefetch_child(const int fd, const void *arg)
+{
+	const struct prefetch_entry *e = arg;
+	const char *name = e->name;
+	const enum spf_prefetch_type type = e->type;
+	struct prefetch_wire w = {
+		.len = 0,
+		.mxcount = 0
+	};
+	char *txt = NULL;
+	struct in6_addr *ip = NULL;
+	struct ips *mx = NULL;
+
+	dnstxt_minttl = ULONG_MAX;
+	dns_queries = 0;
+	errno = 0;
+
+	switch (type) {
+	case SPF_PREFETCH_TXT:
+		w.result = dnstxt_records(&txt, name);
+		w.err = errno;
+		/* the records are separated by 0 bytes */
+		for (int i = 0; i < w.result; i++)
+			w.len += strlen(txt + w.len) + 1;
+		break;
+	case SPF_PREFETCH_A:
+	case SPF_PREFETCH_AAAA:
+		if (type == SPF_PREFETCH_A)
+			w.result = ask_dnsa(name, &ip);
+		else
+			w.result = ask_dnsaaaa(name, &ip);
+		w.err = errno;
+		if (w.result > 0)
+			w.len = w.result * sizeof(*ip);
+		break;
+	case SPF_PREFETCH_MX:
+		w.result = ask_dnsmx(name, &mx);
+		w.err = errno;
+		for (const struct ips *cur = mx; cur != NULL; cur = cur->next)
+			w.mxcount++;
+		break;
+	}
+	w.ttl = dnstxt_minttl;
+	w.queries = dns_queries;
+
+	if (write_all(fd, &w, sizeof(w)) != 0)
+		_exit(1);
+	if ((w.len != 0) && (write_all(fd, (txt != NULL) ? (const void *)txt : (const void *)ip, w.len) != 0))
+		_exit(1);
+
+	if (bgdns_write_mx(fd, mx) != 0)
+		_exit(1);
+
+	_exit(0);
+}
+
+/**
+ * @brief read the answer of a helper
+ * @param e the entry of the helper
+ * @param ans the answer is stored here
+ * @return 0 on success, -1 on error
+ */
+static int
+read_answer(const struct prefetch_entry *e, struct spf_prefetch_answer *ans)
+{
+	struct prefetch_wire w;
+
+	memset(ans, 0, sizeof(*ans));
+
+	if (bgdns_wait(&e->job) != 0)
+		return -1;
+
+	if (read_all(e->job.fd, &w, sizeof(w)) != 0)
+		return -1;
+
+	ans->result = w.result;
+	ans->err = w.err;
+	ans->ttl = w.ttl;
+	/* account the queries as if they were sent by this process */
+	dns_queries += w.queries;
+
+	if (w.len != 0) {
+		void *data = malloc(w.len);
+
+		if (data == NULL)
+			return -1;
+		if (e->type == SPF_PREFETCH_TXT)
+			ans->txt = data;
+		else
+			ans->ip = data;
+
+		if (read_all(e->job.fd, data, w.len) != 0)
+			return -1;
+	}
+
+	return bgdns_read_mx(e->job.fd, w.mxcount, &ans->mx);
+}
+
+static void
+finish_entry(struct prefetch_entry *e, const int sig)
+{
+	if (e->job.pid != 0)
+		bgdns_finish(&e->job, sig);
+}
+
+/**
+ * @brief get the current position in the list of lookups
+ * @return the value to pass to spfprefetch_release()
+ */
+unsigned int
+spfprefetch_mark(void)
+{
+	return entrycnt;
+}
+
+/**
+ * @brief forget the lookups started after the given position
+ * @param mark the value returned by spfprefetch_mark()
+ *
+ * Helpers that are still running are killed.
+ */
+void
+spfprefetch_release(const unsigned int mark)
+{
+	while (entrycnt > mark) {
+		struct prefetch_entry *e = entries + --entrycnt;
+
+		finish_entry(e, SIGKILL);
+		free(e->name);
+		e->name = NULL;
+	}
+}
+
+/**
+ * @brief get the number of lookups whose answers have not been used yet
+ * @return the number of pending lookups
+ */
+unsigned int
+spfprefetch_pending(void)
+{
+	unsigned int ret = 0;
+
+	for (unsigned int i = 0; i < entrycnt; i++)
+		if (!entries[i].taken)
+			ret++;
+
+	return ret;
+}
+
+/**
+ * @brief start a lookup in the background
+ * @param type the kind of lookup
+ * @param name the name to look up
+ *
+ * If the same lookup is already pending or no helper can be started nothing
+ * happens, the lookup will then be done when it is needed.
+ */
+void
+spfprefetch_start(const enum spf_prefetch_type type, const char *name)
+{
+	if (entrycnt == SPF_PREFETCH_MAX)
+		return;
+
+	for (unsigned int i = 0; i < entrycnt; i++)
+		if (!entries[i].taken && (entries[i].type == type) && (strcasecmp(entries[i].name, name) == 0))
+			return;
+
+	struct prefetch_entry *e = entries + entrycnt;
+
+	e->name = strdup(name);
+	if (e->name == NULL)
+		return;
+	e->type = type;
+	e->taken = 0;
+
+	if (bgdns_start(&e->job, prefetch_child, e) != 0) {
+		free(e->name);
+		e->name = NULL;
+		return;
+	}
+
+	entrycnt++;
+}
+
+/**
+ * @brief get the answer of a lookup started in the background
+ * @param type the kind of lookup
+ * @param name the name to look up
+ * @param ans the answer is stored here
+ * @return if an answer is available
+ * @retval 1 ans is set
+ * @retval 0 the lookup was not started before or the helper failed
+ *
+ * Every answer is returned only once. If 0 is returned the caller has to do
+ * the lookup itself.
+ */
+int
+spfprefetch_take(const enum spf_prefetch_type type, const char *name, struct spf_prefetch_answer *ans)
+{
+	for (unsigned int i = 0; i < entrycnt; i++) {
+		struct prefetch_entry *e = entries + i;
+
+		if (e->taken || (e->type != type) || (strcasecmp(e->name, name) != 0))
+			continue;
+
+		e->taken = 1;
+		if (e->job.pid == 0)
+			return 0;
+
+		if (read_answer(e, ans) != 0) {
+			free(ans->txt);
+			free(ans->ip);
+			freeips(ans->mx);
+			finish_entry(e, SIGKILL);
+			return 0;
+		}
+
+		finish_entry(e, 0);
+		return 1;
+	}
+
+	return 0;
+}
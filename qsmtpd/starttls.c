@@ -4,6 +4,7 @@
 
 #include <qsmtpd/starttls.h>
 
+#include <certstore.h>
 #include <control.h>
 #include <fmt.h>
 #include <log.h>
@@ -12,6 +13,7 @@
 #include <qsmtpd/addrparse.h>
 #include <qsmtpd/qsmtpd.h>
 #include <qsmtpd/syntax.h>
+#include <qsmtpd/tlssession.h>
 #include <ssl_timeoutio.h>
 #include <tls.h>
 #include <version.h>
@@ -21,13 +23,15 @@
 #include <fcntl.h>
 #include <stdio.h>
 #include <string.h>
-#include <syslog.h>
 #include <sys/stat.h>
+#include <syslog.h>
 #include <unistd.h>
 
 static char certfilename[24 + INET6_ADDRSTRLEN + 6] = "control/servercert.pem";		/**< path to SSL certificate filename */
 static char keyfilenamebuf[sizeof(certfilename)] = "control/serverkey.pem";	/**< buffer for SSL key filename */
 static const char *keyfilename = certfilename;		/**< path to SSL key filename, defaults to reuse cert file */
+static struct certstore certstore;	/**< the compiled certificates, if any */
+static int certidx = -1;		/**< index of the certificate in certstore, -1 if the files are used */
 
 /**
  * @brief check if a TLS certificate is present
@@ -44,6 +48,13 @@ find_servercert(const char *localport)
 	const size_t diroffs = strlen("control/");
 	size_t iplen;
 
+	if (certstore_open(controldir_fd, CERTSTORE_SERVER, &certstore) == 0) {
+		certidx = certstore_find(&certstore, xmitstat.localip, localport);
+		return (certidx >= 0) ? 0 : -1;
+	} else if (errno != ENOENT) {
+		log_write(LOG_WARNING, "can't use control/" CERTSTORE_NAME ", using the certificate files instead");
+	}
+
 	/* append ".<ip>" to the normal certfilename */
 	certfilename[oldlen] = '.';
 	strncpy(certfilename + oldlen + 1, xmitstat.localip, sizeof(certfilename) - oldlen - 1);
@@ -182,6 +193,35 @@ tls_err(const char *s)
 	return r ? r : -EDONE;
 }
 
+/**
+ * @brief select the certificate matching the name the client asked for
+ *
+ * If no certificate for that name is found the one selected by the local
+ * address is kept.
+ */
+static int
+servername_cb(SSL *s, int *al __attribute__ ((unused)), void *arg __attribute__ ((unused)))
+{
+	const char *name = SSL_get_servername(s, TLSEXT_NAMETYPE_host_name);
+
+	if (name == NULL)
+		return SSL_TLSEXT_ERR_NOACK;
+
+	const int idx = certstore_find_name(&certstore, name);
+	if (idx < 0)
+		return SSL_TLSEXT_ERR_NOACK;
+
+	if ((idx != certidx) && (certstore_use(&certstore, idx, s) != 0)) {
+		const char *logmsg[] = { "can't use certificate ", certstore_file(&certstore, idx),
+				" from " CERTSTORE_NAME " for ", name, NULL };
+
+		log_writen(LOG_ERR, logmsg);
+		return SSL_TLSEXT_ERR_NOACK;
+	}
+
+	return SSL_TLSEXT_ERR_OK;
+}
+
 #define CLIENTCA "control/clientca.pem"
 #define CLIENTCRL "control/clientcrl.pem"
 
@@ -205,10 +245,7 @@ tls_check_cert(char * const *clients)
 	cstring email = { .len = 0, .s = NULL };
 	int ret = 0;
 
-	if (SSL_set_session_id_context(xmitstat.ssl, VERSIONSTRING, strlen(VERSIONSTRING)) != 1) {
-		const char *err = ssl_strerror();
-		return tls_out("setting session id failed", err, -EPROTO);
-	}
+	/* the session id context was already set for the context in tls_session_setup() */
 
 	/* renegotiate to force the client to send it's certificate */
 	int n = ssl_timeoutrehandshake(xmitstat.ssl, timeout);
@@ -290,6 +327,18 @@ tls_verify(void)
 	if (clients == NULL)
 		return 0;
 
+	SSL_CTX *ctx = SSL_get_SSL_CTX(xmitstat.ssl);
+	if (SSL_CTX_load_verify_locations(ctx, CLIENTCA, NULL) != 1) {
+		struct stat st;
+
+		free(clients);
+		/* a missing file only means there are no client CAs, but one that
+		 * can't be loaded is a configuration error */
+		if ((stat(CLIENTCA, &st) == -1) && (errno == ENOENT))
+			return 0;
+		return tls_err("cannot load client CAs");
+	}
+
 	STACK_OF(X509_NAME) *sk = SSL_load_client_CA_file(CLIENTCA);
 	if (sk == NULL) {
 		/* if CLIENTCA contains all the standard root certificates, a
@@ -300,6 +349,12 @@ tls_verify(void)
 		return 0;
 	}
 
+	/* crl checking */
+	X509_STORE *store = SSL_CTX_get_cert_store(ctx);
+	X509_LOOKUP *lookup = X509_STORE_add_lookup(store, X509_LOOKUP_file());
+	if (lookup && (X509_load_crl_file(lookup, CLIENTCRL, X509_FILETYPE_PEM) == 1))
+		X509_STORE_set_flags(store, X509_V_FLAG_CRL_CHECK | X509_V_FLAG_CRL_CHECK_ALL);
+
 	SSL_set_client_CA_list(xmitstat.ssl, sk);
 	SSL_set_verify(xmitstat.ssl, SSL_VERIFY_PEER | SSL_VERIFY_CLIENT_ONCE, verify_callback);
 
@@ -320,9 +375,12 @@ tls_init()
 	const char *ciphfn = "tlsserverciphers";
 	long ssl_options = SSL_OP_SINGLE_DH_USE;
 
-	SSL_library_init();
 	STREMPTY(saciphers);
 
+	/* OpenSSL is first touched here, plaintext sessions never initialize it */
+	if (ssl_library_setup() != 0)
+		return tls_err("unable to initialize library");
+
 	/* a new SSL context with the bare minimum of options */
 	SSL_CTX *ctx = SSL_CTX_new(TLS_server_method());
 	if (!ctx) {
@@ -332,23 +390,18 @@ tls_init()
 	/* disable obsolete and insecure protocol versions */
 	SSL_CTX_set_options(ctx, SSL_OP_NO_SSLv2 | SSL_OP_NO_SSLv3);
 
-	if (!SSL_CTX_use_certificate_chain_file(ctx, certfilename)) {
-		SSL_CTX_free(ctx);
-		return tls_err("missing certificate");
-	}
-	if (SSL_CTX_load_verify_locations(ctx, CLIENTCA, NULL) != 1) {
-		struct stat st;
-		if ((stat(CLIENTCA, &st) != -1) || (errno != ENOENT)) {
+	if (certidx >= 0) {
+		if (certstore_use_ctx(&certstore, certidx, ctx) != 0) {
 			SSL_CTX_free(ctx);
-			return tls_err("cannot load client CAs");
+			return tls_err("invalid certificate in " CERTSTORE_NAME);
 		}
+		SSL_CTX_set_tlsext_servername_callback(ctx, servername_cb);
+	} else if (!SSL_CTX_use_certificate_chain_file(ctx, certfilename)) {
+		SSL_CTX_free(ctx);
+		return tls_err("missing certificate");
 	}
 
-	/* crl checking */
-	X509_STORE *store = SSL_CTX_get_cert_store(ctx);
-	X509_LOOKUP *lookup = X509_STORE_add_lookup(store, X509_LOOKUP_file());
-	if (lookup && (X509_load_crl_file(lookup, CLIENTCRL, X509_FILETYPE_PEM) == 1))
-		X509_STORE_set_flags(store, X509_V_FLAG_CRL_CHECK | X509_V_FLAG_CRL_CHECK_ALL);
+	/* client CAs and CRLs are only loaded in tls_verify() when they are needed */
 
 	saciphers.len = lloadfilefd(openat(controldir_fd, ciphfn, O_RDONLY | O_CLOEXEC), &(saciphers.s), 1);
 	if (saciphers.len == (size_t)-1) {
@@ -371,6 +424,8 @@ tls_init()
 
 	SSL_CTX_set_options(ctx, ssl_options);
 
+	tls_session_setup(ctx, (certidx >= 0) ? certstore_file(&certstore, certidx) : certfilename);
+
 	/* a new SSL object, with the rest added to it directly to avoid copying */
 	SSL *myssl = SSL_new(ctx);
 	SSL_CTX_free(ctx);
@@ -382,7 +437,7 @@ tls_init()
 	SSL_set_verify(myssl, SSL_VERIFY_NONE, NULL);
 
 	/* this will also check whether public and private keys match */
-	if (!SSL_use_RSAPrivateKey_file(myssl, keyfilename, SSL_FILETYPE_PEM)) {
+	if ((certidx < 0) && !SSL_use_RSAPrivateKey_file(myssl, keyfilename, SSL_FILETYPE_PEM)) {
 		ssl_free(myssl);
 		free(saciphers.s);
 		return tls_err("no valid RSA private key");
@@ -409,6 +464,12 @@ tls_init()
 		return tls_err("unable to set fd");
 	}
 
+	/* Kernel TLS can't be renegotiated, which tls_verify() needs to request
+	 * a client certificate. It can only be used if there is nobody who
+	 * could relay by certificate. */
+	if ((faccessat(controldir_fd, "tlsclients", F_OK, 0) != 0) && (errno == ENOENT))
+		ssl_ktls_request(myssl);
+
 	/* protection against CVE-2011-1431 */
 	sync_pipelining();
 
@@ -0,0 +1,408 @@
+/** \file tlssession.c
+ \brief TLS session resumption across Qsmtpd processes
+
+ Every connection is handled by a new Qsmtpd process, so the session cache
+ and the ticket key OpenSSL keeps in memory are never used again. Clients
+ returning later always had to do a full handshake.
+
+ Session tickets are encrypted with keys read from control/tlsticketkeys, so
+ every Qsmtpd instance can decrypt the tickets issued by the others. Clients
+ that do not use tickets can resume sessions stored in a cache file shared by
+ all processes, given in the environment variable TLSSESSIONCACHE.
+ */
+
+#include <qsmtpd/tlssession.h>
+
+#include <control.h>
+#include <log.h>
+#include <sharedtable.h>
+#include <version.h>
+
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#include <openssl/sha.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#include <openssl/core_names.h>
+#else
+#include <openssl/hmac.h>
+#endif
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+
+#define TLSCACHE_MAGIC "QSTLSC1"	/**< identifies a session cache file */
+#define TLSCACHE_SLOTS 2048		/**< number of entries in the session cache file */
+#define TLSCACHE_DATALEN 2048		/**< maximum size of a serialized session */
+
+/** @struct ticket_key
+ * @brief a key to encrypt and decrypt session tickets
+ */
+struct ticket_key {
+	unsigned char name[16];		/**< identifies the key in a ticket */
+	unsigned char hmac[32];		/**< secret for the HMAC-SHA256 of the ticket */
+	unsigned char aes[32];		/**< key for the AES-256-CBC encryption of the ticket */
+};
+
+/** @struct tlscache_slot
+ * @brief one cached TLS session
+ */
+struct tlscache_slot {
+	uint32_t hash;					/**< hash of the session id, 0 if the slot is unused */
+	uint32_t len;					/**< length of data */
+	int64_t expires;				/**< time() when the session becomes invalid */
+	unsigned char idlen;				/**< length of id */
+	unsigned char id[SSL_MAX_SSL_SESSION_ID_LENGTH];	/**< the session id */
+	unsigned char data[TLSCACHE_DATALEN];		/**< the session as serialized by i2d_SSL_SESSION() */
+};
+
+static struct ticket_key *ticketkeys;	/**< the ticket keys, the first one is used for new tickets */
+static unsigned int ticketkeycnt;	/**< number of entries in ticketkeys */
+
+static struct shared_table cache = SHARED_TABLE_INIT("TLSSESSIONCACHE", TLSCACHE_MAGIC, "TLS session cache",
+		TLSCACHE_SLOTS, sizeof(struct tlscache_slot));
+
+static int
+hexval(const char c)
+{
+	if ((c >= '0') && (c <= '9'))
+		return c - '0';
+	if ((c >= 'a') && (c <= 'f'))
+		return c - 'a' + 10;
+	if ((c >= 'A') && (c <= 'F'))
+		return c - 'A' + 10;
+	return -1;
+}
+
+/**
+ * @brief check a line of the ticket key file, use as loadlistfd() callback
+ * @param line the line to check
+ * @return if the line is invalid
+ * @retval 0 the line contains exactly TLS_TICKET_KEYLEN hex encoded bytes
+ */
+int
+tls_ticketkey_invalid(const char *line)
+{
+	if (strlen(line) != 2 * TLS_TICKET_KEYLEN)
+		return 1;
+
+	for (size_t i = 0; i < 2 * TLS_TICKET_KEYLEN; i++)
+		if (hexval(line[i]) < 0)
+			return 1;
+
+	return 0;
+}
+
+/**
+ * @brief load the ticket keys from control/tlsticketkeys
+ * @return the number of keys loaded, -1 on error
+ *
+ * Every line of the file contains one key as TLS_TICKET_KEYLEN hex encoded
+ * bytes. New tickets are encrypted using the first key, the others are only
+ * used to decrypt tickets. To rotate the keys add a new key in front and
+ * remove the oldest one once all tickets encrypted with it have expired.
+ */
+int
+tls_ticketkeys_load(void)
+{
+	char **lines;
+
+	free(ticketkeys);
+	ticketkeys = NULL;
+	ticketkeycnt = 0;
+
+	if (loadlistfd(openat(controldir_fd, "tlsticketkeys", O_RDONLY | O_CLOEXEC), &lines, tls_ticketkey_invalid) != 0)
+		return -1;
+
+	if (lines == NULL)
+		return 0;
+
+	unsigned int cnt = 0;
+	while (lines[cnt] != NULL)
+		cnt++;
+
+	ticketkeys = calloc(cnt, sizeof(*ticketkeys));
+	if (ticketkeys == NULL) {
+		free(lines);
+		return -1;
+	}
+
+	for (unsigned int i = 0; i < cnt; i++) {
+		unsigned char *k = (unsigned char *)(ticketkeys + i);
+
+		for (size_t j = 0; j < TLS_TICKET_KEYLEN; j++)
+			k[j] = (hexval(lines[i][2 * j]) << 4) | hexval(lines[i][2 * j + 1]);
+	}
+
+	free(lines);
+	ticketkeycnt = cnt;
+
+	return cnt;
+}
+
+/**
+ * @brief set up the cipher and HMAC contexts for a session ticket
+ * @param key_name the name of the key, set for new tickets, else read
+ * @param iv the IV, created for new tickets
+ * @param cctx the cipher context
+ * @param enc if a new ticket is created
+ * @return the key to use for the HMAC, NULL if no key is available
+ * @retval ren set if the ticket should be replaced by a new one
+ */
+static const struct ticket_key *
+ticket_key_setup(unsigned char *key_name, unsigned char *iv, EVP_CIPHER_CTX *cctx, const int enc, int *ren)
+{
+	const struct ticket_key *k = NULL;
+
+	*ren = 0;
+
+	if (enc) {
+		if (RAND_bytes(iv, EVP_CIPHER_iv_length(EVP_aes_256_cbc())) != 1)
+			return NULL;
+		k = ticketkeys;
+		memcpy(key_name, k->name, sizeof(k->name));
+		if (EVP_EncryptInit_ex(cctx, EVP_aes_256_cbc(), NULL, k->aes, iv) != 1)
+			return NULL;
+		return k;
+	}
+
+	for (unsigned int i = 0; i < ticketkeycnt; i++) {
+		if (memcmp(key_name, ticketkeys[i].name, sizeof(ticketkeys[i].name)) == 0) {
+			k = ticketkeys + i;
+			/* tickets encrypted with an old key are accepted, but replaced */
+			*ren = (i != 0);
+			break;
+		}
+	}
+
+	if ((k == NULL) || (EVP_DecryptInit_ex(cctx, EVP_aes_256_cbc(), NULL, k->aes, iv) != 1))
+		return NULL;
+
+	return k;
+}
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+static int
+ticket_key_cb(SSL *s __attribute__ ((unused)), unsigned char key_name[16], unsigned char *iv,
+		EVP_CIPHER_CTX *cctx, EVP_MAC_CTX *hctx, int enc)
+{
+	int ren;
+	const struct ticket_key *k = ticket_key_setup(key_name, iv, cctx, enc, &ren);
+
+	if (k == NULL)
+		return enc ? -1 : 0;
+
+	OSSL_PARAM params[] = {
+		OSSL_PARAM_construct_octet_string(OSSL_MAC_PARAM_KEY, (void *)k->hmac, sizeof(k->hmac)),
+		OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, (char *)"SHA256", 0),
+		OSSL_PARAM_construct_end()
+	};
+
+	if (EVP_MAC_CTX_set_params(hctx, params) != 1)
+		return -1;
+
+	return ren ? 2 : 1;
+}
+#else
+static int
+ticket_key_cb(SSL *s __attribute__ ((unused)), unsigned char key_name[16], unsigned char *iv,
+		EVP_CIPHER_CTX *cctx, HMAC_CTX *hctx, int enc)
+{
+	int ren;
+	const struct ticket_key *k = ticket_key_setup(key_name, iv, cctx, enc, &ren);
+
+	if (k == NULL)
+		return enc ? -1 : 0;
+
+	if (HMAC_Init_ex(hctx, k->hmac, sizeof(k->hmac), EVP_sha256(), NULL) != 1)
+		return -1;
+
+	return ren ? 2 : 1;
+}
+#endif
+
+static uint32_t
+id_hash(const unsigned char *id, const unsigned int idlen)
+{
+	/* FNV-1a */
+	uint32_t h = 2166136261u;
+
+	for (unsigned int i = 0; i < idlen; i++) {
+		h ^= id[i];
+		h *= 16777619;
+	}
+
+	/* 0 marks unused slots */
+	return (h == 0) ? 1 : h;
+}
+
+static int
+slot_matches(const struct tlscache_slot *slot, const uint32_t hash, const unsigned char *id, const unsigned int idlen)
+{
+	return (slot->hash == hash) && (slot->idlen == idlen) && (memcmp(slot->id, id, idlen) == 0);
+}
+
+/**
+ * @brief store a session in the shared cache
+ * @param sess the session
+ * @return 0 if the session was stored, -1 otherwise
+ */
+int
+tlscache_store(SSL_SESSION *sess)
+{
+	unsigned int idlen;
+	const unsigned char *id = SSL_SESSION_get_id(sess, &idlen);
+	const int len = i2d_SSL_SESSION(sess, NULL);
+
+	if ((idlen == 0) || (idlen > SSL_MAX_SSL_SESSION_ID_LENGTH) || (len <= 0) || (len > TLSCACHE_DATALEN))
+		return -1;
+	if (!shtable_open(&cache))
+		return -1;
+
+	const uint32_t hash = id_hash(id, idlen);
+	struct tlscache_slot *slot = shtable_slot(&cache, hash);
+
+	if (shtable_lock(&cache, LOCK_EX) != 0)
+		return -1;
+
+	unsigned char *p = slot->data;
+	slot->hash = 0;
+	slot->len = i2d_SSL_SESSION(sess, &p);
+	slot->expires = time(NULL) + SSL_SESSION_get_timeout(sess);
+	slot->idlen = idlen;
+	memcpy(slot->id, id, idlen);
+	slot->hash = hash;
+
+	shtable_unlock(&cache);
+
+	return 0;
+}
+
+/**
+ * @brief look up a session in the shared cache
+ * @param id the session id
+ * @param idlen length of id
+ * @return the session, NULL if it is not in the cache
+ */
+SSL_SESSION *
+tlscache_lookup(const unsigned char *id, const unsigned int idlen)
+{
+	if ((idlen == 0) || (idlen > SSL_MAX_SSL_SESSION_ID_LENGTH) || !shtable_open(&cache))
+		return NULL;
+
+	const uint32_t hash = id_hash(id, idlen);
+	const struct tlscache_slot *slot = shtable_slot(&cache, hash);
+	SSL_SESSION *sess = NULL;
+
+	if (shtable_lock(&cache, LOCK_SH) != 0)
+		return NULL;
+
+	if (slot_matches(slot, hash, id, idlen) && (slot->expires > time(NULL)) && (slot->len <= TLSCACHE_DATALEN)) {
+		const unsigned char *p = slot->data;
+
+		sess = d2i_SSL_SESSION(NULL, &p, slot->len);
+	}
+
+	shtable_unlock(&cache);
+
+	return sess;
+}
+
+/**
+ * @brief remove a session from the shared cache
+ * @param id the session id
+ * @param idlen length of id
+ */
+void
+tlscache_remove(const unsigned char *id, const unsigned int idlen)
+{
+	if ((idlen == 0) || (idlen > SSL_MAX_SSL_SESSION_ID_LENGTH) || !shtable_open(&cache))
+		return;
+
+	const uint32_t hash = id_hash(id, idlen);
+	struct tlscache_slot *slot = shtable_slot(&cache, hash);
+
+	if (shtable_lock(&cache, LOCK_EX) != 0)
+		return;
+
+	if (slot_matches(slot, hash, id, idlen))
+		slot->hash = 0;
+
+	shtable_unlock(&cache);
+}
+
+static int
+new_session_cb(SSL *s __attribute__ ((unused)), SSL_SESSION *sess)
+{
+	(void) tlscache_store(sess);
+
+	/* no reference to the session is kept */
+	return 0;
+}
+
+static SSL_SESSION *
+get_session_cb(SSL *s __attribute__ ((unused)), const unsigned char *id, int idlen, int *copy)
+{
+	*copy = 0;
+
+	return (idlen > 0) ? tlscache_lookup(id, idlen) : NULL;
+}
+
+static void
+remove_session_cb(SSL_CTX *ctx __attribute__ ((unused)), SSL_SESSION *sess)
+{
+	unsigned int idlen;
+	const unsigned char *id = SSL_SESSION_get_id(sess, &idlen);
+
+	tlscache_remove(id, idlen);
+}
+
+/**
+ * @brief set up session resumption for a new server context
+ * @param ctx the context
+ * @param certfile the name of the certificate file used
+ *
+ * Sessions are only resumed for connections using the same certificate and
+ * the same Qsmtpd version. If no ticket keys are configured no tickets are
+ * issued, as no other process could decrypt them.
+ */
+void
+tls_session_setup(SSL_CTX *ctx, const char *certfile)
+{
+	unsigned char sidctx[SHA256_DIGEST_LENGTH];
+	EVP_MD_CTX *mdctx = EVP_MD_CTX_new();
+
+	if ((mdctx != NULL) && (EVP_DigestInit_ex(mdctx, EVP_sha256(), NULL) == 1) &&
+			(EVP_DigestUpdate(mdctx, VERSIONSTRING, strlen(VERSIONSTRING) + 1) == 1) &&
+			(EVP_DigestUpdate(mdctx, certfile, strlen(certfile)) == 1) &&
+			(EVP_DigestFinal_ex(mdctx, sidctx, NULL) == 1))
+		SSL_CTX_set_session_id_context(ctx, sidctx, sizeof(sidctx));
+	else
+		SSL_CTX_set_session_id_context(ctx, (const unsigned char *)VERSIONSTRING, strlen(VERSIONSTRING));
+	EVP_MD_CTX_free(mdctx);
+
+	const int keys = tls_ticketkeys_load();
+	if (keys > 0) {
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+		SSL_CTX_set_tlsext_ticket_key_evp_cb(ctx, ticket_key_cb);
+#else
+		SSL_CTX_set_tlsext_ticket_key_cb(ctx, ticket_key_cb);
+#endif
+	} else {
+		if (keys < 0)
+			log_write(LOG_WARNING, "can't load TLS ticket keys, session tickets disabled");
+		SSL_CTX_set_options(ctx, SSL_OP_NO_TICKET);
+	}
+
+	if (shtable_open(&cache)) {
+		SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER | SSL_SESS_CACHE_NO_INTERNAL);
+		SSL_CTX_sess_set_new_cb(ctx, new_session_cb);
+		SSL_CTX_sess_set_get_cb(ctx, get_session_cb);
+		SSL_CTX_sess_set_remove_cb(ctx, remove_session_cb);
+	} else {
+		SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_OFF);
+	}
+}
@@ -5,6 +5,8 @@
 #include <libowfatconn.h>
 #include <qsmtpd/addrparse.h>
 #include <qsmtpd/antispam.h>
+#include <qsmtpd/bgdns.h>
+#include <qsmtpd/prefetch.h>
 #include <qsmtpd/qsmtpd.h>
 #include <qsmtpd/userconf.h>
 #include "test_io/testcase_io.h"
@@ -35,6 +37,19 @@ check_host(const char *domain __attribute__ ((unused)))
 	return SPF_NONE;
 }
 
+/* the results of the sender lookup are set directly in xmitstat */
+int
+sender_lookup_wait(void)
+{
+	return 0;
+}
+
+/* nothing was looked up in advance */
+void
+connection_rbl_wait(void)
+{
+}
+
 int
 test_ask_dnsa(const char *a, struct in6_addr **b)
 {
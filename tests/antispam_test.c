@@ -1,10 +1,12 @@
 #include <qsmtpd/antispam.h>
 
+#include <control.h>
 #include <qsmtpd/qsmtpd.h>
 #include "test_io/testcase_io.h"
 
 #include <arpa/inet.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <string.h>
 #include <sys/socket.h>
@@ -214,6 +216,9 @@ main(void)
 {
 	int err = 0;
 
+	/* there are no local zone copies in the test directory */
+	controldir_fd = AT_FDCWD;
+
 	testcase_setup_log_writen(test_log_writen);
 	testcase_setup_ask_dnsa(test_ask_dnsa);
 
@@ -0,0 +1,281 @@
+#include <certstore.h>
+
+#include "test_io/testcase_io.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <openssl/err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define STOREDIR "certstore_test.dir"
+
+static int err;
+static const char *srcdir;
+static int dirfd = -1;
+
+static void
+copy_file(const char *target, const char *src1, const char *src2)
+{
+	int fd = openat(dirfd, target, O_CREAT | O_TRUNC | O_WRONLY | O_CLOEXEC, S_IRUSR | S_IWUSR);
+
+	if (fd < 0) {
+		fprintf(stderr, "cannot create %s\n", target);
+		exit(1);
+	}
+
+	const char *srcs[] = { src1, src2, NULL };
+	for (unsigned int i = 0; srcs[i] != NULL; i++) {
+		char fname[strlen(srcdir) + strlen(srcs[i]) + 2];
+		char buf[8192];
+		ssize_t r;
+
+		sprintf(fname, "%s/%s", srcdir, srcs[i]);
+		int in = open(fname, O_RDONLY | O_CLOEXEC);
+		if (in < 0) {
+			fprintf(stderr, "cannot open %s\n", fname);
+			exit(1);
+		}
+		while ((r = read(in, buf, sizeof(buf))) > 0) {
+			if (write(fd, buf, r) != r) {
+				fprintf(stderr, "cannot write %s\n", target);
+				exit(1);
+			}
+		}
+		close(in);
+	}
+
+	close(fd);
+}
+
+static void
+cleanup(void)
+{
+	const char *files[] = { "servercert.pem", "servercert.pem.192.0.2.1", "serverkey.pem.192.0.2.1",
+			"servercert.pem.192.0.2.1:587", "servercert.pem.192.0.2.2", CERTSTORE_NAME,
+		"clientcert.pem", "clientkey.pem", CERTSTORE_CLIENT_NAME, NULL };
+
+	for (unsigned int i = 0; files[i] != NULL; i++)
+		unlinkat(dirfd, files[i], 0);
+}
+
+static int
+compile(const enum certstore_type type, const char **errfile)
+{
+	const char *storename = (type == CERTSTORE_SERVER) ? CERTSTORE_NAME : CERTSTORE_CLIENT_NAME;
+	int fd = openat(dirfd, storename, O_CREAT | O_TRUNC | O_WRONLY | O_CLOEXEC, S_IRUSR | S_IWUSR);
+
+	if (fd < 0) {
+		fprintf(stderr, "cannot create %s\n", storename);
+		exit(1);
+	}
+
+	int r = certstore_compile(dirfd, type, fd, errfile);
+	close(fd);
+
+	return r;
+}
+
+static void
+check_find(const struct certstore *cs, const char *ip, const char *port, const char *expected)
+{
+	const int idx = certstore_find(cs, ip, port);
+	const char *f = (idx < 0) ? NULL : certstore_file(cs, idx);
+
+	if ((f == NULL) != (expected == NULL) || ((f != NULL) && (strcmp(f, expected) != 0))) {
+		fprintf(stderr, "certificate for %s:%s is %s instead of %s\n", ip, (port == NULL) ? "(null)" : port,
+				(f == NULL) ? "(none)" : f, (expected == NULL) ? "(none)" : expected);
+		err++;
+	}
+}
+
+static void
+check_name(const struct certstore *cs, const char *name, const char *expected)
+{
+	const int idx = certstore_find_name(cs, name);
+	const char *f = (idx < 0) ? NULL : certstore_file(cs, idx);
+
+	if ((f == NULL) != (expected == NULL) || ((f != NULL) && (strcmp(f, expected) != 0))) {
+		fprintf(stderr, "certificate for name %s is %s instead of %s\n", name,
+				(f == NULL) ? "(none)" : f, (expected == NULL) ? "(none)" : expected);
+		err++;
+	}
+}
+
+static void
+check_use(const struct certstore *cs, const char *name, const char *cn)
+{
+	SSL_CTX *ctx = SSL_CTX_new(TLS_server_method());
+	const int idx = certstore_find_name(cs, name);
+
+	if ((ctx == NULL) || (idx < 0) || (certstore_use_ctx(cs, idx, ctx) != 0)) {
+		fprintf(stderr, "cannot use certificate for %s\n", name);
+		ERR_print_errors_fp(stderr);
+		err++;
+		SSL_CTX_free(ctx);
+		return;
+	}
+
+	char buf[256] = "";
+	X509_NAME_get_text_by_NID(X509_get_subject_name(SSL_CTX_get0_certificate(ctx)), NID_commonName, buf, sizeof(buf));
+	if (strcmp(buf, cn) != 0) {
+		fprintf(stderr, "certificate for %s has CN %s instead of %s\n", name, buf, cn);
+		err++;
+	}
+	if (SSL_CTX_check_private_key(ctx) != 1) {
+		fprintf(stderr, "private key for %s does not match\n", name);
+		err++;
+	}
+
+	SSL_CTX_free(ctx);
+}
+
+static void
+test_store(void)
+{
+	struct certstore cs = { .map = NULL, .len = 0 };
+	const char *errfile;
+
+	copy_file("servercert.pem", "valid4096.key", "valid4096.crt");
+	copy_file("servercert.pem.192.0.2.1", "wildcard4096.crt", NULL);
+	copy_file("serverkey.pem.192.0.2.1", "wildcard4096.key", NULL);
+	copy_file("servercert.pem.192.0.2.1:587", "valid4096_san2.crt", "valid4096_san2.key");
+
+	int r = compile(CERTSTORE_SERVER, &errfile);
+	if (r != 3) {
+		fprintf(stderr, "compiling returned %i instead of 3, file %s\n", r, (errfile == NULL) ? "(null)" : errfile);
+		err++;
+		return;
+	}
+
+	if (certstore_open(dirfd, CERTSTORE_SERVER, &cs) != 0) {
+		fprintf(stderr, "cannot open store: %i\n", errno);
+		err++;
+		return;
+	}
+
+	check_find(&cs, "192.0.2.1", "587", "servercert.pem.192.0.2.1:587");
+	check_find(&cs, "192.0.2.1", "25", "servercert.pem.192.0.2.1");
+	check_find(&cs, "192.0.2.1", NULL, "servercert.pem.192.0.2.1");
+	check_find(&cs, "192.0.2.10", "587", "servercert.pem");
+	check_find(&cs, "::ffff:192.0.2.1", "587", "servercert.pem");
+
+	/* the default certificate wins over the later ones with the same name */
+	check_name(&cs, "TestCert.Example.ORG", "servercert.pem");
+	check_name(&cs, "other.example.org", "servercert.pem.192.0.2.1:587");
+	check_name(&cs, "foo.example.org", "servercert.pem.192.0.2.1");
+	check_name(&cs, "foo.bar.example.org", NULL);
+	check_name(&cs, "example.org", NULL);
+	check_name(&cs, "example.com", NULL);
+
+	check_use(&cs, "testcert.example.org", "testcert.example.org");
+	check_use(&cs, "foo.example.org", "*.example.org");
+	check_use(&cs, "other.example.org", "");
+}
+
+static void
+test_client(void)
+{
+	struct certstore cs = { .map = NULL, .len = 0 };
+	const char *errfile;
+
+	/* the server certificates must not end up in the client store */
+	copy_file("clientcert.pem", "wildcard4096.crt", NULL);
+	copy_file("clientkey.pem", "wildcard4096.key", NULL);
+
+	int r = compile(CERTSTORE_CLIENT, &errfile);
+	if (r != 1) {
+		fprintf(stderr, "compiling the client store returned %i instead of 1\n", r);
+		free((char *)errfile);
+		err++;
+		return;
+	}
+
+	if (certstore_open(dirfd, CERTSTORE_CLIENT, &cs) != 0) {
+		fprintf(stderr, "cannot open client store: %i\n", errno);
+		err++;
+		return;
+	}
+
+	check_find(&cs, "192.0.2.1", "25", "clientcert.pem");
+	check_use(&cs, "foo.example.org", "*.example.org");
+
+	/* a closed store can be opened again, e.g. after it was recompiled */
+	certstore_close(&cs);
+	if (cs.map != NULL) {
+		fputs("closed store is still mapped\n", stderr);
+		err++;
+	}
+	if (certstore_open(dirfd, CERTSTORE_CLIENT, &cs) != 0) {
+		fprintf(stderr, "cannot open client store again: %i\n", errno);
+		err++;
+		return;
+	}
+	check_find(&cs, "192.0.2.1", "25", "clientcert.pem");
+}
+
+static void
+test_errors(void)
+{
+	const char *errfile;
+
+	cleanup();
+
+	errno = 0;
+	if ((compile(CERTSTORE_SERVER, &errfile) != -1) || (errno != ENOENT)) {
+		fputs("compiling without certificates did not fail with ENOENT\n", stderr);
+		err++;
+	}
+
+	/* the key does not belong to the certificate */
+	copy_file("servercert.pem", "valid4096.key", "valid4096.crt");
+	copy_file("servercert.pem.192.0.2.2", "wildcard4096.crt", "valid4096.key");
+	if (compile(CERTSTORE_SERVER, &errfile) != -1) {
+		fputs("compiling with a wrong key did not fail\n", stderr);
+		err++;
+	} else if ((errfile == NULL) || (strcmp(errfile, "servercert.pem.192.0.2.2") != 0)) {
+		fprintf(stderr, "the failing file is %s instead of servercert.pem.192.0.2.2\n",
+				(errfile == NULL) ? "(null)" : errfile);
+		err++;
+	}
+	free((char *)errfile);
+
+	/* a file that is not a store */
+	struct certstore cs = { .map = NULL, .len = 0 };
+	copy_file(CERTSTORE_NAME, "valid4096.crt", NULL);
+	if ((certstore_open(dirfd, CERTSTORE_SERVER, &cs) != -1) || (errno != EINVAL)) {
+		fputs("opening an invalid store did not fail with EINVAL\n", stderr);
+		err++;
+	}
+}
+
+int
+main(int argc, char **argv)
+{
+	if (argc != 2) {
+		fprintf(stderr, "usage: %s certdir\n", argv[0]);
+		return EINVAL;
+	}
+	srcdir = argv[1];
+
+	mkdir(STOREDIR, S_IRWXU);
+	dirfd = open(STOREDIR, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (dirfd < 0) {
+		fputs("cannot open " STOREDIR "\n", stderr);
+		return 1;
+	}
+	cleanup();
+
+	test_store();
+	test_client();
+	test_errors();
+
+	cleanup();
+	close(dirfd);
+	rmdir(STOREDIR);
+
+	return err;
+}
@@ -4,6 +4,8 @@
 #include <netio.h>
 #include <qdns.h>
 #include <qsmtpd/antispam.h>
+#include <qsmtpd/bgdns.h>
+#include <qsmtpd/prefetch.h>
 #include <qsmtpd/queue.h>
 #include <qsmtpd/qsauth.h>
 #include <qsmtpd/qsmtpd.h>
@@ -16,12 +18,14 @@
 
 #include <arpa/inet.h>
 #include <assert.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 #include <sys/socket.h>
 #include <syslog.h>
+#include <unistd.h>
 
 struct xmitstat xmitstat;
 int relayclient;
@@ -118,6 +122,19 @@ queue_reset(void)
 	abort();
 }
 
+int
+connection_lookup_wait(void)
+{
+	abort();
+}
+
+/* nothing to clean up here, the lookup helper runs the mocked functions */
+pid_t
+fork_clean(void)
+{
+	return fork();
+}
+
 /* may in theory be used, but since the files opened before are
  * not there the flow should never reach this. */
 int
@@ -273,6 +290,8 @@ main(void)
 		unsigned int tls_verify:1;	/* call to tls_verify() is permitted */
 		int tls_verify_result;
 		int from_result;	/* expected result of smtp_from() */
+		int wait_errno;		/* expected errno of sender_lookup_wait() */
+		const char *mxname;	/* expected name of the first MX */
 		const char *netmsg;
 	} testdata[] = {
 		/* simple acceptance */
@@ -283,8 +302,31 @@ main(void)
 				},
 			},
 			.input = "MAIL FROM:<foo@example.org>",
+			.mxname = "mx.example.net",
 			.netmsg = "250 2.1.5 sender <foo@example.org> is syntactically correct\r\n",
 		},
+		/* local error in MX lookup, only noticed when the result is needed */
+		{
+			.xmitstat = {
+				.mailfrom = {
+					.s = "foo@strange.example.org"
+				},
+			},
+			.input = "MAIL FROM:<foo@strange.example.org>",
+			.wait_errno = ENOTBLK,
+			.netmsg = "250 2.1.5 sender <foo@strange.example.org> is syntactically correct\r\n",
+		},
+		/* local error in SPF lookup */
+		{
+			.xmitstat = {
+				.mailfrom = {
+					.s = "foo@spferror.example.net"
+				},
+			},
+			.input = "MAIL FROM:<foo@spferror.example.net>",
+			.wait_errno = EPIPE,
+			.netmsg = "250 2.1.5 sender <foo@spferror.example.net> is syntactically correct\r\n",
+		},
 		/* again, but SIZE given */
 		{
 			.xmitstat = {
@@ -295,6 +337,7 @@ main(void)
 				.thisbytes = 12345
 			},
 			.input = "MAIL FROM:<foo@example.org> SIZE=12345",
+			.mxname = "mx.example.net",
 			.netmsg = "250 2.1.5 sender <foo@example.org> is syntactically correct\r\n",
 		},
 		/* again, but too large SIZE given */
@@ -480,8 +523,29 @@ main(void)
 		}
 
 		if (r == 0) {
-			// TODO: check frommx
+			errno = 0;
+			if ((sender_lookup_wait() == 0) != (testdata[i].wait_errno == 0)) {
+				fprintf(stderr, "%u: sender_lookup_wait() returned an unexpected result\n", i);
+				errcnt++;
+			} else if ((testdata[i].wait_errno != 0) && (errno != testdata[i].wait_errno)) {
+				fprintf(stderr, "%u: sender_lookup_wait() set errno to %i instead of %i\n",
+						i, errno, testdata[i].wait_errno);
+				errcnt++;
+			}
+
+			if (testdata[i].mxname == NULL) {
+				if (xmitstat.frommx != NULL) {
+					fprintf(stderr, "%u: sender_lookup_wait() set frommx\n", i);
+					errcnt++;
+				}
+			} else if ((xmitstat.frommx == NULL) || (xmitstat.frommx->count != 1) ||
+					(xmitstat.frommx->next != NULL) ||
+					(strcmp(xmitstat.frommx->name, testdata[i].mxname) != 0)) {
+				fprintf(stderr, "%u: sender_lookup_wait() did not set the expected frommx\n", i);
+				errcnt++;
+			}
 			freeips(xmitstat.frommx);
+			xmitstat.frommx = NULL;
 		} else {
 			if (xmitstat.frommx != NULL) {
 				fprintf(stderr, "%u: smtp_from() returned %i, but set frommx\n",
@@ -2,6 +2,8 @@
 
 #include <fmt.h>
 #include <netio.h>
+#include <qsmtpd/bgdns.h>
+#include <qsmtpd/prefetch.h>
 #include <qsmtpd/queue.h>
 #include <qsmtpd/qsauth.h>
 #include <qsmtpd/qsmtpd.h>
@@ -150,6 +152,24 @@ smtp_authstring(void)
 	abort();
 }
 
+int
+sender_lookup_start(const char *a __attribute__ ((unused)))
+{
+	abort();
+}
+
+void
+sender_lookup_cancel(void)
+{
+	abort();
+}
+
+int
+connection_lookup_wait(void)
+{
+	abort();
+}
+
 int
 check_host(const char *a __attribute__ ((unused)))
 {
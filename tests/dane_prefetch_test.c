@@ -0,0 +1,197 @@
+#include <qremote/conn.h>
+
+#include <libowfatconn.h>
+#include <qdns.h>
+#include <qdns_dane.h>
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+unsigned int targetport = 25;
+static unsigned int direct_lookups;	/* dnstlsa() calls from the main process */
+static int err;
+static int gate[2] = { -1, -1 };	/* the lookup of mx2 waits until something is written here */
+
+int
+dnsmx(char **out, size_t *len, const char *host)
+{
+	static const char mxlist[] = "\0\12mx1.example.com\0\0\24mx2.example.com";
+
+	assert(strcmp(host, "example.com") == 0);
+
+	*out = malloc(sizeof(mxlist));
+	assert(*out != NULL);
+	memcpy(*out, mxlist, sizeof(mxlist));
+	*len = sizeof(mxlist);
+
+	return 0;
+}
+
+int
+dnstlsa(const char *host, const unsigned short port, struct daneinfo **out)
+{
+	assert(port == targetport);
+	assert(out != NULL);
+
+	direct_lookups++;
+	*out = NULL;
+
+	if (strcmp(host, "mx1.example.com") == 0) {
+		*out = calloc(2, sizeof(**out));
+		assert(*out != NULL);
+		for (unsigned char i = 0; i < 2; i++) {
+			(*out)[i].cert_usage = TLSA_CU_DANE_EE;
+			(*out)[i].selector = TLSA_SEL_SPKI;
+			(*out)[i].matching_type = TLSA_MT_SHA2_256;
+			(*out)[i].datalen = 32;
+			(*out)[i].data = malloc(32);
+			assert((*out)[i].data != NULL);
+			memset((*out)[i].data, 'a' + i, 32);
+		}
+		return 2;
+	} else if (strcmp(host, "mx2.example.com") == 0) {
+		char c;
+
+		if ((gate[0] >= 0) && (read(gate[0], &c, 1) != 1))
+			abort();
+		return DNS_ERROR_TEMP;
+	}
+
+	return 0;
+}
+
+void
+daneinfo_free(struct daneinfo *di, int cnt)
+{
+	for (int i = 0; i < cnt; i++)
+		free(di[i].data);
+	free(di);
+}
+
+static void
+check_mx1(void)
+{
+	struct daneinfo *d;
+	int r = tlsa_lookup("mx1.example.com", &d);
+
+	if (r != 2) {
+		fprintf(stderr, "tlsa_lookup(mx1.example.com) returned %i instead of 2\n", r);
+		err++;
+		if (r > 0)
+			daneinfo_free(d, r);
+		return;
+	}
+
+	for (int i = 0; i < r; i++) {
+		if ((d[i].cert_usage != TLSA_CU_DANE_EE) || (d[i].selector != TLSA_SEL_SPKI) ||
+				(d[i].matching_type != TLSA_MT_SHA2_256) || (d[i].datalen != 32) ||
+				(d[i].data[0] != 'a' + i) || (d[i].data[31] != 'a' + i)) {
+			fprintf(stderr, "TLSA record %i of mx1.example.com has wrong contents\n", i);
+			err++;
+		}
+	}
+
+	daneinfo_free(d, r);
+}
+
+int
+main(void)
+{
+	struct daneinfo *d;
+
+	/* no helper for IP addresses, the lookup is done directly */
+	tlsa_prefetch_start("[192.0.2.1]", NULL);
+	if ((tlsa_lookup("mx1.example.com", &d) != 2) || (direct_lookups != 1)) {
+		fprintf(stderr, "lookup without prefetch was not done directly\n");
+		err++;
+	}
+	daneinfo_free(d, 2);
+	direct_lookups = 0;
+
+	tlsa_prefetch_start("example.com", NULL);
+
+	/* the records are handed out as copies, so they can be requested again */
+	check_mx1();
+	check_mx1();
+
+	int r = tlsa_lookup("mx2.example.com", &d);
+	if ((r != DNS_ERROR_TEMP) || (d != NULL)) {
+		fprintf(stderr, "tlsa_lookup(mx2.example.com) returned %i instead of %i\n", r, DNS_ERROR_TEMP);
+		err++;
+	}
+
+	if (direct_lookups != 0) {
+		fprintf(stderr, "prefetched records were looked up again\n");
+		err++;
+	}
+
+	/* a host that was not prefetched is looked up directly */
+	r = tlsa_lookup("other.example.com", &d);
+	if ((r != 0) || (direct_lookups != 1)) {
+		fprintf(stderr, "lookup of unknown host was not done directly\n");
+		err++;
+	}
+
+	tlsa_prefetch_reset();
+	direct_lookups = 0;
+
+	/* a slow lookup does not delay the records of the other hosts, and
+	 * the records are queried for the port set when the prefetch starts */
+	if (pipe(gate) != 0) {
+		fputs("cannot create pipe\n", stderr);
+		return 1;
+	}
+	targetport = 2525;
+	tlsa_prefetch_start("example.com", NULL);
+
+	alarm(5);
+	check_mx1();
+	if (direct_lookups != 0) {
+		fprintf(stderr, "records of mx1.example.com were not prefetched for port 2525\n");
+		err++;
+	}
+
+	if (write(gate[1], "", 1) != 1) {
+		fputs("cannot release the lookup of mx2.example.com\n", stderr);
+		return 1;
+	}
+	r = tlsa_lookup("mx2.example.com", &d);
+	if ((r != DNS_ERROR_TEMP) || (direct_lookups != 0)) {
+		fprintf(stderr, "tlsa_lookup(mx2.example.com) returned %i instead of %i after waiting\n", r, DNS_ERROR_TEMP);
+		err++;
+	}
+	alarm(0);
+
+	tlsa_prefetch_reset();
+	close(gate[0]);
+	close(gate[1]);
+	gate[0] = -1;
+	targetport = 25;
+	direct_lookups = 0;
+
+	/* for a cached route the names of the given mail exchangers are used
+	 * instead of querying the MX records, dnsmx() would not know mx3 */
+	struct ips backup = {
+		.name = "mx1.example.com",
+		.priority = 10
+	};
+	struct ips cached = {
+		.name = "mx3.example.com",
+		.priority = 5,
+		.next = &backup
+	};
+	tlsa_prefetch_start("example.net", &cached);
+	check_mx1();
+	r = tlsa_lookup("mx3.example.com", &d);
+	if ((r != 0) || (direct_lookups != 0)) {
+		fprintf(stderr, "records of the cached route were not prefetched\n");
+		err++;
+	}
+
+	tlsa_prefetch_reset();
+
+	return err;
+}
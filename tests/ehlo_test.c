@@ -35,6 +35,7 @@ testcase_ignore(void)
 		"8BITMIMEX WITH ARGS",
 		"CHUNKINGX",
 		"CHUNKINGX WITH ARGS",
+		"BINARYMIMEX",
 		"AUTHXX",
 		"AUTHX WITH ARGS",
 		"AUTH=LOGIN PLAIN",
@@ -80,6 +81,10 @@ testcase_no_args(void)
 			.line = "CHUNKING",
 			.extension = esmtp_chunking
 		},
+		{
+			.line = "BINARYMIME",
+			.extension = esmtp_binarymime
+		},
 #endif /* CHUNKING */
 		{ }
 	};
@@ -154,6 +159,7 @@ testcase_invalid(void)
 		"8BITMIME X", /* 8BITMIME does not accept arguments */
 #ifdef CHUNKING
 		"CHUNKING X", /* CHUNKING does not accept arguments */
+		"BINARYMIME X", /* BINARYMIME does not accept arguments */
 #endif /* CHUNKING */
 		"AUTH \tPLAIN", /* unprintable character */
 		NULL
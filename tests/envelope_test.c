@@ -113,6 +113,38 @@ checkreply(const char *status, const char **pre, const int mask)
 	return ret;
 }
 
+/* which messages are sent with BDAT */
+static int
+test_body_chunked(void)
+{
+	const struct {
+		unsigned int ext;
+		unsigned int recodeflag;
+		int chunked;
+	} cases[] = {
+		{ 0, 0, 0 },
+		{ esmtp_chunking, 0, 1 },
+		{ esmtp_chunking, recode_8bit, 0 },
+		{ esmtp_chunking | esmtp_8bitmime, recode_8bit, 1 },
+		{ esmtp_chunking | esmtp_8bitmime, recode_long_line, 0 },
+		{ esmtp_chunking | esmtp_binarymime, recode_8bit, 1 },
+		{ esmtp_chunking | esmtp_binarymime, recode_long_header, 1 },
+		{ esmtp_binarymime, recode_8bit, 0 }
+	};
+	int err = 0;
+
+	for (unsigned int i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+		smtpext = cases[i].ext;
+		if (body_chunked(cases[i].recodeflag) != cases[i].chunked) {
+			fprintf(stderr, "body_chunked(%u) with extensions 0x%x returned %i\n",
+					cases[i].recodeflag, cases[i].ext, !cases[i].chunked);
+			err++;
+		}
+	}
+
+	return err;
+}
+
 // The arguments are expected as follows:
 // 1: control string, consisting of REXX:checkreplies
 //    R: recodeflag to set ('0'..'3')
@@ -134,6 +166,9 @@ main(int argc, char *argv[])
 	int r;
 	char *end;
 
+	if ((argc == 2) && (strcmp(argv[1], "chunked") == 0))
+		return test_body_chunked();
+
 	if (argc < 4)
 		return EINVAL;
 
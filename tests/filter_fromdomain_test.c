@@ -1,5 +1,6 @@
 #include <qsmtpd/userfilters.h>
 
+#include <qsmtpd/bgdns.h>
 #include <qsmtpd/qsmtpd.h>
 #include <qsmtpd/userconf.h>
 #include "test_io/testcase_io.h"
@@ -20,6 +21,13 @@ const char **globalconf;
 
 extern int cb_fromdomain(const struct userconf *ds, const char **logmsg, enum config_domain *t);
 
+/* the results of the sender lookup are set directly in xmitstat */
+int
+sender_lookup_wait(void)
+{
+	return 0;
+}
+
 static int err;
 
 static struct userconf ds;
@@ -1,4 +1,5 @@
 #include <qsmtpd/qsmtpd.h>
+#include <qsmtpd/bgdns.h>
 #include <qsmtpd/userfilters.h>
 #include <qsmtpd/userconf.h>
 #include <qsmtpd/antispam.h>
@@ -146,6 +147,13 @@ userconf_find_domain(const struct userconf *ds, const char *key,
 	abort();
 }
 
+/* the results of the sender lookup are set directly in xmitstat */
+int
+sender_lookup_wait(void)
+{
+	return 0;
+}
+
 int
 check_host(const char *domain)
 {
@@ -1,6 +1,7 @@
 #include <qsmtpd/userfilters.h>
 
 #include <control.h>
+#include <qsmtpd/bgdns.h>
 #include <qsmtpd/qsmtpd.h>
 #include <qsmtpd/userconf.h>
 
@@ -21,6 +22,13 @@ int controldir_fd = AT_FDCWD;
 
 extern int cb_wildcardns(const struct userconf *ds, const char **logmsg, enum config_domain *t);
 
+/* the results of the sender lookup are set directly in xmitstat */
+int
+sender_lookup_wait(void)
+{
+	return 0;
+}
+
 long
 getsettingglobal(const struct userconf *ds __attribute__ ((unused)), const char *a, enum config_domain *t)
 {
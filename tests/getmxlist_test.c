@@ -15,6 +15,37 @@ smtproute(const char *a __attribute__ ((unused)), const size_t b __attribute__ (
 	return NULL;
 }
 
+struct ips *
+route_cache_lookup(const char *host __attribute__ ((unused)), const unsigned int port __attribute__ ((unused)))
+{
+	return NULL;
+}
+
+void
+tlsa_prefetch_start(const char *remhost __attribute__ ((unused)), const struct ips *mx __attribute__ ((unused)))
+{
+}
+
+int
+host_health_check(const struct in6_addr *addr __attribute__ ((unused)), const unsigned int port __attribute__ ((unused)),
+		unsigned int *rtt)
+{
+	*rtt = 0;
+	return 0;
+}
+
+void
+host_health_connected(const struct in6_addr *addr __attribute__ ((unused)), const unsigned int port __attribute__ ((unused)),
+		const unsigned int rtt __attribute__ ((unused)))
+{
+}
+
+void
+host_health_result(const struct in6_addr *addr __attribute__ ((unused)), const unsigned int port __attribute__ ((unused)),
+		const enum host_failure reason __attribute__ ((unused)))
+{
+}
+
 void
 write_status(const char *str)
 {
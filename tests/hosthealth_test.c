@@ -0,0 +1,171 @@
+#include <qremote/hosthealth.h>
+
+#include "test_io/testcase_io.h"
+
+#include <arpa/inet.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define HEALTHFILE "hosthealth_test.table"
+
+static int err;
+
+static struct in6_addr
+addr(const char *s)
+{
+	struct in6_addr a;
+
+	if (inet_pton(AF_INET6, s, &a) != 1) {
+		fprintf(stderr, "cannot parse %s\n", s);
+		exit(1);
+	}
+
+	return a;
+}
+
+static void
+check_state(const char *desc, const struct in6_addr *a, const unsigned int port, const int down,
+		const unsigned int rtt)
+{
+	unsigned int r;
+	const int d = host_health_check(a, port, &r);
+
+	if (d != down) {
+		fprintf(stderr, "%s: address is %s\n", desc, d ? "down" : "up");
+		err++;
+	}
+	if (r != rtt) {
+		fprintf(stderr, "%s: rtt is %u instead of %u\n", desc, r, rtt);
+		err++;
+	}
+}
+
+static void
+check_holddown(void)
+{
+	struct host_health_slot slot;
+	const struct {
+		uint32_t failures;
+		int64_t age;
+		int down;
+	} checks[] = {
+		{ 1, 59, 1 },
+		{ 1, 60, 0 },
+		{ 2, 119, 1 },
+		{ 2, 120, 0 },
+		{ 6, 1919, 1 },
+		{ 7, 3599, 1 },
+		{ 7, 3600, 0 },
+		{ 1000, 3600, 0 },
+		{ 0, 0, 0 }
+	};
+
+	memset(&slot, 0, sizeof(slot));
+	slot.used = 1;
+	slot.reason = HOST_FAIL_CONNECT;
+	slot.last_failure = 100000;
+
+	for (unsigned int i = 0; i < sizeof(checks) / sizeof(checks[0]); i++) {
+		slot.failures = checks[i].failures;
+		if (host_health_down(&slot, slot.last_failure + checks[i].age) != checks[i].down) {
+			fprintf(stderr, "%u failures %" PRId64 "s ago: address should be %s\n", checks[i].failures,
+					checks[i].age, checks[i].down ? "down" : "up");
+			err++;
+		}
+	}
+
+	/* timeouts put the address on hold like connect failures */
+	slot.failures = 1;
+	slot.reason = HOST_FAIL_TIMEOUT;
+	if (!host_health_down(&slot, slot.last_failure)) {
+		fputs("timeout does not put address on hold\n", stderr);
+		err++;
+	}
+
+	/* a server that rejects the session or has TLS problems is still reachable */
+	slot.reason = HOST_FAIL_GREETING;
+	if (host_health_down(&slot, slot.last_failure)) {
+		fputs("greeting failure puts address on hold\n", stderr);
+		err++;
+	}
+	slot.reason = HOST_FAIL_TLS;
+	if (host_health_down(&slot, slot.last_failure)) {
+		fputs("TLS failure puts address on hold\n", stderr);
+		err++;
+	}
+}
+
+int
+main(void)
+{
+	const struct in6_addr a1 = addr("2001:db8::1");
+	const struct in6_addr a2 = addr("::ffff:192.0.2.1");
+
+	testcase_setup_log_writen(testcase_log_writen_console);
+
+	unlink(HEALTHFILE);
+	setenv("HOSTHEALTH", HEALTHFILE, 1);
+
+	check_state("unknown", &a1, 25, 0, 0);
+
+	host_health_result(&a1, 25, HOST_FAIL_CONNECT);
+	check_state("connect failure", &a1, 25, 1, 0);
+	check_state("other port", &a1, 587, 0, 0);
+	check_state("other address", &a2, 25, 0, 0);
+
+	host_health_connected(&a1, 25, 80);
+	host_health_result(&a1, 25, HOST_FAIL_NONE);
+	check_state("success", &a1, 25, 0, 80);
+
+	host_health_connected(&a1, 25, 160);
+	check_state("smoothed", &a1, 25, 0, 90);
+
+	host_health_result(&a2, 25, HOST_FAIL_TLS);
+	check_state("TLS failure", &a2, 25, 0, 0);
+	host_health_result(&a2, 25, HOST_FAIL_GREETING);
+	check_state("greeting failure", &a2, 25, 0, 0);
+	host_health_result(&a2, 25, HOST_FAIL_TIMEOUT);
+	check_state("timeout", &a2, 25, 1, 0);
+	/* the server replies again, so the hold down ends */
+	host_health_result(&a2, 25, HOST_FAIL_GREETING);
+	check_state("greeting failure after timeout", &a2, 25, 0, 0);
+
+	struct host_health_slot slot;
+	unsigned int used = 0;
+	for (unsigned int i = 0; i < HOSTHEALTH_SLOTS; i++) {
+		if (host_health_get(i, &slot) != 1)
+			continue;
+		used++;
+		if (IN6_ARE_ADDR_EQUAL(&slot.addr, &a2) && ((slot.failures != 0) || (slot.reason != HOST_FAIL_GREETING))) {
+			fprintf(stderr, "entry has %u failures, reason %u\n", slot.failures, slot.reason);
+			err++;
+		}
+	}
+	if (used != 2) {
+		fprintf(stderr, "%u entries in table instead of 2\n", used);
+		err++;
+	}
+
+	if (host_health_reset(&a2) != 1) {
+		fputs("resetting one address did not remove one entry\n", stderr);
+		err++;
+	}
+	check_state("reset", &a2, 25, 0, 0);
+	check_state("not reset", &a1, 25, 0, 90);
+
+	host_health_result(&a2, 25, HOST_FAIL_CONNECT);
+	if (host_health_reset(NULL) != 2) {
+		fputs("resetting all did not remove two entries\n", stderr);
+		err++;
+	}
+	check_state("all reset", &a1, 25, 0, 0);
+
+	check_holddown();
+
+	unlink(HEALTHFILE);
+
+	return err;
+}
@@ -4,7 +4,9 @@
 #include "test_io/testcase_io.h"
 
 #include <assert.h>
+#include <errno.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 void
@@ -428,6 +430,105 @@ test_no_multipart(void)
 	return ret;
 }
 
+static int
+test_find_boundary(void)
+{
+	int ret = 0;
+	const cstring boundary = {
+		.s = "b",
+		.len = 1
+	};
+	const struct {
+		const char *buf;
+		off_t result;
+	} patterns[] = {
+		{ "x\r\n--b\r\ny", 6 },
+		{ "\r\n--b", 5 },
+		{ "--b\r\n", 0 },
+		{ "\n--bx\n--b--", 9 },
+		{ "\n--ab\n--b-", 0 },
+		{ "\r--b--x\r\n--b--\r\n", 12 },
+		{ NULL, 0 }
+	};
+
+	for (unsigned int i = 0; patterns[i].buf != NULL; i++) {
+		const off_t r = find_boundary(patterns[i].buf, strlen(patterns[i].buf), &boundary);
+
+		if (r != patterns[i].result) {
+			fprintf(stderr, "boundary search in pattern %u returned %lli instead of %lli\n",
+					i, (long long)r, (long long)patterns[i].result);
+			ret++;
+		}
+	}
+
+	return ret;
+}
+
+static int
+test_index(void)
+{
+	int ret = 0;
+	char msg[2200];
+	const cstring boundary = {
+		.s = "b",
+		.len = 1
+	};
+	struct mime_index idx;
+
+	strcpy(msg, "Subject: ");
+	memset(msg + strlen(msg), 's', 995);
+	strcpy(msg + 1004, "\r\nContent-Type: multipart/mixed; boundary=b\r\n\r\npre\n--b\r\n\r\n\xe4\r--b--x\n--b--\r\n");
+	const size_t tail = strlen(msg);
+	memset(msg + tail, 'l', 1000);
+	const off_t len = tail + 1000;
+	const off_t pre = strstr(msg, "pre") - msg;
+
+	const struct {
+		off_t off;
+		off_t len;
+		int result;
+	} checks[] = {
+		{ 0, len, recode_8bit | recode_long_header | recode_long_line },
+		{ 0, pre, recode_long_header },
+		{ pre, len - pre, recode_8bit | recode_long_line },
+		/* the unterminated last line has one character less to be too long */
+		{ tail, 1000, recode_long_header },
+		{ tail, 0, 0 },
+		{ 1, len - 1, -EINVAL },
+		{ 0, 1005, -EINVAL }
+	};
+
+	if (mime_index_build(&idx, msg, len) != 0)
+		exit(ENOMEM);
+
+	for (unsigned int i = 0; i < sizeof(checks) / sizeof(checks[0]); i++) {
+		const int r = mime_index_recode(&idx, checks[i].off, checks[i].len);
+
+		if (r != checks[i].result) {
+			fprintf(stderr, "index check %u returned %i instead of %i\n", i, r, checks[i].result);
+			ret++;
+		}
+	}
+
+	/* the boundaries must be found exactly like find_boundary() does */
+	for (off_t off = 0; off < len; off++) {
+		for (off_t l = len - off; (l > 0) && (l > len - off - 3); l--) {
+			const off_t r = mime_index_boundary(&idx, off, l, &boundary);
+			const off_t e = find_boundary(msg + off, l, &boundary);
+
+			if (r != e) {
+				fprintf(stderr, "boundary search at %lli, length %lli returned %lli instead of %lli\n",
+						(long long)off, (long long)l, (long long)r, (long long)e);
+				ret++;
+			}
+		}
+	}
+
+	mime_index_free(&idx);
+
+	return ret;
+}
+
 int
 main(void)
 {
@@ -438,6 +539,8 @@ main(void)
 	err += test_multipart_bad();
 	err += test_multipart_boundary();
 	err += test_no_multipart();
+	err += test_find_boundary();
+	err += test_index();
 
 	return err;
 }
@@ -53,6 +53,12 @@ ssl_timeoutwrite(SSL *s __attribute__ ((unused)), time_t a __attribute__ ((unuse
 	return write(socketd, b, c);
 }
 
+int
+ssl_ktls_send(SSL *s __attribute__ ((unused)))
+{
+	return 0;
+}
+
 static int allow_ssl_pending = -1;
 
 int
@@ -855,6 +861,38 @@ test_net_writen(void)
 }
 #undef MANY_THINGS
 
+static int
+test_netnwritev(void)
+{
+	int ret = 0;
+	const struct iovec iov[] = {
+		{ .iov_base = "250 first", .iov_len = 9 },
+		{ .iov_base = "", .iov_len = 0 },
+		{ .iov_base = "second\r\n250 third\r\n", .iov_len = 19 }
+	};
+
+	testname = "netnwritev";
+
+	if (unexpected_pending())
+		return ++ret;
+
+	if (netnwritev(iov, 3) != 0) {
+		fprintf(stderr, "%s: cannot write output\n", testname);
+		return ++ret;
+	}
+
+	if (read_check("250 firstsecond"))
+		ret++;
+	if (read_check("250 third"))
+		ret++;
+	if (data_pending(NULL)) {
+		fprintf(stderr, "%s: spurious data after test\n", testname);
+		ret++;
+	}
+
+	return ret;
+}
+
 static int
 test_net_write_multiline(void)
 {
@@ -1191,6 +1229,7 @@ main(int argc, char **argv)
 
 	ret += test_net_writen();
 	ret += test_net_write_multiline();
+	ret += test_netnwritev();
 
 	int i = data_pending(NULL);
 	if (i != 0) {
@@ -0,0 +1,251 @@
+#include <qsmtpd/prefetch.h>
+
+#include <control.h>
+#include <qdns.h>
+#include <qsmtpd/antispam.h>
+#include <qsmtpd/bgdns.h>
+#include <qsmtpd/qsmtpd.h>
+#include "test_io/testcase_io.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+
+struct xmitstat xmitstat;
+
+static int err;
+
+/* the lookup helper runs the mocked functions */
+pid_t
+fork_clean(void)
+{
+	return fork();
+}
+
+int
+check_host(const char *domain __attribute__ ((unused)))
+{
+	abort();
+}
+
+int
+validate_names(const char *rnames, int r, char ***domainlist)
+{
+	if ((r != 2) || (strcmp(rnames, "mail.example.net") != 0) ||
+			(strcmp(rnames + strlen(rnames) + 1, "other.example.net") != 0))
+		abort();
+
+	*domainlist = malloc(sizeof(**domainlist));
+	if (*domainlist == NULL)
+		exit(ENOMEM);
+	(*domainlist)[0] = strdup(rnames);
+	if ((*domainlist)[0] == NULL)
+		exit(ENOMEM);
+
+	return 1;
+}
+
+int
+rbl_lookup(const char *rbl, char **txt)
+{
+	if (strcmp(rbl, "bl.example.com") == 0) {
+		*txt = strdup("listed for testing");
+		if (*txt == NULL)
+			exit(ENOMEM);
+		return 1;
+	} else if (strcmp(rbl, "clean.example.org") == 0) {
+		return DNS_ERROR_PERM;
+	}
+
+	abort();
+}
+
+static int
+test_ask_dnsname(const struct in6_addr *ip __attribute__ ((unused)), char **result)
+{
+	static const char names[] = "mail.example.net\0other.example.net";
+
+	switch (xmitstat.sremoteip.s6_addr[15]) {
+	case 1:
+		*result = malloc(sizeof(names));
+		if (*result == NULL)
+			exit(ENOMEM);
+		memcpy(*result, names, sizeof(names));
+		return 2;
+	case 2:
+		return DNS_ERROR_TEMP;
+	case 3:
+		errno = ENOTBLK; /* easily detectable */
+		return DNS_ERROR_LOCAL;
+	case 4:
+		/* never answer in time, the helper must be killed */
+		sleep(30);
+		return DNS_ERROR_TEMP;
+	default:
+		abort();
+	}
+}
+
+static void
+set_ip(const char *ip)
+{
+	memset(&xmitstat, 0, sizeof(xmitstat));
+	inet_pton(AF_INET6, ip, &xmitstat.sremoteip);
+	xmitstat.ipv4conn = IN6_IS_ADDR_V4MAPPED(&xmitstat.sremoteip) ? 1 : 0;
+}
+
+static void
+test_names(void)
+{
+	set_ip("::ffff:192.0.2.1");
+
+	if (connection_lookup_start() != 0) {
+		fprintf(stderr, "connection_lookup_start() failed\n");
+		err++;
+		return;
+	}
+
+	if (connection_lookup_wait() != 0) {
+		fprintf(stderr, "connection_lookup_wait() failed\n");
+		err++;
+	} else if ((xmitstat.remotehost.s == NULL) || (strcmp(xmitstat.remotehost.s, "mail.example.net") != 0) ||
+			(xmitstat.remotehost.len != strlen("mail.example.net"))) {
+		fprintf(stderr, "remotehost was not set to the first name\n");
+		err++;
+	}
+
+	if ((xmitstat.prefetch == NULL) || (xmitstat.prefetch->validcnt != 1) ||
+			(strcmp(xmitstat.prefetch->validnames[0], "mail.example.net") != 0)) {
+		fprintf(stderr, "validated names were not set\n");
+		err++;
+	}
+
+	connection_rbl_wait();
+
+	if ((xmitstat.prefetch == NULL) || (xmitstat.prefetch->rblcnt != 2)) {
+		fprintf(stderr, "DNSBL results were not set\n");
+		err++;
+	} else {
+		const struct rbl_result *r = xmitstat.prefetch->rbls;
+
+		if ((strcmp(r[0].rbl, "bl.example.com") != 0) || (r[0].result != 1) ||
+				(r[0].txt == NULL) || (strcmp(r[0].txt, "listed for testing") != 0)) {
+			fprintf(stderr, "first DNSBL result is wrong\n");
+			err++;
+		}
+		if ((strcmp(r[1].rbl, "clean.example.org") != 0) || (r[1].result != DNS_ERROR_PERM) ||
+				(r[1].txt != NULL)) {
+			fprintf(stderr, "second DNSBL result is wrong\n");
+			err++;
+		}
+	}
+
+	connection_lookup_cancel();
+	free(xmitstat.remotehost.s);
+
+	if (xmitstat.prefetch != NULL) {
+		fprintf(stderr, "connection_lookup_cancel() did not reset the prefetch data\n");
+		err++;
+	}
+}
+
+static void
+test_errors(void)
+{
+	/* there is no dnsblv6 file, so only the reverse lookup is done */
+	set_ip("::2");
+
+	if ((connection_lookup_start() != 0) || (connection_lookup_wait() != 0)) {
+		fprintf(stderr, "lookup with temporary DNS error failed\n");
+		err++;
+	} else if ((xmitstat.remotehost.len != 0) || (xmitstat.prefetch->validcnt != DNS_ERROR_TEMP)) {
+		fprintf(stderr, "temporary DNS error was not recorded\n");
+		err++;
+	}
+
+	connection_rbl_wait();
+	if (xmitstat.prefetch->rblcnt != 0) {
+		fprintf(stderr, "DNSBL results set without dnsblv6 file\n");
+		err++;
+	}
+
+	connection_lookup_cancel();
+
+	set_ip("::3");
+	log_write_msg = "can't look up remote host name";
+	log_write_priority = LOG_ERR;
+
+	if (connection_lookup_start() != 0) {
+		fprintf(stderr, "connection_lookup_start() failed\n");
+		err++;
+	} else if (connection_lookup_wait() != -1) {
+		fprintf(stderr, "local error was not reported\n");
+		err++;
+	} else if (errno != ENOTBLK) {
+		fprintf(stderr, "local error was reported with errno %i instead of %i\n", errno, ENOTBLK);
+		err++;
+	}
+
+	connection_lookup_cancel();
+}
+
+static void
+test_budget(void)
+{
+	set_ip("::4");
+	dnsphasebudget = 1;
+	dns_budget_phase();
+
+	if (dns_time_left() <= 0) {
+		fprintf(stderr, "dns_time_left() returned %i after the budget was set\n", dns_time_left());
+		err++;
+	}
+
+	log_write_msg = "DNS time budget exceeded, remote host lookup cancelled";
+	log_write_priority = LOG_WARNING;
+
+	if (connection_lookup_start() != 0) {
+		fprintf(stderr, "connection_lookup_start() failed\n");
+		err++;
+	} else if (connection_lookup_wait() != 0) {
+		fprintf(stderr, "timed out lookup was reported as error\n");
+		err++;
+	} else if (xmitstat.remotehost.len != 0) {
+		fprintf(stderr, "remotehost set by timed out lookup\n");
+		err++;
+	}
+
+	if (dns_time_left() != 0) {
+		fprintf(stderr, "dns_time_left() returned %i after the budget was used up\n", dns_time_left());
+		err++;
+	}
+
+	connection_lookup_cancel();
+
+	dnsphasebudget = 0;
+	dns_budget_phase();
+	if (dns_time_left() != -1) {
+		fprintf(stderr, "dns_time_left() returned %i without budget\n", dns_time_left());
+		err++;
+	}
+}
+
+int
+main(void)
+{
+	controldir_fd = AT_FDCWD;
+
+	testcase_setup_ask_dnsname(test_ask_dnsname);
+	testcase_setup_log_write(testcase_log_write_compare);
+
+	test_names();
+	test_errors();
+	test_budget();
+
+	return err;
+}
@@ -4,8 +4,10 @@
 #endif /* CHUNKING */
 
 #include <netio.h>
+#include <qremote/greeting.h>
 #include <qremote/qrdata.h>
 #include <qremote/qremote.h>
+#include <qremote/timing.h>
 #include "test_io/testcase_io.h"
 
 #include <errno.h>
@@ -33,6 +35,55 @@ static struct checkreply_data {
 	int result;
 } const *checkreply_msgs;
 static unsigned int checkreply_index;
+static const unsigned int *checkreply_writes;	/* number of chunks that must have been sent on each checkreply() */
+static int checkreply_any;			/* accept all replies without checking checkreply_msgs */
+
+/* a simulated link: writing takes time depending on the rate, and the reply
+ * to a chunk arrives link_rtt after it was written */
+static long long fakeclock;			/* the current time in microseconds */
+static unsigned int link_rate;			/* bytes written per microsecond, 0 for no delay */
+static long long link_rtt;			/* microseconds until the reply to a chunk arrives */
+static long long arrivals[64];			/* the times the replies to the chunks arrive */
+static unsigned int arrivals_sent;		/* number of chunks written */
+static unsigned int arrivals_read;		/* number of replies read */
+
+int
+clock_gettime(clockid_t clk __attribute__ ((unused)), struct timespec *ts)
+{
+	ts->tv_sec = fakeclock / 1000000;
+	ts->tv_nsec = (fakeclock % 1000000) * 1000;
+
+	return 0;
+}
+
+static void
+link_write(const size_t l)
+{
+	if (arrivals_sent == sizeof(arrivals) / sizeof(arrivals[0])) {
+		fprintf(stderr, "too many chunks sent\n");
+		exit(EINVAL);
+	}
+
+	if (link_rate != 0)
+		fakeclock += l / link_rate;
+	arrivals[arrivals_sent++] = fakeclock + link_rtt;
+}
+
+static void
+link_setup(const unsigned int rate, const long long rtt)
+{
+	fakeclock = 0;
+	link_rate = rate;
+	link_rtt = rtt;
+	arrivals_sent = 0;
+	arrivals_read = 0;
+}
+
+static int
+test_data_pending(SSL *s __attribute__ ((unused)))
+{
+	return (arrivals_read < arrivals_sent) && (arrivals[arrivals_read] <= fakeclock);
+}
 
 void
 quit(void)
@@ -63,6 +114,13 @@ quit(void)
 int
 checkreply(const char *status, const char **pre __attribute__ ((unused)), const int mask __attribute__ ((unused)))
 {
+	/* wait for the reply to arrive */
+	if ((arrivals_read < arrivals_sent) && (arrivals[arrivals_read++] > fakeclock))
+		fakeclock = arrivals[arrivals_read - 1];
+
+	if (checkreply_any)
+		return 250;
+
 	if ((checkreply_msgs == NULL) || (checkreply_msgs[checkreply_index].status == NULL)) {
 		fprintf(stderr, "%s was called but should not, status '%s'\n", __FUNCTION__, status);
 		exit(EFAULT);
@@ -74,15 +132,39 @@ checkreply(const char *status, const char **pre __attribute__ ((unused)), const
 		exit(EINVAL);
 	}
 
+	if ((checkreply_writes != NULL) && (checkreply_writes[checkreply_index] != write_msg_index)) {
+		fprintf(stderr, "reply %u was read after %u chunks, expected after %u\n",
+			checkreply_index, write_msg_index, checkreply_writes[checkreply_index]);
+		exit(EINVAL);
+	}
+
 	return checkreply_msgs[checkreply_index++].result;
 }
 
+int
+body_binarymime(const unsigned int recodeflag __attribute__ ((unused)))
+{
+	return 0;
+}
+
+void
+timing_reply(void)
+{
+}
+
+void
+err_mem(const int doquit __attribute__ ((unused)))
+{
+	fprintf(stderr, "%s() called unexpected\n", __FUNCTION__);
+	exit(EFAULT);
+}
+
 static unsigned int was_send_data_called;
 
 void
 send_data(unsigned int recodeflag)
 {
-	if (recodeflag != 42) {
+	if (recodeflag != recode_8bit) {
 		fprintf(stderr, "invalid recodeflag %u found\n", recodeflag);
 		exit(EINVAL);
 	}
@@ -165,6 +247,7 @@ test_netnwrite(const char *s, const size_t l)
 	}
 
 	test_netnwrite_bdatlen(s, l);
+	link_write(l);
 	write_msg_index++;
 
 	return 0;
@@ -179,10 +262,12 @@ test_bad_malloc(void)
 
 	testcase_setup_log_write(test_log_write);
 
-	msgdata = "1234\r\n.\r\n";
+	/* messages with CRLF line endings are sent without buffer */
+	msgdata = "1234\n.\n";
 	msgsize = strchr(msgdata, '\n') - msgdata + 1;
 
-	send_bdat(42);
+	/* the message is not sent as BINARYMIME, so DATA can send it unmodified */
+	send_bdat(recode_8bit);
 
 	if (may_log_count != 0) {
 		fprintf(stderr, "may_log_count is %i but should be 0\n", may_log_count);
@@ -353,6 +438,173 @@ test_newline_crlf_errors(void)
 	return 0;
 }
 
+static int
+check_pipelining(const unsigned int *writes, const long long rtt)
+{
+	const char *netmsgs[] = {
+		"BDAT 3\r\nabc",
+		"BDAT 4\r\nde\r\n",
+		"BDAT 3\r\nfgh",
+		"BDAT 3\r\nijk",
+		"BDAT 2 LAST\r\nlm",
+		NULL
+	};
+	const struct checkreply_data chrmsgs[] = {
+		{ " ZD", 250 },
+		{ " ZD", 250 },
+		{ " ZD", 250 },
+		{ " ZD", 250 },
+		{ "KZD", 250 },
+		{ NULL, 0 }
+	};
+
+	msgdata = "abcde\r\nfghijklm";
+	msgsize = strlen(msgdata);
+	may_log_count = 0;
+	chunksize = 18;
+	smtpext = esmtp_pipelining;
+	write_msg_index = 0;
+	write_msgs = netmsgs;
+	checkreply_index = 0;
+	checkreply_msgs = chrmsgs;
+	checkreply_writes = writes;
+	successmsg[2] = "3";
+	link_setup(0, rtt);
+
+	testcase_setup_netnwrite(test_netnwrite);
+	testcase_setup_data_pending(test_data_pending);
+
+	send_bdat(0);
+
+	smtpext = 0;
+	checkreply_writes = NULL;
+
+	if (write_msgs[write_msg_index] != NULL) {
+		fprintf(stderr, "only %u of the chunks were sent\n", write_msg_index);
+		return 1;
+	}
+
+	return 0;
+}
+
+static int
+test_pipelining(void)
+{
+	/* the replies are late, so the window of 4 chunks is filled */
+	const unsigned int late[] = { 4, 5, 5, 5, 5 };
+	/* replies that are already there are read before the next chunk is sent */
+	const unsigned int early[] = { 1, 2, 3, 4, 5 };
+
+	return check_pipelining(late, 1000) + check_pipelining(early, 0);
+}
+
+static size_t chunk_sizes[64];
+
+static int
+test_netnwrite_size(const char *s, const size_t l)
+{
+	if (write_msg_index == sizeof(chunk_sizes) / sizeof(chunk_sizes[0])) {
+		fprintf(stderr, "too many chunks sent\n");
+		exit(EINVAL);
+	}
+
+	test_netnwrite_bdatlen(s, l);
+	link_write(l);
+	chunk_sizes[write_msg_index++] = strtoul(s + 5, NULL, 10);
+
+	return 0;
+}
+
+/**
+ * @brief send a message of only 'x' characters over a simulated link
+ * @param len length of the message
+ * @param max the chunksize
+ * @param rate bytes written per microsecond
+ * @param rtt round trip time of the link in microseconds
+ * @return number of chunks sent
+ */
+static unsigned int
+send_sized(const size_t len, const size_t max, const unsigned int rate, const long long rtt)
+{
+	char *msg = malloc(len + 1);
+
+	if (msg == NULL) {
+		fputs("out of memory\n", stderr);
+		exit(ENOMEM);
+	}
+
+	memset(msg, 'x', len);
+	msg[len] = '\0';
+	msgdata = msg;
+	msgsize = len;
+	may_log_count = 0;
+	chunksize = max;
+	write_msg_index = 0;
+	write_msgs = NULL;
+	checkreply_any = 1;
+	successmsg[2] = "3";
+	link_setup(rate, rtt);
+
+	testcase_setup_netnwrite(test_netnwrite_size);
+	testcase_setup_data_pending(test_data_pending);
+
+	send_bdat(0);
+
+	checkreply_any = 0;
+	free(msg);
+
+	return write_msg_index;
+}
+
+static int
+test_chunk_growth(void)
+{
+	/* "BDAT 16384 LAST\r\n" is reserved in every chunk */
+	const size_t expected[] = { 16384 - 18, 16384 - 18, 40000 - 2 * (16384 - 18), 0 };
+	int ret = 0;
+
+	/* without PIPELINING every chunk waits for its reply, so all have the
+	 * maximum size from the start, no matter how slow the link is */
+	smtpext = 0;
+	unsigned int cnt = send_sized(40000, 16384, 100, 50000);
+
+	for (unsigned int i = 0; expected[i] != 0; i++) {
+		if (chunk_sizes[i] != expected[i]) {
+			fprintf(stderr, "chunk %u has size %zu, expected %zu\n", i, chunk_sizes[i], expected[i]);
+			ret++;
+		}
+	}
+	if (cnt != 3) {
+		fprintf(stderr, "%u chunks sent instead of 3\n", cnt);
+		ret++;
+	}
+
+	/* a distant link needs a lot of data in flight: after the first window
+	 * the chunks grow to the maximum size */
+	smtpext = esmtp_pipelining;
+	cnt = send_sized(200000, 65536, 100, 50000);
+	for (unsigned int i = 0; i < 4; i++) {
+		if (chunk_sizes[i] != 8192 - 18) {
+			fprintf(stderr, "chunk %u on distant link has size %zu, expected %u\n", i, chunk_sizes[i], 8192 - 18);
+			ret++;
+		}
+	}
+	if ((cnt < 5) || (chunk_sizes[4] != 65536 - 18)) {
+		fprintf(stderr, "chunks on distant link did not grow to %u\n", 65536 - 18);
+		ret++;
+	}
+
+	/* on a short link the replies come in early and the chunks shrink */
+	cnt = send_sized(40000, 65536, 100, 100);
+	if ((cnt < 5) || (chunk_sizes[3] >= chunk_sizes[0]) || (chunk_sizes[cnt - 2] < 1024 - 18)) {
+		fprintf(stderr, "chunks on short link did not shrink: %zu, %zu\n", chunk_sizes[0], chunk_sizes[3]);
+		ret++;
+	}
+	smtpext = 0;
+
+	return ret;
+}
+
 static int
 test_wrap_fail(void)
 {
@@ -396,6 +648,8 @@ main(void)
 	ret += test_wrap_single_line();
 	ret += test_wrap_multi_lines();
 	ret += test_newline_crlf_errors();
+	ret += test_pipelining();
+	ret += test_chunk_growth();
 
 	if (ret != 0) {
 		fprintf(stderr, "%i errors before calling final test\n", ret);
@@ -452,6 +452,12 @@ static struct {
 		.recodeflag = recode_8bit,
 		.log_count = 0
 	},
+	{
+		.name = "largeRecode",
+		.filters = 0,
+		.recodeflag = recode_8bit,
+		.log_count = 0
+	},
 	{ }
 };
 static unsigned int usepattern;
@@ -0,0 +1,226 @@
+#include <qremote/daemon.h>
+
+#include <netio.h>
+#include <qremote/qremote.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define SOCKPATH "qremote_daemon_test.sock"
+#define MSGFILE "qremote_daemon_test.msg"
+
+int socketd = -1;
+static int err;
+static unsigned int deliveries;	/* messages sent by this worker */
+
+void
+net_conn_shutdown(const enum conn_shutdown_type sd_type __attribute__ ((unused)))
+{
+	exit(0);
+}
+
+void
+err_conf(const char *errmsg)
+{
+	fprintf(stderr, "configuration error: %s\n", errmsg);
+	exit(1);
+}
+
+void
+write_status(const char *str)
+{
+	if (write(1, str, strlen(str) + 1) < 0)
+		exit(1);
+}
+
+void
+deliver(const int msgfd, const off_t size, int argc, char **argv)
+{
+	char msg[64] = "";
+	char buf[256];
+
+	if ((argc != 4) || (strcmp(argv[0], "Qremote") != 0) || (strcmp(argv[2], "sender@example.org") != 0) ||
+			(strcmp(argv[3], "rcpt@example.net") != 0)) {
+		write_status("Zinvalid arguments");
+		return;
+	}
+
+	if ((size >= (off_t)sizeof(msg)) || (pread(msgfd, msg, size, 0) != size)) {
+		write_status("Zcan't read message");
+		return;
+	}
+
+	/* a session that is never closed by the server */
+	if (socketd < 0) {
+		int p[2];
+
+		if (pipe(p) != 0)
+			exit(1);
+		socketd = p[0];
+	}
+
+	deliveries++;
+	snprintf(buf, sizeof(buf), "K%i %u %s %s", (int)getpid(), deliveries, argv[1], msg);
+	write_status(buf);
+
+	/* the connection is lost during the delivery */
+	if (strcmp(argv[1], "die.example.net") == 0)
+		net_conn_shutdown(shutdown_abort);
+}
+
+/**
+ * @brief send a message through the daemon
+ * @param host the target host
+ * @param msg the message contents
+ * @param out the status written by the worker
+ * @param outlen size of out
+ * @return return code of daemon_delegate()
+ */
+static int
+run(const char *host, const char *msg, char *out, const size_t outlen)
+{
+	char *argv[] = { "Qremote", (char *)host, "sender@example.org", "rcpt@example.net", NULL };
+	int p[2];
+
+	int fd = open(MSGFILE, O_CREAT | O_TRUNC | O_RDWR | O_CLOEXEC, 0600);
+	if ((fd < 0) || (write(fd, msg, strlen(msg)) != (ssize_t)strlen(msg)) || (pipe(p) != 0)) {
+		fputs("cannot set up message\n", stderr);
+		exit(1);
+	}
+
+	const int saved0 = dup(0);
+	const int saved1 = dup(1);
+	fflush(stdout);
+	dup2(fd, 0);
+	dup2(p[1], 1);
+	close(fd);
+	close(p[1]);
+
+	const int r = daemon_delegate(SOCKPATH, 4, argv);
+
+	dup2(saved0, 0);
+	dup2(saved1, 1);
+	close(saved0);
+	close(saved1);
+
+	/* this only ends once the worker has released the status output */
+	size_t len = 0;
+	ssize_t l;
+	while ((l = read(p[0], out + len, outlen - 1 - len)) > 0)
+		len += l;
+	out[len] = '\0';
+	close(p[0]);
+
+	return r;
+}
+
+/**
+ * @brief send a message and check which worker handled it
+ * @param host the target host
+ * @param count the expected number of messages sent by the worker
+ * @return the process id of the worker
+ */
+static pid_t
+check(const char *host, const unsigned int count)
+{
+	char out[256];
+	char expect[256];
+	int pid;
+	unsigned int cnt;
+
+	if (run(host, "msg", out, sizeof(out)) != 0) {
+		fprintf(stderr, "message to %s was not taken by the daemon\n", host);
+		err++;
+		return 0;
+	}
+
+	if (sscanf(out, "K%i %u", &pid, &cnt) != 2) {
+		fprintf(stderr, "invalid status for %s: %s\n", host, out);
+		err++;
+		return 0;
+	}
+
+	snprintf(expect, sizeof(expect), "K%i %u %s msg", pid, cnt, host);
+	if (strcmp(out, expect) != 0) {
+		fprintf(stderr, "status for %s is '%s' instead of '%s'\n", host, out, expect);
+		err++;
+	}
+
+	if (cnt != count) {
+		fprintf(stderr, "message to %s was message %u of the session instead of %u\n", host, cnt, count);
+		err++;
+	}
+
+	return pid;
+}
+
+int
+main(void)
+{
+	char out[256];
+	sigset_t mask;
+
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGPIPE);
+	sigprocmask(SIG_BLOCK, &mask, NULL);
+
+	unlink(SOCKPATH);
+
+	if (run("a.example.net", "msg", out, sizeof(out)) != -1) {
+		fputs("message was delegated without a running daemon\n", stderr);
+		err++;
+	}
+
+	timeoutidle = 1;
+	const pid_t daemon = fork();
+	if (daemon < 0) {
+		fputs("cannot fork\n", stderr);
+		return 1;
+	} else if (daemon == 0) {
+		daemon_run(SOCKPATH);
+	}
+
+	for (unsigned int i = 0; access(SOCKPATH, F_OK) != 0; i++) {
+		if (i == 100) {
+			fputs("daemon socket was not created\n", stderr);
+			kill(daemon, SIGTERM);
+			return 1;
+		}
+		usleep(50000);
+	}
+
+	/* the second message uses the session of the first one */
+	const pid_t a = check("a.example.net", 1);
+	if (check("A.example.net", 2) != a) {
+		fputs("the session to a.example.net was not reused\n", stderr);
+		err++;
+	}
+
+	if (check("b.example.net", 1) == a) {
+		fputs("b.example.net got the session of a.example.net\n", stderr);
+		err++;
+	}
+
+	/* a worker that lost its connection is replaced */
+	check("die.example.net", 1);
+	check("die.example.net", 1);
+
+	/* idle sessions are closed after timeoutidle */
+	sleep(2);
+	check("a.example.net", 1);
+
+	kill(daemon, SIGTERM);
+	waitpid(daemon, NULL, 0);
+	unlink(SOCKPATH);
+	unlink(MSGFILE);
+
+	return err;
+}
@@ -0,0 +1,340 @@
+#include <qremote/daemon.h>
+
+#include <netio.h>
+#include <qremote/conn.h>
+#include <qremote/qrdata.h>
+#include <qremote/qremote.h>
+#include <qremote/routecache.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define SOCKPATH "qremote_deliver_test.sock"
+#define MSGFILE "qremote_deliver_test.msg"
+
+/* the message looks like a server reply, so reading it instead of the
+ * connection is noticed */
+#define MSGBODY "250 this is the message\r\n"
+
+int socketd = -1;
+char *rhost;
+size_t rhostlen;
+unsigned int targetport = 25;
+struct in6_addr outgoingip;
+struct in6_addr outgoingip6;
+const char *successmsg[] = {NULL, " accepted ", NULL, "message", "", "", "", "./Remote host said: ", NULL};
+const char *msgdata = MAP_FAILED;
+off_t msgsize;
+static unsigned int connections;	/* connections opened by this worker */
+static int err;
+
+void
+net_conn_shutdown(const enum conn_shutdown_type sd_type)
+{
+	if ((sd_type == shutdown_clean) && (socketd >= 0))
+		quitmsg();
+	else
+		conn_abort();
+	exit(0);
+}
+
+void
+err_mem(const int doquit __attribute__ ((unused)))
+{
+	exit(ENOMEM);
+}
+
+void
+err_conf(const char *errmsg)
+{
+	fprintf(stderr, "configuration error: %s\n", errmsg);
+	exit(1);
+}
+
+void
+conn_abort(void)
+{
+	if (socketd < 0)
+		return;
+
+	close(socketd);
+	socketd = -1;
+	free(rhost);
+	rhost = NULL;
+}
+
+void
+quitmsg(void)
+{
+	netwrite("QUIT\r\n");
+	net_read(0);
+	conn_abort();
+}
+
+enum mx_source
+getmxlist(char *remhost __attribute__ ((unused)), struct ips **mx)
+{
+	*mx = NULL;
+	return MX_SOURCE_CACHE;
+}
+
+struct ips *
+filter_my_ips(struct ips *ipl __attribute__ ((unused)))
+{
+	abort();
+}
+
+void
+route_cache_store(const char *host __attribute__ ((unused)), const unsigned int port __attribute__ ((unused)),
+		const struct ips *mx __attribute__ ((unused)), const unsigned long ttl __attribute__ ((unused)))
+{
+	abort();
+}
+
+void
+tlsa_prefetch_reset(void)
+{
+}
+
+/**
+ * @brief a plaintext SMTP server that accepts any message
+ * @param fd the connection to the client
+ */
+static void __attribute__ ((noreturn))
+server(const int fd)
+{
+	FILE *f = fdopen(fd, "r+");
+	char line[1024];
+	unsigned int messages = 0;
+	int indata = 0;
+
+	if (f == NULL)
+		_exit(1);
+
+	setvbuf(f, NULL, _IONBF, 0);
+	fputs("220 server ESMTP\r\n", f);
+
+	while (fgets(line, sizeof(line), f) != NULL) {
+		if (indata) {
+			if (strcmp(line, ".\r\n") == 0) {
+				indata = 0;
+				fprintf(f, "250 message %u of the session\r\n", ++messages);
+			}
+		} else if (strncmp(line, "RSET", 4) == 0) {
+			fputs("250 reset\r\n", f);
+		} else if (strncmp(line, "MAIL", 4) == 0) {
+			fputs("250 sender ok\r\n", f);
+		} else if (strncmp(line, "DATA", 4) == 0) {
+			indata = 1;
+			fputs("354 go ahead\r\n", f);
+		} else if (strncmp(line, "QUIT", 4) == 0) {
+			fputs("221 bye\r\n", f);
+			break;
+		} else {
+			fputs("500 unknown command\r\n", f);
+		}
+	}
+
+	_exit(0);
+}
+
+int
+connect_mx(struct ips *mx __attribute__ ((unused)), const struct in6_addr *outip4 __attribute__ ((unused)),
+		const struct in6_addr *outip6 __attribute__ ((unused)))
+{
+	int sp[2];
+
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sp) != 0)
+		return -ENOENT;
+
+	switch (fork()) {
+	case -1:
+		return -ENOENT;
+	case 0:
+		/* the client waits until all copies of the status output are closed */
+		for (int i = 0; i < 1024; i++)
+			if (i != sp[1])
+				close(i);
+		server(sp[1]);
+	default:
+		break;
+	}
+
+	close(sp[1]);
+	socketd = sp[0];
+	/* like the real connect_mx(): the replies are read from fd 0 */
+	if (dup2(socketd, 0) != 0)
+		return -ENOENT;
+
+	connections++;
+	rhost = strdup("server");
+	if ((rhost == NULL) || (netget(0) != 220))
+		return -ENOENT;
+
+	return 0;
+}
+
+unsigned int
+need_recode(const char *buf __attribute__ ((unused)), off_t len __attribute__ ((unused)))
+{
+	return 0;
+}
+
+int
+send_envelope(const unsigned int recodeflag __attribute__ ((unused)), const char *sender,
+		int rcptcount __attribute__ ((unused)), char **rcpts __attribute__ ((unused)))
+{
+	const char *cmd[] = { "MAIL FROM:<", sender, ">", NULL };
+
+	if ((net_writen(cmd) != 0) || (netget(0) != 250)) {
+		write_status("Zsender not accepted");
+		return -1;
+	}
+
+	return 0;
+}
+
+#ifdef CHUNKING
+int
+body_chunked(const unsigned int recodeflag __attribute__ ((unused)))
+{
+	return 0;
+}
+
+void
+send_bdat(unsigned int recodeflag __attribute__ ((unused)))
+{
+	abort();
+}
+#endif
+
+void
+send_data(unsigned int recodeflag __attribute__ ((unused)))
+{
+	char buf[256];
+
+	if ((netwrite("DATA\r\n") != 0) || (netget(0) != 354)) {
+		write_status("ZDATA not accepted");
+		return;
+	}
+
+	if ((netnwrite(msgdata, msgsize) != 0) || (netwrite(".\r\n") != 0) || (netget(0) != 250)) {
+		write_status("Zmessage not accepted");
+		return;
+	}
+
+	snprintf(buf, sizeof(buf), "K%u %s", connections, linein.s + 4);
+	write_status(buf);
+}
+
+/**
+ * @brief send a message through the daemon
+ * @param out the status written by the worker
+ * @param outlen size of out
+ * @return return code of daemon_delegate()
+ */
+static int
+run(char *out, const size_t outlen)
+{
+	char *argv[] = { "Qremote", "example.net", "sender@example.org", "rcpt@example.net", NULL };
+	int p[2];
+
+	int fd = open(MSGFILE, O_CREAT | O_TRUNC | O_RDWR | O_CLOEXEC, 0600);
+	if ((fd < 0) || (write(fd, MSGBODY, strlen(MSGBODY)) != (ssize_t)strlen(MSGBODY)) || (pipe(p) != 0)) {
+		fputs("cannot set up message\n", stderr);
+		exit(1);
+	}
+
+	const int saved0 = dup(0);
+	const int saved1 = dup(1);
+	fflush(stdout);
+	dup2(fd, 0);
+	dup2(p[1], 1);
+	close(fd);
+	close(p[1]);
+
+	const int r = daemon_delegate(SOCKPATH, 4, argv);
+
+	dup2(saved0, 0);
+	dup2(saved1, 1);
+	close(saved0);
+	close(saved1);
+
+	size_t len = 0;
+	ssize_t l;
+	while ((l = read(p[0], out + len, outlen - 1 - len)) > 0)
+		len += l;
+	out[len] = '\0';
+	close(p[0]);
+
+	return r;
+}
+
+/**
+ * @brief send a message and check the session it was sent over
+ * @param expect the expected status
+ */
+static void
+check(const char *expect)
+{
+	char out[256];
+
+	if (run(out, sizeof(out)) != 0) {
+		fputs("message was not taken by the daemon\n", stderr);
+		err++;
+	} else if (strcmp(out, expect) != 0) {
+		fprintf(stderr, "status is '%s' instead of '%s'\n", out, expect);
+		err++;
+	}
+}
+
+int
+main(void)
+{
+	sigset_t mask;
+
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGPIPE);
+	sigprocmask(SIG_BLOCK, &mask, NULL);
+
+	unlink(SOCKPATH);
+	timeout = 5;
+	timeoutidle = 5;
+
+	const pid_t daemon = fork();
+	if (daemon < 0) {
+		fputs("cannot fork\n", stderr);
+		return 1;
+	} else if (daemon == 0) {
+		daemon_run(SOCKPATH);
+	}
+
+	for (unsigned int i = 0; access(SOCKPATH, F_OK) != 0; i++) {
+		if (i == 100) {
+			fputs("daemon socket was not created\n", stderr);
+			kill(daemon, SIGTERM);
+			return 1;
+		}
+		usleep(50000);
+	}
+
+	/* the later messages are sent after a RSET over the connection of the first one */
+	check("K1 message 1 of the session\n");
+	check("K1 message 2 of the session\n");
+	check("K1 message 3 of the session\n");
+
+	kill(daemon, SIGTERM);
+	waitpid(daemon, NULL, 0);
+	unlink(SOCKPATH);
+	unlink(MSGFILE);
+
+	return err;
+}
@@ -225,6 +225,13 @@ queue_result(void)
 	return 0;
 }
 
+/* the results of the sender lookup are set directly in xmitstat */
+int
+sender_lookup_wait(void)
+{
+	return 0;
+}
+
 int
 spfreceived(int fd, const int spf)
 {
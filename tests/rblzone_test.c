@@ -0,0 +1,211 @@
+#include <rblzone.h>
+
+#include <control.h>
+#include <qdns.h>
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static int err;
+
+static const char ipzone[] =
+	"# comment\n"
+	"$TTL 3600\n"
+	":127.0.0.2:listed by default\n"
+	"192.0.2.0/24\n"
+	"192.0.2.128/25 :127.0.0.3:subnet $ listed\n"
+	"!192.0.2.200\n"
+	"198.51.100.1-198.51.100.10\n"
+	"203.0.113.5:127.0.0.4:single\n"
+	"2001:db8::/32 ipv6 net\n"
+	"\n"
+	"2001:db8:1::1 :127.0.0.2:\n"
+	"10.0.0.0/8 :127.0.0.2:wide\n"
+	"10.1.0.0/16 :127.0.0.2:medium\n"
+	"10.1.0.5 :127.0.0.2:single\n"
+	"10.1.2.0/24 :127.0.0.2:narrow\n"
+	"10.1.2.3 :127.0.0.2:single\n"
+	"!10.1.2.9\n"
+	"10.2.0.7 :127.0.0.2:single\n";
+
+static const char namezone[] =
+	"; comment\n"
+	":127.0.0.2:bad domain\n"
+	"spam.example.com\n"
+	"*.wild.example.org :127.0.0.2:wildcard\n"
+	".all.example.net\n"
+	"!good.all.example.net\n";
+
+static void
+compile(const char *name, const char *src, const enum rblzone_type type)
+{
+	char fname[64];
+	unsigned int errline;
+
+	snprintf(fname, sizeof(fname), RBLZONE_DIR "%s", name);
+	int fd = open(fname, O_CREAT | O_TRUNC | O_WRONLY | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		fprintf(stderr, "cannot create %s\n", fname);
+		exit(1);
+	}
+
+	if (rblzone_compile(src, strlen(src), type, fd, &errline) != 0) {
+		fprintf(stderr, "compiling %s failed in line %u, errno %i\n", name, errline, errno);
+		exit(1);
+	}
+	close(fd);
+}
+
+static void
+check_ip(const char *ip, const int expected, const char *exptxt)
+{
+	struct in6_addr addr;
+	struct in_addr ip4;
+	char *txt = NULL;
+
+	if (inet_pton(AF_INET, ip, &ip4) == 1)
+		addr = in_addr_to_v4mapped(&ip4);
+	else if (inet_pton(AF_INET6, ip, &addr) != 1)
+		abort();
+
+	int r = rblzone_lookup_ip("ip.example.com", &addr, &txt);
+	if (r != expected) {
+		fprintf(stderr, "lookup of %s returned %i instead of %i\n", ip, r, expected);
+		err++;
+	} else if ((exptxt == NULL) != (txt == NULL)) {
+		fprintf(stderr, "lookup of %s returned reason %s instead of %s\n", ip,
+				(txt == NULL) ? "(none)" : txt, (exptxt == NULL) ? "(none)" : exptxt);
+		err++;
+	} else if ((txt != NULL) && (strcmp(txt, exptxt) != 0)) {
+		fprintf(stderr, "lookup of %s returned reason '%s' instead of '%s'\n", ip, txt, exptxt);
+		err++;
+	}
+
+	free(txt);
+}
+
+static void
+check_name(const char *name, const int expected, const char *exptxt)
+{
+	char *txt = NULL;
+
+	int r = rblzone_lookup_name("name.example.com", name, &txt);
+	if (r != expected) {
+		fprintf(stderr, "lookup of %s returned %i instead of %i\n", name, r, expected);
+		err++;
+	} else if ((exptxt == NULL) != (txt == NULL)) {
+		fprintf(stderr, "lookup of %s returned reason %s instead of %s\n", name,
+				(txt == NULL) ? "(none)" : txt, (exptxt == NULL) ? "(none)" : exptxt);
+		err++;
+	} else if ((txt != NULL) && (strcmp(txt, exptxt) != 0)) {
+		fprintf(stderr, "lookup of %s returned reason '%s' instead of '%s'\n", name, txt, exptxt);
+		err++;
+	}
+
+	free(txt);
+}
+
+static void
+check_syntax(void)
+{
+	const char *bad[] = {
+		"192.0.2.1/33\n",
+		"192.0.2.10-192.0.2.1\n",
+		"192.0.2.1-2001:db8::1\n",
+		"not.an.ip\n",
+		NULL
+	};
+	unsigned int errline;
+
+	for (unsigned int i = 0; bad[i] != NULL; i++) {
+		int fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+
+		if ((rblzone_compile(bad[i], strlen(bad[i]), RBLZONE_IP, fd, &errline) != -1) ||
+				(errno != EINVAL) || (errline != 1)) {
+			fprintf(stderr, "invalid entry '%s' was not detected\n", bad[i]);
+			err++;
+		}
+		close(fd);
+	}
+
+	int fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+	const char badname[] = "good.example.com\nbad..example.com\n";
+	if ((rblzone_compile(badname, strlen(badname), RBLZONE_NAME, fd, &errline) != -1) ||
+			(errno != EINVAL) || (errline != 2)) {
+		fprintf(stderr, "invalid name was not detected\n");
+		err++;
+	}
+	close(fd);
+}
+
+int
+main(void)
+{
+	struct in6_addr addr;
+
+	controldir_fd = AT_FDCWD;
+	if ((mkdir(RBLZONE_DIR, 0755) != 0) && (errno != EEXIST)) {
+		fprintf(stderr, "cannot create " RBLZONE_DIR "\n");
+		return 1;
+	}
+
+	compile("ip.example.com", ipzone, RBLZONE_IP);
+	compile("name.example.com", namezone, RBLZONE_NAME);
+
+	check_ip("192.0.2.1", 1, "listed by default");
+	check_ip("192.0.2.129", 1, "subnet 192.0.2.129 listed");
+	check_ip("192.0.2.200", 0, NULL);
+	check_ip("192.0.3.1", 0, NULL);
+	check_ip("198.51.100.1", 1, "listed by default");
+	check_ip("198.51.100.10", 1, "listed by default");
+	check_ip("198.51.100.11", 0, NULL);
+	check_ip("203.0.113.5", 1, "single");
+	check_ip("203.0.113.6", 0, NULL);
+	check_ip("2001:db8:ffff::1", 1, "ipv6 net");
+	check_ip("2001:db8:1::1", 1, NULL);
+	check_ip("2001:db9::1", 0, NULL);
+	check_ip("::1", 0, NULL);
+	/* entries nested in wider ranges are skipped when they end before the address */
+	check_ip("10.1.0.5", 1, "single");
+	check_ip("10.1.0.9", 1, "medium");
+	check_ip("10.1.2.9", 0, NULL);
+	check_ip("10.1.2.200", 1, "narrow");
+	check_ip("10.1.3.0", 1, "medium");
+	check_ip("10.2.0.8", 1, "wide");
+	check_ip("11.0.0.0", 0, NULL);
+
+	check_name("spam.example.com", 1, "bad domain");
+	check_name("SPAM.Example.com", 1, "bad domain");
+	check_name("sub.spam.example.com", 0, NULL);
+	check_name("wild.example.org", 0, NULL);
+	check_name("a.b.wild.example.org", 1, "wildcard");
+	check_name("all.example.net", 1, "bad domain");
+	check_name("x.all.example.net", 1, "bad domain");
+	check_name("good.all.example.net", 0, NULL);
+	check_name("example.net", 0, NULL);
+
+	/* wrong type or missing zone */
+	memset(&addr, 0, sizeof(addr));
+	if ((rblzone_lookup_ip("name.example.com", &addr, NULL) != -1) || (errno != EINVAL)) {
+		fprintf(stderr, "zone of wrong type was accepted\n");
+		err++;
+	}
+	if ((rblzone_lookup_name("missing.example.com", "foo.example.com", NULL) != -1) || (errno != ENOENT)) {
+		fprintf(stderr, "missing zone was not reported as ENOENT\n");
+		err++;
+	}
+
+	check_syntax();
+
+	unlink(RBLZONE_DIR "ip.example.com");
+	unlink(RBLZONE_DIR "name.example.com");
+	rmdir(RBLZONE_DIR);
+
+	return err;
+}
@@ -0,0 +1,129 @@
+#include <qremote/routecache.h>
+
+#include <qdns.h>
+#include "test_io/testcase_io.h"
+
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define CACHEFILE "routecache_test.cache"
+
+static int err;
+
+static struct ips *
+make_mx(const char *name, const unsigned int priority, const char *ip1, const char *ip2, struct ips *next)
+{
+	const unsigned int cnt = (ip2 == NULL) ? 1 : 2;
+	struct in6_addr *a = calloc(cnt, sizeof(*a));
+
+	if ((a == NULL) || (inet_pton(AF_INET6, ip1, a) != 1) ||
+			((ip2 != NULL) && (inet_pton(AF_INET6, ip2, a + 1) != 1))) {
+		fputs("cannot set up addresses\n", stderr);
+		exit(1);
+	}
+
+	struct ips *res = in6_to_ips(a, cnt, priority);
+	if (res == NULL) {
+		fputs("out of memory\n", stderr);
+		exit(1);
+	}
+	if (name != NULL)
+		res->name = strdup(name);
+	res->next = next;
+
+	return res;
+}
+
+static void
+check_equal(const char *desc, const struct ips *expect, const struct ips *got)
+{
+	for (; (expect != NULL) && (got != NULL); expect = expect->next, got = got->next) {
+		if ((expect->priority != got->priority) || (expect->count != got->count) ||
+				(memcmp(expect->addr, got->addr, expect->count * sizeof(*expect->addr)) != 0) ||
+				((expect->name == NULL) != (got->name == NULL)) ||
+				((expect->name != NULL) && (strcmp(expect->name, got->name) != 0))) {
+			fprintf(stderr, "%s: cached entry differs\n", desc);
+			err++;
+			return;
+		}
+	}
+
+	if ((expect != NULL) || (got != NULL)) {
+		fprintf(stderr, "%s: cached list has a different length\n", desc);
+		err++;
+	}
+}
+
+static void
+check_none(const char *desc, const char *host, const unsigned int port)
+{
+	struct ips *r = route_cache_lookup(host, port);
+
+	if (r != NULL) {
+		fprintf(stderr, "%s: lookup returned an entry\n", desc);
+		err++;
+		freeips(r);
+	}
+}
+
+int
+main(void)
+{
+	struct ips *mx = make_mx("mx1.example.net", 10, "2001:db8::1", "::ffff:192.0.2.1",
+			make_mx(NULL, MX_PRIORITY_IMPLICIT, "::ffff:192.0.2.2", NULL, NULL));
+
+	testcase_setup_log_writen(testcase_log_writen_console);
+
+	unlink(CACHEFILE);
+	setenv("ROUTECACHE", CACHEFILE, 1);
+
+	check_none("empty cache", "example.net", 25);
+
+	route_cache_store("Example.NET", 25, mx, 3600);
+	struct ips *r = route_cache_lookup("example.net", 25);
+	check_equal("lookup", mx, r);
+	freeips(r);
+
+	check_none("other port", "example.net", 587);
+	check_none("other host", "example.org", 25);
+
+	/* a route with too many MX entries is not cached */
+	struct ips *big = NULL;
+	for (unsigned int i = 0; i < 20; i++)
+		big = make_mx("mx.example.com", i, "::ffff:192.0.2.3", NULL, big);
+	route_cache_store("example.com", 25, big, 3600);
+	check_none("too many MX entries", "example.com", 25);
+	freeips(big);
+
+	/* a new route replaces the old one */
+	struct ips *mx2 = make_mx("mx2.example.net", 5, "::ffff:192.0.2.4", NULL, NULL);
+	route_cache_store("example.net", 25, mx2, 3600);
+	r = route_cache_lookup("EXAMPLE.net", 25);
+	check_equal("replaced", mx2, r);
+	freeips(r);
+
+	/* a DNS TTL of 0 means the records must not be cached */
+	route_cache_store("example.org", 25, mx, 0);
+	check_none("TTL 0", "example.org", 25);
+
+	/* the lower of the DNS TTL and the configured time is used */
+	route_cache_store("example.org", 25, mx, 1);
+	route_cache_store("example.net", 25, mx, 3600);
+	routecache_ttl = 1;
+	route_cache_store("example.com", 25, mx, 3600);
+	sleep(2);
+	check_none("expired by DNS TTL", "example.org", 25);
+	check_none("expired", "example.com", 25);
+	r = route_cache_lookup("example.net", 25);
+	check_equal("not expired", mx, r);
+	freeips(r);
+
+	freeips(mx);
+	freeips(mx2);
+	unlink(CACHEFILE);
+
+	return err;
+}
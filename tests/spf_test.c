@@ -32,6 +32,13 @@ dieerror(int a __attribute__ ((unused)))
 	abort();
 }
 
+/* nothing to clean up here, the prefetch helpers run the mocked functions */
+pid_t
+fork_clean(void)
+{
+	return fork();
+}
+
 enum dnstype {
 	DNSTYPE_A,
 	DNSTYPE_AAAA,
@@ -49,6 +56,15 @@ struct dnsentry {
 };
 
 const struct dnsentry *dnsdata;
+static pid_t mainpid;		/**< the process to count the DNS lookups of */
+static unsigned int mainlookups;	/**< DNS lookups done by mainpid */
+
+static void
+count_lookup(void)
+{
+	if (getpid() == mainpid)
+		mainlookups++;
+}
 
 static const char *
 dnsentry_search(const enum dnstype stype, const char *skey)
@@ -121,6 +137,7 @@ test_ask_dnsmx(const char *domain, struct ips **ips)
 {
 	const char *value = dnsentry_search(DNSTYPE_MX, domain);
 
+	count_lookup();
 	*ips = NULL;
 	if (value == NULL) {
 		struct in6_addr *a;
@@ -206,6 +223,7 @@ test_ask_dnsaaaa(const char *domain, struct in6_addr **ips)
 	struct in6_addr *cur;
 	int r;
 
+	count_lookup();
 	if (value == NULL)
 		return ask_dnsa(domain, ips);
 
@@ -235,6 +253,7 @@ test_ask_dnsa(const char *domain, struct in6_addr **ips)
 	const char *value = dnsentry_search(DNSTYPE_A, domain);
 	int r;
 
+	count_lookup();
 	if (value == NULL) {
 		if (dnsentry_search(DNSTYPE_TIMEOUT, domain) != NULL)
 			return DNS_ERROR_TEMP;
@@ -291,6 +310,7 @@ dns_resolve_txt(char **out, const char *host)
 {
 	const char *value = dnsentry_search(DNSTYPE_TXT, host);
 
+	count_lookup();
 	if (value == NULL) {
 		if (dnsentry_search(DNSTYPE_TIMEOUT, host) != NULL)
 			errno = ETIMEDOUT;
@@ -3917,6 +3937,94 @@ test_received()
 	return err;
 }
 
+static int
+test_prefetch(void)
+{
+	struct dnsentry dns[] = {
+		{
+			.type = DNSTYPE_TXT,
+			.key = "prefetch.example.net",
+			.value = "v=spf1 include:inc.example.net a:a.example.net mx:mx.example.net exists:ex.example.net -all"
+		},
+		{
+			.type = DNSTYPE_TXT,
+			.key = "inc.example.net",
+			.value = "v=spf1 a:b.example.net ~all"
+		},
+		{
+			.type = DNSTYPE_A,
+			.key = "a.example.net",
+			.value = "::ffff:192.0.2.10"
+		},
+		{
+			.type = DNSTYPE_A,
+			.key = "b.example.net",
+			.value = "::ffff:192.0.2.11"
+		},
+		{
+			.type = DNSTYPE_MX,
+			.key = "mx.example.net",
+			.value = "mx1.example.net"
+		},
+		{
+			.type = DNSTYPE_A,
+			.key = "mx1.example.net",
+			.value = "::ffff:192.0.2.12"
+		},
+		{
+			.type = DNSTYPE_NONE
+		}
+	};
+	const struct {
+		const char *ip;
+		int result;
+		const char *mechanism;
+	} checks[] = {
+		{ "::ffff:192.0.2.1", SPF_FAIL, "all" },
+		{ "::ffff:192.0.2.10", SPF_PASS, "A" },
+		{ "::ffff:192.0.2.11", SPF_PASS, "include" },
+		{ "::ffff:192.0.2.12", SPF_PASS, "MX" },
+		{ NULL, 0, NULL }
+	};
+	int err = 0;
+
+	dnsdata = dns;
+	mainpid = getpid();
+
+	for (unsigned int i = 0; checks[i].ip != NULL; i++) {
+		setup_transfer("prefetch.example.net", "foo@prefetch.example.net", checks[i].ip);
+		xmitstat.spfmechanism = NULL;
+		mainlookups = 0;
+
+		int r = check_host("prefetch.example.net");
+
+		if ((r != checks[i].result) || (xmitstat.spfmechanism == NULL) ||
+				(strcmp(xmitstat.spfmechanism, checks[i].mechanism) != 0)) {
+			fprintf(stderr, "prefetch: %s got result %i/%s instead of %i/%s\n", checks[i].ip, r,
+					xmitstat.spfmechanism, checks[i].result, checks[i].mechanism);
+			err++;
+		}
+
+		/* only the TXT record of the checked domain is queried by this process */
+		if (mainlookups != 1) {
+			fprintf(stderr, "prefetch: %s did %u lookups in the main process instead of 1\n",
+					checks[i].ip, mainlookups);
+			err++;
+		}
+
+		free(xmitstat.mailfrom.s);
+		STREMPTY(xmitstat.mailfrom);
+		free(xmitstat.helostr.s);
+		STREMPTY(xmitstat.helostr);
+		free(xmitstat.remotehost.s);
+		STREMPTY(xmitstat.remotehost);
+	}
+
+	mainpid = 0;
+
+	return err;
+}
+
 static int
 test_suite(void)
 {
@@ -3956,6 +4064,8 @@ int main(int argc, char **argv)
 		return test_received();
 	else if (strcmp(argv[1], "_suite_") == 0)
 		return test_suite();
+	else if (strcmp(argv[1], "_prefetch_") == 0)
+		return test_prefetch();
 	else {
 		fprintf(stderr, "invalid argument: %s\n", argv[1]);
 		return EINVAL;
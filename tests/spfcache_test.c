@@ -0,0 +1,162 @@
+#include <qsmtpd/spfcache.h>
+
+#include <qsmtpd/antispam.h>
+#include <qsmtpd/qsmtpd.h>
+#include "test_io/testcase_io.h"
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define CACHEFILE "spfcache_test.cache"
+
+struct xmitstat xmitstat;
+
+static int err;
+
+static void
+set_client(const char *ip, const char *from)
+{
+	inet_pton(AF_INET6, ip, &xmitstat.sremoteip);
+	xmitstat.mailfrom.s = (char *)from;
+	xmitstat.mailfrom.len = (from == NULL) ? 0 : strlen(from);
+}
+
+static void
+check_lookup(const char *domain, const int expected, const char *msg)
+{
+	int r = spfcache_lookup(domain);
+
+	if (r != expected) {
+		fprintf(stderr, "%s: lookup of %s returned %i instead of %i\n", msg, domain, r, expected);
+		err++;
+	}
+}
+
+static void
+test_disabled(void)
+{
+	/* without SPFCACHE nothing is stored */
+	set_client("::ffff:192.0.2.1", "foo@example.com");
+	xmitstat.spfmechanism = "all";
+	spfcache_store("example.com", SPF_PASS, 300);
+	check_lookup("example.com", -1, "cache without SPFCACHE");
+}
+
+static void
+test_keys(void)
+{
+	set_client("::ffff:192.0.2.1", "foo@example.com");
+	xmitstat.spfmechanism = "IP4";
+	spfcache_store("example.com", SPF_PASS, 300);
+
+	xmitstat.spfmechanism = NULL;
+	check_lookup("example.com", SPF_PASS, "stored entry");
+	if ((xmitstat.spfmechanism == NULL) || (strcmp(xmitstat.spfmechanism, "IP4") != 0)) {
+		fprintf(stderr, "cached mechanism is %s instead of IP4\n",
+				(xmitstat.spfmechanism == NULL) ? "(null)" : xmitstat.spfmechanism);
+		err++;
+	}
+
+	check_lookup("EXAMPLE.com", SPF_PASS, "domain case");
+	check_lookup("example.net", -1, "other domain");
+
+	/* the local part of the sender is not part of the key */
+	set_client("::ffff:192.0.2.1", "bar@Example.COM");
+	check_lookup("example.com", SPF_PASS, "other local part");
+
+	set_client("::ffff:192.0.2.1", "foo@example.org");
+	check_lookup("example.com", -1, "other sender domain");
+
+	set_client("::ffff:192.0.2.2", "foo@example.com");
+	check_lookup("example.com", -1, "other client");
+
+	/* a null sender uses the HELO as sender domain */
+	set_client("::ffff:192.0.2.1", NULL);
+	xmitstat.helostr.s = (char *)"example.com";
+	xmitstat.helostr.len = strlen(xmitstat.helostr.s);
+	check_lookup("example.com", SPF_PASS, "null sender with HELO matching the sender domain");
+	xmitstat.helostr.s = (char *)"mail.example.com";
+	xmitstat.helostr.len = strlen(xmitstat.helostr.s);
+	check_lookup("example.com", -1, "null sender with other HELO");
+}
+
+static void
+test_explanation(void)
+{
+	set_client("2001:db8::1", "foo@example.com");
+	xmitstat.spfmechanism = "all";
+	xmitstat.spfexp = strdup("go away");
+	spfcache_store("example.com", SPF_FAIL, 300);
+	free(xmitstat.spfexp);
+	xmitstat.spfexp = NULL;
+
+	check_lookup("example.com", SPF_FAIL, "failure with explanation");
+	if ((xmitstat.spfexp == NULL) || (strcmp(xmitstat.spfexp, "go away") != 0)) {
+		fprintf(stderr, "cached explanation is %s instead of 'go away'\n",
+				(xmitstat.spfexp == NULL) ? "(null)" : xmitstat.spfexp);
+		err++;
+	}
+	free(xmitstat.spfexp);
+	xmitstat.spfexp = NULL;
+}
+
+static void
+test_lifetime(void)
+{
+	set_client("::ffff:198.51.100.1", "foo@example.com");
+	xmitstat.spfmechanism = "default";
+
+	/* a TTL of 0 must not be cached at all */
+	spfcache_store("ttl0.example.com", SPF_NEUTRAL, 0);
+	check_lookup("ttl0.example.com", -1, "TTL 0");
+
+	/* the lifetime is limited by spfcachetime */
+	spfcachetime = 1;
+	spfcache_store("short.example.com", SPF_NEUTRAL, 86400);
+	check_lookup("short.example.com", SPF_NEUTRAL, "limited lifetime");
+	sleep(2);
+	check_lookup("short.example.com", -1, "expired entry");
+	spfcachetime = 3600;
+}
+
+int
+main(void)
+{
+	/* the cache is disabled for the whole process once SPFCACHE is found unset */
+	pid_t pid = fork();
+	if (pid == 0) {
+		test_disabled();
+		_exit(err);
+	}
+
+	int status;
+	if ((pid < 0) || (waitpid(pid, &status, 0) != pid) || !WIFEXITED(status)) {
+		fprintf(stderr, "test process did not finish\n");
+		err++;
+	} else {
+		err += WEXITSTATUS(status);
+	}
+
+	/* a file of the wrong size is reinitialized */
+	int fd = open(CACHEFILE, O_CREAT | O_TRUNC | O_WRONLY | O_CLOEXEC, S_IRUSR | S_IWUSR);
+	if ((fd < 0) || (write(fd, "garbage", 7) != 7)) {
+		fprintf(stderr, "cannot create " CACHEFILE "\n");
+		return 1;
+	}
+	close(fd);
+
+	setenv("SPFCACHE", CACHEFILE, 1);
+	test_keys();
+	test_explanation();
+	test_lifetime();
+
+	unlink(CACHEFILE);
+
+	return err;
+}
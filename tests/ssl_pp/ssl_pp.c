@@ -12,6 +12,7 @@
 
 #include <errno.h>
 #include <limits.h>
+#include <openssl/crypto.h>
 #include <signal.h>
 #include <stdio.h>
 #include <unistd.h>
@@ -23,6 +24,7 @@
 struct xmitstat xmitstat;
 char *partner_fqdn = "testcert.example.org";
 char *rhost;
+unsigned int targetport = 25;
 int socketd;
 static const char *logmsg;
 static const char *client_log;
@@ -31,6 +33,8 @@ static int client_init_result;
 static int server_init_result;
 static int dane_count;
 static int is_client;
+static int plaintext;
+static unsigned long ssl_allocs;	/* allocations done by OpenSSL in this process */
 
 int
 checkaddr(const char *const a __attribute__((unused)))
@@ -124,11 +128,38 @@ write_status_m(const char **strs __attribute__ ((unused)), const unsigned int co
 {
 }
 
+/* OpenSSL allocates memory as soon as it is initialized, so counting its
+ * allocations shows if a session has touched it at all */
+static void *
+count_malloc(size_t num, const char *file __attribute__ ((unused)), int line __attribute__ ((unused)))
+{
+	ssl_allocs++;
+	return malloc(num);
+}
+
+static void *
+count_realloc(void *p, size_t num, const char *file __attribute__ ((unused)), int line __attribute__ ((unused)))
+{
+	ssl_allocs++;
+	return realloc(p, num);
+}
+
+static void
+count_free(void *p, const char *file __attribute__ ((unused)), int line __attribute__ ((unused)))
+{
+	free(p);
+}
+
 static int sockets[2];
 
 static int
 setup(void)
 {
+	if (CRYPTO_set_mem_functions(count_malloc, count_realloc, count_free) != 1) {
+		fputs("OpenSSL was initialized before the session started\n", stderr);
+		return -1;
+	}
+
 	controldir_fd = get_dirfd(AT_FDCWD, "control");
 
 	if (controldir_fd < 0) {
@@ -166,10 +197,37 @@ setup(void)
 static const char query[] = "ping";
 static const char answer[] = "250 pong";
 
+/**
+ * @brief send the ping and check the reply of the server
+ */
 static int
-client(void)
+client_ping(void)
 {
 	const char *ping[] = { query, NULL };
+	int r = 0;
+
+	net_writen(ping);
+	printf("CLIENT: sent ping\n");
+	int k = netget(0);
+	if (k != 250) {
+		fprintf(stderr, "client: netget() returned wrong result %i, message was '%s'\n", k, linein.s);
+		r++;
+	} else if ((linein.len != strlen(answer) || strcmp(linein.s, answer) != 0)) {
+		fprintf(stderr, "client: netget() returned string '%s' instead of '%s'\n", linein.s, answer);
+		r++;
+	}
+
+	if (plaintext && (ssl_allocs != 0)) {
+		fprintf(stderr, "client: OpenSSL was used in a plaintext session\n");
+		r++;
+	}
+
+	return r;
+}
+
+static int
+client(void)
+{
 	/* only usage types that are ignored by tls_init() as unusable */
 	const struct daneinfo tlsa_info[2] = {
 		{
@@ -192,6 +250,14 @@ client(void)
 
 	socketd = sockets[1];
 
+	if (plaintext)
+		return client_ping();
+
+	if (ssl_allocs != 0) {
+		fprintf(stderr, "client: OpenSSL was used before STARTTLS\n");
+		return 1;
+	}
+
 	int r = tls_init(tlsa_info, dane_count);
 	if (r != client_init_result)
 		return 1;
@@ -201,25 +267,40 @@ client(void)
 		return 0;
 	}
 
-	r = 0;
 	printf("CLIENT: init done, protocol version is %s, cipher is %s\n", SSL_get_version(ssl), SSL_get_cipher(ssl));
 
-	net_writen(ping);
-	printf("CLIENT: sent ping\n");
-	int k = netget(0);
-	if (k != 250) {
-		fprintf(stderr, "client: netget() returned wrong result %i, message was '%s'\n", k, linein.s);
-		r++;
-	} else if ((linein.len != strlen(answer) || strcmp(linein.s, answer) != 0)) {
-		fprintf(stderr, "client: netget() returned string '%s' instead of '%s'\n", linein.s, answer);
-		r++;
-	}
-
-	return r;
+	return client_ping();
 }
 
 static int expect_verify_success;
 
+/**
+ * @brief answer the ping of a client that did not use STARTTLS
+ */
+static int
+server_plain(void)
+{
+	const char *pong[] = { answer, NULL };
+
+	if (net_read(0) != 0) {
+		fprintf(stderr, "server: net_read() failed\n");
+		return 1;
+	} else if ((linein.len != strlen(query) || strcmp(linein.s, query) != 0)) {
+		fprintf(stderr, "server: net_read() returned string '%s' instead of '%s'\n", linein.s, query);
+		return 1;
+	}
+
+	printf("SERVER: got ping\n");
+	net_writen(pong);
+
+	if (ssl_allocs != 0) {
+		fprintf(stderr, "server: OpenSSL was used in a plaintext session\n");
+		return 1;
+	}
+
+	return 0;
+}
+
 static int
 server(void)
 {
@@ -235,6 +316,9 @@ server(void)
 
 	socketd = sockets[0];
 
+	if (plaintext)
+		return server_plain();
+
 	memset(buf, 0, sizeof(buf));
 	if ((read(socketd, buf, sizeof(buf) - 1) != (ssize_t)strlen(stls)) || (strcmp(buf, stls) != 0)) {
 		fprintf(stderr, "server: did not receive STARTTLS command, but '%s'\n", buf);
@@ -246,6 +330,11 @@ server(void)
 	if (find_servercert("587") != 0)
 		return -ENOENT;
 
+	if (ssl_allocs != 0) {
+		fprintf(stderr, "server: OpenSSL was used before STARTTLS\n");
+		return 1;
+	}
+
 	xmitstat.esmtp = 1;
 	int r = smtp_starttls();
 
@@ -313,7 +402,7 @@ main(int argc, char **argv)
 {
 	int r;
 
-	while ((r = getopt(argc, argv, "s:f:l:L:i:I:d:")) != -1) {
+	while ((r = getopt(argc, argv, "s:f:l:L:i:I:d:p")) != -1) {
 		switch(r) {
 		case 's':
 			/* result of server tls_verify() */
@@ -360,6 +449,10 @@ main(int argc, char **argv)
 		case 'I':
 			server_init_result = parse_init_result(optarg);
 			break;
+		case 'p':
+			/* no STARTTLS at all */
+			plaintext = 1;
+			break;
 		case ':':
 			printf("-%c without argument\n", optopt);
 			return 1;
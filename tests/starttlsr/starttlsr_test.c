@@ -22,6 +22,7 @@
 char *rhost;
 size_t rhostlen;
 char *partner_fqdn;
+unsigned int targetport = 25;
 unsigned int smtpext;
 string heloname;
 static unsigned int conf_error_expected;
@@ -116,6 +117,12 @@ test_ssl_free(SSL *myssl)
 	ssl_library_destroy();
 }
 
+int
+ssl_library_setup(void)
+{
+	return (OPENSSL_init_ssl(0, NULL) == 1) ? 0 : -1;
+}
+
 void
 ssl_library_destroy()
 {
@@ -5,6 +5,7 @@
 
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 static char lineinbuf[TESTIO_MAX_LINELEN];
@@ -172,6 +173,33 @@ netnwrite(const char *a, const size_t len)
 	return testcase_netnwrite(a, len);
 }
 
+int
+netnwritev(const struct iovec *iov, const unsigned int cnt)
+{
+	size_t len = 0;
+
+	for (unsigned int i = 0; i < cnt; i++)
+		len += iov[i].iov_len;
+
+	/* combine the buffers so the netnwrite() checkers see them as one message */
+	char *buf = malloc(len + 1);
+	size_t pos = 0;
+
+	if (buf == NULL)
+		abort();
+
+	for (unsigned int i = 0; i < cnt; i++) {
+		memcpy(buf + pos, iov[i].iov_base, iov[i].iov_len);
+		pos += iov[i].iov_len;
+	}
+	buf[len] = '\0';
+
+	const int r = netnwrite(buf, len);
+	free(buf);
+
+	return r;
+}
+
 int
 testcase_netnwrite_compare(const char *a, const size_t len)
 {
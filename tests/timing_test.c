@@ -0,0 +1,107 @@
+#include <qremote/timing.h>
+
+#include <qremote/qrdata.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+const char *successmsg[] = { "1", "2", "3", "4", "5", "6", "", "8", NULL };
+
+static int err;
+
+/**
+ * @brief get the value of a field from a timing record
+ * @param record the record
+ * @param name the name of the field
+ * @return the value, -1 if the field is not in the record
+ */
+static long
+field(const char *record, const char *name)
+{
+	char key[32];
+	const char *f;
+
+	snprintf(key, sizeof(key), "%s=", name);
+	f = strstr(record, key);
+	if ((f == NULL) || ((f != record) && (f[-1] != ' ') && (f[-1] != '[')))
+		return -1;
+
+	return strtol(f + strlen(key), NULL, 10);
+}
+
+static void
+sleep_ms(const long ms)
+{
+	const struct timespec ts = {
+		.tv_sec = 0,
+		.tv_nsec = ms * 1000000
+	};
+
+	nanosleep(&ts, NULL);
+}
+
+int
+main(void)
+{
+	char record[TIMING_RECORD_LEN];
+
+	timing_start();
+	timing_phase(TIMING_DNS);
+	sleep_ms(20);
+	timing_phase(TIMING_CONNECT);
+	sleep_ms(10);
+	timing_phase(TIMING_DNS);
+	sleep_ms(10);
+	timing_phase(TIMING_ENVELOPE);
+
+	size_t len = timing_record(record, sizeof(record));
+	if (len != strlen(record)) {
+		fprintf(stderr, "record length %zu does not match string length %zu\n", len, strlen(record));
+		err++;
+	}
+
+	if (field(record, "dns") < 30) {
+		fprintf(stderr, "dns phase was not summed up: %s\n", record);
+		err++;
+	}
+	if (field(record, "connect") < 10) {
+		fprintf(stderr, "connect phase is too short: %s\n", record);
+		err++;
+	}
+	if ((field(record, "envelope") < 0) || (field(record, "greeting") != -1) || (field(record, "reply") != -1)) {
+		fprintf(stderr, "record does not contain exactly the entered phases: %s\n", record);
+		err++;
+	}
+	if (field(record, "total") < field(record, "dns") + field(record, "connect")) {
+		fprintf(stderr, "total is less than the sum of the phases: %s\n", record);
+		err++;
+	}
+
+	/* the record is only added to the report if configured */
+	timing_reply();
+	if (strcmp(successmsg[6], "") != 0) {
+		fprintf(stderr, "timing record was added to the report: %s\n", successmsg[6]);
+		err++;
+	}
+
+	timing_mode = TIMING_STATUS;
+	timing_start();
+	timing_phase(TIMING_DATA);
+	timing_reply();
+	if ((strncmp(successmsg[6], " [data=", 7) != 0) || (field(successmsg[6], "total") < 0) ||
+			(successmsg[6][strlen(successmsg[6]) - 1] != ']')) {
+		fprintf(stderr, "invalid timing record in report: '%s'\n", successmsg[6]);
+		err++;
+	}
+
+	/* the reply is measured after the report was set up */
+	timing_record(record, sizeof(record));
+	if (field(record, "reply") < 0) {
+		fprintf(stderr, "reply phase is not in record: %s\n", record);
+		err++;
+	}
+
+	return err;
+}
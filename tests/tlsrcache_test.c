@@ -0,0 +1,241 @@
+#include <qremote/tlscache.h>
+
+#include <qdns_dane.h>
+#include "test_io/testcase_io.h"
+
+#include <errno.h>
+#include <openssl/err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define CACHEFILE "tlsrcache_test.cache"
+#define CLIENTCERT "control/clientcert.pem"
+
+static int err;
+static SSL_CTX *sctx;
+static struct tlsr_cache_key curkey;
+
+static int
+new_session_cb(SSL *s __attribute__ ((unused)), SSL_SESSION *sess)
+{
+	if (tlsr_cache_store(&curkey, sess) != 0) {
+		fputs("storing the session failed\n", stderr);
+		err++;
+	}
+
+	return 0;
+}
+
+/**
+ * @brief do a handshake in memory, offering the cached session
+ * @return if the session was resumed, -1 on error
+ */
+static int
+connect_once(const int version)
+{
+	SSL_CTX *cctx = SSL_CTX_new(TLS_client_method());
+	SSL_CTX_set_min_proto_version(cctx, version);
+	SSL_CTX_set_max_proto_version(cctx, version);
+	SSL_CTX_set_session_cache_mode(cctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+	SSL_CTX_sess_set_new_cb(cctx, new_session_cb);
+
+	SSL *c = SSL_new(cctx);
+	SSL *s = SSL_new(sctx);
+	SSL_CTX_free(cctx);
+	BIO *cbio;
+	BIO *sbio;
+	BIO_new_bio_pair(&cbio, 0, &sbio, 0);
+	SSL_set_bio(c, cbio, cbio);
+	SSL_set_bio(s, sbio, sbio);
+	SSL_set_connect_state(c);
+	SSL_set_accept_state(s);
+
+	SSL_SESSION *cached = tlsr_cache_lookup(&curkey);
+	if (cached != NULL) {
+		SSL_set_session(c, cached);
+		SSL_SESSION_free(cached);
+	}
+
+	int done = 0;
+	for (int i = 0; (i < 100) && !done; i++) {
+		const int cr = SSL_do_handshake(c);
+		const int sr = SSL_do_handshake(s);
+		done = (cr == 1) && (sr == 1);
+	}
+
+	int ret = -1;
+	if (done) {
+		char buf[4];
+
+		/* let the client receive TLS 1.3 tickets */
+		if ((SSL_write(s, "x", 1) == 1) && (SSL_read(c, buf, sizeof(buf)) == 1))
+			ret = SSL_session_reused(c);
+	}
+	if (ret < 0)
+		ERR_print_errors_fp(stderr);
+
+	SSL_free(c);
+	SSL_free(s);
+
+	return ret;
+}
+
+static void
+check_connect(const int version, const int expected, const char *msg)
+{
+	const int r = connect_once(version);
+
+	if (r != expected) {
+		fprintf(stderr, "%s: connect returned %i instead of %i\n", msg, r, expected);
+		err++;
+	}
+}
+
+static void
+test_keys(void)
+{
+	struct tlsr_cache_key a;
+	struct tlsr_cache_key b;
+	struct stat st;
+	unsigned char tlsadata[32];
+	struct daneinfo tlsa = {
+		.cert_usage = 3,
+		.selector = 1,
+		.matching_type = 1,
+		.data = tlsadata,
+		.datalen = sizeof(tlsadata)
+	};
+
+	memset(&st, 0, sizeof(st));
+	memset(tlsadata, 0x55, sizeof(tlsadata));
+
+	tlsr_cache_key(&a, "mx.example.com", 25, "", &st, CLIENTCERT, NULL, CLIENTCERT, NULL, "DEFAULT", NULL, 0);
+	tlsr_cache_key(&b, "MX.Example.COM", 25, "", &st, CLIENTCERT, NULL, CLIENTCERT, NULL, "DEFAULT", NULL, 0);
+	if (memcmp(&a, &b, sizeof(a)) != 0) {
+		fputs("host name case changes the key\n", stderr);
+		err++;
+	}
+
+	const struct {
+		const char *host;
+		unsigned int port;
+		const char *cert;
+		const char *ciphers;
+		int tlsa_cnt;
+		const char *msg;
+	} variants[] = {
+		{ "mx2.example.com", 25, "", "DEFAULT", 0, "other host" },
+		{ "mx.example.com", 587, "", "DEFAULT", 0, "other port" },
+		{ "mx.example.com", 25, "control/tlshosts/mx.example.com.pem", "DEFAULT", 0, "certificate file" },
+		{ "mx.example.com", 25, "", "HIGH", 0, "other ciphers" },
+		{ "mx.example.com", 25, "", "DEFAULT", 1, "TLSA record" },
+		{ NULL, 0, NULL, NULL, 0, NULL }
+	};
+
+	for (unsigned int i = 0; variants[i].host != NULL; i++) {
+		tlsr_cache_key(&b, variants[i].host, variants[i].port, variants[i].cert, &st,
+				CLIENTCERT, NULL, CLIENTCERT, NULL, variants[i].ciphers, &tlsa, variants[i].tlsa_cnt);
+		if (memcmp(&a, &b, sizeof(a)) == 0) {
+			fprintf(stderr, "%s does not change the key\n", variants[i].msg);
+			err++;
+		}
+	}
+
+	/* a changed certificate file invalidates the key */
+	tlsr_cache_key(&a, "mx.example.com", 25, "control/tlshosts/mx.example.com.pem", &st, CLIENTCERT, NULL, CLIENTCERT, NULL, "DEFAULT", NULL, 0);
+	st.st_mtime = 1;
+	tlsr_cache_key(&b, "mx.example.com", 25, "control/tlshosts/mx.example.com.pem", &st, CLIENTCERT, NULL, CLIENTCERT, NULL, "DEFAULT", NULL, 0);
+	if (memcmp(&a, &b, sizeof(a)) == 0) {
+		fputs("modification of the certificate file does not change the key\n", stderr);
+		err++;
+	}
+
+	/* the client certificate of the route is part of the key */
+	st.st_mtime = 0;
+	tlsr_cache_key(&a, "mx.example.com", 25, "", &st, CLIENTCERT, NULL, CLIENTCERT, NULL, "DEFAULT", NULL, 0);
+	tlsr_cache_key(&b, "mx.example.com", 25, "", &st, "control/route.pem", NULL, "control/route.pem", NULL,
+			"DEFAULT", NULL, 0);
+	if (memcmp(&a, &b, sizeof(a)) == 0) {
+		fputs("other client certificate does not change the key\n", stderr);
+		err++;
+	}
+	tlsr_cache_key(&b, "mx.example.com", 25, "", &st, CLIENTCERT, NULL, "control/clientkey.pem", NULL,
+			"DEFAULT", NULL, 0);
+	if (memcmp(&a, &b, sizeof(a)) == 0) {
+		fputs("other client key does not change the key\n", stderr);
+		err++;
+	}
+	tlsr_cache_key(&b, "mx.example.com", 25, "", &st, CLIENTCERT, &st, CLIENTCERT, &st, "DEFAULT", NULL, 0);
+	if (memcmp(&a, &b, sizeof(a)) == 0) {
+		fputs("existing client certificate does not change the key\n", stderr);
+		err++;
+	}
+	tlsr_cache_key(&a, "mx.example.com", 25, "", &st, CLIENTCERT, &st, CLIENTCERT, &st, "DEFAULT", NULL, 0);
+	st.st_ino = 42;
+	tlsr_cache_key(&b, "mx.example.com", 25, "", &st, CLIENTCERT, &st, CLIENTCERT, &st, "DEFAULT", NULL, 0);
+	if (memcmp(&a, &b, sizeof(a)) == 0) {
+		fputs("replaced client certificate does not change the key\n", stderr);
+		err++;
+	}
+}
+
+static void
+test_resume(const char *certfile, const char *keyfile)
+{
+	struct stat st;
+
+	memset(&st, 0, sizeof(st));
+
+	sctx = SSL_CTX_new(TLS_server_method());
+	if ((sctx == NULL) || (SSL_CTX_use_certificate_chain_file(sctx, certfile) != 1) ||
+			(SSL_CTX_use_PrivateKey_file(sctx, keyfile, SSL_FILETYPE_PEM) != 1)) {
+		ERR_print_errors_fp(stderr);
+		exit(1);
+	}
+
+	tlsr_cache_key(&curkey, "mx.example.com", 25, "", &st, CLIENTCERT, NULL, CLIENTCERT, NULL, "DEFAULT", NULL, 0);
+	check_connect(TLS1_2_VERSION, 0, "TLS 1.2 initial connection");
+	check_connect(TLS1_2_VERSION, 1, "TLS 1.2 resumed connection");
+	check_connect(TLS1_2_VERSION, 1, "TLS 1.2 session used again");
+
+	tlsr_cache_remove(&curkey);
+	check_connect(TLS1_2_VERSION, 0, "TLS 1.2 after removal");
+
+	tlsr_cache_key(&curkey, "mx.example.com", 587, "", &st, CLIENTCERT, NULL, CLIENTCERT, NULL, "DEFAULT", NULL, 0);
+	check_connect(TLS1_3_VERSION, 0, "TLS 1.3 initial connection");
+	/* the ticket is taken from the cache, but a new one is stored */
+	check_connect(TLS1_3_VERSION, 1, "TLS 1.3 resumed connection");
+	check_connect(TLS1_3_VERSION, 1, "TLS 1.3 with new ticket");
+
+	SSL_SESSION *sess = tlsr_cache_lookup(&curkey);
+	SSL_SESSION_free(sess);
+	sess = tlsr_cache_lookup(&curkey);
+	if (sess != NULL) {
+		fputs("TLS 1.3 ticket was returned twice\n", stderr);
+		SSL_SESSION_free(sess);
+		err++;
+	}
+
+	SSL_CTX_free(sctx);
+}
+
+int
+main(int argc, char **argv)
+{
+	if (argc != 3) {
+		fprintf(stderr, "usage: %s certfile keyfile\n", argv[0]);
+		return EINVAL;
+	}
+
+	test_keys();
+
+	unlink(CACHEFILE);
+	setenv("TLSCLIENTCACHE", CACHEFILE, 1);
+	test_resume(argv[1], argv[2]);
+	unlink(CACHEFILE);
+
+	return err;
+}
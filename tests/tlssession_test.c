@@ -0,0 +1,213 @@
+#include <qsmtpd/tlssession.h>
+
+#include <control.h>
+#include "test_io/testcase_io.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#define CACHEFILE "tlssession_test.cache"
+#define KEYFILE "tlsticketkeys"
+
+static int err;
+static int warnings;
+
+static void
+count_warnings(int priority, const char **msg __attribute__ ((unused)))
+{
+	if (priority == LOG_WARNING)
+		warnings++;
+}
+
+static char *
+make_key(const char c)
+{
+	/* one byte more to test a too long key */
+	static char key[2 * TLS_TICKET_KEYLEN + 2];
+
+	memset(key, c, 2 * TLS_TICKET_KEYLEN);
+	key[2 * TLS_TICKET_KEYLEN] = '\0';
+
+	return key;
+}
+
+static void
+test_keyline(void)
+{
+	const struct {
+		const char *line;
+		int invalid;
+	} lines[] = {
+		{ .line = make_key('0'), .invalid = 0 },
+		{ .line = "", .invalid = 1 },
+		{ .line = "0123456789abcdef", .invalid = 1 },
+		{ .line = NULL }
+	};
+
+	for (unsigned int i = 0; lines[i].line != NULL; i++) {
+		if (!tls_ticketkey_invalid(lines[i].line) != !lines[i].invalid) {
+			fprintf(stderr, "key line %u was %s\n", i, lines[i].invalid ? "accepted" : "rejected");
+			err++;
+		}
+	}
+
+	char *k = make_key('F');
+	if (tls_ticketkey_invalid(k) != 0) {
+		fputs("upper case hex key was rejected\n", stderr);
+		err++;
+	}
+	k[17] = 'g';
+	if (tls_ticketkey_invalid(k) == 0) {
+		fputs("key with non-hex character was accepted\n", stderr);
+		err++;
+	}
+	k[17] = 'F';
+	strcat(k, "0");
+	if (tls_ticketkey_invalid(k) == 0) {
+		fputs("too long key was accepted\n", stderr);
+		err++;
+	}
+}
+
+static void
+test_keyload(void)
+{
+	unlink(KEYFILE);
+	if (tls_ticketkeys_load() != 0) {
+		fputs("keys loaded without key file\n", stderr);
+		err++;
+	}
+
+	FILE *f = fopen(KEYFILE, "w");
+	if (f == NULL) {
+		fputs("cannot create " KEYFILE "\n", stderr);
+		exit(1);
+	}
+	fprintf(f, "%s\n", make_key('a'));
+	fprintf(f, "notakey\n");
+	fprintf(f, "%s\n", make_key('1'));
+	fclose(f);
+
+	warnings = 0;
+	int r = tls_ticketkeys_load();
+	if (r != 2) {
+		fprintf(stderr, "%i keys loaded instead of 2\n", r);
+		err++;
+	}
+	if (warnings != 1) {
+		fprintf(stderr, "%i warnings for invalid key lines instead of 1\n", warnings);
+		err++;
+	}
+
+	unlink(KEYFILE);
+}
+
+static const SSL_CIPHER *cipher;
+
+static SSL_SESSION *
+make_session(const unsigned char id)
+{
+	unsigned char sid[32];
+	SSL_SESSION *sess = SSL_SESSION_new();
+
+	memset(sid, id, sizeof(sid));
+	/* a session without cipher can't be serialized */
+	if ((sess == NULL) || (SSL_SESSION_set1_id(sess, sid, sizeof(sid)) != 1) ||
+			(SSL_SESSION_set_protocol_version(sess, TLS1_2_VERSION) != 1) ||
+			(SSL_SESSION_set_cipher(sess, cipher) != 1)) {
+		fputs("cannot create session\n", stderr);
+		exit(1);
+	}
+	SSL_SESSION_set_timeout(sess, 300);
+
+	return sess;
+}
+
+static void
+check_lookup(const unsigned char id, const int expected, const char *msg)
+{
+	unsigned char sid[32];
+
+	memset(sid, id, sizeof(sid));
+	SSL_SESSION *sess = tlscache_lookup(sid, sizeof(sid));
+
+	if ((sess != NULL) != expected) {
+		fprintf(stderr, "%s: session %02x %s\n", msg, id, expected ? "not found" : "found");
+		err++;
+	}
+
+	if (sess != NULL) {
+		unsigned int idlen;
+		const unsigned char *gotid = SSL_SESSION_get_id(sess, &idlen);
+
+		if ((idlen != sizeof(sid)) || (memcmp(gotid, sid, idlen) != 0)) {
+			fprintf(stderr, "%s: session %02x has wrong id\n", msg, id);
+			err++;
+		}
+		SSL_SESSION_free(sess);
+	}
+}
+
+static void
+test_cache(void)
+{
+	unsigned char sid[32];
+	SSL_SESSION *sess = make_session(0x42);
+
+	if (tlscache_store(sess) != 0) {
+		fputs("storing the session failed\n", stderr);
+		err++;
+	}
+	SSL_SESSION_free(sess);
+
+	check_lookup(0x42, 1, "stored session");
+	check_lookup(0x43, 0, "other session");
+
+	memset(sid, 0x42, sizeof(sid));
+	tlscache_remove(sid, sizeof(sid));
+	check_lookup(0x42, 0, "removed session");
+
+	/* an expired session is not returned */
+	sess = make_session(0x44);
+	SSL_SESSION_set_timeout(sess, 0);
+	if (tlscache_store(sess) != 0) {
+		fputs("storing the expired session failed\n", stderr);
+		err++;
+	}
+	SSL_SESSION_free(sess);
+	check_lookup(0x44, 0, "expired session");
+}
+
+int
+main(void)
+{
+	controldir_fd = AT_FDCWD;
+	testcase_setup_log_writen(count_warnings);
+
+	test_keyline();
+	test_keyload();
+
+	SSL_CTX *ctx = SSL_CTX_new(TLS_server_method());
+	SSL *ssl = (ctx == NULL) ? NULL : SSL_new(ctx);
+	/* TLS_ECDHE_RSA_WITH_AES_128_GCM_SHA256 */
+	cipher = (ssl == NULL) ? NULL : SSL_CIPHER_find(ssl, (const unsigned char *)"\xc0\x2f");
+	if (cipher == NULL) {
+		fputs("cannot find cipher\n", stderr);
+		return 1;
+	}
+
+	unlink(CACHEFILE);
+	setenv("TLSSESSIONCACHE", CACHEFILE, 1);
+	test_cache();
+
+	unlink(CACHEFILE);
+	SSL_free(ssl);
+	SSL_CTX_free(ctx);
+
+	return err;
+}
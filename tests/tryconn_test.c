@@ -10,6 +10,7 @@
 #include <unistd.h>
 #include <sys/socket.h>
 #include <sys/wait.h>
+#include <time.h>
 
 struct ips *
 smtproute(const char *a __attribute__ ((unused)), const size_t b __attribute__ ((unused)),
@@ -18,6 +19,37 @@ smtproute(const char *a __attribute__ ((unused)), const size_t b __attribute__ (
 	return NULL;
 }
 
+struct ips *
+route_cache_lookup(const char *host __attribute__ ((unused)), const unsigned int port __attribute__ ((unused)))
+{
+	return NULL;
+}
+
+void
+tlsa_prefetch_start(const char *remhost __attribute__ ((unused)), const struct ips *mx __attribute__ ((unused)))
+{
+}
+
+int
+host_health_check(const struct in6_addr *addr __attribute__ ((unused)), const unsigned int port __attribute__ ((unused)),
+		unsigned int *rtt)
+{
+	*rtt = 0;
+	return 0;
+}
+
+void
+host_health_connected(const struct in6_addr *addr __attribute__ ((unused)), const unsigned int port __attribute__ ((unused)),
+		const unsigned int rtt __attribute__ ((unused)))
+{
+}
+
+void
+host_health_result(const struct in6_addr *addr __attribute__ ((unused)), const unsigned int port __attribute__ ((unused)),
+		const enum host_failure reason __attribute__ ((unused)))
+{
+}
+
 void
 write_status(const char *str)
 {
@@ -237,6 +269,116 @@ test_fork(unsigned int mxindex)
 	return r;
 }
 
+/* the first MX does not answer, the connection to the second one must not wait for it */
+static int
+test_race(void)
+{
+	struct in_addr l4 = {
+		.s_addr = htonl(INADDR_LOOPBACK)
+	};
+	struct in6_addr loopback4 = in_addr_to_v4mapped(&l4);
+	struct in_addr b4 = {
+		.s_addr = htonl(INADDR_LOOPBACK + 1)
+	};
+	struct in6_addr blackhole = in_addr_to_v4mapped(&b4);
+#ifdef IPV4ONLY
+	const int sfamily = AF_INET;
+	struct sockaddr_in sa = {
+		.sin_family = sfamily,
+		.sin_addr = l4
+	};
+	struct in6_addr target = loopback4;
+#else
+	const int sfamily = AF_INET6;
+	struct sockaddr_in6 sa = {
+		.sin6_family = sfamily,
+		.sin6_addr = in6addr_loopback
+	};
+	struct in6_addr target = in6addr_loopback;
+#endif
+	socklen_t salen = sizeof(sa);
+	int fillers[8];
+	int ret = 0;
+
+	int s = socket(sfamily, SOCK_STREAM, 0);
+	if ((s < 0) || (bind(s, (struct sockaddr *)&sa, sizeof(sa)) != 0) ||
+			(getsockname(s, (struct sockaddr *)&sa, &salen) != 0) || (listen(s, 1) != 0)) {
+		printf("%s: server setup error %i\n", __func__, errno);
+		if (s >= 0)
+			close(s);
+		return 1;
+	}
+#ifdef IPV4ONLY
+	targetport = ntohs(sa.sin_port);
+#else
+	targetport = ntohs(sa.sin6_port);
+#endif
+
+	/* a server that never accepts: once the queue is full new connections hang */
+	struct sockaddr_in ba = {
+		.sin_family = AF_INET,
+		.sin_port = htons(targetport),
+		.sin_addr = b4
+	};
+	int b = socket(AF_INET, SOCK_STREAM, 0);
+	if ((b < 0) || (bind(b, (struct sockaddr *)&ba, sizeof(ba)) != 0) || (listen(b, 0) != 0)) {
+		printf("%s: blackhole setup error %i\n", __func__, errno);
+		if (b >= 0)
+			close(b);
+		close(s);
+		return 1;
+	}
+	for (unsigned int i = 0; i < sizeof(fillers) / sizeof(fillers[0]); i++) {
+		fillers[i] = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+		if (fillers[i] >= 0)
+			(void) connect(fillers[i], (struct sockaddr *)&ba, sizeof(ba));
+	}
+
+	struct ips mx[2] = {
+		{
+			.addr = &blackhole,
+			.next = mx + 1,
+			.priority = 10,
+			.count = 1
+		},
+		{
+			.addr = &target,
+			.priority = 10,
+			.count = 1
+		}
+	};
+
+	timeoutconnect = 10;
+	const time_t start = time(NULL);
+
+	getrhost_permitted = 1;
+	int c = tryconn(mx, &loopback4, &in6addr_loopback);
+	if (c < 0) {
+		printf("%s: tryconn() failed: %i\n", __func__, c);
+		ret++;
+	} else {
+		close(c);
+	}
+
+	if (time(NULL) - start >= (time_t)timeoutconnect) {
+		printf("%s: tryconn() waited for the first MX to time out\n", __func__);
+		ret++;
+	}
+	if ((mx[0].priority != MX_PRIORITY_USED) || (mx[1].priority != MX_PRIORITY_CURRENT)) {
+		printf("%s: MX priorities are %u and %u instead of %u and %u\n", __func__,
+				mx[0].priority, mx[1].priority, MX_PRIORITY_USED, MX_PRIORITY_CURRENT);
+		ret++;
+	}
+
+	for (unsigned int i = 0; i < sizeof(fillers) / sizeof(fillers[0]); i++)
+		if (fillers[i] >= 0)
+			close(fillers[i]);
+	close(b);
+	close(s);
+
+	return ret;
+}
+
 int
 main(void)
 {
@@ -246,6 +388,7 @@ main(void)
 	r += test_exhausted();
 	for (i = 0; i < 2; i++)
 		r += test_fork(i);
+	r += test_race();
 
 	return r;
 }
@@ -0,0 +1,139 @@
+/** \file hosthealth.c
+ \brief helper program to show and reset the host health table of Qremote
+ */
+
+#include <qremote/hosthealth.h>
+
+#include <log.h>
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+void
+log_writen(int priority __attribute__ ((unused)), const char **s)
+{
+	for (unsigned int i = 0; s[i] != NULL; i++)
+		fputs(s[i], stderr);
+	fputc('\n', stderr);
+}
+
+static void __attribute__ ((noreturn))
+usage(const char *prog)
+{
+	fputs("Usage: ", stdout);
+	fputs(prog, stdout);
+	fputs(" file\n       ", stdout);
+	fputs(prog, stdout);
+	fputs(" -r file [address]\n", stdout);
+	exit(1);
+}
+
+static const char *
+reason_name(const uint32_t reason)
+{
+	switch (reason) {
+	case HOST_FAIL_CONNECT:
+		return "connect";
+	case HOST_FAIL_GREETING:
+		return "greeting";
+	case HOST_FAIL_TLS:
+		return "tls";
+	case HOST_FAIL_TIMEOUT:
+		return "timeout";
+	default:
+		return "-";
+	}
+}
+
+static int
+dump(void)
+{
+	const time_t now = time(NULL);
+
+	for (unsigned int i = 0; i < HOSTHEALTH_SLOTS; i++) {
+		struct host_health_slot slot;
+		char addr[INET6_ADDRSTRLEN];
+
+		int r = host_health_get(i, &slot);
+		if (r < 0) {
+			fputs("cannot open host health table\n", stderr);
+			return EIO;
+		} else if (r == 0) {
+			continue;
+		}
+
+		if (IN6_IS_ADDR_V4MAPPED(&slot.addr))
+			inet_ntop(AF_INET, slot.addr.s6_addr + 12, addr, sizeof(addr));
+		else
+			inet_ntop(AF_INET6, &slot.addr, addr, sizeof(addr));
+
+		printf("%s port %" PRIu32 ": %s, %" PRIu32 " failures, last %s", addr, slot.port,
+				host_health_down(&slot, now) ? "down" : "up", slot.failures,
+				reason_name((slot.last_failure != 0) ? slot.reason : HOST_FAIL_NONE));
+		if (slot.last_failure != 0)
+			printf(" %" PRId64 "s ago", (int64_t)now - slot.last_failure);
+		if (slot.rtt != 0)
+			printf(", rtt %" PRIu32 "ms", slot.rtt);
+		putchar('\n');
+	}
+
+	return 0;
+}
+
+int
+main(int argc, char *argv[])
+{
+	const char *fname;
+	int reset = 0;
+
+	if ((argc == 2) && (argv[1][0] != '-')) {
+		fname = argv[1];
+	} else if (((argc == 3) || (argc == 4)) && (strcmp(argv[1], "-r") == 0)) {
+		fname = argv[2];
+		reset = 1;
+	} else {
+		usage(argv[0]);
+	}
+
+	/* the table is always found through the environment, like in Qremote */
+	if (setenv("HOSTHEALTH", fname, 1) != 0)
+		return errno;
+
+	if (!reset)
+		return dump();
+
+	struct in6_addr addr;
+	const struct in6_addr *a = NULL;
+
+	if (argc == 4) {
+		struct in_addr a4;
+
+		if (inet_pton(AF_INET6, argv[3], &addr) == 1) {
+			a = &addr;
+		} else if (inet_pton(AF_INET, argv[3], &a4) == 1) {
+			memset(&addr, 0, sizeof(addr));
+			addr.s6_addr[10] = 0xff;
+			addr.s6_addr[11] = 0xff;
+			memcpy(addr.s6_addr + 12, &a4, sizeof(a4));
+			a = &addr;
+		} else {
+			fputs("invalid address\n", stderr);
+			return EINVAL;
+		}
+	}
+
+	int r = host_health_reset(a);
+	if (r < 0) {
+		fputs("cannot open host health table\n", stderr);
+		return EIO;
+	}
+
+	printf("%i entries removed\n", r);
+
+	return 0;
+}
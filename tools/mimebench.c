@@ -0,0 +1,191 @@
+/** \file mimebench.c
+ \brief benchmark for the quoted-printable recoding of nested MIME messages
+
+ mimebench generates multipart messages with 8bit text parts that are nested
+ up to the given depth and measures how fast Qremotes recoding engine
+ processes them. The recoded data is discarded.
+ */
+
+#include <fmt.h>
+#include <netio.h>
+#include <qremote/qrdata.h>
+#include <sstring.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+unsigned int smtpext;
+struct string heloname;
+int in_data;
+
+static unsigned long long outbytes;	/**< bytes "sent" in the current run */
+
+void quit(void)
+{
+}
+
+void write_status(const char *str)
+{
+	puts(str);
+}
+
+void write_status_m(const char **strs, const unsigned int count)
+{
+	for (unsigned int i = 0; i < count - 1; i++)
+		fputs(strs[i], stdout);
+	puts(strs[count - 1]);
+}
+
+void net_conn_shutdown(const enum conn_shutdown_type sd_type __attribute__ ((unused)))
+{
+	exit(1);
+}
+
+int net_writen(const char *const *s)
+{
+	for (unsigned int i = 0; s[i] != NULL; i++)
+		outbytes += strlen(s[i]);
+	outbytes += 2;
+	return 0;
+}
+
+int checkreply(const char *status __attribute__ ((unused)), const char **pre __attribute__ ((unused)),
+					const int mask __attribute__ ((unused)))
+{
+	return 0;
+}
+
+void log_write(int loglevel __attribute__ ((unused)), const char *msg __attribute__ ((unused)))
+{
+}
+
+int netget(void)
+{
+	return 354;
+}
+
+void ultostr(const unsigned long u, char *res)
+{
+	snprintf(res, ULSTRLEN, "%lu", u);
+}
+
+char lineinbuf[10];
+struct string linein = {
+	.s = lineinbuf
+};
+
+int netnwrite(const char *s __attribute__ ((unused)), size_t l)
+{
+	outbytes += l;
+	return 0;
+}
+
+static char *msg;
+static size_t msglen;
+static size_t msgalloc;
+
+static void
+append(const char *s)
+{
+	const size_t l = strlen(s);
+
+	if (msglen + l > msgalloc) {
+		msgalloc = (msgalloc + l) * 2;
+		char *n = realloc(msg, msgalloc);
+		if (n == NULL) {
+			fputs("out of memory\n", stderr);
+			exit(ENOMEM);
+		}
+		msg = n;
+	}
+	memcpy(msg + msglen, s, l);
+	msglen += l;
+}
+
+/**
+ * @brief add a MIME part to the message
+ * @param depth nesting level of the part, 0 for a text part
+ * @param width number of subparts of every multipart
+ */
+static void
+add_part(const unsigned int depth, const unsigned int width)
+{
+	char line[128];
+
+	if (depth == 0) {
+		append("Content-Type: text/plain; charset=iso-8859-1\r\n\r\n");
+		for (unsigned int i = 0; i < 20; i++)
+			append("Gr\xfc\xdf" "e aus M\xfcnchen, die Stra\xdf" "e ist heute \xfc" "berf\xfcllt und die Sonne scheint.\r\n");
+		return;
+	}
+
+	snprintf(line, sizeof(line), "Content-Type: multipart/mixed; boundary=\"level%u\"\r\n\r\n", depth);
+	append(line);
+	append("This is a multi-part message in MIME format.\r\n");
+	for (unsigned int i = 0; i < width; i++) {
+		snprintf(line, sizeof(line), "--level%u\r\n", depth);
+		append(line);
+		add_part(depth - 1, width);
+		append("\r\n");
+	}
+	snprintf(line, sizeof(line), "--level%u--\r\n", depth);
+	append(line);
+}
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned int maxdepth = 6;
+	unsigned int width = 3;
+
+	if ((argc > 3) || ((argc > 1) && ((maxdepth = strtoul(argv[1], NULL, 10)) == 0)) ||
+			((argc > 2) && ((width = strtoul(argv[2], NULL, 10)) == 0))) {
+		fputs("Usage: mimebench [maxdepth [width]]\n", stderr);
+		return 1;
+	}
+
+	heloname.s = "caliban.sf-tec.de";
+	heloname.len = strlen(heloname.s);
+
+	for (unsigned int depth = 1; depth <= maxdepth; depth++) {
+		msglen = 0;
+		append("From: <sender@example.org>\r\nSubject: benchmark\r\nMIME-Version: 1.0\r\n");
+		add_part(depth, width);
+
+		msgdata = msg;
+		msgsize = msglen;
+
+		const unsigned int recodeflag = need_recode(msgdata, msgsize);
+		unsigned int runs = 0;
+		const double start = now();
+		double elapsed;
+
+		/* repeat until the measurement is long enough to be meaningful */
+		do {
+			outbytes = 0;
+			send_data(recodeflag);
+			runs++;
+			elapsed = now() - start;
+		} while (elapsed < 0.5);
+
+		printf("depth %u: %zu bytes in, %llu bytes out, %.3f ms per message, %.1f MB/s\n",
+				depth, msglen, outbytes, elapsed * 1000 / runs,
+				(double)msglen * runs / elapsed / 1e6);
+	}
+
+	free(msg);
+
+	return 0;
+}
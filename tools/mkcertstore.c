@@ -0,0 +1,145 @@
+/** \file mkcertstore.c
+ \brief helper program to compile the certificates of Qsmtpd and Qremote into certificate stores
+ */
+
+#include <certstore.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static void __attribute__ ((noreturn))
+usage(const char *prog)
+{
+	fputs("Usage: ", stdout);
+	fputs(prog, stdout);
+	fputs(" controldir\n", stdout);
+	exit(1);
+}
+
+/**
+ * @brief compile one store
+ * @param dirfd the control directory
+ * @param type the type of the store
+ * @param certfile the default certificate file of that type
+ * @param storename the name of the store
+ * @return 0 on success, error code otherwise
+ */
+static int
+compile_store(const int dirfd, const enum certstore_type type, const char *certfile, const char *storename)
+{
+	/* the store contains the private keys, so it gets the owner of the
+	 * default certificate, which must already be readable by the user of it */
+	struct stat st;
+	if (fstatat(dirfd, certfile, &st, 0) != 0) {
+		int e = errno;
+		fputs("cannot access ", stderr);
+		fputs(certfile, stderr);
+		fputc('\n', stderr);
+		return e;
+	}
+
+	/* write to a temporary file and rename it afterwards, so the
+	 * programs will never see a partially written store */
+	char tmpname[strlen(storename) + 5];
+	strcpy(tmpname, storename);
+	strcat(tmpname, ".tmp");
+	int outfd = openat(dirfd, tmpname, O_CREAT | O_TRUNC | O_WRONLY | O_CLOEXEC, S_IRUSR | S_IWUSR);
+	if (outfd < 0) {
+		int e = errno;
+		fputs("cannot create output file\n", stderr);
+		return e;
+	}
+
+	if ((geteuid() == 0) && (fchown(outfd, st.st_uid, st.st_gid) != 0)) {
+		int e = errno;
+		fputs("cannot change owner of output file\n", stderr);
+		unlinkat(dirfd, tmpname, 0);
+		return e;
+	}
+
+	const char *errfile;
+	int r = certstore_compile(dirfd, type, outfd, &errfile);
+	int e = errno;
+
+	if ((r > 0) && (fsync(outfd) != 0)) {
+		r = -1;
+		e = errno;
+	}
+	if ((close(outfd) != 0) && (r > 0)) {
+		r = -1;
+		e = errno;
+	}
+
+	if (r <= 0) {
+		if (errfile != NULL) {
+			fputs("cannot use certificate ", stderr);
+			fputs(errfile, stderr);
+			fputs(": ", stderr);
+			fputs(strerror(e), stderr);
+			fputc('\n', stderr);
+			free((char *)errfile);
+		} else {
+			fputs("cannot write output file\n", stderr);
+		}
+		unlinkat(dirfd, tmpname, 0);
+		return e;
+	}
+
+	if (renameat(dirfd, tmpname, dirfd, storename) != 0) {
+		e = errno;
+		fputs("cannot rename output file\n", stderr);
+		unlinkat(dirfd, tmpname, 0);
+		return e;
+	}
+
+	printf("%i certificates stored in %s\n", r, storename);
+
+	return 0;
+}
+
+int
+main(int argc, char *argv[])
+{
+	if (argc != 2)
+		usage(argv[0]);
+
+	int dirfd = open(argv[1], O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (dirfd < 0) {
+		int e = errno;
+		fputs("cannot open control directory\n", stderr);
+		return e;
+	}
+
+	const char *certfiles[] = {
+		[CERTSTORE_SERVER] = "servercert.pem",
+		[CERTSTORE_CLIENT] = "clientcert.pem"
+	};
+	const char *storenames[] = {
+		[CERTSTORE_SERVER] = CERTSTORE_NAME,
+		[CERTSTORE_CLIENT] = CERTSTORE_CLIENT_NAME
+	};
+	int found = 0;
+
+	for (enum certstore_type t = CERTSTORE_SERVER; t <= CERTSTORE_CLIENT; t++) {
+		/* only build the stores for the certificates that are used */
+		if ((faccessat(dirfd, certfiles[t], F_OK, 0) != 0) && (errno == ENOENT))
+			continue;
+
+		found = 1;
+		int r = compile_store(dirfd, t, certfiles[t], storenames[t]);
+		if (r != 0)
+			return r;
+	}
+
+	if (!found) {
+		fputs("neither servercert.pem nor clientcert.pem found\n", stderr);
+		return ENOENT;
+	}
+
+	return 0;
+}
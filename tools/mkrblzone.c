@@ -0,0 +1,114 @@
+/** \file mkrblzone.c
+ \brief helper program to compile a DNS blacklist zone in rbldnsd format for Qsmtpd
+ */
+
+#include <fmt.h>
+#include <mmap.h>
+#include <rblzone.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static void __attribute__ ((noreturn))
+usage(const char *prog)
+{
+	fputs("Usage: ", stdout);
+	fputs(prog, stdout);
+	fputs(" ip|name source target\n", stdout);
+	exit(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+	enum rblzone_type type;
+
+	if (argc != 4)
+		usage(argv[0]);
+
+	if (strcmp(argv[1], "ip") == 0)
+		type = RBLZONE_IP;
+	else if (strcmp(argv[1], "name") == 0)
+		type = RBLZONE_NAME;
+	else
+		usage(argv[0]);
+
+	int fd = open(argv[2], O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		int e = errno;
+		fputs("cannot open source file\n", stderr);
+		return e;
+	}
+
+	off_t srclen;
+	char *src = mmap_fd(fd, &srclen);
+	if ((src == NULL) && (errno != 0)) {
+		int e = errno;
+		fputs("cannot map source file\n", stderr);
+		close(fd);
+		return e;
+	}
+	close(fd);
+
+	/* write to a temporary file and rename it afterwards, so Qsmtpd
+	 * will never see a partially written zone */
+	char *tmpname = malloc(strlen(argv[3]) + strlen(".tmp") + 1);
+	if (tmpname == NULL)
+		return ENOMEM;
+	strcpy(tmpname, argv[3]);
+	strcat(tmpname, ".tmp");
+
+	int outfd = open(tmpname, O_CREAT | O_TRUNC | O_WRONLY | O_CLOEXEC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+	if (outfd < 0) {
+		int e = errno;
+		fputs("cannot create output file\n", stderr);
+		return e;
+	}
+
+	unsigned int errline;
+	int r = rblzone_compile((src == NULL) ? "" : src, srclen, type, outfd, &errline);
+	int e = errno;
+
+	if (src != NULL)
+		munmap(src, srclen);
+
+	if ((r == 0) && (fsync(outfd) != 0)) {
+		r = -1;
+		e = errno;
+	}
+	if ((close(outfd) != 0) && (r == 0)) {
+		r = -1;
+		e = errno;
+	}
+
+	if (r != 0) {
+		if (errline != 0) {
+			char linebuf[ULSTRLEN];
+
+			ultostr(errline, linebuf);
+			fputs("invalid entry in line ", stderr);
+			fputs(linebuf, stderr);
+			fputs(" of source file\n", stderr);
+		} else {
+			fputs("cannot write output file\n", stderr);
+		}
+		unlink(tmpname);
+		return e;
+	}
+
+	if (rename(tmpname, argv[3]) != 0) {
+		e = errno;
+		fputs("cannot rename output file\n", stderr);
+		unlink(tmpname);
+		return e;
+	}
+
+	free(tmpname);
+	return 0;
+}
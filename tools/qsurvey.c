@@ -100,6 +100,15 @@ smtproute(const char *remhost __attribute__((unused)), const size_t reml __attri
 	return NULL;
 }
 
+/*
+ * private version: the survey does not verify the servers with DANE, so the
+ * TLSA records are not needed.
+ */
+void
+tlsa_prefetch_start(const char *remhost __attribute__((unused)), const struct ips *mxlist __attribute__((unused)))
+{
+}
+
 void
 quitmsg(void)
 {
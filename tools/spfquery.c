@@ -3,17 +3,30 @@
 
  \details With this tools you can construct the SMTP context and then do a real SPF lookup and
  check the outcome.
+
+ With "-b file" a batch of checks is read from the given file ("-" for stdin). Every line
+ contains the client IP address, the sender address ("<>" for the null sender), and the HELO
+ name, separated by whitespace. Empty lines and lines starting with '#' are ignored. The checks
+ are split among the number of worker processes given with "-j". For every check the result,
+ the time it took, and the number of DNS queries are printed, followed by throughput and
+ latency statistics for the whole batch.
  */
 
 #include <qsmtpd/antispam.h>
 #include <qsmtpd/qsmtpd.h>
 #include <sstring.h>
 
+#include <qdns.h>
+
 #include <arpa/inet.h>
 #include <errno.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
 
 struct xmitstat xmitstat;
 string heloname = {.s = "caliban.sf-tec.de", .len = 17};
@@ -21,13 +34,402 @@ string heloname = {.s = "caliban.sf-tec.de", .len = 17};
 int log_write() {return 0;}
 int log_writen() {return 0;}
 int dieerror() {return 0;}
+pid_t fork_clean() {return fork();}
 int socketd;
 
+#define BATCH_MAX_JOBS 256	/**< maximum number of worker processes in batch mode */
+
+static const char *resultnames[] = {
+	"none",
+	"pass",
+	"neutral",
+	"softfail",
+	"fail",
+	"permerror",
+	"permerror",
+	"temperror",
+	"permerror"
+};
+
+/** @struct batch_entry
+ * @brief one check of a batch
+ */
+struct batch_entry {
+	char *line;			/**< the input line, the strings below point into it */
+	const char *ip;			/**< the client IP address as given */
+	const char *sender;		/**< the sender address, "<>" for the null sender */
+	const char *helo;		/**< the HELO name */
+	struct in6_addr addr;		/**< the parsed client IP address */
+	int done;			/**< set once the result was received */
+	int result;			/**< return code of check_host() */
+	const char *mechanism;		/**< the SPF mechanism that matched */
+	unsigned long usec;		/**< time check_host() took in microseconds */
+	unsigned long queries;		/**< DNS queries sent by check_host() */
+};
+
+/** @struct batch_result
+ * @brief the result of one check as sent from a worker to the main process
+ *
+ * This is smaller than PIPE_BUF, so all workers can write to the same pipe.
+ */
+struct batch_result {
+	unsigned int index;		/**< index of the check in the batch */
+	int result;			/**< return code of check_host() */
+	const char *mechanism;		/**< the SPF mechanism that matched, always a string literal */
+	unsigned long usec;		/**< time check_host() took in microseconds */
+	unsigned long queries;		/**< DNS queries sent by check_host() */
+};
+
+static int
+parse_ip(const char *s, struct in6_addr *addr)
+{
+	if (strchr(s, ':') == NULL)
+		return (inet_pton_v4mapped(s, addr) > 0) ? 0 : -1;
+	else
+		return (inet_pton(AF_INET6, s, addr) > 0) ? 0 : -1;
+}
+
+/**
+ * @brief read the checks of a batch
+ * @param f the file to read from
+ * @param entries the checks are stored here
+ * @param cnt the number of checks is stored here
+ * @return 0 on success, error code otherwise
+ */
+static int
+read_batch(FILE *f, struct batch_entry **entries, unsigned int *cnt)
+{
+	char *line = NULL;
+	size_t linelen = 0;
+	unsigned int lineno = 0;
+
+	*entries = NULL;
+	*cnt = 0;
+
+	while (getline(&line, &linelen, f) >= 0) {
+		char *save;
+		struct batch_entry e = {
+			.done = 0
+		};
+
+		lineno++;
+		if ((line[0] == '#') || (strspn(line, " \t\r\n") == strlen(line)))
+			continue;
+
+		e.line = strdup(line);
+		if (e.line == NULL) {
+			free(line);
+			return ENOMEM;
+		}
+
+		e.ip = strtok_r(e.line, " \t\r\n", &save);
+		e.sender = strtok_r(NULL, " \t\r\n", &save);
+		e.helo = strtok_r(NULL, " \t\r\n", &save);
+
+		if ((e.helo == NULL) || (strtok_r(NULL, " \t\r\n", &save) != NULL)) {
+			fprintf(stderr, "line %u: expected client IP, sender, and HELO\n", lineno);
+			free(e.line);
+			free(line);
+			return EINVAL;
+		}
+		if (parse_ip(e.ip, &e.addr) != 0) {
+			fprintf(stderr, "line %u: failed to parse '%s' as IP address\n", lineno, e.ip);
+			free(e.line);
+			free(line);
+			return EINVAL;
+		}
+		if ((strcmp(e.sender, "<>") != 0) && (strchr(e.sender, '@') == NULL)) {
+			fprintf(stderr, "line %u: sender '%s' contains no @\n", lineno, e.sender);
+			free(e.line);
+			free(line);
+			return EINVAL;
+		}
+
+		struct batch_entry *n = realloc(*entries, (*cnt + 1) * sizeof(*n));
+		if (n == NULL) {
+			free(e.line);
+			free(line);
+			return ENOMEM;
+		}
+		*entries = n;
+		n[(*cnt)++] = e;
+	}
+
+	free(line);
+
+	return ferror(f) ? errno : 0;
+}
+
+/**
+ * @brief set up the transaction data for a check
+ * @param e the check
+ * @return the domain to pass to check_host()
+ */
+static const char *
+setup_check(const struct batch_entry *e)
+{
+	free(xmitstat.spfexp);
+	xmitstat.spfexp = NULL;
+	xmitstat.spfmechanism = NULL;
+
+	xmitstat.sremoteip = e->addr;
+	xmitstat.ipv4conn = IN6_IS_ADDR_V4MAPPED(&e->addr) ? 1 : 0;
+	inet_ntop(AF_INET6, &e->addr, xmitstat.remoteip, sizeof(xmitstat.remoteip));
+
+	xmitstat.helostr.s = (char *)e->helo;
+	xmitstat.helostr.len = strlen(e->helo);
+
+	if (strcmp(e->sender, "<>") == 0) {
+		STREMPTY(xmitstat.mailfrom);
+		return e->helo;
+	}
+
+	xmitstat.mailfrom.s = (char *)e->sender;
+	xmitstat.mailfrom.len = strlen(e->sender);
+	return strchr(e->sender, '@') + 1;
+}
+
+static unsigned long
+usec_since(const struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (now.tv_sec - start->tv_sec) * 1000000UL + now.tv_nsec / 1000 - start->tv_nsec / 1000;
+}
+
+static void __attribute__ ((noreturn))
+batch_worker(const int fd, const struct batch_entry *entries, const unsigned int cnt,
+		const unsigned int first, const unsigned int step)
+{
+	for (unsigned int i = first; i < cnt; i += step) {
+		const char *domain = setup_check(entries + i);
+		struct batch_result res = {
+			.index = i
+		};
+		struct timespec start;
+
+		dns_queries = 0;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		res.result = check_host(domain);
+		res.usec = usec_since(&start);
+		res.queries = dns_queries;
+		res.mechanism = xmitstat.spfmechanism;
+
+		if (write(fd, &res, sizeof(res)) != sizeof(res))
+			_exit(1);
+	}
+
+	_exit(0);
+}
+
+static int
+cmp_ulong(const void *a, const void *b)
+{
+	const unsigned long l = *(const unsigned long *)a;
+	const unsigned long r = *(const unsigned long *)b;
+
+	return (l > r) - (l < r);
+}
+
+/**
+ * @brief get a percentile of sorted values
+ * @param values the sorted values
+ * @param cnt number of values
+ * @param p the percentile
+ * @return the nearest-rank percentile
+ */
+static unsigned long
+percentile(const unsigned long *values, const unsigned int cnt, const unsigned int p)
+{
+	unsigned int rank = (cnt * p + 99) / 100;
+
+	return values[(rank == 0) ? 0 : rank - 1];
+}
+
+static void
+print_summary(const struct batch_entry *entries, const unsigned int cnt, const unsigned int jobs,
+		const unsigned long wall)
+{
+	unsigned long *lat = calloc(cnt, sizeof(*lat));
+	unsigned int results[sizeof(resultnames) / sizeof(resultnames[0])] = { 0 };
+	unsigned int done = 0;
+	unsigned int failed = 0;
+	unsigned long queries = 0;
+
+	if (lat == NULL) {
+		fprintf(stderr, "out of memory\n");
+		return;
+	}
+
+	for (unsigned int i = 0; i < cnt; i++) {
+		if (!entries[i].done)
+			continue;
+		lat[done++] = entries[i].usec;
+		queries += entries[i].queries;
+		if ((entries[i].result < 0) || ((size_t)entries[i].result >= sizeof(resultnames) / sizeof(resultnames[0])))
+			failed++;
+		else if (strcmp(resultnames[entries[i].result], "permerror") == 0)
+			/* the PermError variants are reported together */
+			results[SPF_PERMERROR]++;
+		else
+			results[entries[i].result]++;
+	}
+
+	printf("# checks: %u of %u, workers: %u, wall time: %lu.%03lu s, throughput: %.1f checks/s\n",
+			done, cnt, jobs, wall / 1000000, (wall / 1000) % 1000,
+			(wall == 0) ? 0.0 : done * 1000000.0 / wall);
+
+	if (done > 0) {
+		qsort(lat, done, sizeof(*lat), cmp_ulong);
+		printf("# latency ms: min %.3f p50 %.3f p90 %.3f p99 %.3f max %.3f\n",
+				lat[0] / 1000.0, percentile(lat, done, 50) / 1000.0,
+				percentile(lat, done, 90) / 1000.0, percentile(lat, done, 99) / 1000.0,
+				lat[done - 1] / 1000.0);
+		printf("# DNS queries: %lu, %.2f per check\n", queries, (double)queries / done);
+
+		printf("# results:");
+		for (size_t i = 0; i < sizeof(resultnames) / sizeof(resultnames[0]); i++) {
+			if (results[i] != 0)
+				printf(" %s %u", resultnames[i], results[i]);
+		}
+		if (failed != 0)
+			printf(" error %u", failed);
+		printf("\n");
+	}
+
+	free(lat);
+}
+
+/**
+ * @brief run a batch of checks
+ * @param fname the file to read the checks from, "-" for stdin
+ * @param jobs number of worker processes
+ * @return 0 if all checks were done, error code otherwise
+ */
+static int
+batch(const char *fname, unsigned int jobs)
+{
+	FILE *f = (strcmp(fname, "-") == 0) ? stdin : fopen(fname, "r");
+	struct batch_entry *entries;
+	unsigned int cnt;
+	struct batch_result res;
+	struct timespec start;
+	pid_t pids[BATCH_MAX_JOBS];
+	int p[2];
+
+	if (f == NULL) {
+		fprintf(stderr, "can't open %s: %s\n", fname, strerror(errno));
+		return errno;
+	}
+
+	int r = read_batch(f, &entries, &cnt);
+	if (f != stdin)
+		fclose(f);
+	if (r != 0)
+		return r;
+
+	if (jobs > cnt)
+		jobs = (cnt == 0) ? 1 : cnt;
+
+	if (pipe(p) != 0) {
+		fprintf(stderr, "can't create pipe: %s\n", strerror(errno));
+		return errno;
+	}
+
+	fflush(stdout);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	for (unsigned int i = 0; i < jobs; i++) {
+		pids[i] = fork();
+		if (pids[i] < 0) {
+			fprintf(stderr, "can't start worker: %s\n", strerror(errno));
+			jobs = i;
+			break;
+		} else if (pids[i] == 0) {
+			close(p[0]);
+			batch_worker(p[1], entries, cnt, i, jobs);
+		}
+	}
+	close(p[1]);
+
+	while (read(p[0], &res, sizeof(res)) == sizeof(res)) {
+		if (res.index >= cnt)
+			continue;
+		entries[res.index].done = 1;
+		entries[res.index].result = res.result;
+		entries[res.index].mechanism = res.mechanism;
+		entries[res.index].usec = res.usec;
+		entries[res.index].queries = res.queries;
+	}
+	close(p[0]);
+
+	for (unsigned int i = 0; i < jobs; i++)
+		while ((waitpid(pids[i], NULL, 0) < 0) && (errno == EINTR))
+			;
+
+	const unsigned long wall = usec_since(&start);
+
+	r = 0;
+	for (unsigned int i = 0; i < cnt; i++) {
+		const struct batch_entry *e = entries + i;
+
+		if (!e->done) {
+			printf("%s\t%s\t%s\tmissing\n", e->ip, e->sender, e->helo);
+			r = EIO;
+			continue;
+		}
+
+		printf("%s\t%s\t%s\t%s\t%s\t%lu.%03lu\t%lu\n", e->ip, e->sender, e->helo,
+				((e->result >= 0) && ((size_t)e->result < sizeof(resultnames) / sizeof(resultnames[0]))) ?
+						resultnames[e->result] : "error",
+				(e->mechanism == NULL) ? "-" : e->mechanism,
+				e->usec / 1000, e->usec % 1000, e->queries);
+	}
+
+	print_summary(entries, cnt, jobs, wall);
+
+	for (unsigned int i = 0; i < cnt; i++)
+		free(entries[i].line);
+	free(entries);
+
+	return r;
+}
+
+static int
+batch_main(int argc, char *argv[])
+{
+	unsigned long jobs = 1;
+
+	if (argc == 4) {
+		char *end;
+
+		if (strcmp(argv[2], "-j") != 0) {
+			fprintf(stderr, "unknown argument '%s'\n", argv[2]);
+			return EINVAL;
+		}
+		jobs = strtoul(argv[3], &end, 10);
+		if ((*end != '\0') || (jobs == 0) || (jobs > BATCH_MAX_JOBS)) {
+			fprintf(stderr, "invalid number of workers '%s'\n", argv[3]);
+			return EINVAL;
+		}
+	} else if (argc != 2) {
+		fprintf(stderr, "usage: spfquery -b file [-j workers]\n");
+		return EINVAL;
+	}
+
+	return batch(argv[1], jobs);
+}
+
 int
 main(int argc, char *argv[])
 {
 	const char *s;
 
+	if ((argc > 1) && (strcmp(argv[1], "-b") == 0))
+		return batch_main(argc - 1, argv + 1);
+
 	xmitstat.mailfrom.s = getenv("SENDER");
 	if (!xmitstat.mailfrom.s) {
 		xmitstat.mailfrom.s = "strong-bad@email.example.com";
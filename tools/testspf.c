@@ -15,6 +15,7 @@
 #include <sys/socket.h>
 
 #include <string.h>
+#include <unistd.h>
 
 struct xmitstat xmitstat;
 string heloname = {.s = "caliban.sf-tec.de", .len = 17};
@@ -22,6 +23,7 @@ string heloname = {.s = "caliban.sf-tec.de", .len = 17};
 int log_write() {return 0;}
 int log_writen() {return 0;}
 int dieerror() {return 0;}
+pid_t fork_clean() {return fork();}
 int socketd;
 
 extern int spf_makro(const char *token, const char *domain, int ex, char **result);